@@ -0,0 +1,156 @@
+#include "stdafx.h"
+
+#include "AudioBatchEncoder.h"
+#include "AudioProbe.h"
+#include "AudioReaderDecoder.h"
+#include "AudioResampler.h"
+#include "WorkStealingThreadPool.h"
+
+#include <functional>
+
+namespace
+{
+   // Decodes and resamples as AudioLoader does, but hands each batch of resampler output
+   // straight to an encoder instead of keeping it
+   class EncodingLoader : protected AudioLoader
+   {
+   public:
+      EncodingLoader( const std::string& path, const AudioParams& outputParams, AudioEncoder& encoder )
+         : AudioLoader( path, outputParams )
+         , _encoder( encoder )
+         , _encoderOk( true )
+      {
+
+      }
+
+      using AudioLoader::state;
+
+      // Decoding stops at the first failed write, which leaves the state at OutputWriteFails
+      bool run()
+      {
+         if ( !initializeDecoding() )
+            return false;
+
+         std::function< void( const AVFrame * ) > callback = [this]( const AVFrame *frame )
+         {
+            this->processDecodedAudio( frame );
+         };
+
+         while ( _encoderOk && _readerDecoder->decodeNextPacket( callback ) )
+            ;
+         if ( _encoderOk )
+            finishDecoding();
+
+         _state = _encoderOk ? Ok : OutputWriteFails;
+         return _encoderOk;
+      }
+
+   protected:
+      void copyResampledAudio( int sampleCount ) override
+      {
+         LOAD_STATS_TIME( &_loadStats, Copy );
+
+         if ( _encoderOk )
+            _encoderOk = _encoder.write( _resampler->outputBuffers(), size_t( sampleCount ) );
+      }
+
+      AudioEncoder& _encoder;
+      bool          _encoderOk;
+   };
+}
+
+AudioBatchEncoder::AudioBatchEncoder( unsigned workerCount/*=0*/ )
+   : AudioBatchEncoder( workerCount, AudioEncoder::Params() )
+{
+
+}
+
+AudioBatchEncoder::AudioBatchEncoder( unsigned workerCount, const AudioEncoder::Params& params )
+   : _params( params )
+   , _pool( new WorkStealingThreadPool( workerCount ) )
+{
+
+}
+
+AudioBatchEncoder::~AudioBatchEncoder()
+{
+
+}
+
+unsigned AudioBatchEncoder::workerCount() const
+{
+   return _pool->workerCount();
+}
+
+std::vector< std::future<AudioBatchEncoder::Result> > AudioBatchEncoder::encode( const std::vector<Job>& jobs, CompletionCb onComplete/*=nullptr*/ )
+{
+   std::vector< std::future<Result> > results;
+   results.reserve( jobs.size() );
+
+   for ( size_t i = 0; i < jobs.size(); ++i )
+   {
+      const Job job = jobs[i];
+      const AudioEncoder::Params params = _params;
+
+      results.push_back( _pool->async( [i, job, params, onComplete]()
+      {
+         Result result = encodeFile( job, params );
+
+         if ( onComplete != nullptr )
+            onComplete( i, result );
+
+         return result;
+      } ) );
+   }
+
+   return results;
+}
+
+std::vector<AudioBatchEncoder::Result> AudioBatchEncoder::encodeAll( const std::vector<Job>& jobs )
+{
+   auto futures = encode( jobs );
+
+   std::vector<Result> results;
+   results.reserve( futures.size() );
+   for ( auto& future : futures )
+      results.push_back( future.get() );
+
+   return results;
+}
+
+AudioBatchEncoder::Result AudioBatchEncoder::encodeFile( const Job& job, const AudioEncoder::Params& params )
+{
+   Result result;
+
+   // The header gives the input's rate and channel count for params that leave them open, and
+   // its sample format: FLAC keeps 16-bit inputs at 16 bits, everything else goes through float
+   AudioProbe::Result probed;
+   if ( !AudioProbe::probe( job.inPath, probed ) )
+   {
+      result.loadState = AudioLoader::ReaderDecoderInitFails;
+      return result;
+   }
+
+   const bool sixteenBit = params.codec == AudioEncoder::Codec::FLAC && probed.params.bytesPerSample <= 2;
+   const AudioParams decodeParams( ( params.channelCount > 0 ) ? params.channelCount : probed.params.channelCount,
+                                   sixteenBit ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_FLTP,
+                                   ( params.sampleRate > 0 ) ? params.sampleRate : probed.params.sampleRate,
+                                   sixteenBit ? 2 : 4 );
+
+   AudioEncoder encoder( job.outPath, decodeParams, params );
+   result.encoderState = encoder.initialize();
+   if ( result.encoderState != AudioEncoderInitState::Ok )
+      return result;
+
+   EncodingLoader loader( job.inPath, decodeParams, encoder );
+   const bool decoded = loader.run();
+   result.loadState = loader.state();
+
+   const bool finished = encoder.finish();
+   if ( !finished && result.loadState == AudioLoader::Ok )
+      result.loadState = AudioLoader::OutputWriteFails;
+
+   result.ok = finished && decoded;
+   result.framesEncoded = encoder.framesEncoded();
+   return result;
+}
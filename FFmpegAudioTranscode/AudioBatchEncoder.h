@@ -0,0 +1,58 @@
+#pragma once
+
+#include "AudioEncoder.h"
+#include "AudioLoader.h"
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+class WorkStealingThreadPool;
+
+// Encodes many files concurrently, one job per input, on a shared work-stealing pool. Each job
+// decodes its input as AudioLoader would and feeds the output to an AudioEncoder as it's
+// resampled, so no job holds more than a few buffers of audio however long its input.
+class AudioBatchEncoder
+{
+public:
+   struct Job
+   {
+      std::string inPath;
+      std::string outPath;
+   };
+
+   // Failures are reported as they would be for the loader and the encoder on their own. Writes
+   // that fail once encoding is under way leave loadState at OutputWriteFails, as for AudioTranscoder.
+   struct Result
+   {
+      AudioLoader::State    loadState = AudioLoader::NoInit;
+      AudioEncoderInitState encoderState = AudioEncoderInitState::NoInit;
+      uint64_t              framesEncoded = 0;   // at the encoder's sample rate
+      bool                  ok = false;
+   };
+
+   // Called on a worker thread as each job finishes, successfully or not
+   typedef std::function< void( size_t /*index*/, const Result& ) > CompletionCb;
+
+   // A worker count of zero means one worker per hardware thread
+   explicit AudioBatchEncoder( unsigned workerCount = 0 );
+   AudioBatchEncoder( unsigned workerCount, const AudioEncoder::Params& params );
+   virtual ~AudioBatchEncoder();
+
+   unsigned workerCount() const;
+
+   // Queues every job and returns one future per job, in the same order
+   std::vector< std::future<Result> > encode( const std::vector<Job>& jobs, CompletionCb onComplete = nullptr );
+
+   // Convenience wrapper that waits for the whole batch
+   std::vector<Result> encodeAll( const std::vector<Job>& jobs );
+
+   // One job on the calling thread
+   static Result encodeFile( const Job& job, const AudioEncoder::Params& params );
+
+protected:
+   const AudioEncoder::Params              _params;
+   std::unique_ptr<WorkStealingThreadPool> _pool;
+};
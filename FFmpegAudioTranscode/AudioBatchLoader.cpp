@@ -0,0 +1,58 @@
+#include "stdafx.h"
+
+#include "AudioBatchLoader.h"
+#include "WorkStealingThreadPool.h"
+
+AudioBatchLoader::AudioBatchLoader( unsigned workerCount/*=0*/, const AudioParams& outputParams/*=AudioLoader::defaultOutputParams()*/ )
+   : _outputParams( outputParams )
+   , _pool( new WorkStealingThreadPool( workerCount ) )
+{
+
+}
+
+AudioBatchLoader::~AudioBatchLoader()
+{
+
+}
+
+unsigned AudioBatchLoader::workerCount() const
+{
+   return _pool->workerCount();
+}
+
+std::vector< std::future<AudioBatchLoader::LoaderPtr> > AudioBatchLoader::load( const std::vector<std::string>& paths, CompletionCb onComplete/*=nullptr*/ )
+{
+   std::vector< std::future<LoaderPtr> > results;
+   results.reserve( paths.size() );
+
+   for ( size_t i = 0; i < paths.size(); ++i )
+   {
+      const std::string path = paths[i];
+      const AudioParams outputParams = _outputParams;
+
+      results.push_back( _pool->async( [i, path, outputParams, onComplete]()
+      {
+         LoaderPtr loader( new AudioLoader( path, outputParams ) );
+         loader->loadAudioData();
+
+         if ( onComplete != nullptr )
+            onComplete( i, *loader );
+
+         return loader;
+      } ) );
+   }
+
+   return results;
+}
+
+std::vector<AudioBatchLoader::LoaderPtr> AudioBatchLoader::loadAll( const std::vector<std::string>& paths )
+{
+   auto futures = load( paths );
+
+   std::vector<LoaderPtr> loaders;
+   loaders.reserve( futures.size() );
+   for ( auto& future : futures )
+      loaders.push_back( future.get() );
+
+   return loaders;
+}
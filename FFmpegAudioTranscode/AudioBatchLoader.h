@@ -0,0 +1,40 @@
+#pragma once
+
+#include "AudioLoader.h"
+#include "AudioParams.h"
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+class WorkStealingThreadPool;
+
+// Loads many files concurrently, one AudioLoader per file, on a shared work-stealing pool.
+// Each file's AudioLoader is handed back as-is, so failures are reported the same way as for a
+// single load: through AudioLoader::state() and the reader-decoder/resampler init states.
+class AudioBatchLoader
+{
+public:
+   typedef std::unique_ptr<AudioLoader> LoaderPtr;
+
+   // Called on a worker thread as each file finishes, successfully or not
+   typedef std::function< void( size_t /*index*/, const AudioLoader& ) > CompletionCb;
+
+   // A worker count of zero means one worker per hardware thread
+   explicit AudioBatchLoader( unsigned workerCount = 0, const AudioParams& outputParams = AudioLoader::defaultOutputParams() );
+   virtual ~AudioBatchLoader();
+
+   unsigned workerCount() const;
+
+   // Queues every path for loading and returns one future per path, in the same order
+   std::vector< std::future<LoaderPtr> > load( const std::vector<std::string>& paths, CompletionCb onComplete = nullptr );
+
+   // Convenience wrapper that waits for the whole batch
+   std::vector<LoaderPtr> loadAll( const std::vector<std::string>& paths );
+
+protected:
+   const AudioParams                       _outputParams;
+   std::unique_ptr<WorkStealingThreadPool> _pool;
+};
@@ -0,0 +1,429 @@
+#include "stdafx.h"
+
+#include "AudioEncoder.h"
+#include "AudioLoader.h"
+#include "AudioResampler.h"
+#include "AudioStreamReader.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+}
+
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+   AVCodecID codecId( AudioEncoder::Codec codec )
+   {
+      switch ( codec )
+      {
+      case AudioEncoder::Codec::FLAC:  return AV_CODEC_ID_FLAC;
+      case AudioEncoder::Codec::Opus:  return AV_CODEC_ID_OPUS;
+      default:                         return AV_CODEC_ID_AAC;
+      }
+   }
+
+   // Where a codec goes when the output path doesn't say
+   const char* defaultContainer( AudioEncoder::Codec codec )
+   {
+      switch ( codec )
+      {
+      case AudioEncoder::Codec::FLAC:  return "flac";
+      case AudioEncoder::Codec::Opus:  return "ogg";
+      default:                         return "ipod";   // .m4a
+      }
+   }
+
+   // The input's own format if the encoder takes it, in either layout; failing that, the first the
+   // encoder lists that's at least as wide, so float input doesn't go through 16 bits needlessly
+   AVSampleFormat chooseSampleFormat( const AVCodec* codec, AVSampleFormat inputFormat )
+   {
+      if ( codec->sample_fmts == nullptr )
+         return inputFormat;
+
+      const AVSampleFormat alternate = ::av_sample_fmt_is_planar( inputFormat ) ? ::av_get_packed_sample_fmt( inputFormat ) : ::av_get_planar_sample_fmt( inputFormat );
+      for ( const AVSampleFormat* format = codec->sample_fmts; *format != AV_SAMPLE_FMT_NONE; ++format )
+      {
+         if ( *format == inputFormat )
+            return inputFormat;
+      }
+      for ( const AVSampleFormat* format = codec->sample_fmts; *format != AV_SAMPLE_FMT_NONE; ++format )
+      {
+         if ( *format == alternate )
+            return alternate;
+      }
+      for ( const AVSampleFormat* format = codec->sample_fmts; *format != AV_SAMPLE_FMT_NONE; ++format )
+      {
+         if ( ::av_get_bytes_per_sample( *format ) >= ::av_get_bytes_per_sample( inputFormat ) )
+            return *format;
+      }
+      return codec->sample_fmts[0];
+   }
+
+   // The requested rate if the encoder supports it, otherwise the lowest supported rate above it,
+   // otherwise the highest there is
+   int chooseSampleRate( const AVCodec* codec, int sampleRate )
+   {
+      if ( codec->supported_samplerates == nullptr )
+         return sampleRate;
+
+      int above = 0;
+      int highest = 0;
+      for ( const int* rate = codec->supported_samplerates; *rate != 0; ++rate )
+      {
+         if ( *rate == sampleRate )
+            return sampleRate;
+         if ( *rate > sampleRate && ( above == 0 || *rate < above ) )
+            above = *rate;
+         highest = std::max( highest, *rate );
+      }
+      return ( above != 0 ) ? above : highest;
+   }
+}
+
+AudioEncoder::AudioEncoder( const std::string& outPath, const AudioParams& inputParams )
+   : AudioEncoder( outPath, inputParams, Params() )
+{
+
+}
+
+AudioEncoder::AudioEncoder( const std::string& outPath, const AudioParams& inputParams, const Params& params )
+   : _path( outPath )
+   , _inputParams( inputParams )
+   , _params( params )
+   , _initState( AudioEncoderInitState::NoInit )
+   , _failed( false )
+   , _finished( false )
+   , _frameSize( 0 )
+   , _shortLastFrame( false )
+   , _framesEncoded( 0 )
+   , _formatContext( nullptr )
+   , _stream( nullptr )
+   , _codecContext( nullptr )
+   , _frame( nullptr )
+   , _packet( nullptr )
+   , _fifo( nullptr )
+{
+
+}
+
+AudioEncoder::~AudioEncoder()
+{
+   if ( _initState == AudioEncoderInitState::Ok && !_finished )
+      finish();
+
+   cleanup();
+}
+
+const char* AudioEncoder::codecName( Codec codec )
+{
+   switch ( codec )
+   {
+   case Codec::FLAC:  return "FLAC";
+   case Codec::Opus:  return "Opus";
+   default:           return "AAC";
+   }
+}
+
+#define SetStateAndReturn(a) \
+{                  \
+   _initState = a; \
+   return a;       \
+}
+
+AudioEncoderInitState AudioEncoder::initialize()
+{
+   if ( _initState != AudioEncoderInitState::NoInit )
+      return _initState;
+
+   // libopus where the build has it; FFmpeg's own Opus encoder is still marked experimental
+   const AVCodecID id = codecId( _params.codec );
+   const AVCodec* codec = ( _params.codec == Codec::Opus ) ? ::avcodec_find_encoder_by_name( "libopus" ) : nullptr;
+   if ( codec == nullptr )
+      codec = ::avcodec_find_encoder( id );
+   if ( codec == nullptr )
+      SetStateAndReturn( AudioEncoderInitState::EncoderNotFound );
+
+   AVOutputFormat* format = ::av_guess_format( nullptr, _path.c_str(), nullptr );
+   if ( format == nullptr || ::avformat_query_codec( format, id, FF_COMPLIANCE_NORMAL ) != 1 )
+      format = ::av_guess_format( defaultContainer( _params.codec ), nullptr, nullptr );
+   ::avformat_alloc_output_context2( &_formatContext, format, nullptr, _path.c_str() );
+   if ( _formatContext == nullptr )
+      SetStateAndReturn( AudioEncoderInitState::OutputFormatFails );
+
+   const int channelCount = ( _params.channelCount > 0 ) ? _params.channelCount : _inputParams.channelCount;
+   const AVSampleFormat sampleFormat = chooseSampleFormat( codec, _inputParams.sampleFormat );
+   const int sampleRate = chooseSampleRate( codec, ( _params.sampleRate > 0 ) ? _params.sampleRate : _inputParams.sampleRate );
+
+   _codecContext = ::avcodec_alloc_context3( codec );
+   if ( _codecContext == nullptr )
+      SetStateAndReturn( AudioEncoderInitState::EncoderInitFails );
+   _codecContext->channels = channelCount;
+   _codecContext->channel_layout = ::av_get_default_channel_layout( channelCount );
+   _codecContext->sample_rate = sampleRate;
+   _codecContext->sample_fmt = sampleFormat;
+   _codecContext->time_base.num = 1;
+   _codecContext->time_base.den = sampleRate;
+   _codecContext->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+   if ( _params.codec == Codec::FLAC )
+   {
+      if ( _params.compressionLevel >= 0 )
+         _codecContext->compression_level = _params.compressionLevel;
+
+      // 32-bit samples are only taken for 24-bit FLAC
+      if ( sampleFormat == AV_SAMPLE_FMT_S32 || sampleFormat == AV_SAMPLE_FMT_S32P )
+         _codecContext->bits_per_raw_sample = 24;
+   }
+   else
+   {
+      _codecContext->bit_rate = _params.bitRate;
+   }
+   if ( _formatContext->oformat->flags & AVFMT_GLOBALHEADER )
+      _codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+   if ( ::avcodec_open2( _codecContext, codec, nullptr ) != 0 )
+      SetStateAndReturn( AudioEncoderInitState::EncoderInitFails );
+
+   _stream = ::avformat_new_stream( _formatContext, nullptr );
+   if ( _stream == nullptr || ::avcodec_parameters_from_context( _stream->codecpar, _codecContext ) < 0 )
+      SetStateAndReturn( AudioEncoderInitState::OutputFormatFails );
+   _stream->time_base = _codecContext->time_base;
+
+   _encoderParams = AudioParams( channelCount, sampleFormat, sampleRate, ::av_get_bytes_per_sample( sampleFormat ) );
+
+   // Encoders that take frames of any size are fed 4096 at a time
+   _frameSize = ( _codecContext->frame_size > 0 ) ? _codecContext->frame_size : 4096;
+   _shortLastFrame = ( codec->capabilities & ( AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE ) ) != 0;
+
+   _frame = ::av_frame_alloc();
+   _packet = ::av_packet_alloc();
+   _fifo = ::av_audio_fifo_alloc( sampleFormat, channelCount, _frameSize * 2 );
+   if ( _frame == nullptr || _packet == nullptr || _fifo == nullptr )
+      SetStateAndReturn( AudioEncoderInitState::EncoderInitFails );
+   _frame->format = sampleFormat;
+   _frame->nb_samples = _frameSize;
+   _frame->channel_layout = _codecContext->channel_layout;
+   _frame->channels = channelCount;
+   _frame->sample_rate = sampleRate;
+   if ( ::av_frame_get_buffer( _frame, 0 ) != 0 )
+      SetStateAndReturn( AudioEncoderInitState::EncoderInitFails );
+
+   if ( _inputParams.channelCount != _encoderParams.channelCount || _inputParams.sampleFormat != _encoderParams.sampleFormat ||
+        _inputParams.sampleRate != _encoderParams.sampleRate )
+   {
+      _converter.reset( new AudioResampler( _inputParams, MaxConvertFrames, _encoderParams ) );
+      if ( _converter->initialize() != AudioResamplerInitState::Ok )
+         SetStateAndReturn( AudioEncoderInitState::ConverterInitFails );
+   }
+
+   if ( !( _formatContext->oformat->flags & AVFMT_NOFILE ) && ::avio_open( &_formatContext->pb, _path.c_str(), AVIO_FLAG_WRITE ) < 0 )
+      SetStateAndReturn( AudioEncoderInitState::OutputFileFails );
+   if ( ::avformat_write_header( _formatContext, nullptr ) < 0 )
+      SetStateAndReturn( AudioEncoderInitState::OutputFileFails );
+
+   SetStateAndReturn( AudioEncoderInitState::Ok );
+}
+
+bool AudioEncoder::write( const uint8_t* const* planes, size_t frameCount )
+{
+   if ( _initState == AudioEncoderInitState::NoInit )
+      initialize();
+   if ( _initState != AudioEncoderInitState::Ok || _failed || _finished )
+      return false;
+
+   // A bounded amount at a time, so neither the converter's output nor the FIFO grows with the input
+   const bool planar = ::av_sample_fmt_is_planar( _inputParams.sampleFormat ) != 0;
+   const size_t planeCount = planar ? _inputParams.channelCount : 1;
+   const size_t planeFrameBytes = size_t( ::av_get_bytes_per_sample( _inputParams.sampleFormat ) ) * ( planar ? 1 : _inputParams.channelCount );
+   std::vector<const uint8_t*> chunk( planeCount );
+
+   for ( size_t offset = 0; offset < frameCount; offset += MaxConvertFrames )
+   {
+      const int n = int( std::min<size_t>( MaxConvertFrames, frameCount - offset ) );
+      for ( size_t i = 0; i < planeCount; ++i )
+         chunk[i] = planes[i] + offset * planeFrameBytes;
+
+      bool ok;
+      if ( _converter != nullptr )
+         ok = writeConverted( _converter->outputBuffers(), size_t( _converter->convert( chunk.data(), n ) ) );
+      else
+         ok = writeConverted( chunk.data(), size_t( n ) );
+      if ( !ok )
+         return false;
+   }
+   return true;
+}
+
+bool AudioEncoder::write( const int16_t* frames, size_t frameCount )
+{
+   const uint8_t* planes[] = { reinterpret_cast<const uint8_t*>( frames ) };
+   return write( planes, frameCount );
+}
+
+bool AudioEncoder::write( const float* const* planes, size_t frameCount )
+{
+   return write( reinterpret_cast<const uint8_t* const*>( planes ), frameCount );
+}
+
+bool AudioEncoder::finish()
+{
+   // An encoder that was never written to still leaves a valid, empty file
+   if ( _initState == AudioEncoderInitState::NoInit )
+      initialize();
+   if ( _initState != AudioEncoderInitState::Ok || _finished )
+      return false;
+   _finished = true;
+
+   if ( _converter != nullptr )
+   {
+      int n;
+      while ( !_failed && ( n = _converter->flush() ) > 0 )
+         writeConverted( _converter->outputBuffers(), size_t( n ) );
+   }
+
+   bool ok = !_failed && encodeFrames( true ) && sendFrame( nullptr );
+   ok = ( ::av_write_trailer( _formatContext ) == 0 ) && ok;
+   if ( !( _formatContext->oformat->flags & AVFMT_NOFILE ) )
+      ok = ( ::avio_closep( &_formatContext->pb ) == 0 ) && ok;
+
+   _failed = !ok;
+   return ok;
+}
+
+bool AudioEncoder::encode( const AudioLoader& loader )
+{
+   const AudioParams& params = loader.outputParams();
+   if ( loader.state() != AudioLoader::Ok || params.channelCount != _inputParams.channelCount ||
+        params.sampleFormat != _inputParams.sampleFormat || params.sampleRate != _inputParams.sampleRate )
+      return false;
+
+   bool ok;
+   if ( params.sampleFormat == AV_SAMPLE_FMT_FLTP )
+   {
+      std::vector<const float*> planes( params.channelCount );
+      for ( int i = 0; i < params.channelCount; ++i )
+         planes[i] = loader.processedPlanarAudioData( i );
+      ok = write( planes.data(), loader.processedFrameCount() );
+   }
+   else
+   {
+      ok = write( loader.processedAudioData(), loader.processedFrameCount() );
+   }
+
+   return finish() && ok;
+}
+
+bool AudioEncoder::encode( AudioStreamReader& reader )
+{
+   const AudioParams& params = reader.outputParams();
+   if ( params.channelCount != _inputParams.channelCount || params.sampleFormat != _inputParams.sampleFormat ||
+        params.sampleRate != _inputParams.sampleRate )
+      return false;
+
+   std::vector<int16_t> chunk( size_t( MaxConvertFrames ) * params.channelCount );
+   bool ok = true;
+   size_t n;
+   while ( ok && ( n = reader.read( chunk.data(), MaxConvertFrames ) ) > 0 )
+      ok = write( chunk.data(), n );
+
+   ok = ok && reader.state() == AudioLoader::Ok;
+   return finish() && ok;
+}
+
+bool AudioEncoder::writeConverted( const uint8_t* const* planes, size_t frameCount )
+{
+   if ( frameCount > 0 && ::av_audio_fifo_write( _fifo, reinterpret_cast<void**>( const_cast<uint8_t**>( planes ) ), int( frameCount ) ) < int( frameCount ) )
+   {
+      _failed = true;
+      return false;
+   }
+   return encodeFrames( false );
+}
+
+// Sends the FIFO's contents to the encoder a whole frame at a time, and at the end what's left
+bool AudioEncoder::encodeFrames( bool final )
+{
+   int available;
+   while ( ( available = ::av_audio_fifo_size( _fifo ) ) >= _frameSize || ( final && available > 0 ) )
+   {
+      // The encoder may still hold a reference to the last frame's buffers
+      if ( ::av_frame_make_writable( _frame ) < 0 )
+      {
+         _failed = true;
+         return false;
+      }
+
+      const int count = std::min( available, _frameSize );
+      ::av_audio_fifo_read( _fifo, reinterpret_cast<void**>( _frame->extended_data ), count );
+      _frame->nb_samples = count;
+      if ( count < _frameSize && !_shortLastFrame )
+      {
+         ::av_samples_set_silence( _frame->extended_data, count, _frameSize - count, _encoderParams.channelCount, _encoderParams.sampleFormat );
+         _frame->nb_samples = _frameSize;
+      }
+      _frame->pts = int64_t( _framesEncoded );
+      _framesEncoded += uint64_t( count );
+
+      if ( !sendFrame( _frame ) )
+         return false;
+   }
+   return true;
+}
+
+// Null flushes the encoder
+bool AudioEncoder::sendFrame( const AVFrame* frame )
+{
+   if ( ::avcodec_send_frame( _codecContext, frame ) < 0 )
+   {
+      _failed = true;
+      return false;
+   }
+
+   while ( true )
+   {
+      int status = ::avcodec_receive_packet( _codecContext, _packet );
+      if ( status == AVERROR( EAGAIN ) || status == AVERROR_EOF )
+         return true;
+      if ( status < 0 )
+         break;
+
+      ::av_packet_rescale_ts( _packet, _codecContext->time_base, _stream->time_base );
+      _packet->stream_index = _stream->index;
+      if ( ::av_interleaved_write_frame( _formatContext, _packet ) < 0 )
+         break;
+   }
+
+   _failed = true;
+   return false;
+}
+
+void AudioEncoder::cleanup()
+{
+   _converter.reset();
+
+   if ( _fifo != nullptr )
+   {
+      ::av_audio_fifo_free( _fifo );
+      _fifo = nullptr;
+   }
+   if ( _packet != nullptr )
+      ::av_packet_free( &_packet );
+   if ( _frame != nullptr )
+      ::av_frame_free( &_frame );
+   if ( _codecContext != nullptr )
+      ::avcodec_free_context( &_codecContext );
+
+   if ( _formatContext != nullptr )
+   {
+      if ( _formatContext->pb != nullptr && !( _formatContext->oformat->flags & AVFMT_NOFILE ) )
+         ::avio_closep( &_formatContext->pb );
+      ::avformat_free_context( _formatContext );
+      _formatContext = nullptr;
+   }
+}
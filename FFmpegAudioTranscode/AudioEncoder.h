@@ -0,0 +1,109 @@
+#pragma once
+
+#include "AudioParams.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+extern "C"
+{
+   struct AVAudioFifo;
+   struct AVCodecContext;
+   struct AVFormatContext;
+   struct AVFrame;
+   struct AVPacket;
+   struct AVStream;
+}
+
+class AudioLoader;
+class AudioResampler;
+class AudioStreamReader;
+
+enum class AudioEncoderInitState
+{
+   Ok, NoInit, EncoderNotFound, OutputFormatFails, EncoderInitFails, ConverterInitFails, OutputFileFails
+};
+
+// Compresses audio to a file: AAC, FLAC or Opus, in whatever container the output path's
+// extension names, or the codec's usual one (.m4a, .flac, .ogg) when FFmpeg doesn't know the
+// extension or the container can't hold the codec. Input comes in any of AudioLoader's output
+// formats, at any rate and channel count, and is converted to what the encoder takes on the way
+// in -- Opus, for one, only runs at 48 kHz and below.
+class AudioEncoder
+{
+public:
+   enum class Codec { AAC, FLAC, Opus };
+
+   struct Params
+   {
+      Codec codec = Codec::AAC;
+      int   channelCount = 0;            // zero for the input's
+      int   sampleRate = 0;              // zero for the input's; the nearest the encoder supports, if not this
+      int   bitRate = 128000;            // AAC and Opus
+      int   compressionLevel = -1;       // FLAC, 0 to 12; -1 leaves the encoder's default
+   };
+
+   AudioEncoder( const std::string& outPath, const AudioParams& inputParams );
+   AudioEncoder( const std::string& outPath, const AudioParams& inputParams, const Params& params );
+   virtual ~AudioEncoder();
+
+   AudioEncoder( const AudioEncoder& ) = delete;
+   AudioEncoder& operator=( const AudioEncoder& ) = delete;
+
+   // Opens the encoder and output file; the first write() does it if need be
+   AudioEncoderInitState initialize();
+   AudioEncoderInitState initState() const { return _initState; }
+
+   // In the input format: one pointer per channel for AV_SAMPLE_FMT_FLTP, a single pointer for
+   // interleaved AV_SAMPLE_FMT_S16. Any amount at a time; the encoder is fed whole frames.
+   bool write( const uint8_t* const* planes, size_t frameCount );
+   bool write( const int16_t* frames, size_t frameCount );
+   bool write( const float* const* planes, size_t frameCount );
+
+   // Encodes what's left, pads or shortens the last frame as the codec allows, and closes the file
+   bool finish();
+
+   // All of a loaded stream, or everything a stream reader has still to give, then finish().
+   // The loader's or reader's output params must be this encoder's input params.
+   bool encode( const AudioLoader& loader );
+   bool encode( AudioStreamReader& reader );
+
+   const AudioParams& inputParams() const { return _inputParams; }
+   const Params& params() const { return _params; }
+
+   // What the encoder actually runs at, once initialized
+   const AudioParams& encoderParams() const { return _encoderParams; }
+
+   // Per channel, at the encoder's sample rate
+   uint64_t framesEncoded() const { return _framesEncoded; }
+
+   static const char* codecName( Codec codec );
+
+protected:
+   bool writeConverted( const uint8_t* const* planes, size_t frameCount );
+   bool encodeFrames( bool final );
+   bool sendFrame( const AVFrame* frame );
+   void cleanup();
+
+   static const int MaxConvertFrames = 4096;   // resampler input per call
+
+   const std::string       _path;
+   const AudioParams       _inputParams;
+   const Params            _params;
+   AudioEncoderInitState   _initState;
+   bool                    _failed;
+   bool                    _finished;
+   AudioParams             _encoderParams;
+   int                     _frameSize;          // per encoder call
+   bool                    _shortLastFrame;     // if not, the last frame is padded with silence
+   uint64_t                _framesEncoded;
+   AVFormatContext*        _formatContext;
+   AVStream*               _stream;
+   AVCodecContext*         _codecContext;
+   AVFrame*                _frame;
+   AVPacket*               _packet;
+   AVAudioFifo*            _fifo;               // encoder-format samples waiting for a whole frame
+   std::unique_ptr<AudioResampler> _converter;  // null when the input is already what the encoder takes
+};
@@ -4,8 +4,17 @@
 #include "AudioParams.h"
 #include "AudioReaderDecoder.h"
 #include "AudioResampler.h"
+#include "DecodedAudioCache.h"
+#include "SpscQueue.h"
+#include "WavUtil.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <future>
+#include <numeric>
+#include <sstream>
+#include <thread>
 
 #include <string.h>
 
@@ -17,90 +26,1403 @@ namespace
       std::swap( ch[0], ch[1] );
       return *(int16_t *)ch;
    }
+
+   const int SegmentOverlapDivisor = 10; // 100 ms
+   const int MinSegmentSeconds = 1;
+
+   // Queue depths between pipeline stages; enough to ride out hiccups without holding much memory
+   const size_t PacketQueueDepth = 64;
+   const size_t FrameQueueDepth = 16;
+
+   // Decoder frames are usually much smaller; the resampler's output grows for larger ones
+   const int InitialResampleFrameCount = 8192;
+
+   // Format-specific adjustment for "priming samples"; sources without a path get theirs once
+   // the format is known
+   int primingAdjustmentFor( const AudioSource& source )
+   {
+      size_t pos;
+      if ( ( pos = source.path.rfind( '.' ) ) != std::string::npos )
+      {
+         std::string ext( source.path.substr( pos ) );
+         if ( ext == ".mp3" )
+            return 1152;
+      }
+      return 0;
+   }
+}
+
+AudioLoader::AudioLoader( const std::string& path, bool forceLittleEndian/*=false*/ )
+   : AudioLoader( path, defaultOutputParams(), forceLittleEndian )
+{
+
+}
+
+AudioLoader::AudioLoader( const std::string& path, const AudioParams& outputParams, bool forceLittleEndian/*=false*/ )
+   : AudioLoader( AudioSource::fromFile( path ), outputParams, forceLittleEndian )
+{
+
+}
+
+AudioLoader::AudioLoader( const AudioSource& source, const AudioParams& outputParams/*=defaultOutputParams()*/, bool forceLittleEndian/*=false*/ )
+   : _source( source )
+   , _outputParams( outputParams )
+   , _forceLittleEndian( forceLittleEndian )
+   , _resamplerQuality( ResamplerQuality::Default )
+   , _state( NoInit )
+   , _heldMemory()
+   , _overBudget( false )
+   , _resampler( nullptr )
+   , _nativeWavReading( true )
+   , _loadedNatively( false )
+   , _compressedStorage( false )
+   , _availableFrames( 0 )
+   , _outputInStores( true )
+   , _outputDiscarded( false )
+   , _waveformBlockSize( 0 )
+   , _paddingSpan( 0 )
+   , _primingAdjustment( 0 )
+   , _inputPosition( 0 )
+   , _positionOrigin( 0 )
+{
+   _primingAdjustment = primingAdjustmentFor( source );
+
+   _outputParams.bytesPerSample = ::av_get_bytes_per_sample( _outputParams.sampleFormat );
+}
+
+AudioLoader::~AudioLoader()
+{
+   if ( _loadThread.joinable() )
+      _loadThread.join();
+
+   for ( int i = 0; i < MemoryAccount::CategoryCount; ++i )
+      holdMemory( MemoryAccount::Category( i ), 0 );
+}
+
+void AudioLoader::reset( const std::string& path )
+{
+   reset( AudioSource::fromFile( path ) );
+}
+
+void AudioLoader::reset( const AudioSource& source )
+{
+   _source = source;
+   _primingAdjustment = primingAdjustmentFor( source );
+   _state = NoInit;
+
+   _cachedAudio.reset();
+   _wavReader.reset();
+   _loadedNatively = false;
+   _compressedAudio.reset();
+   _processedAudio.clear();
+   _processedPlanarAudio.clear();
+   _outputStore.clear();
+   _planarOutputStores.clear();
+   _availableFrames = 0;
+   _outputDiscarded = false;
+   _range = InputRange();
+   updateOutputMemory();
+}
+
+void AudioLoader::setMemoryAccount( std::shared_ptr<MemoryAccount> account )
+{
+   for ( int i = 0; i < MemoryAccount::CategoryCount; ++i )
+      holdMemory( MemoryAccount::Category( i ), 0 );
+
+   _memoryAccount = account;
+   if ( _readerDecoder != nullptr )
+      _readerDecoder->setMemoryAccount( account );
+
+   updateOutputMemory();
+   updateResamplerMemory();
+}
+
+#define SetStateAndReturn(a, b) \
+{              \
+   _state = a; \
+   return b;   \
+}
+
+bool AudioLoader::loadAudioData()
+{
+   LOAD_STATS_RESET( &_loadStats );
+
+   if ( !outputParamsSupported() )
+      SetStateAndReturn( UnsupportedOutputParams, false );
+
+   if ( loadFromWav() )
+      return _state == Ok;
+
+   if ( loadFromCache() )
+      SetStateAndReturn( Ok, true );
+
+   if ( !initializeDecoding() )
+      return false;
+
+   double duration;
+   if ( _readerDecoder->getDuration( duration ) )
+      reserveOutput( duration );
+
+   std::function< void( const AVFrame * ) > callback = [this]( const AVFrame *frame )
+   {
+      this->processDecodedAudio( frame );
+   };
+
+   while ( !overBudget() && _readerDecoder->decodeNextPacket( callback ) )
+      ;
+
+   if ( !overBudget() )
+   {
+      finishDecoding();
+      moveOutputToProcessedAudio();
+   }
+   if ( overBudget() )
+      return failOverBudget();
+
+   storeInCache();
+
+   SetStateAndReturn( Ok, true );
+}
+
+bool AudioLoader::loadAudioDataSegmented( unsigned segmentCount/*=0*/ )
+{
+   LOAD_STATS_RESET( &_loadStats );
+
+   if ( !outputParamsSupported() )
+      SetStateAndReturn( UnsupportedOutputParams, false );
+
+   if ( loadFromWav() )
+      return _state == Ok;
+
+   if ( loadFromCache() )
+      SetStateAndReturn( Ok, true );
+
+   // Callbacks give a single stream position, which concurrent decoders can't share
+   if ( _source.kind == AudioSource::Callbacks )
+      return loadAudioData();
+
+   if ( !initializeDecoding() )
+      return false;
+
+   if ( segmentCount == 0 )
+      segmentCount = std::max( 1U, std::thread::hardware_concurrency() );
+
+   // Segment boundaries fall on multiples of inPeriod input samples, which correspond exactly to
+   // outPeriod output samples, so each segment's resampler runs in phase with a full load's
+   const int64_t inRate = _inputParams.sampleRate;
+   const int64_t outRate = _outputParams.sampleRate;
+   const int64_t inPeriod = inRate / std::gcd( inRate, outRate );
+   const int64_t outPeriod = outRate / std::gcd( inRate, outRate );
+   const int64_t overlap = ( inRate / SegmentOverlapDivisor + inPeriod - 1 ) / inPeriod * inPeriod;
+
+   double duration = 0.0;
+   if ( !_readerDecoder->getDuration( duration ) )
+      return loadAudioData();
+
+   int64_t estimatedInputLength = int64_t( duration * inRate );
+   segmentCount = unsigned( std::min<int64_t>( segmentCount, estimatedInputLength / ( MinSegmentSeconds * inRate ) ) );
+   if ( segmentCount < 2 )
+      return loadAudioData();
+
+   int64_t origin;
+   if ( !findStreamOrigin( origin ) )
+      return loadAudioData();
+
+   std::vector<int64_t> boundaries( segmentCount + 1 );
+   for ( unsigned i = 0; i < segmentCount; ++i )
+      boundaries[i] = estimatedInputLength * i / segmentCount / inPeriod * inPeriod;
+   boundaries[segmentCount] = -1;
+
+   std::vector< std::unique_ptr<AudioLoader> > segments;
+   std::vector< std::future<bool> > results;
+   for ( unsigned i = 0; i < segmentCount; ++i )
+   {
+      int64_t start = std::max<int64_t>( 0, boundaries[i] - overlap );
+      int64_t end = ( i + 1 < segmentCount ) ? boundaries[i + 1] + overlap : -1;
+
+      segments.emplace_back( new AudioLoader( _source, _outputParams ) );
+      AudioLoader* segment = segments.back().get();
+      segment->setDecoderOptions( _decoderOptions );
+      segment->setResamplerQuality( _resamplerQuality );
+      if ( _memoryAccount != nullptr )
+         segment->setMemoryAccount( std::make_shared<MemoryAccount>( _memoryAccount.get() ) );
+      results.push_back( std::async( std::launch::async, [segment, origin, start, end]()
+      {
+         return segment->loadSegment( origin, start, end );
+      } ) );
+   }
+
+   bool segmentsOk = true;
+   for ( auto& result : results )
+      segmentsOk = result.get() && segmentsOk;
+
+#ifdef AUDIO_LOAD_STATS
+   for ( const auto& segment : segments )
+      _loadStats += segment->_loadStats;
+#endif
+
+   // Running out of budget isn't something another try would get around
+   for ( const auto& segment : segments )
+   {
+      if ( segment->state() == MemoryBudgetExceeded )
+         return failOverBudget();
+   }
+
+   // Work out which part of each segment's output to keep, in output frames from the segment's start
+   std::vector< std::pair<int64_t, int64_t> > keep( segmentCount );
+   for ( unsigned i = 0; segmentsOk && i < segmentCount; ++i )
+   {
+      int64_t chunkStart = std::max<int64_t>( 0, boundaries[i] - overlap ) / inPeriod * outPeriod;
+      int64_t available = int64_t( segments[i]->processedFrameCount() );
+
+      keep[i].first = boundaries[i] / inPeriod * outPeriod - chunkStart;
+      keep[i].second = ( i + 1 < segmentCount ) ? boundaries[i + 1] / inPeriod * outPeriod - chunkStart : available;
+      if ( keep[i].second > available || keep[i].first > keep[i].second )
+         segmentsOk = false;
+   }
+   if ( !segmentsOk )
+      return loadAudioData();
+
+   reserveOutput( duration );
+   if ( overBudget() )
+      return failOverBudget();
+
+   const int channelCount = _outputParams.channelCount;
+   std::vector<const uint8_t*> keptPlanes;
+   for ( unsigned i = 0; i < segmentCount; ++i )
+   {
+      LOAD_STATS_TIME( &_loadStats, Copy );
+
+      size_t first = size_t( keep[i].first );
+      size_t count = size_t( keep[i].second - keep[i].first );
+      keptPlanes.clear();
+      if ( outputIsPlanar() )
+      {
+         for ( int ch = 0; ch < channelCount; ++ch )
+         {
+            _planarOutputStores[ch].append( segments[i]->_processedPlanarAudio[ch].data() + first, count );
+            keptPlanes.push_back( (const uint8_t*)( segments[i]->_processedPlanarAudio[ch].data() + first ) );
+         }
+      }
+      else
+      {
+         const int16_t* kept = segments[i]->_processedAudio.data() + first * channelCount;
+         if ( _compressedAudio != nullptr )
+            appendCompressed( kept, count );
+         else
+            _outputStore.append( kept, count * channelCount );
+         keptPlanes.push_back( (const uint8_t*)kept );
+      }
+      appendToWaveformPyramid( keptPlanes.data(), count );
+      segments[i].reset();
+
+      updateOutputMemory();
+      if ( overBudget() )
+         return failOverBudget();
+   }
+   if ( _waveformPyramid != nullptr )
+      _waveformPyramid->finish();
+
+   moveOutputToProcessedAudio();
+   if ( overBudget() )
+      return failOverBudget();
+
+   storeInCache();
+
+   SetStateAndReturn( Ok, true );
+}
+
+bool AudioLoader::loadAudioDataPipelined()
+{
+   LOAD_STATS_RESET( &_loadStats );
+
+   if ( !outputParamsSupported() )
+      SetStateAndReturn( UnsupportedOutputParams, false );
+
+   if ( loadFromWav() )
+      return _state == Ok;
+
+   if ( loadFromCache() )
+      SetStateAndReturn( Ok, true );
+
+   if ( !initializeDecoding() )
+      return false;
+
+   double duration;
+   if ( _readerDecoder->getDuration( duration ) )
+      reserveOutput( duration );
+   if ( overBudget() )
+      return failOverBudget();
+
+   // Packets and frames are passed along as references to FFmpeg's refcounted buffers, so
+   // nothing is copied between stages. Once a stage is done with a packet or frame it goes back
+   // to the stage that produced it, through the reverse queue, to be filled again.
+   SpscQueue<AVPacket*> packets( PacketQueueDepth ), freePackets( PacketQueueDepth );
+   SpscQueue<AVFrame*> frames( FrameQueueDepth ), freeFrames( FrameQueueDepth );
+   AudioReaderDecoder* readerDecoder = _readerDecoder.get();
+
+   // Queued packets count as staging until the decoder is done with them
+   MemoryAccount* account = _memoryAccount.get();
+   std::atomic<bool> packetsOverBudget( false );
+
+   std::thread demuxer( [readerDecoder, account, &packetsOverBudget, &packets, &freePackets]()
+   {
+      for ( ;; )
+      {
+         AVPacket* packet;
+         if ( !freePackets.tryPop( packet ) )
+            packet = ::av_packet_alloc();
+         if ( packet == nullptr || !readerDecoder->readNextPacket( packet ) )
+         {
+            ::av_packet_free( &packet );
+            break;
+         }
+
+         const size_t packetSize = size_t( packet->size );
+         if ( account != nullptr && !account->charge( MemoryAccount::Staging, packetSize ) )
+         {
+            packetsOverBudget = true;
+            ::av_packet_free( &packet );
+            break;
+         }
+         if ( !packets.push( packet ) )
+         {
+            if ( account != nullptr )
+               account->release( MemoryAccount::Staging, packetSize );
+            ::av_packet_free( &packet );
+            break;
+         }
+      }
+      packets.close();
+   } );
+
+   std::thread decoder( [readerDecoder, account, &packets, &freePackets, &frames, &freeFrames]()
+   {
+      std::function< void( const AVFrame * ) > queueFrame = [&frames, &freeFrames]( const AVFrame *frame )
+      {
+         AVFrame* ref;
+         if ( !freeFrames.tryPop( ref ) )
+            ref = ::av_frame_alloc();
+         if ( ref != nullptr && ( ::av_frame_ref( ref, frame ) < 0 || !frames.push( ref ) ) )
+            ::av_frame_free( &ref );
+      };
+
+      AVPacket* packet;
+      while ( packets.pop( packet ) )
+      {
+         const size_t packetSize = size_t( packet->size );
+         readerDecoder->decodePacket( packet, queueFrame );
+         if ( account != nullptr )
+            account->release( MemoryAccount::Staging, packetSize );
+         if ( !freePackets.tryPush( packet ) )
+            ::av_packet_free( &packet );
+      }
+      readerDecoder->decodePacket( nullptr, queueFrame );
+      frames.close();
+   } );
+
+   // Once over budget the other stages are told to stop, and what's already queued is drained
+   AVFrame* frame;
+   while ( frames.pop( frame ) )
+   {
+      if ( !overBudget() && !packetsOverBudget )
+      {
+         processDecodedAudio( frame );
+      }
+      else
+      {
+         packets.close();
+         frames.close();
+      }
+      ::av_frame_unref( frame );
+      if ( !freeFrames.tryPush( frame ) )
+         ::av_frame_free( &frame );
+   }
+
+   decoder.join();
+   demuxer.join();
+
+   AVPacket* packet;
+   while ( freePackets.tryPop( packet ) )
+      ::av_packet_free( &packet );
+   while ( freeFrames.tryPop( frame ) )
+      ::av_frame_free( &frame );
+
+   if ( packetsOverBudget )
+      _overBudget = true;
+   if ( !overBudget() )
+   {
+      finishDecoding();
+      moveOutputToProcessedAudio();
+   }
+   if ( overBudget() )
+      return failOverBudget();
+
+   storeInCache();
+
+   SetStateAndReturn( Ok, true );
+}
+
+std::future<bool> AudioLoader::loadAudioDataAsync()
+{
+   if ( _loadThread.joinable() )
+      _loadThread.join();
+
+   // Nothing is readable until the load has produced some output
+   _availableFrames.store( 0, std::memory_order_relaxed );
+   _outputDiscarded = false;
+
+   std::promise<bool> promise;
+   std::future<bool> result = promise.get_future();
+   _loadThread = std::thread( [this]( std::promise<bool> promise )
+   {
+      const bool ok = loadAudioData();
+
+      // Cached and natively read output only becomes readable here, all at once
+      publishOutput();
+      promise.set_value( ok );
+   }, std::move( promise ) );
+
+   return result;
+}
+
+size_t AudioLoader::readAvailable( size_t firstFrame, size_t frameCount, int16_t* dst ) const
+{
+   const size_t available = availableFrames();
+   if ( outputIsPlanar() || firstFrame >= available )
+      return 0;
+
+   const size_t n = std::min( frameCount, available - firstFrame );
+   const size_t channelCount = size_t( _outputParams.channelCount );
+
+   std::lock_guard<std::mutex> lock( _outputMutex );
+   if ( _outputDiscarded )
+      return 0;
+   if ( _outputInStores && _compressedAudio == nullptr )
+      _outputStore.read( firstFrame * channelCount, n * channelCount, dst );
+   else
+      readProcessedAudio( firstFrame, n, dst );
+   return n;
+}
+
+size_t AudioLoader::readAvailable( size_t firstFrame, size_t frameCount, float* const* planes ) const
+{
+   const size_t available = availableFrames();
+   if ( !outputIsPlanar() || firstFrame >= available )
+      return 0;
+
+   const size_t n = std::min( frameCount, available - firstFrame );
+
+   std::lock_guard<std::mutex> lock( _outputMutex );
+   if ( _outputDiscarded )
+      return 0;
+   if ( _outputInStores )
+   {
+      for ( int i = 0; i < _outputParams.channelCount; ++i )
+         _planarOutputStores[i].read( firstFrame, n, planes[i] );
+   }
+   else
+   {
+      readProcessedAudio( firstFrame, n, planes );
+   }
+   return n;
+}
+
+// Makes the finished output, wherever it ended up, what readAvailable() reads. A failed load's
+// output is gone, but availableFrames() stays where it got to, so it never goes backwards.
+void AudioLoader::publishOutput()
+{
+   std::lock_guard<std::mutex> lock( _outputMutex );
+   _outputInStores = false;
+   _outputDiscarded = ( _state != Ok );
+   if ( !_outputDiscarded )
+      _availableFrames.store( processedFrameCount(), std::memory_order_release );
+}
+
+bool AudioLoader::loadAudioData( double startTime, double endTime )
+{
+   LOAD_STATS_RESET( &_loadStats );
+
+   if ( !outputParamsSupported() )
+      SetStateAndReturn( UnsupportedOutputParams, false );
+
+   if ( startTime < 0.0 || ( endTime >= 0.0 && endTime <= startTime ) )
+      SetStateAndReturn( LoadAudioFails, false );
+
+   const int64_t outRate = _outputParams.sampleRate;
+   const int64_t outStart = std::llround( startTime * outRate );
+   const int64_t outEnd = ( endTime < 0.0 ) ? -1 : std::llround( endTime * outRate );
+
+   // Cuts the output down to the range, given the output position of the first frame decoded
+   auto keepRange = [this, outStart, outEnd]( int64_t chunkStart )
+   {
+      const int64_t available = int64_t( processedFrameCount() );
+      const int64_t first = outStart - chunkStart;
+      const int64_t end = ( outEnd < 0 ) ? available : std::min( outEnd - chunkStart, available );
+      if ( first < 0 || first >= end )
+      {
+         trimProcessedAudio( 0, 0 );
+         return false;
+      }
+      trimProcessedAudio( size_t( first ), size_t( end ) );
+      compressOutput();
+      return true;
+   };
+
+   // Natively read WAV files only have the range itself mapped or converted
+   if ( loadFromWav( outStart, outEnd ) )
+   {
+      if ( _state == Ok && processedFrameCount() == 0 )
+         SetStateAndReturn( LoadAudioFails, false );
+      return _state == Ok;
+   }
+
+   // Cutting the range out of a cached full decode beats decoding it
+   if ( loadFromCache() )
+   {
+      bool ok = keepRange( 0 );
+      SetStateAndReturn( ok ? Ok : LoadAudioFails, ok );
+   }
+
+   // A callback source can only be read through once, so there's no probing it before seeking
+   if ( _source.kind == AudioSource::Callbacks )
+   {
+      if ( !loadAudioData() )
+         return false;
+      bool ok = keepRange( 0 );
+      SetStateAndReturn( ok ? Ok : LoadAudioFails, ok );
+   }
+
+   if ( !initializeDecoding() )
+      return false;
+
+   // As with segments, decoding starts where the input and output sample clocks line up, and far
+   // enough ahead of the range for the resampler to have settled
+   const int64_t inRate = _inputParams.sampleRate;
+   const int64_t inPeriod = inRate / std::gcd( inRate, outRate );
+   const int64_t outPeriod = outRate / std::gcd( inRate, outRate );
+   const int64_t overlap = ( inRate / SegmentOverlapDivisor + inPeriod - 1 ) / inPeriod * inPeriod;
+   const int64_t decodeStart = std::max<int64_t>( 0, outStart / outPeriod * inPeriod - overlap );
+   const int64_t decodeEnd = ( outEnd < 0 ) ? -1 : ( outEnd + outPeriod - 1 ) / outPeriod * inPeriod + overlap;
+
+   int64_t origin;
+   bool decoded = false;
+   if ( findStreamOrigin( origin ) && initializeDecoding() )
+   {
+      _positionOrigin = origin;
+      if ( decodeEnd >= 0 )
+         reserveOutput( double( decodeEnd - decodeStart ) / inRate );
+      decoded = decodeRange( decodeStart, decodeEnd );
+
+      // Seeking landed after the start of the range, so read from the beginning instead and
+      // discard everything ahead of the range
+      if ( !decoded && !overBudget() && initializeDecoding() )
+      {
+         _positionOrigin = origin;
+         decoded = decodeRange( decodeStart, decodeEnd, false );
+      }
+   }
+   if ( overBudget() )
+      return failOverBudget();
+
+   // Without timestamps to place frames by, the whole stream has to be decoded
+   if ( !decoded )
+   {
+      if ( !loadAudioData() )
+         return false;
+      bool ok = keepRange( 0 );
+      SetStateAndReturn( ok ? Ok : LoadAudioFails, ok );
+   }
+
+   moveOutputToProcessedAudio();
+   if ( overBudget() )
+      return failOverBudget();
+
+   bool ok = keepRange( decodeStart / inPeriod * outPeriod );
+   SetStateAndReturn( ok ? Ok : LoadAudioFails, ok );
+}
+
+bool AudioLoader::findStreamOrigin( int64_t& origin )
+{
+   // Positions are measured from the first decoded frame, which is where a full load starts
+   origin = AV_NOPTS_VALUE;
+   bool gotFrame = false;
+   std::function< void( const AVFrame * ) > findOrigin = [&]( const AVFrame *frame )
+   {
+      if ( !gotFrame )
+         origin = _readerDecoder->frameSamplePosition( frame );
+      gotFrame = true;
+   };
+   while ( !gotFrame && _readerDecoder->decodeNextPacket( findOrigin ) )
+      ;
+
+   return origin != AV_NOPTS_VALUE;
+}
+
+bool AudioLoader::loadSegment( int64_t origin, int64_t startSample, int64_t endSample )
+{
+   if ( !initializeDecoding() )
+      return false;
+
+   if ( endSample >= 0 )
+      reserveOutput( double( endSample - startSample ) / _inputParams.sampleRate );
+
+   _positionOrigin = origin;
+   if ( !decodeRange( startSample, endSample ) )
+      return overBudget() ? failOverBudget() : false;
+
+   moveOutputToProcessedAudio();
+   return overBudget() ? failOverBudget() : true;
+}
+
+bool AudioLoader::decodeRange( int64_t startSample, int64_t endSample, bool seekToStart/*=true*/ )
+{
+   _range = InputRange();
+   _range.active = true;
+   _range.start = startSample;
+   _range.end = endSample;
+   _inputPosition = startSample;
+
+   if ( seekToStart && startSample > 0 && !_readerDecoder->seek( _positionOrigin + startSample ) )
+      return false;
+
+   std::function< void( const AVFrame * ) > callback = [this]( const AVFrame *frame )
+   {
+      this->processDecodedAudio( frame );
+   };
+
+   bool reachedEndOfStream = false;
+   while ( !_range.satisfied && !_range.startMissed && !overBudget() )
+   {
+      if ( !_readerDecoder->decodeNextPacket( callback ) )
+      {
+         reachedEndOfStream = true;
+         break;
+      }
+   }
+   _range.active = false;
+
+   if ( _range.startMissed || !_range.started || overBudget() )
+      return false;
+
+   // Priming-sample padding only applies at the real end of the stream
+   finishDecoding( reachedEndOfStream );
+   return true;
+}
+
+bool AudioLoader::outputParamsSupported() const
+{
+   bool outputFormatSupported = ( _outputParams.sampleFormat == AV_SAMPLE_FMT_S16 || _outputParams.sampleFormat == AV_SAMPLE_FMT_FLTP );
+   return outputFormatSupported && _outputParams.channelCount > 0 && _outputParams.sampleRate > 0;
+}
+
+bool AudioLoader::initializeDecoding()
+{
+   if ( !outputParamsSupported() )
+      SetStateAndReturn( UnsupportedOutputParams, false );
+
+   _cachedAudio.reset();
+   _wavReader.reset();
+
+   _overBudget = false;
+
+   if ( _readerDecoder != nullptr )
+      _readerDecoder->reset( _source, _decoderOptions );
+   else
+      _readerDecoder.reset( new AudioReaderDecoder( _source, _decoderOptions ) );
+   _readerDecoder->setMemoryAccount( _memoryAccount );
+
+#ifdef AUDIO_LOAD_STATS
+   _readerDecoder->setLoadStats( &_loadStats );
+#endif
+
+   if ( _readerDecoder->initialize() != AudioReaderDecoderInitState::Ok )
+      SetStateAndReturn( ReaderDecoderInitFails, false );
+
+   if ( _source.kind != AudioSource::File && _readerDecoder->formatName() == "mp3" )
+      _primingAdjustment = 1152;
+
+   // ReaderDecoder has already successfully initialized so no need to check return value
+   _readerDecoder->getAudioParams( _inputParams );
+
+   // Decoder frames go to the resampler as they are, planar or not, and it writes directly in the
+   // output layout, so no extra pass is needed on either side
+   // Resamplers are kept per parameter combination, so a loader that's reset to similar inputs
+   // only has to clear out the old state of one
+   ResamplerKey key( _inputParams.channelCount, _inputParams.sampleFormat, _inputParams.sampleRate,
+                     _outputParams.channelCount, _outputParams.sampleFormat, _outputParams.sampleRate, _resamplerQuality );
+   std::unique_ptr<AudioResampler>& resampler = _resamplers[key];
+   AudioResamplerInitState resamplerState;
+   if ( resampler == nullptr )
+   {
+      resampler.reset( new AudioResampler( _inputParams, InitialResampleFrameCount, _outputParams, _resamplerQuality ) );
+      resamplerState = resampler->initialize();
+   }
+   else
+   {
+      resamplerState = resampler->reset();
+   }
+   _resampler = resampler.get();
+   if ( resamplerState != AudioResamplerInitState::Ok )
+      SetStateAndReturn( ResamplerInitFails, false );
+   updateResamplerMemory();
+
+   _paddingSpan = _inputParams.sampleRate;
+
+   {
+      std::lock_guard<std::mutex> lock( _outputMutex );
+      _compressedAudio.reset();
+      _outputStore.clear();
+      _planarOutputStores.clear();
+      if ( outputIsPlanar() )
+         _planarOutputStores.resize( _outputParams.channelCount );
+
+      // Compressed output goes straight into its store as it's decoded, so no more than a block
+      // of it is ever held uncompressed
+      if ( _compressedStorage && !outputIsPlanar() )
+      {
+         _compressedAudio.reset( new CompressedSampleStore( _outputParams.channelCount ) );
+         std::vector<int16_t>().swap( _processedAudio );
+      }
+      _outputInStores = true;
+      _outputDiscarded = false;
+      _availableFrames = 0;
+   }
+   updateOutputMemory();
+   resetWaveformPyramid();
+
+   _inputPosition = 0;
+   _positionOrigin = 0;
+   _range = InputRange();
+
+   return true;
+}
+
+void AudioLoader::reserveOutput( double seconds )
+{
+   // How small compressed output will be isn't known up front
+   if ( _compressedAudio != nullptr )
+      return;
+
+   // Size the output up front (plus some slack for priming samples and container durations
+   // that are slightly off) so it normally lands in a single block
+   size_t expectedFrameCount = size_t( seconds * _outputParams.sampleRate ) + _outputParams.sampleRate / 2;
+
+   // Output that's known not to fit the budget isn't worth starting on
+   if ( !holdMemory( MemoryAccount::Staging, expectedFrameCount * _outputParams.channelCount * _outputParams.bytesPerSample ) )
+      return;
+
+   if ( outputIsPlanar() )
+   {
+      for ( auto& store : _planarOutputStores )
+         store.reserve( expectedFrameCount );
+   }
+   else
+   {
+      _outputStore.reserve( expectedFrameCount * _outputParams.channelCount );
+   }
+   updateOutputMemory();
+}
+
+void AudioLoader::finishDecoding( bool atEndOfStream/*=true*/ )
+{
+   padEndOfStream( atEndOfStream );
+
+   int numFlushed = resample( nullptr, 0 );
+   if ( numFlushed > 0 )
+      copyResampledAudio( numFlushed );
+
+   if ( _waveformPyramid != nullptr )
+      _waveformPyramid->finish();
+}
+
+void AudioLoader::moveOutputToProcessedAudio()
+{
+   LOAD_STATS_TIME( &_loadStats, Copy );
+
+   // Stores of more than one block are copied into a new vector, which needs room alongside them
+   if ( _memoryAccount != nullptr )
+   {
+      size_t copied = ( _outputStore.blockCount() > 1 ) ? _outputStore.size() * sizeof( int16_t ) : 0;
+      for ( const auto& store : _planarOutputStores )
+         copied += ( store.blockCount() > 1 ) ? store.size() * sizeof( float ) : 0;
+      if ( !holdMemory( MemoryAccount::Output, _heldMemory[MemoryAccount::Output] + copied ) )
+         return;
+   }
+
+   // Readers of an async load switch over to the processed output with the stores
+   std::lock_guard<std::mutex> lock( _outputMutex );
+   _outputInStores = false;
+
+   if ( _compressedAudio != nullptr )
+   {
+      _compressedAudio->finish();
+   }
+   else if ( outputIsPlanar() )
+   {
+      _processedPlanarAudio.resize( _planarOutputStores.size() );
+      for ( size_t i = 0; i < _planarOutputStores.size(); ++i )
+         _planarOutputStores[i].moveTo( _processedPlanarAudio[i] );
+   }
+   else
+   {
+      _outputStore.moveTo( _processedAudio );
+
+      if ( _forceLittleEndian )
+         convertToLittleEndian( _processedAudio.data(), _processedAudio.size() );
+   }
+   updateOutputMemory();
+}
+
+bool AudioLoader::loadFromCache()
+{
+   _cachedAudio.reset();
+   if ( _cache == nullptr || _source.kind != AudioSource::File )
+      return false;
+
+   std::unique_ptr<CachedAudio> cached( new CachedAudio );
+   if ( !_cache->lookup( _source.path, _outputParams, cacheVariant(), *cached ) )
+      return false;
+
+   _compressedAudio.reset();
+   _processedAudio.clear();
+   _processedPlanarAudio.clear();
+   _cachedAudio = std::move( cached );
+   rebuildWaveformPyramid();
+   return true;
+}
+
+// Handles the load, successfully or not, if the source is a WAV file that can be read natively;
+// otherwise leaves it to FFmpeg. The range is in output (and so input) frames.
+bool AudioLoader::loadFromWav( int64_t startFrame/*=0*/, int64_t endFrame/*=-1*/ )
+{
+   _wavReader.reset();
+   _loadedNatively = false;
+   if ( !_nativeWavReading || _source.kind != AudioSource::File )
+      return false;
+
+   std::unique_ptr<WavReader> wav( new WavReader );
+   if ( !wav->open( _source.path ) || wav->channelCount() != _outputParams.channelCount || wav->sampleRate() != _outputParams.sampleRate )
+      return false;
+
+   const int64_t available = int64_t( wav->frameCount() );
+   const size_t first = size_t( std::min( startFrame, available ) );
+   const size_t end = size_t( std::max<int64_t>( first, ( endFrame < 0 ) ? available : std::min( endFrame, available ) ) );
+   const size_t count = end - first;
+   const size_t channelCount = size_t( _outputParams.channelCount );
+
+   _cachedAudio.reset();
+   _compressedAudio.reset();
+   _processedAudio.clear();
+   _processedPlanarAudio.clear();
+   _outputStore.clear();
+   _planarOutputStores.clear();
+   _overBudget = false;
+   _loadedNatively = true;
+
+   const uint8_t* frames = wav->data() + first * channelCount * wav->bytesPerSample();
+   bool inOutputFormat;
+   if ( outputIsPlanar() )
+      inOutputFormat = ( channelCount == 1 && wav->encoding() == WavEncoding::Float32 && wav->nativeByteOrder() );
+   else
+      inOutputFormat = ( wav->encoding() == WavEncoding::Signed16 && ( _forceLittleEndian ? !wav->bigEndian() : wav->nativeByteOrder() ) );
+   inOutputFormat = inOutputFormat && ( uintptr_t( frames ) % _outputParams.bytesPerSample ) == 0;
+
+   if ( inOutputFormat )
+   {
+      _cachedAudio.reset( new CachedAudio );
+      _cachedAudio->planes.push_back( frames );
+      _cachedAudio->frameCount = count;
+      _wavReader = std::move( wav );
+   }
+   else if ( _compressedStorage && !outputIsPlanar() )
+   {
+      // Converted a block at a time, straight into compressed storage
+      LOAD_STATS_TIME( &_loadStats, Copy );
+      std::unique_ptr<CompressedSampleStore> compressed( new CompressedSampleStore( _outputParams.channelCount ) );
+      std::vector<int16_t> block( compressed->blockFrames() * channelCount );
+      uint8_t* plane = (uint8_t*)block.data();
+      for ( size_t done = 0; done < count; done += compressed->blockFrames() )
+      {
+         const size_t n = std::min( count - done, compressed->blockFrames() );
+         wav->convert( first + done, n, _outputParams.sampleFormat, &plane );
+         if ( _forceLittleEndian )
+            convertToLittleEndian( block.data(), n * channelCount );
+         compressed->append( block.data(), n );
+      }
+      compressed->finish();
+      _compressedAudio = std::move( compressed );
+      LOAD_STATS_ADD( &_loadStats, bytesRead, count * channelCount * wav->bytesPerSample() );
+   }
+   else
+   {
+      if ( !holdMemory( MemoryAccount::Output, count * channelCount * _outputParams.bytesPerSample ) )
+      {
+         failOverBudget();
+         return true;
+      }
+
+      LOAD_STATS_TIME( &_loadStats, Copy );
+      std::vector<uint8_t*> planes;
+      if ( outputIsPlanar() )
+      {
+         _processedPlanarAudio.resize( channelCount );
+         for ( auto& channel : _processedPlanarAudio )
+         {
+            channel.resize( count );
+            planes.push_back( (uint8_t*)channel.data() );
+         }
+      }
+      else
+      {
+         _processedAudio.resize( count * channelCount );
+         planes.push_back( (uint8_t*)_processedAudio.data() );
+      }
+      wav->convert( first, count, _outputParams.sampleFormat, planes.data() );
+
+      if ( !outputIsPlanar() && _forceLittleEndian )
+         convertToLittleEndian( _processedAudio.data(), _processedAudio.size() );
+      LOAD_STATS_ADD( &_loadStats, bytesRead, count * channelCount * wav->bytesPerSample() );
+   }
+   updateOutputMemory();
+   if ( _overBudget )
+   {
+      failOverBudget();
+      return true;
+   }
+   rebuildWaveformPyramid();
+
+   _state = Ok;
+   return true;
 }
 
-AudioLoader::AudioLoader( const std::string& path, bool forceLittleEndian/*=false*/ )
-   : _path( path )
-   , _forceLittleEndian( forceLittleEndian )
-   , _state( NoInit )
-   , _numInResampleBuffer( 0 )
-   , _resampleBufferSampleCapacity( 0 )
-   , _primingAdjustment( 0 )
+void AudioLoader::storeInCache()
 {
-   // format-specific adjustment for "priming samples"
-   size_t pos;
-   if ( ( pos = path.rfind( '.' ) ) != std::string::npos )
+   if ( _cache == nullptr || _source.kind != AudioSource::File )
+      return;
+
+   // Compressed output is written out a few blocks at a time rather than decompressed whole
+   if ( _compressedAudio != nullptr )
+   {
+      const CompressedSampleStore* compressed = _compressedAudio.get();
+      _cache->store( _source.path, _outputParams, cacheVariant(), [compressed]( size_t firstFrame, size_t frameCount, uint8_t* dst )
+      {
+         compressed->read( firstFrame, frameCount, (int16_t*)dst );
+      }, compressed->frameCount() );
+      return;
+   }
+
+   std::vector<const uint8_t*> planes;
+   if ( outputIsPlanar() )
+   {
+      for ( const auto& channel : _processedPlanarAudio )
+         planes.push_back( (const uint8_t*)channel.data() );
+   }
+   else
    {
-      std::string ext( path.substr( pos ) );
-      if ( ext == ".mp3" )
-         _primingAdjustment = 1152;
+      planes.push_back( (const uint8_t*)_processedAudio.data() );
    }
+
+   _cache->store( _source.path, _outputParams, cacheVariant(), planes, processedFrameCount() );
 }
 
-AudioLoader::~AudioLoader()
+// Swaps 16-bit output that was put together whole, such as a range cut out of a cache mapping, for
+// a compressed copy, if compressed storage is on. Decoded output is compressed as it arrives.
+void AudioLoader::compressOutput()
 {
+   if ( !_compressedStorage || outputIsPlanar() || _cachedAudio != nullptr || _processedAudio.empty() )
+      return;
 
+   LOAD_STATS_TIME( &_loadStats, Copy );
+
+   const size_t channelCount = size_t( _outputParams.channelCount );
+   std::unique_ptr<CompressedSampleStore> compressed( new CompressedSampleStore( _outputParams.channelCount ) );
+   compressed->append( _processedAudio.data(), _processedAudio.size() / channelCount );
+   compressed->finish();
+
+   // Readers of an async load may be reading the uncompressed output until now
+   {
+      std::lock_guard<std::mutex> lock( _outputMutex );
+      _compressedAudio = std::move( compressed );
+      std::vector<int16_t>().swap( _processedAudio );
+   }
+   updateOutputMemory();
 }
 
-#define SetStateAndReturn(a, b) \
-{              \
-   _state = a; \
-   return b;   \
+// Default-quality entries keep the names they had before there were qualities to choose from
+std::string AudioLoader::cacheVariant() const
+{
+   std::string variant = _forceLittleEndian ? "le" : "";
+   if ( _resamplerQuality == ResamplerQuality::Preview )
+      variant += "preview";
+   else if ( _resamplerQuality == ResamplerQuality::Mastering )
+      variant += "mastering";
+
+   // Decoder options can change what's decoded, so any that are set go into the variant too; the
+   // thread settings don't change the output and are left out. Each string is prefixed with its
+   // length so that no two sets of options serialize the same way.
+   const DecoderOptions& options = _decoderOptions;
+   if ( !options.inputFormat.empty() || options.probeSize != 0 || options.analyzeDuration != 0
+        || !options.formatOptions.empty() || !options.codecOptions.empty() )
+   {
+      std::ostringstream os;
+      auto write = [&os]( const std::string& text ) { os << text.size() << ':' << text; };
+      os << "|in=";
+      write( options.inputFormat );
+      os << "|probe=" << options.probeSize << ',' << options.analyzeDuration;
+      auto writeOptions = [&write]( const std::map<std::string, std::string>& list )
+      {
+         for ( const auto& option : list )   // std::map, so already in key order
+         {
+            write( option.first );
+            write( option.second );
+         }
+      };
+      os << "|fmt=";
+      writeOptions( options.formatOptions );
+      os << "|codec=";
+      writeOptions( options.codecOptions );
+      variant += os.str();
+   }
+   return variant;
 }
 
-bool AudioLoader::loadAudioData()
+const std::vector<int16_t>& AudioLoader::processedAudio() const
 {
-   _readerDecoder.reset( new AudioReaderDecoder( _path ) );
+   // Once filled in, the copy doesn't change until the next load
+   std::lock_guard<std::mutex> lock( _copyMutex );
+   if ( _compressedAudio != nullptr && _processedAudio.empty() )
+   {
+      // The decompressed copy is output like any other, and has to fit the budget as well
+      const size_t bytes = _compressedAudio->frameCount() * _outputParams.channelCount * sizeof( int16_t );
+      const size_t held = _processedAudio.capacity() * sizeof( int16_t );
+      if ( _memoryAccount != nullptr && bytes > held )
+      {
+         if ( !_memoryAccount->charge( MemoryAccount::Output, bytes - held ) )
+            return _processedAudio;
+         _heldMemory[MemoryAccount::Output] += bytes - held;
+      }
 
-   if ( _readerDecoder->initialize() != AudioReaderDecoderInitState::Ok )
-      SetStateAndReturn( ReaderDecoderInitFails, false );
+      _processedAudio.resize( _compressedAudio->frameCount() * _outputParams.channelCount );
+      _compressedAudio->read( 0, _compressedAudio->frameCount(), _processedAudio.data() );
+   }
+   else if ( _cachedAudio != nullptr && !outputIsPlanar() && _processedAudio.empty() )
+   {
+      const int16_t* data = processedAudioData();
+      _processedAudio.assign( data, data + _cachedAudio->frameCount * _outputParams.channelCount );
+   }
+   return _processedAudio;
+}
 
-   // ReaderDecoder has already successfully initialized so no need to check return value
-   _readerDecoder->getAudioParams( _inputParams );
+const std::vector< std::vector<float> >& AudioLoader::processedPlanarAudio() const
+{
+   std::lock_guard<std::mutex> lock( _copyMutex );
+   if ( _cachedAudio != nullptr && outputIsPlanar() && _processedPlanarAudio.empty() )
+   {
+      _processedPlanarAudio.resize( _outputParams.channelCount );
+      for ( int i = 0; i < _outputParams.channelCount; ++i )
+      {
+         const float* data = processedPlanarAudioData( i );
+         _processedPlanarAudio[i].assign( data, data + _cachedAudio->frameCount );
+      }
+   }
+   return _processedPlanarAudio;
+}
+
+size_t AudioLoader::processedFrameCount() const
+{
+   if ( _cachedAudio != nullptr )
+      return _cachedAudio->frameCount;
 
-   // We always feed the resampler with interleaved (aka packed) data
-   _resamplerInputParams = _inputParams;
-   _resamplerInputParams.sampleFormat = ::av_get_packed_sample_fmt( _inputParams.sampleFormat );
+   if ( _compressedAudio != nullptr )
+      return _compressedAudio->frameCount();
 
-   AudioParams outputParams = { 2, AV_SAMPLE_FMT_S16, 44100, 2 };
+   if ( outputIsPlanar() )
+      return _processedPlanarAudio.empty() ? 0 : _processedPlanarAudio[0].size();
 
-   _resampler.reset( new AudioResampler( _resamplerInputParams, _resamplerInputParams.sampleRate, outputParams ) );
-   if ( _resampler->initialize() != AudioResamplerInitState::Ok )
-      SetStateAndReturn( ResamplerInitFails, false );
+   return _processedAudio.size() / _outputParams.channelCount;
+}
 
-   _resampleBufferSampleCapacity = _inputParams.sampleRate;
+const int16_t* AudioLoader::processedAudioData() const
+{
+   if ( outputIsPlanar() )
+      return nullptr;
 
-   int bufferSize = _resampleBufferSampleCapacity * _inputParams.channelCount *_inputParams.bytesPerSample;
+   if ( _cachedAudio != nullptr )
+      return (const int16_t*)_cachedAudio->planes[0];
 
-   _resampleBuff.reset( new uint8_t[bufferSize] );
-   ::memset( _resampleBuff.get(), 0, bufferSize );
+   const std::vector<int16_t>& audio = processedAudio();
+   return audio.empty() ? nullptr : audio.data();
+}
 
-   std::function< void( const AVFrame * ) > callback = [this]( const AVFrame *frame )
+const float* AudioLoader::processedPlanarAudioData( int channel ) const
+{
+   if ( !outputIsPlanar() || channel < 0 || channel >= _outputParams.channelCount )
+      return nullptr;
+
+   if ( _cachedAudio != nullptr )
+      return (const float*)_cachedAudio->planes[channel];
+
+   if ( size_t( channel ) >= _processedPlanarAudio.size() )
+      return nullptr;
+
+   return _processedPlanarAudio[channel].data();
+}
+
+void AudioLoader::readProcessedAudio( size_t firstFrame, size_t frameCount, int16_t* dst ) const
+{
+   if ( outputIsPlanar() || frameCount == 0 )
+      return;
+
+   // Compressed output is decoded a block at a time, whether or not processedAudio() has made a
+   // whole copy, which another thread may be in the middle of
+   if ( _compressedAudio != nullptr )
    {
-      this->processDecodedAudio( frame );
-   };
+      _compressedAudio->read( firstFrame, frameCount, dst );
+      return;
+   }
 
-   if ( !_readerDecoder->readAndDecode( callback ) )
-      SetStateAndReturn( LoadAudioFails, false );
+   const size_t channelCount = size_t( _outputParams.channelCount );
+   ::memcpy( dst, processedAudioData() + firstFrame * channelCount, frameCount * channelCount * sizeof( int16_t ) );
+}
 
-   flushResampleBuffer();
+void AudioLoader::readProcessedAudio( size_t firstFrame, size_t frameCount, float* const* planes ) const
+{
+   if ( !outputIsPlanar() || frameCount == 0 )
+      return;
 
-   int numFlushed = _resampler->flush();
-   if ( numFlushed > 0 )
-      copyResampledAudio( numFlushed );
+   for ( int i = 0; i < _outputParams.channelCount; ++i )
+      ::memcpy( planes[i], processedPlanarAudioData( i ) + firstFrame, frameCount * sizeof( float ) );
+}
 
-   if ( _forceLittleEndian )
+void AudioLoader::trimProcessedAudio( size_t firstFrame, size_t endFrame )
+{
+   const size_t channelCount = size_t( _outputParams.channelCount );
+
+   // Compressed output is recompressed a block at a time, from only the blocks that are kept
+   if ( _compressedAudio != nullptr )
    {
-      int i = 1;
-      char c = *(char *)&i;
-      if ( c == 0 ) // running on big-endian architecture
+      std::unique_ptr<CompressedSampleStore> kept( new CompressedSampleStore( _outputParams.channelCount ) );
+      std::vector<int16_t> block( kept->blockFrames() * channelCount );
+      for ( size_t first = firstFrame; first < endFrame; first += kept->blockFrames() )
+      {
+         const size_t n = std::min( endFrame - first, kept->blockFrames() );
+         _compressedAudio->read( first, n, block.data() );
+         kept->append( block.data(), n );
+      }
+      kept->finish();
+
       {
-         for ( auto iter = _processedAudio.begin(); iter != _processedAudio.end(); ++iter )
-            *iter = swap_endian( *iter );
+         std::lock_guard<std::mutex> lock( _outputMutex );
+         _compressedAudio = std::move( kept );
+         std::vector<int16_t>().swap( _processedAudio );
       }
+      updateOutputMemory();
+      rebuildWaveformPyramid();
+      return;
    }
 
-   SetStateAndReturn( Ok, true );
+   // Only the part that's kept is copied out of a cache mapping
+   if ( _cachedAudio != nullptr )
+   {
+      if ( outputIsPlanar() )
+      {
+         _processedPlanarAudio.resize( channelCount );
+         for ( size_t ch = 0; ch < channelCount; ++ch )
+         {
+            const float* data = processedPlanarAudioData( int( ch ) );
+            _processedPlanarAudio[ch].assign( data + firstFrame, data + endFrame );
+         }
+      }
+      else
+      {
+         const int16_t* data = processedAudioData();
+         _processedAudio.assign( data + firstFrame * channelCount, data + endFrame * channelCount );
+      }
+      _cachedAudio.reset();
+      _wavReader.reset();
+      updateOutputMemory();
+      rebuildWaveformPyramid();
+      return;
+   }
+
+   if ( outputIsPlanar() )
+   {
+      for ( auto& channel : _processedPlanarAudio )
+      {
+         channel.resize( endFrame );
+         channel.erase( channel.begin(), channel.begin() + firstFrame );
+      }
+   }
+   else
+   {
+      _processedAudio.resize( endFrame * channelCount );
+      _processedAudio.erase( _processedAudio.begin(), _processedAudio.begin() + firstFrame * channelCount );
+   }
+   updateOutputMemory();
+   rebuildWaveformPyramid();
+}
+
+// Brings what this loader has charged for a category to the given amount
+bool AudioLoader::holdMemory( MemoryAccount::Category category, size_t bytes )
+{
+   if ( _memoryAccount == nullptr )
+      return true;
+
+   size_t& held = _heldMemory[category];
+   if ( bytes > held && !_memoryAccount->charge( category, bytes - held ) )
+   {
+      _overBudget = true;
+      return false;
+   }
+   if ( bytes < held )
+      _memoryAccount->release( category, held - bytes );
+
+   held = bytes;
+   return true;
+}
+
+// Charged by what's allocated rather than what's filled
+void AudioLoader::updateOutputMemory()
+{
+   if ( _memoryAccount == nullptr )
+      return;
+
+   size_t staging = _outputStore.capacity() * sizeof( int16_t );
+   for ( const auto& store : _planarOutputStores )
+      staging += store.capacity() * sizeof( float );
+
+   size_t output = _processedAudio.capacity() * sizeof( int16_t );
+   if ( _compressedAudio != nullptr )
+      output += _compressedAudio->memoryBytes();
+   for ( const auto& channel : _processedPlanarAudio )
+      output += channel.capacity() * sizeof( float );
+
+   holdMemory( MemoryAccount::Staging, staging );
+   holdMemory( MemoryAccount::Output, output );
+}
+
+void AudioLoader::updateResamplerMemory()
+{
+   if ( _memoryAccount == nullptr )
+      return;
+
+   size_t bytes = 0;
+   for ( const auto& resampler : _resamplers )
+   {
+      const AudioParams& params = resampler.second->outputParams();
+      bytes += size_t( resampler.second->outputCapacity() ) * params.channelCount * params.bytesPerSample;
+   }
+   holdMemory( MemoryAccount::Resampler, bytes );
+}
+
+bool AudioLoader::overBudget() const
+{
+   return _overBudget || ( _readerDecoder != nullptr && _readerDecoder->memoryBudgetExceeded() );
+}
+
+// Lets go of whatever the load had collected before reporting the failure
+bool AudioLoader::failOverBudget()
+{
+   {
+      std::lock_guard<std::mutex> lock( _outputMutex );
+      _outputDiscarded = true;
+      _outputInStores = true;
+      _compressedAudio.reset();
+      _outputStore.clear();
+      for ( auto& store : _planarOutputStores )
+         store.clear();
+   }
+   std::vector<int16_t>().swap( _processedAudio );
+   _processedPlanarAudio.clear();
+   updateOutputMemory();
+
+   SetStateAndReturn( MemoryBudgetExceeded, false );
+}
+
+const WaveformPyramid* AudioLoader::waveformPyramid() const
+{
+   if ( _state != Ok || _waveformPyramid == nullptr || !_waveformPyramid->finished() )
+      return nullptr;
+
+   return _waveformPyramid.get();
+}
+
+void AudioLoader::resetWaveformPyramid()
+{
+   if ( _waveformBlockSize <= 0 )
+   {
+      _waveformPyramid.reset();
+      return;
+   }
+
+   if ( _waveformPyramid == nullptr )
+      _waveformPyramid.reset( new WaveformPyramid( _outputParams.channelCount, _waveformBlockSize ) );
+   else
+      _waveformPyramid->reset( _outputParams.channelCount, _waveformBlockSize );
+}
+
+void AudioLoader::appendToWaveformPyramid( const uint8_t* const* planes, size_t frameCount )
+{
+   if ( _waveformPyramid == nullptr )
+      return;
+
+   if ( outputIsPlanar() )
+      _waveformPyramid->append( reinterpret_cast<const float* const*>( planes ), frameCount );
+   else
+      _waveformPyramid->append( reinterpret_cast<const int16_t*>( planes[0] ), frameCount );
+}
+
+// For output that didn't pass through copyResampledAudio() on its way in, or was cut down since
+void AudioLoader::rebuildWaveformPyramid()
+{
+   resetWaveformPyramid();
+   if ( _waveformPyramid == nullptr )
+      return;
+
+   // Compressed output is fed through a block at a time rather than decompressed whole
+   if ( _compressedAudio != nullptr && _processedAudio.empty() )
+   {
+      const size_t frameCount = _compressedAudio->frameCount();
+      const size_t blockFrames = _compressedAudio->blockFrames();
+      std::vector<int16_t> block( blockFrames * _outputParams.channelCount );
+      const uint8_t* plane = (const uint8_t*)block.data();
+      for ( size_t first = 0; first < frameCount; first += blockFrames )
+      {
+         const size_t n = std::min( frameCount - first, blockFrames );
+         _compressedAudio->read( first, n, block.data() );
+         appendToWaveformPyramid( &plane, n );
+      }
+      _waveformPyramid->finish();
+      return;
+   }
+
+   std::vector<const uint8_t*> planes;
+   if ( outputIsPlanar() )
+   {
+      for ( int ch = 0; ch < _outputParams.channelCount; ++ch )
+         planes.push_back( (const uint8_t*)processedPlanarAudioData( ch ) );
+   }
+   else
+   {
+      planes.push_back( (const uint8_t*)processedAudioData() );
+   }
+
+   const size_t frameCount = processedFrameCount();
+   if ( frameCount > 0 && planes[0] != nullptr )
+      appendToWaveformPyramid( planes.data(), frameCount );
+   _waveformPyramid->finish();
+}
+
+void AudioLoader::convertToLittleEndian( int16_t* samples, size_t count )
+{
+   int i = 1;
+   char c = *(char *)&i;
+   if ( c == 0 ) // running on big-endian architecture
+   {
+      for ( size_t ii = 0; ii < count; ++ii )
+         samples[ii] = swap_endian( samples[ii] );
+   }
 }
 
 bool AudioLoader::readerDecoderInitState( AudioReaderDecoderInitState& state ) const
@@ -123,79 +1445,192 @@ bool AudioLoader::resamplerInitState( AudioResamplerInitState& state ) const
 
 void AudioLoader::processDecodedAudio( const AVFrame* frame )
 {
-   int sampleCount = frame->nb_samples;
-   int numToCopy = std::min( _resampleBufferSampleCapacity - _numInResampleBuffer, sampleCount );
-   bool needToInterleaveSamples = ( _inputParams.sampleFormat != _resamplerInputParams.sampleFormat );
-   int n = _inputParams.channelCount * _inputParams.bytesPerSample;
+   if ( !_range.active )
+   {
+      resampleDecodedAudio( frame, 0, frame->nb_samples );
+      return;
+   }
 
-   if ( !needToInterleaveSamples )
+   // Frames are placed by timestamp until the range starts; after that they're taken to be
+   // contiguous, just as they are in a full load
+   int64_t position;
+   if ( _range.started )
    {
-      ::memcpy( _resampleBuff.get() + _numInResampleBuffer * n, frame->data[0], numToCopy * n );
+      position = _range.nextFramePosition;
    }
    else
    {
-      uint8_t* dst = _resampleBuff.get() + _numInResampleBuffer * n;
-      for ( int i = 0; i < numToCopy; ++i )
+      position = _readerDecoder->frameSamplePosition( frame );
+      if ( position == AV_NOPTS_VALUE )
       {
-         for ( int ii = 0; ii < _inputParams.channelCount; ++ii )
-         {
-            const uint8_t* src = &frame->data[ii][i * _inputParams.bytesPerSample];
-            ::memcpy( dst, src, _inputParams.bytesPerSample );
-            dst += _inputParams.bytesPerSample;
-         }
+         _range.startMissed = true;
+         return;
       }
+      position -= _positionOrigin;
+   }
+   _range.nextFramePosition = position + frame->nb_samples;
+
+   int64_t start = std::max( position, _range.start );
+   int64_t end = _range.nextFramePosition;
+   if ( _range.end >= 0 )
+   {
+      end = std::min( end, _range.end );
+      if ( _range.nextFramePosition >= _range.end )
+         _range.satisfied = true;
    }
-   _numInResampleBuffer += numToCopy;
+   if ( start >= end )
+      return;
 
-   // Resample buffer was filled... need to resample and preserve leftovers from this frame
-   if ( _numInResampleBuffer == _resampleBufferSampleCapacity )
+   if ( !_range.started )
    {
-      int numConverted = _resampler->convert( _resampleBuff.get(), _resampleBufferSampleCapacity );
-      int numLeftovers = sampleCount - numToCopy;
+      // Decoding started after the beginning of the range, so samples would be missing
+      if ( position > _range.start )
+      {
+         _range.startMissed = true;
+         return;
+      }
+      _range.started = true;
+   }
+
+   resampleDecodedAudio( frame, int( start - position ), int( end - start ) );
+}
+
+void AudioLoader::resampleDecodedAudio( const AVFrame* frame, int offset, int count )
+{
+   const bool planar = ( ::av_sample_fmt_is_planar( _inputParams.sampleFormat ) != 0 );
+   const int planeCount = planar ? _inputParams.channelCount : 1;
+   const int frameStride = planar ? _inputParams.bytesPerSample : _inputParams.bytesPerSample * _inputParams.channelCount;
+
+   _inputPlanes.resize( planeCount );
+   for ( int i = 0; i < planeCount; ++i )
+      _inputPlanes[i] = frame->extended_data[i] + offset * frameStride;
 
+   int numConverted = resample( _inputPlanes.data(), count );
+   if ( numConverted > 0 )
       copyResampledAudio( numConverted );
 
-      if ( !needToInterleaveSamples )
+   _inputPosition += count;
+}
+
+// Every resampler call goes through here so it's accounted for in one place; null planes flush
+int AudioLoader::resample( const uint8_t* const* planes, int count )
+{
+   LOAD_STATS_TIME( &_loadStats, Resample );
+   const int capacity = _resampler->outputCapacity();
+
+   int numConverted = ( planes != nullptr ) ? _resampler->convert( planes, count ) : _resampler->flush();
+
+   if ( _resampler->outputCapacity() != capacity )
+   {
+      LOAD_STATS_ADD( &_loadStats, bufferGrowths, 1 );
+      updateResamplerMemory();
+   }
+   LOAD_STATS_ADD( &_loadStats, resamplerInputSamples, count );
+   LOAD_STATS_ADD( &_loadStats, resamplerOutputSamples, std::max( numConverted, 0 ) );
+
+   return numConverted;
+}
+
+void AudioLoader::copyResampledAudio( int sampleCount )
+{
+   LOAD_STATS_TIME( &_loadStats, Copy );
+#ifdef AUDIO_LOAD_STATS
+   const size_t blockCount = outputBlockCount();
+#endif
+
+   auto output = _resampler->outputBuffers();
+   {
+      // Only adding a block needs to keep readAvailable() out; appending within one doesn't
+      std::unique_lock<std::mutex> lock( _outputMutex, std::defer_lock );
+      if ( outputWillGrow( sampleCount ) )
+         lock.lock();
+
+      if ( outputIsPlanar() )
+      {
+         for ( int i = 0; i < _outputParams.channelCount; ++i )
+            _planarOutputStores[i].append( (const float *)output[i], sampleCount );
+      }
+      else if ( _compressedAudio != nullptr )
       {
-         ::memcpy( _resampleBuff.get(), frame->data[0] + numToCopy * n, numLeftovers * n );
+         appendCompressed( (const int16_t *)output[0], size_t( sampleCount ) );
       }
       else
       {
-         int srcStartIndex = numToCopy * _inputParams.bytesPerSample;
-         uint8_t* dst = _resampleBuff.get();
-         for ( int i = 0; i < numLeftovers; ++i )
-         {
-            for ( int ii = 0; ii < _inputParams.channelCount; ++ii )
-            {
-               const uint8_t* src = &frame->data[ii][srcStartIndex + i * _inputParams.bytesPerSample];
-               ::memcpy( dst, src, _inputParams.bytesPerSample );
-               dst += _inputParams.bytesPerSample;
-            }
-         }
+         _outputStore.append( (const int16_t *)output[0], sampleCount * _outputParams.channelCount );
       }
-
-      _numInResampleBuffer = sampleCount - numToCopy;
    }
+   size_t frameCount;
+   if ( outputIsPlanar() )
+      frameCount = _planarOutputStores[0].size();
+   else if ( _compressedAudio != nullptr )
+      frameCount = _compressedAudio->frameCount();
+   else
+      frameCount = _outputStore.size() / _outputParams.channelCount;
+   _availableFrames.store( frameCount, std::memory_order_release );
+
+   appendToWaveformPyramid( output, size_t( sampleCount ) );
+   updateOutputMemory();
+
+#ifdef AUDIO_LOAD_STATS
+   LOAD_STATS_ADD( &_loadStats, bufferGrowths, outputBlockCount() - blockCount );
+#endif
 }
 
-void AudioLoader::copyResampledAudio( int sampleCount )
+bool AudioLoader::outputWillGrow( int sampleCount ) const
 {
-   auto output = _resampler->outputBuffers();
-   const int16_t *ptr = (const int16_t *)output[0];
-   for ( int i = 0; i < sampleCount; ++i )
+   // Any append may finish a compressed block, and reads can't run alongside one
+   if ( _compressedAudio != nullptr )
+      return true;
+
+   if ( outputIsPlanar() )
+      return _planarOutputStores[0].size() + size_t( sampleCount ) > _planarOutputStores[0].capacity();
+
+   return _outputStore.size() + size_t( sampleCount ) * _outputParams.channelCount > _outputStore.capacity();
+}
+
+// Compressed output is converted to little-endian on the way in, since nothing goes over it afterwards
+void AudioLoader::appendCompressed( const int16_t* frames, size_t frameCount )
+{
+   if ( !_forceLittleEndian )
    {
-      _processedAudio.push_back( *ptr++ );
-      _processedAudio.push_back( *ptr++ );
+      _compressedAudio->append( frames, frameCount );
+      return;
    }
+
+   _littleEndianFrames.assign( frames, frames + frameCount * _outputParams.channelCount );
+   convertToLittleEndian( _littleEndianFrames.data(), _littleEndianFrames.size() );
+   _compressedAudio->append( _littleEndianFrames.data(), frameCount );
 }
 
-void AudioLoader::flushResampleBuffer()
+#ifdef AUDIO_LOAD_STATS
+size_t AudioLoader::outputBlockCount() const
 {
-   if ( _numInResampleBuffer == 0 )
-      return;
+   size_t count = _outputStore.blockCount();
+   for ( const auto& store : _planarOutputStores )
+      count += store.blockCount();
+   return count;
+}
+#endif
 
-   int numConverted = _resampler->convert( _resampleBuff.get(), std::min( _numInResampleBuffer + _primingAdjustment, _resampleBufferSampleCapacity ) );
-   copyResampledAudio( numConverted );
+void AudioLoader::padEndOfStream( bool atEndOfStream )
+{
+   // At the end of the stream, pad with silence to make up for the priming samples. Padding is
+   // limited to the rest of the current one-second span of input, and there's none when the input
+   // ends exactly on a span boundary; output lengths have always been worked out this way. Basing
+   // it on the absolute input position keeps the result the same however the stream was split up
+   // for decoding.
+   int numPadding = 0;
+   int remainder = int( _inputPosition % _paddingSpan );
+   if ( atEndOfStream && remainder != 0 )
+      numPadding = std::min( _primingAdjustment, _paddingSpan - remainder );
 
-   _numInResampleBuffer = 0;
+   if ( numPadding > 0 )
+   {
+      // Zeroes are silence in every format the decoders produce other than unsigned 8-bit
+      std::vector<uint8_t> silence( size_t( numPadding ) * _inputParams.channelCount * _inputParams.bytesPerSample, 0 );
+      std::vector<const uint8_t*> planes( _inputParams.channelCount, silence.data() );
+      int numConverted = resample( planes.data(), numPadding );
+      if ( numConverted > 0 )
+         copyResampledAudio( numConverted );
+   }
 }
@@ -1,9 +1,23 @@
 #pragma once
 
 #include "AudioParams.h"
+#include "AudioResampler.h"
+#include "AudioSource.h"
+#include "CompressedSampleStore.h"
+#include "DecoderOptions.h"
+#include "LoadStats.h"
+#include "MemoryAccount.h"
+#include "SampleBlockStore.h"
+#include "WaveformPyramid.h"
 
+#include <atomic>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 extern "C"
@@ -12,43 +26,253 @@ extern "C"
 }
 
 class AudioReaderDecoder;
-class AudioResampler;
+class DecodedAudioCache;
+class WavReader;
+struct CachedAudio;
 
 enum class AudioReaderDecoderInitState;
-enum class AudioResamplerInitState;
 
 class AudioLoader
 {
 public:
    AudioLoader( const std::string& path, bool forceLittleEndian=false );
+
+   // Output may be any channel count and sample rate, as either interleaved 16-bit
+   // (AV_SAMPLE_FMT_S16) or per-channel float (AV_SAMPLE_FMT_FLTP)
+   AudioLoader( const std::string& path, const AudioParams& outputParams, bool forceLittleEndian=false );
+
+   // Reads from memory or caller-provided callbacks rather than a file. Such sources bypass the
+   // cache, and callback sources are always decoded sequentially.
+   AudioLoader( const AudioSource& source, const AudioParams& outputParams = defaultOutputParams(), bool forceLittleEndian=false );
    virtual ~AudioLoader();
 
-   enum State { Ok, NoInit, ReaderDecoderInitFails, ResamplerInitFails, LoadAudioFails };
+   enum State { Ok, NoInit, ReaderDecoderInitFails, ResamplerInitFails, LoadAudioFails, UnsupportedOutputParams, MemoryBudgetExceeded, OutputWriteFails };
+
+   // 16-bit stereo 44.1 kHz interleaved
+   static AudioParams defaultOutputParams() { return AudioParams( 2, AV_SAMPLE_FMT_S16, 44100, 2 ); }
+
+   // Points the loader at a new input, keeping its decoder, resamplers and buffers for reuse.
+   // Running many small files through one loader this way saves most of the per-file setup.
+   void reset( const std::string& path );
+   void reset( const AudioSource& source );
 
    bool loadAudioData();
 
+   // Loads just the part of the stream from startTime up to endTime, in seconds; an endTime < 0
+   // means the end of the stream. Decoding starts from the nearest seek point before the range,
+   // with 100 ms of pre-roll for the resampler to settle, and stops as soon as the range is
+   // covered, so the cost scales with the length of the range rather than the file. Samples match
+   // the same span of loadAudioData()'s output to within the loadAudioDataSegmented() tolerance.
+   // A cached full decode is cut down rather than decoding anything, but ranges aren't cached.
+   bool loadAudioData( double startTime, double endTime );
+
+   // Splits the stream into time ranges and decodes/resamples each on its own thread, with its own
+   // decoder and resampler, then stitches the results together. Adjacent ranges overlap by 100 ms
+   // so decoders and resamplers have settled before their output is used, and range boundaries sit
+   // where the input and output sample clocks line up. The result has the same length as
+   // loadAudioData()'s, with samples matching to within 2 LSB for 16-bit output (2e-4 for float
+   // output). Falls back to loadAudioData() for inputs shorter than a second per range, inputs
+   // lacking a duration or timestamps, or when seeking doesn't land early enough.
+   // A segment count of zero means one per hardware thread.
+   bool loadAudioDataSegmented( unsigned segmentCount = 0 );
+
+   // Same result as loadAudioData(), but demuxing, decoding and resampling each run on their own
+   // thread, handing packets and frames along through bounded lock-free queues. Waiting on I/O
+   // overlaps with codec work, and throughput approaches that of the slowest stage.
+   bool loadAudioDataPipelined();
+
+   // loadAudioData() on a thread of its own, so playback can start on the first few thousand
+   // frames rather than wait for the whole stream. While it runs, availableFrames() says how much
+   // of the output is ready -- it only ever grows, and samples below it never change -- and
+   // readAvailable() copies from that prefix; both may be called from any thread. The future gives
+   // what loadAudioData() would have returned; until it's ready, no other member may be used.
+   std::future<bool> loadAudioDataAsync();
+   size_t availableFrames() const { return _availableFrames.load( std::memory_order_acquire ); }
+
+   // Copy up to frameCount frames from firstFrame on, as far as availableFrames(), and return how
+   // many were copied: 16-bit interleaved output to dst, float output to one plane per channel.
+   // Once a load has failed, its output is dropped and nothing more is copied, though
+   // availableFrames() stays where it got to.
+   size_t readAvailable( size_t firstFrame, size_t frameCount, int16_t* dst ) const;
+   size_t readAvailable( size_t firstFrame, size_t frameCount, float* const* planes ) const;
+
+   // Consults the cache before decoding and adds the result to it afterwards. A hit maps the
+   // stored samples read-only rather than running FFmpeg at all.
+   void setCache( std::shared_ptr<DecodedAudioCache> cache ) { _cache = cache; }
+   bool loadedFromCache() const { return _cachedAudio != nullptr && _wavReader == nullptr; }
+
+   // PCM WAV files at the output's sample rate and channel count are read natively, without
+   // FFmpeg or a resampler: samples already in the output format, byte order included, are used
+   // straight from a read-only mapping of the file, and others take one conversion pass. The
+   // result is what FFmpeg would have produced. On by default; loads read this way aren't cached.
+   void setNativeWavReading( bool enabled ) { _nativeWavReading = enabled; }
+   bool nativeWavReading() const { return _nativeWavReading; }
+   bool loadedNatively() const { return _loadedNatively; }
+
+   // Keeps 16-bit interleaved output losslessly compressed, in blocks that are decoded on demand
+   // (see CompressedSampleStore). Output is compressed as it's decoded, so no more than a block of
+   // it is held uncompressed at any time. readProcessedAudio() reads any range by decoding just the
+   // blocks it touches, with the last few kept decoded for nearby reads; the other accessors
+   // decompress the whole output on first use, and that copy is charged to the memory account.
+   // Output mapped from the cache or a WAV file, and float output, stay as they are. Off by
+   // default; from the next load on.
+   void setCompressedStorage( bool enabled ) { _compressedStorage = enabled; }
+   bool compressedStorage() const { return _compressedStorage; }
+
+   // Threading and other FFmpeg options for the decoder; they apply from the next load on
+   void setDecoderOptions( const DecoderOptions& options ) { _decoderOptions = options; }
+   const DecoderOptions& decoderOptions() const { return _decoderOptions; }
+
+   // Speed/accuracy trade-off for resampling, from the next load on. Loads at different
+   // qualities are cached separately.
+   void setResamplerQuality( ResamplerQuality quality ) { _resamplerQuality = quality; }
+   ResamplerQuality resamplerQuality() const { return _resamplerQuality; }
+
+   // Builds a WaveformPyramid of the output as it's produced, in the same pass; loads that are
+   // served from the cache or cut down to a range build it from the final output instead. A base
+   // block size of zero turns it off again.
+   void enableWaveformPyramid( int baseBlockSize = WaveformPyramid::DefaultBaseBlockSize ) { _waveformBlockSize = baseBlockSize; }
+
+   // Null unless enabled and a load has succeeded
+   const WaveformPyramid* waveformPyramid() const;
+
+   // Opt-in accounting of the memory loads use: output and staging buffers, resampler buffers and
+   // decoded frames. An account can be shared by several loaders, and every account also reports
+   // to MemoryAccount::total(). If the account, or one above it, has a budget, a load that would
+   // exceed it stops as soon as that's known -- before decoding anything when the stream's duration
+   // shows the output won't fit -- drops what it has, and fails with MemoryBudgetExceeded.
+   void setMemoryAccount( std::shared_ptr<MemoryAccount> account );
+   const MemoryAccount* memoryAccount() const { return _memoryAccount.get(); }
+
+#ifdef AUDIO_LOAD_STATS
+   // Where the time went in the last load; a segmented load includes its segments' stats
+   const LoadStats& loadStats() const { return _loadStats; }
+#endif
+
    State state() const { return _state; }
    bool readerDecoderInitState( AudioReaderDecoderInitState& state ) const;
    bool resamplerInitState( AudioResamplerInitState& state ) const;
 
-   // 16-bit stereo interleaved audio samples
-   const std::vector<int16_t> & processedAudio() const { return _processedAudio; }
+   const AudioParams& outputParams() const { return _outputParams; }
+
+   // 16-bit interleaved audio samples; empty unless the output format is AV_SAMPLE_FMT_S16. Also
+   // empty if the output is compressed and the memory account refuses its decompressed copy.
+   const std::vector<int16_t> & processedAudio() const;
+
+   // One vector of float samples per channel; empty unless the output format is AV_SAMPLE_FMT_FLTP
+   const std::vector< std::vector<float> > & processedPlanarAudio() const;
+
+   // Zero-copy access to the output, whether it was decoded or mapped from the cache or a WAV
+   // file. The two accessors above copy mapped samples into vectors on first use; any number of
+   // threads may call them at once, and the copy is only made once.
+   size_t processedFrameCount() const;
+   const int16_t* processedAudioData() const;
+   const float* processedPlanarAudioData( int channel ) const;
+
+   // Copies frameCount frames from firstFrame on, however the output is stored: 16-bit interleaved
+   // output to dst, float output to one plane per channel. The range must lie within the output.
+   void readProcessedAudio( size_t firstFrame, size_t frameCount, int16_t* dst ) const;
+   void readProcessedAudio( size_t firstFrame, size_t frameCount, float* const* planes ) const;
 
 protected:
+   bool initializeDecoding();
+   void reserveOutput( double seconds );
+   void finishDecoding( bool atEndOfStream = true );
+   void moveOutputToProcessedAudio();
+   bool outputWillGrow( int sampleCount ) const;
+   void publishOutput();
+
+   bool outputParamsSupported() const;
+   bool loadFromCache();
+   bool loadFromWav( int64_t startFrame = 0, int64_t endFrame = -1 );
+   void storeInCache();
+   void compressOutput();
+   std::string cacheVariant() const;
+
+   // Input sample positions here are relative to _positionOrigin, the position of the stream's
+   // first decoded frame. An end position < 0 means the end of the stream.
+   bool findStreamOrigin( int64_t& origin );
+   bool decodeRange( int64_t startSample, int64_t endSample, bool seekToStart = true );
+   bool loadSegment( int64_t origin, int64_t startSample, int64_t endSample );
+   void trimProcessedAudio( size_t firstFrame, size_t endFrame );
+
+   bool holdMemory( MemoryAccount::Category category, size_t bytes );
+   void updateOutputMemory();
+   void updateResamplerMemory();
+   bool overBudget() const;
+   bool failOverBudget();
+
+   void resetWaveformPyramid();
+   void appendToWaveformPyramid( const uint8_t* const* planes, size_t frameCount );
+   void rebuildWaveformPyramid();
+
    void processDecodedAudio( const AVFrame* );
-   void copyResampledAudio( int sampleCount );
-   void flushResampleBuffer();
+   void resampleDecodedAudio( const AVFrame* frame, int offset, int count );
+   int resample( const uint8_t* const* planes, int count );
+   virtual void copyResampledAudio( int sampleCount );
+   void appendCompressed( const int16_t* frames, size_t frameCount );
+   void padEndOfStream( bool atEndOfStream );
+#ifdef AUDIO_LOAD_STATS
+   size_t outputBlockCount() const;
+#endif
+
+   static void convertToLittleEndian( int16_t* samples, size_t count );
 
-   const std::string                   _path;
+   bool outputIsPlanar() const { return _outputParams.sampleFormat == AV_SAMPLE_FMT_FLTP; }
+
+   typedef std::tuple<int, int, int, int, int, int, ResamplerQuality> ResamplerKey;   // input then output channels/format/rate, and quality
+
+   AudioSource                         _source;
+   AudioParams                         _outputParams;
    const bool                          _forceLittleEndian;
+   DecoderOptions                      _decoderOptions;
+   ResamplerQuality                    _resamplerQuality;
    State                               _state;
+   std::shared_ptr<MemoryAccount>      _memoryAccount;      // outlives the decoder's frame buffers
+   mutable size_t                      _heldMemory[MemoryAccount::CategoryCount];   // charged to it by this loader
+   bool                                _overBudget;
    std::unique_ptr<AudioReaderDecoder> _readerDecoder;
-   std::unique_ptr<AudioResampler>     _resampler;
-   std::vector<int16_t>                _processedAudio;
-   std::unique_ptr<uint8_t[]>          _resampleBuff;
-   int                                 _numInResampleBuffer;
-   int                                 _resampleBufferSampleCapacity;
+   std::map< ResamplerKey, std::unique_ptr<AudioResampler> > _resamplers;
+   AudioResampler*                     _resampler;          // one of _resamplers
+   std::shared_ptr<DecodedAudioCache>  _cache;
+   std::unique_ptr<CachedAudio>        _cachedAudio;        // output mapped from the cache, or from _wavReader's file
+   std::unique_ptr<WavReader>          _wavReader;
+   bool                                _nativeWavReading;
+   bool                                _loadedNatively;
+   bool                                _compressedStorage;
+   std::unique_ptr<CompressedSampleStore> _compressedAudio; // the output, when compressed; _processedAudio is then a copy, if anything
+   std::vector<int16_t>                _littleEndianFrames; // byte-swapped output on its way into _compressedAudio
+   mutable std::vector<int16_t>        _processedAudio;
+   mutable std::vector< std::vector<float> > _processedPlanarAudio;
+   SampleBlockStore<int16_t>           _outputStore;
+   std::vector< SampleBlockStore<float> > _planarOutputStores;
+   std::atomic<size_t>                 _availableFrames;    // output ready for readAvailable()
+   mutable std::mutex                  _outputMutex;        // held while the stores' block lists change
+   mutable std::mutex                  _copyMutex;          // held while the const accessors fill in their copies
+   bool                                _outputInStores;     // readAvailable() reads the stores, not the processed output
+   bool                                _outputDiscarded;    // the load failed; readAvailable() has nothing to read
+   std::thread                         _loadThread;         // of loadAudioDataAsync()
+   int                                 _waveformBlockSize;
+   std::unique_ptr<WaveformPyramid>    _waveformPyramid;
    AudioParams                         _inputParams;
-   AudioParams                         _resamplerInputParams;
+   std::vector<const uint8_t*>         _inputPlanes;        // decoder frame planes as handed to the resampler
+   int                                 _paddingSpan;
    int                                 _primingAdjustment;
+   int64_t                             _inputPosition;      // input samples resampled so far, from _positionOrigin
+   int64_t                             _positionOrigin;
+
+   struct InputRange
+   {
+      bool     active = false;
+      int64_t  start = 0;
+      int64_t  end = -1;
+      int64_t  nextFramePosition = 0;
+      bool     started = false;
+      bool     startMissed = false;  // decoding began after 'start' (e.g. an imprecise seek)
+      bool     satisfied = false;
+   };
+   InputRange                          _range;
+#ifdef AUDIO_LOAD_STATS
+   LoadStats                           _loadStats;
+#endif
 };
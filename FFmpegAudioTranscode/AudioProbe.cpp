@@ -0,0 +1,127 @@
+#include "stdafx.h"
+
+#include "AudioProbe.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+namespace
+{
+   // FFmpeg won't go below 32 bytes, but a little more lets the format be detected by content for
+   // inputs whose extension is missing or wrong
+   const int64_t DefaultProbeSize = 32 * 1024;
+   const int64_t DefaultAnalyzeDuration = AV_TIME_BASE / 10;
+}
+
+DecoderOptions AudioProbe::defaultOptions()
+{
+   DecoderOptions options;
+   options.probeSize = DefaultProbeSize;
+   options.analyzeDuration = DefaultAnalyzeDuration;
+   return options;
+}
+
+AudioProbe::AudioProbe( const std::string& path, const DecoderOptions& options/*=defaultOptions()*/ )
+   : AudioProbe( AudioSource::fromFile( path ), options )
+{
+
+}
+
+AudioProbe::AudioProbe( const AudioSource& source, const DecoderOptions& options/*=defaultOptions()*/ )
+   : AudioReaderDecoder( source, options )
+{
+
+}
+
+AudioProbe::~AudioProbe()
+{
+
+}
+
+void AudioProbe::reset( const std::string& path )
+{
+   reset( AudioSource::fromFile( path ) );
+}
+
+void AudioProbe::reset( const AudioSource& source )
+{
+   AudioReaderDecoder::reset( source, _options );
+}
+
+bool AudioProbe::probe( const std::string& path, Result& result, const DecoderOptions& options/*=defaultOptions()*/ )
+{
+   AudioProbe audioProbe( path, options );
+   return audioProbe.probe( result );
+}
+
+bool AudioProbe::probe( Result& result )
+{
+   if ( _initState == AudioReaderDecoderInitState::NoInit )
+   {
+      _initState = probeInput( result );
+
+      // Nothing more is read, so there's no reason to hold on to the file
+      closeInput();
+   }
+
+   return _initState == AudioReaderDecoderInitState::Ok;
+}
+
+AudioReaderDecoderInitState AudioProbe::probeInput( Result& result )
+{
+   result = Result();
+
+   AudioReaderDecoderInitState openState = openInput();
+   if ( openState != AudioReaderDecoderInitState::Ok )
+      return openState;
+
+   // Formats without a header only add their streams as packets are read
+   _streamIndex = ::av_find_best_stream( _formatContext, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0 );
+   const AVCodecParameters* codecParams = ( _streamIndex >= 0 ) ? _formatContext->streams[_streamIndex]->codecpar : nullptr;
+   if ( codecParams == nullptr || codecParams->sample_rate <= 0 || codecParams->channels <= 0 )
+   {
+      if ( ::avformat_find_stream_info( _formatContext, nullptr ) < 0 )
+         return AudioReaderDecoderInitState::FindStreamInfoFails;
+
+      _streamIndex = ::av_find_best_stream( _formatContext, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0 );
+      if ( _streamIndex < 0 )
+         return AudioReaderDecoderInitState::NoAudioStream;
+      codecParams = _formatContext->streams[_streamIndex]->codecpar;
+   }
+
+   AVSampleFormat sampleFormat = AVSampleFormat( codecParams->format );
+   if ( sampleFormat == AV_SAMPLE_FMT_NONE )
+   {
+      const AVCodec* codec = ::avcodec_find_decoder( codecParams->codec_id );
+      if ( codec != nullptr && codec->sample_fmts != nullptr )
+         sampleFormat = codec->sample_fmts[0];
+   }
+
+   result.params = AudioParams( codecParams->channels, sampleFormat, codecParams->sample_rate,
+                                ( sampleFormat != AV_SAMPLE_FMT_NONE ) ? ::av_get_bytes_per_sample( sampleFormat ) : 0 );
+   result.bitRate = ( codecParams->bit_rate > 0 ) ? codecParams->bit_rate : _formatContext->bit_rate;
+   result.formatName = formatName();
+   result.codecName = ::avcodec_get_name( codecParams->codec_id );
+
+   // getDuration() only looks at the stream and format contexts, so it works without a decoder
+   _initState = AudioReaderDecoderInitState::Ok;
+   if ( !getDuration( result.duration ) )
+   {
+      // The same estimate avformat_find_stream_info() falls back on for constant bit rate streams
+      int64_t fileSize = ( _formatContext->pb != nullptr ) ? ::avio_size( _formatContext->pb ) : -1;
+      if ( fileSize > 0 && result.bitRate > 0 )
+      {
+         result.duration = double( fileSize ) * 8.0 / double( result.bitRate );
+         result.durationEstimated = true;
+      }
+      else
+      {
+         result.duration = -1.0;
+      }
+   }
+
+   return AudioReaderDecoderInitState::Ok;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "AudioParams.h"
+#include "AudioReaderDecoder.h"
+
+#include <cstdint>
+#include <string>
+
+// Reports the parameters and duration of an input's audio stream from its container header,
+// without opening a decoder or analyzing packets the way AudioReaderDecoder::initialize() does.
+// Only when the header leaves the sample rate or channel count out is the stream analyzed, and
+// then no further than the probe size and analyze duration allow. One AudioProbe can be reset()
+// to each input of a large batch in turn.
+class AudioProbe : protected AudioReaderDecoder
+{
+public:
+   struct Result
+   {
+      // sampleFormat is what the decoder will produce; for most codecs that's only implied by the
+      // codec, so it's the decoder's preferred format rather than anything read from the input
+      AudioParams params;
+
+      // Seconds; negative if the container gives no duration and there's no bit rate to estimate one from
+      double      duration = -1.0;
+      bool        durationEstimated = false;   // worked out from the file size and bit rate
+
+      int64_t     bitRate = 0;                 // bits per second; zero if not known
+      std::string formatName;                  // e.g. "mp3" or "wav"
+      std::string codecName;                   // e.g. "mp3" or "pcm_s16le"
+   };
+
+   // Reads at most 32 KB of the input to detect the format, and analyzes at most a tenth of a second
+   static DecoderOptions defaultOptions();
+
+   AudioProbe( const std::string& path, const DecoderOptions& options = defaultOptions() );
+   AudioProbe( const AudioSource& source, const DecoderOptions& options = defaultOptions() );
+   ~AudioProbe() override;
+
+   void reset( const std::string& path );
+   void reset( const AudioSource& source );
+
+   // Opens the input and fills in the result; the input is closed again before returning
+   bool probe( Result& result );
+
+   // Shorthand for a single file
+   static bool probe( const std::string& path, Result& result, const DecoderOptions& options = defaultOptions() );
+
+   using AudioReaderDecoder::initState;
+
+protected:
+   AudioReaderDecoderInitState probeInput( Result& result );
+};
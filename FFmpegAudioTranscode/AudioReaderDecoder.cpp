@@ -2,6 +2,7 @@
 
 #include "AudioReaderDecoder.h"
 #include "AudioParams.h"
+#include "MemoryAccount.h"
 #include "WavUtil.h"
 
 extern "C"
@@ -11,14 +12,53 @@ extern "C"
 #include <libswresample/swresample.h>
 }
 
+#include <algorithm>
+#include <cstdio>
+
+#include <string.h>
+
+namespace
+{
+   const int FrameBufferPadding = 64;
+
+   // Each accounted frame buffer keeps its account alive, since frames can hold on to buffers
+   // after the pool and the reader-decoder are gone
+   struct AccountedBuffer
+   {
+      std::shared_ptr<MemoryAccount> account;
+      size_t                         size;
+   };
+
+   AVDictionary* makeDictionary( const std::map<std::string, std::string>& options )
+   {
+      AVDictionary* dict = nullptr;
+      for ( const auto& option : options )
+         ::av_dict_set( &dict, option.first.c_str(), option.second.c_str(), 0 );
+      return dict;
+   }
+}
+
 AudioReaderDecoder::AudioReaderDecoder( const std::string& path )
-   : _path( path )
+   : AudioReaderDecoder( AudioSource::fromFile( path ) )
+{
+
+}
+
+AudioReaderDecoder::AudioReaderDecoder( const AudioSource& source, const DecoderOptions& options/*=DecoderOptions()*/ )
+   : _source( source )
+   , _options( options )
    , _initState( AudioReaderDecoderInitState::NoInit )
    , _streamIndex( -1 )
    , _formatContext( nullptr )
+   , _ioContext( nullptr )
+   , _memoryReadPos( 0 )
    , _codecContext( nullptr )
    , _packet( nullptr )
    , _frame( nullptr )
+   , _receivedEOF( false )
+   , _framePool( nullptr )
+   , _framePoolBufferSize( 0 )
+   , _memoryBudgetExceeded( false )
 {
 
 }
@@ -31,8 +71,156 @@ AudioReaderDecoder::~AudioReaderDecoder()
       ::av_packet_free( &_packet );
    if ( _codecContext != nullptr )
       ::avcodec_free_context( &_codecContext );
+   closeInput();
+
+   // Buffers still referenced by frames outlive the pool
+   if ( _framePool != nullptr )
+      ::av_buffer_pool_uninit( &_framePool );
+}
+
+void AudioReaderDecoder::closeInput()
+{
+   // Closes the demuxer and the file it opened, which freeing the context alone leaves open. An
+   // AVIOContext of our own is marked as custom I/O, so it's left for us to free.
    if ( _formatContext != nullptr )
-      ::avformat_free_context( _formatContext );
+      ::avformat_close_input( &_formatContext );
+
+   // FFmpeg may have replaced the buffer we handed it, so free whichever one it holds now
+   if ( _ioContext != nullptr )
+   {
+      ::av_freep( &_ioContext->buffer );
+      ::avio_context_free( &_ioContext );
+   }
+}
+
+void AudioReaderDecoder::reset( const AudioSource& source, const DecoderOptions& options )
+{
+   closeInput();
+   if ( _packet != nullptr )
+      ::av_packet_unref( _packet );
+   if ( _frame != nullptr )
+      ::av_frame_unref( _frame );
+
+   _source = source;
+   _options = options;
+   _initState = AudioReaderDecoderInitState::NoInit;
+   _streamIndex = -1;
+   _memoryReadPos = 0;
+   _receivedEOF = false;
+   _memoryBudgetExceeded = false;
+}
+
+void AudioReaderDecoder::setMemoryAccount( std::shared_ptr<MemoryAccount> account )
+{
+   if ( account == _memoryAccount )
+      return;
+
+   // Buffers already in the pool were charged elsewhere, or not at all; start a new pool so
+   // every buffer is released to the account it was charged to
+   _memoryAccount = account;
+   if ( _framePool != nullptr )
+      ::av_buffer_pool_uninit( &_framePool );
+   _framePoolBufferSize = 0;
+}
+
+bool AudioReaderDecoder::canReuseCodecContext( const AVCodec* codec, const AVCodecParameters* params ) const
+{
+   if ( _codecContext == nullptr || _codecContext->codec != codec || _codecContext->codec_id != params->codec_id )
+      return false;
+
+   if ( _codecContext->sample_rate != params->sample_rate || _codecContext->channels != params->channels ||
+        _codecContext->channel_layout != params->channel_layout || _codecContext->block_align != params->block_align ||
+        _codecContext->bits_per_coded_sample != params->bits_per_coded_sample )
+      return false;
+
+   if ( _codecContext->extradata_size != params->extradata_size ||
+        ( params->extradata_size > 0 && ::memcmp( _codecContext->extradata, params->extradata, params->extradata_size ) != 0 ) )
+      return false;
+
+   return _openedOptions.threadCount == _options.threadCount && _openedOptions.threadType == _options.threadType &&
+          _openedOptions.codecOptions == _options.codecOptions;
+}
+
+// Decoded frames get their sample buffers from a pool that lives as long as this object, so
+// they're recycled across frames and across inputs rather than allocated for each frame. With
+// frame threading this runs on the decoder's worker threads, so replacing the pool is locked.
+int AudioReaderDecoder::getFrameBuffer( AVCodecContext* codecContext, AVFrame* frame, int flags )
+{
+   AudioReaderDecoder* self = static_cast<AudioReaderDecoder*>( codecContext->opaque );
+   AVSampleFormat format = AVSampleFormat( frame->format );
+
+   int planeCount = ::av_sample_fmt_is_planar( format ) ? frame->channels : 1;
+   if ( planeCount > AV_NUM_DATA_POINTERS )
+      return ::avcodec_default_get_buffer2( codecContext, frame, flags );
+
+   int lineSize = 0;
+   if ( ::av_samples_get_buffer_size( &lineSize, frame->channels, frame->nb_samples, format, 0 ) < 0 )
+      return AVERROR( EINVAL );
+
+   std::lock_guard<std::mutex> lock( self->_framePoolMutex );
+
+   // Padded like FFmpeg's own buffers, for decoders whose SIMD code writes a little past the end
+   if ( lineSize + FrameBufferPadding > self->_framePoolBufferSize )
+   {
+      // Sized with some headroom so decoders with varying frame sizes settle on one pool
+      if ( self->_framePool != nullptr )
+         ::av_buffer_pool_uninit( &self->_framePool );
+      self->_framePoolBufferSize = lineSize + lineSize / 2 + FrameBufferPadding;
+      if ( self->_memoryAccount != nullptr )
+         self->_framePool = ::av_buffer_pool_init2( self->_framePoolBufferSize, self, allocatePoolBuffer, nullptr );
+      else
+         self->_framePool = ::av_buffer_pool_init( self->_framePoolBufferSize, nullptr );
+      if ( self->_framePool == nullptr )
+      {
+         self->_framePoolBufferSize = 0;
+         return AVERROR( ENOMEM );
+      }
+   }
+
+   for ( int i = 0; i < planeCount; ++i )
+   {
+      frame->buf[i] = ::av_buffer_pool_get( self->_framePool );
+      if ( frame->buf[i] == nullptr )
+      {
+         for ( int ii = 0; ii < i; ++ii )
+            ::av_buffer_unref( &frame->buf[ii] );
+         return AVERROR( ENOMEM );
+      }
+      frame->data[i] = frame->buf[i]->data;
+   }
+   frame->extended_data = frame->data;
+   frame->linesize[0] = lineSize;
+
+   return 0;
+}
+
+AVBufferRef* AudioReaderDecoder::allocatePoolBuffer( void* opaque, int size )
+{
+   AudioReaderDecoder* self = static_cast<AudioReaderDecoder*>( opaque );
+   if ( !self->_memoryAccount->charge( MemoryAccount::Decoder, size_t( size ) ) )
+   {
+      self->_memoryBudgetExceeded = true;
+      return nullptr;
+   }
+
+   uint8_t* data = static_cast<uint8_t*>( ::av_malloc( size ) );
+   AccountedBuffer* accounted = ( data != nullptr ) ? new AccountedBuffer{ self->_memoryAccount, size_t( size ) } : nullptr;
+   AVBufferRef* buffer = ( accounted != nullptr ) ? ::av_buffer_create( data, size, freePoolBuffer, accounted, 0 ) : nullptr;
+   if ( buffer == nullptr )
+   {
+      ::av_free( data );
+      delete accounted;
+      self->_memoryAccount->release( MemoryAccount::Decoder, size_t( size ) );
+   }
+   return buffer;
+}
+
+void AudioReaderDecoder::freePoolBuffer( void* opaque, uint8_t* data )
+{
+   AccountedBuffer* accounted = static_cast<AccountedBuffer*>( opaque );
+   accounted->account->release( MemoryAccount::Decoder, accounted->size );
+   ::av_free( data );
+   delete accounted;
 }
 
 #define SetStateAndReturn(a) \
@@ -41,20 +229,67 @@ AudioReaderDecoder::~AudioReaderDecoder()
    return a;       \
 }
 
-AudioReaderDecoderInitState AudioReaderDecoder::initialize()
+// Allocates the format context (and AVIOContext for memory and callback sources) and opens the
+// input, which reads and parses the container header but nothing more
+AudioReaderDecoderInitState AudioReaderDecoder::openInput()
 {
-   if ( _initState != AudioReaderDecoderInitState::NoInit )
-      return _initState;
+#ifdef AUDIO_LOAD_STATS
+   _statsBytesRead = 0;
+#endif
 
    _formatContext = ::avformat_alloc_context();
    if ( _formatContext == nullptr )
-      SetStateAndReturn( AudioReaderDecoderInitState::FormatContextAllocFails );
+      return AudioReaderDecoderInitState::FormatContextAllocFails;
 
-   int status = ::avformat_open_input( &_formatContext, _path.c_str(), nullptr, nullptr );
+   if ( _source.kind != AudioSource::File )
+   {
+      int bufferSize = std::max( _source.ioBufferSize, 4096 );
+      uint8_t* buffer = static_cast<uint8_t*>( ::av_malloc( bufferSize ) );
+      bool seekable = _source.kind == AudioSource::Memory || _source.seek;
+      if ( buffer != nullptr )
+         _ioContext = ::avio_alloc_context( buffer, bufferSize, 0, this, readPacket, nullptr, seekable ? seekStream : nullptr );
+      if ( _ioContext == nullptr )
+      {
+         ::av_free( buffer );
+         return AudioReaderDecoderInitState::FormatContextAllocFails;
+      }
+      _formatContext->pb = _ioContext;
+      _formatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+   }
+
+   AVInputFormat* inputFormat = nullptr;
+   if ( !_options.inputFormat.empty() )
+   {
+      inputFormat = ::av_find_input_format( _options.inputFormat.c_str() );
+      if ( inputFormat == nullptr )
+         return AudioReaderDecoderInitState::OpenFails;
+   }
+
+   if ( _options.probeSize > 0 )
+      _formatContext->probesize = _options.probeSize;
+   if ( _options.analyzeDuration > 0 )
+      _formatContext->max_analyze_duration = _options.analyzeDuration;
+
+   // Options FFmpeg doesn't recognize are left in the dictionary and ignored
+   AVDictionary* formatOptions = makeDictionary( _options.formatOptions );
+   int status = ::avformat_open_input( &_formatContext, _source.path.c_str(), inputFormat, &formatOptions );
+   ::av_dict_free( &formatOptions );
    if ( status != 0 )
-      SetStateAndReturn( AudioReaderDecoderInitState::OpenFails );
+      return AudioReaderDecoderInitState::OpenFails;
 
-   status = ::avformat_find_stream_info( _formatContext, nullptr );
+   return AudioReaderDecoderInitState::Ok;
+}
+
+AudioReaderDecoderInitState AudioReaderDecoder::initialize()
+{
+   if ( _initState != AudioReaderDecoderInitState::NoInit )
+      return _initState;
+
+   AudioReaderDecoderInitState openState = openInput();
+   if ( openState != AudioReaderDecoderInitState::Ok )
+      SetStateAndReturn( openState );
+
+   int status = ::avformat_find_stream_info( _formatContext, nullptr );
    if ( status < 0 )
       SetStateAndReturn( AudioReaderDecoderInitState::FindStreamInfoFails );
 
@@ -63,33 +298,127 @@ AudioReaderDecoderInitState AudioReaderDecoder::initialize()
    if ( _streamIndex == -1 )
       SetStateAndReturn( AudioReaderDecoderInitState::NoAudioStream );
 
-   _codecContext = ::avcodec_alloc_context3( codec );
-   if ( _codecContext == nullptr )
-      SetStateAndReturn( AudioReaderDecoderInitState::CodecContextAllocFails );
-
+   // A codec context left over from the previous input is only flushed if nothing about it changes
    AVStream* pStream = _formatContext->streams[_streamIndex];
-   status = ::avcodec_parameters_to_context( _codecContext, pStream->codecpar );
-   if ( status < 0 )
-      SetStateAndReturn( AudioReaderDecoderInitState::CodecContextFillFails );
+   if ( canReuseCodecContext( codec, pStream->codecpar ) )
+   {
+      ::avcodec_flush_buffers( _codecContext );
+   }
+   else
+   {
+      if ( _codecContext != nullptr )
+         ::avcodec_free_context( &_codecContext );
 
-   status = ::avcodec_open2( _codecContext, codec, nullptr );
-   if ( status != 0 )
-      SetStateAndReturn( AudioReaderDecoderInitState::CodecOpenFails );
+      _codecContext = ::avcodec_alloc_context3( codec );
+      if ( _codecContext == nullptr )
+         SetStateAndReturn( AudioReaderDecoderInitState::CodecContextAllocFails );
+
+      status = ::avcodec_parameters_to_context( _codecContext, pStream->codecpar );
+      if ( status < 0 )
+         SetStateAndReturn( AudioReaderDecoderInitState::CodecContextFillFails );
+
+      _codecContext->thread_count = _options.threadCount;
+      _codecContext->thread_type = _options.threadType;
+      _codecContext->opaque = this;
+
+      // Custom allocators are only allowed for decoders that can work with buffers they didn't
+      // allocate themselves; the rest keep FFmpeg's
+      if ( codec->capabilities & AV_CODEC_CAP_DR1 )
+         _codecContext->get_buffer2 = getFrameBuffer;
+
+      AVDictionary* codecOptions = makeDictionary( _options.codecOptions );
+      status = ::avcodec_open2( _codecContext, codec, &codecOptions );
+      ::av_dict_free( &codecOptions );
+      if ( status != 0 )
+      {
+         ::avcodec_free_context( &_codecContext );
+         SetStateAndReturn( AudioReaderDecoderInitState::CodecOpenFails );
+      }
+      _openedOptions = _options;
+   }
 
-   _packet = ::av_packet_alloc();
    if ( _packet == nullptr )
-      SetStateAndReturn( AudioReaderDecoderInitState::PacketAllocFails );
-   ::av_init_packet( _packet );
+   {
+      _packet = ::av_packet_alloc();
+      if ( _packet == nullptr )
+         SetStateAndReturn( AudioReaderDecoderInitState::PacketAllocFails );
+      ::av_init_packet( _packet );
+   }
 
-   _frame = ::av_frame_alloc();
    if ( _frame == nullptr )
-      SetStateAndReturn( AudioReaderDecoderInitState::FrameAllocFails );
+   {
+      _frame = ::av_frame_alloc();
+      if ( _frame == nullptr )
+         SetStateAndReturn( AudioReaderDecoderInitState::FrameAllocFails );
+   }
 
    ::av_seek_frame( _formatContext, _streamIndex, 0, AVSEEK_FLAG_ANY );
 
    SetStateAndReturn( AudioReaderDecoderInitState::Ok );
 }
 
+int AudioReaderDecoder::readPacket( void* opaque, uint8_t* buffer, int size )
+{
+   AudioReaderDecoder* self = static_cast<AudioReaderDecoder*>( opaque );
+
+   int count;
+   if ( self->_source.kind == AudioSource::Memory )
+   {
+      int64_t remaining = int64_t( self->_source.size ) - self->_memoryReadPos;
+      count = int( std::min<int64_t>( size, std::max<int64_t>( remaining, 0 ) ) );
+      ::memcpy( buffer, self->_source.data + self->_memoryReadPos, count );
+      self->_memoryReadPos += count;
+   }
+   else
+   {
+      count = self->_source.read( buffer, size );
+   }
+
+   return ( count > 0 ) ? count : ( count == 0 ? AVERROR_EOF : count );
+}
+
+int64_t AudioReaderDecoder::seekStream( void* opaque, int64_t offset, int whence )
+{
+   AudioReaderDecoder* self = static_cast<AudioReaderDecoder*>( opaque );
+   whence &= ~AVSEEK_FORCE;
+
+   if ( self->_source.kind != AudioSource::Memory )
+      return self->_source.seek( offset, whence );
+
+   const int64_t size = int64_t( self->_source.size );
+   int64_t pos;
+   switch ( whence )
+   {
+   case AVSEEK_SIZE: return size;
+   case SEEK_SET: pos = offset; break;
+   case SEEK_CUR: pos = self->_memoryReadPos + offset; break;
+   case SEEK_END: pos = size + offset; break;
+   default: return -1;
+   }
+
+   if ( pos < 0 || pos > size )
+      return -1;
+
+   self->_memoryReadPos = pos;
+   return pos;
+}
+
+std::string AudioReaderDecoder::formatName() const
+{
+   if ( _formatContext == nullptr || _formatContext->iformat == nullptr || _formatContext->iformat->name == nullptr )
+      return std::string();
+
+   return _formatContext->iformat->name;
+}
+
+std::string AudioReaderDecoder::codecName() const
+{
+   if ( _codecContext == nullptr || _codecContext->codec == nullptr || _codecContext->codec->name == nullptr )
+      return std::string();
+
+   return _codecContext->codec->name;
+}
+
 bool AudioReaderDecoder::getAudioParams( AudioParams& p )
 {
    if ( _initState == AudioReaderDecoderInitState::NoInit )
@@ -108,6 +437,72 @@ bool AudioReaderDecoder::getAudioParams( AudioParams& p )
    return true;
 }
 
+bool AudioReaderDecoder::getDuration( double& seconds )
+{
+   if ( _initState == AudioReaderDecoderInitState::NoInit )
+      initialize();
+
+   if ( _initState != AudioReaderDecoderInitState::Ok )
+      return false;
+
+   const AVStream* stream = _formatContext->streams[_streamIndex];
+   if ( stream->duration != AV_NOPTS_VALUE && stream->duration > 0 )
+   {
+      seconds = stream->duration * ::av_q2d( stream->time_base );
+      return true;
+   }
+
+   if ( _formatContext->duration != AV_NOPTS_VALUE && _formatContext->duration > 0 )
+   {
+      seconds = double( _formatContext->duration ) / AV_TIME_BASE;
+      return true;
+   }
+
+   return false;
+}
+
+bool AudioReaderDecoder::seek( int64_t samplePosition )
+{
+   if ( _initState == AudioReaderDecoderInitState::NoInit )
+      initialize();
+
+   if ( _initState != AudioReaderDecoderInitState::Ok )
+      return false;
+
+   const AVStream* stream = _formatContext->streams[_streamIndex];
+   AVRational sampleTimeBase = { 1, _codecContext->sample_rate };
+   int64_t timestamp = ::av_rescale_q( samplePosition, sampleTimeBase, stream->time_base );
+   if ( stream->start_time != AV_NOPTS_VALUE )
+      timestamp += stream->start_time;
+
+   if ( ::av_seek_frame( _formatContext, _streamIndex, timestamp, AVSEEK_FLAG_BACKWARD ) < 0 )
+      return false;
+
+   ::avcodec_flush_buffers( _codecContext );
+   _receivedEOF = false;
+
+   return true;
+}
+
+int64_t AudioReaderDecoder::frameSamplePosition( const AVFrame* frame ) const
+{
+   if ( _initState != AudioReaderDecoderInitState::Ok )
+      return AV_NOPTS_VALUE;
+
+   int64_t timestamp = frame->best_effort_timestamp;
+   if ( timestamp == AV_NOPTS_VALUE )
+      timestamp = frame->pts;
+   if ( timestamp == AV_NOPTS_VALUE )
+      return AV_NOPTS_VALUE;
+
+   const AVStream* stream = _formatContext->streams[_streamIndex];
+   if ( stream->start_time != AV_NOPTS_VALUE )
+      timestamp -= stream->start_time;
+
+   AVRational sampleTimeBase = { 1, _codecContext->sample_rate };
+   return ::av_rescale_q( timestamp, stream->time_base, sampleTimeBase );
+}
+
 bool AudioReaderDecoder::readAndDecode( std::function<void( const AVFrame * )> callback )
 {
    if ( _initState == AudioReaderDecoderInitState::NoInit )
@@ -116,35 +511,85 @@ bool AudioReaderDecoder::readAndDecode( std::function<void( const AVFrame * )> c
    if ( _initState != AudioReaderDecoderInitState::Ok )
       return false;
 
-   int status;
-   for ( bool receivedEOF = false; !receivedEOF; )
+   while ( decodeNextPacket( callback ) )
+      ;
+
+   return true;
+}
+
+bool AudioReaderDecoder::decodeNextPacket( const std::function<void( const AVFrame * )>& callback )
+{
+   if ( _initState == AudioReaderDecoderInitState::NoInit )
+      initialize();
+
+   if ( _initState != AudioReaderDecoderInitState::Ok || _receivedEOF )
+      return false;
+
+   // Treat read errors like EOF so the decoder still gets drained
+   if ( !readNextPacket( _packet ) )
+      _receivedEOF = true;
+
+   decodePacket( _receivedEOF ? nullptr : _packet, callback );
+
+   return !_receivedEOF;
+}
+
+bool AudioReaderDecoder::readNextPacket( AVPacket* packet )
+{
+   if ( _initState != AudioReaderDecoderInitState::Ok )
+      return false;
+
+   LOAD_STATS_TIME( _loadStats, Demux );
+
+   bool gotPacket = false;
+   while ( !gotPacket && ::av_read_frame( _formatContext, packet ) == 0 )
    {
-      while ( ( status = ::av_read_frame( _formatContext, _packet ) ) == 0 )
-      {
-         if ( _packet->stream_index == _streamIndex )
-            break;
-         ::av_packet_unref( _packet );
-      }
+      gotPacket = ( packet->stream_index == _streamIndex );
+      if ( !gotPacket )
+         ::av_packet_unref( packet );
+   }
 
-      if ( status == AVERROR_EOF )
-         receivedEOF = true;
+#ifdef AUDIO_LOAD_STATS
+   // Counts what the demuxer read to open the input, too
+   if ( _formatContext->pb != nullptr )
+   {
+      LOAD_STATS_ADD( _loadStats, bytesRead, _formatContext->pb->bytes_read - _statsBytesRead );
+      _statsBytesRead = _formatContext->pb->bytes_read;
+   }
+   if ( gotPacket )
+      LOAD_STATS_ADD( _loadStats, packets, 1 );
+#endif
 
-      status = ::avcodec_send_packet( _codecContext, receivedEOF ? nullptr : _packet );
+   return gotPacket;
+}
 
-      if ( status == 0 )
+bool AudioReaderDecoder::decodePacket( AVPacket* packet, const std::function<void( const AVFrame * )>& callback )
+{
+   if ( _initState != AudioReaderDecoderInitState::Ok )
+      return false;
+
+   int status;
+   {
+      LOAD_STATS_TIME( _loadStats, Decode );
+      status = ::avcodec_send_packet( _codecContext, packet );
+   }
+
+   // Only the decoder's own calls are timed, not the callback's handling of the frames
+   bool sent = ( status == 0 );
+   while ( sent )
+   {
       {
-         do
-         {
-            status = ::avcodec_receive_frame( _codecContext, _frame );
-            if ( status == AVERROR_EOF )
-               break;
-
-            if ( status == 0 )
-               callback( _frame );
-         } while ( status != AVERROR( EAGAIN ) );
+         LOAD_STATS_TIME( _loadStats, Decode );
+         status = ::avcodec_receive_frame( _codecContext, _frame );
       }
-      ::av_packet_unref( _packet );
+      if ( status != 0 )
+         break;
+
+      LOAD_STATS_ADD( _loadStats, frames, 1 );
+      callback( _frame );
    }
+   if ( packet != nullptr )
+      ::av_packet_unref( packet );
 
-   return true;
+   return sent;
 }
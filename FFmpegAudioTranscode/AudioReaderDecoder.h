@@ -1,17 +1,30 @@
 #pragma once
 
+#include "AudioSource.h"
+#include "DecoderOptions.h"
+#include "LoadStats.h"
+
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 
 extern "C"
 {
+   struct AVBufferPool;
+   struct AVBufferRef;
+   struct AVCodec;
    struct AVCodecContext;
+   struct AVCodecParameters;
    struct AVFormatContext;
    struct AVFrame;
+   struct AVIOContext;
    struct AVPacket;
 }
 
 struct AudioParams;
+class MemoryAccount;
 
 enum class AudioReaderDecoderInitState
 {
@@ -23,21 +36,90 @@ class AudioReaderDecoder
 {
 public:
    AudioReaderDecoder( const std::string& path );
+   AudioReaderDecoder( const AudioSource& source, const DecoderOptions& options = DecoderOptions() );
    virtual ~AudioReaderDecoder();
 
    AudioReaderDecoderInitState initialize();
+
+   // Switches to a new input, which is opened by the next initialize(). The codec context is kept
+   // if the new stream's codec and parameters match the old one's, and the packet, frame and frame
+   // buffer pool are always kept, which saves most of the setup cost over many small inputs.
+   void reset( const AudioSource& source, const DecoderOptions& options = DecoderOptions() );
    AudioReaderDecoderInitState initState() const { return _initState; }
 
    bool readAndDecode( std::function<void( const AVFrame * )> callback );
 
+   // Reads the next packet of the audio stream and passes any frames decoded from it to the
+   // callback. Returns false once the end of the stream has been reached and the decoder drained.
+   bool decodeNextPacket( const std::function<void( const AVFrame * )>& callback );
+
+   // The two halves of decodeNextPacket(), for running demuxing and decoding on separate threads.
+   // readNextPacket() fills the packet with the next one from the audio stream, returning false at
+   // the end of the input. decodePacket() takes ownership of the packet's data; a null packet
+   // drains the decoder.
+   bool readNextPacket( AVPacket* packet );
+   bool decodePacket( AVPacket* packet, const std::function<void( const AVFrame * )>& callback );
+
    bool getAudioParams( AudioParams& p );
 
+   // Duration of the audio stream as reported by the container; false if it isn't known
+   bool getDuration( double& seconds );
+
+   // Sample positions are counted at the stream's own sample rate from the stream's start time.
+   // seek() repositions to the nearest decodable point at or before the given position, so the
+   // first frames decoded afterwards may start somewhat earlier.
+   bool seek( int64_t samplePosition );
+
+   // Position of a frame handed to the callback, or AV_NOPTS_VALUE if it has no timestamp
+   int64_t frameSamplePosition( const AVFrame* frame ) const;
+
+   // Short name of the container format, e.g. "mp3" or "wav"; empty until initialized
+   std::string formatName() const;
+
+   // Short name of the audio decoder, e.g. "mp3float"; empty until initialized
+   std::string codecName() const;
+
+   // Decoded frames are charged to the account while the frame pool holds them. Once a frame
+   // can't be allocated within the account's budget, decoding stops producing frames and
+   // memoryBudgetExceeded() turns true until the next input.
+   void setMemoryAccount( std::shared_ptr<MemoryAccount> account );
+   bool memoryBudgetExceeded() const { return _memoryBudgetExceeded.load( std::memory_order_acquire ); }
+
+#ifdef AUDIO_LOAD_STATS
+   // Demux and decode times and counts are added to stats from here on; null stops collection
+   void setLoadStats( LoadStats* stats ) { _loadStats = stats; }
+#endif
+
 protected:
-   const std::string             _path;
+   AudioReaderDecoderInitState openInput();
+   void closeInput();
+   bool canReuseCodecContext( const AVCodec* codec, const AVCodecParameters* params ) const;
+
+   static int getFrameBuffer( AVCodecContext* codecContext, AVFrame* frame, int flags );
+   static AVBufferRef* allocatePoolBuffer( void* opaque, int size );
+   static void freePoolBuffer( void* opaque, uint8_t* data );
+   static int readPacket( void* opaque, uint8_t* buffer, int size );
+   static int64_t seekStream( void* opaque, int64_t offset, int whence );
+
+   AudioSource                   _source;
+   DecoderOptions                _options;
+   DecoderOptions                _openedOptions;      // what the current codec context was opened with
    AudioReaderDecoderInitState   _initState;
    int                           _streamIndex;
    AVFormatContext*              _formatContext;
+   AVIOContext*                  _ioContext;
+   int64_t                       _memoryReadPos;
    AVCodecContext*               _codecContext;
    AVPacket*                     _packet;
    AVFrame*                      _frame;
+   bool                          _receivedEOF;
+   AVBufferPool*                 _framePool;
+   int                           _framePoolBufferSize;
+   std::mutex                    _framePoolMutex;     // held by getFrameBuffer(), which decoder threads may call
+   std::shared_ptr<MemoryAccount> _memoryAccount;
+   std::atomic<bool>             _memoryBudgetExceeded;
+#ifdef AUDIO_LOAD_STATS
+   LoadStats*                    _loadStats = nullptr;
+   int64_t                       _statsBytesRead = 0;  // of the current input, already added to _loadStats
+#endif
 };
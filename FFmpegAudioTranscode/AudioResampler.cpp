@@ -6,13 +6,17 @@ extern "C"
 {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 }
 
-AudioResampler::AudioResampler( const AudioParams& inputParams, int maxInSampleCount, const AudioParams& outputParams )
+AudioResampler::AudioResampler( const AudioParams& inputParams, int maxInSampleCount, const AudioParams& outputParams,
+                                ResamplerQuality quality/*=ResamplerQuality::Default*/ )
    : _inputParams( inputParams )
    , _maxInSampleCount( maxInSampleCount )
    , _outputParams( outputParams )
+   , _quality( quality )
+   , _usingSoxr( false )
    , _maxReturnedSampleCount( 0 )
    , _dstData( nullptr )
    , _initState( AudioResamplerInitState::NoInit )
@@ -26,9 +30,8 @@ AudioResampler::~AudioResampler()
 {
    if ( _dstData != nullptr )
    {
-      int n = ( ::av_sample_fmt_is_planar( _outputParams.sampleFormat ) != 0 ) ? _outputParams.channelCount : 1;
-      for ( int i = 0; i < n; ++i )
-         ::av_freep( &_dstData[i] );
+      // All planes share the single allocation made by av_samples_alloc_array_and_samples()
+      ::av_freep( &_dstData[0] );
       ::av_freep( &_dstData );
    }
 
@@ -50,36 +53,114 @@ AudioResamplerInitState AudioResampler::initialize()
    if ( _initState != AudioResamplerInitState::NoInit )
       return _initState;
 
+   // soxr is an optional part of FFmpeg builds, and swr_init() is where its absence shows up
+   if ( !initializeContext( true ) && !( _quality == ResamplerQuality::Mastering && initializeContext( false ) ) )
+      SetStateAndReturn( AudioResamplerInitState::InitFails );
+
+   if ( !allocateOutput( ::swr_get_out_samples( _swrContext, _maxInSampleCount ) ) )
+      SetStateAndReturn( AudioResamplerInitState::OutputInitFails );
+
+   SetStateAndReturn( AudioResamplerInitState::Ok );
+}
+
+bool AudioResampler::initializeContext( bool allowSoxr )
+{
    uint64_t inChannelLayout = ::av_get_default_channel_layout( _inputParams.channelCount );
    uint64_t outChannelLayout = ::av_get_default_channel_layout( _outputParams.channelCount );
 
-   _swrContext = ::swr_alloc_set_opts( nullptr,
+   _swrContext = ::swr_alloc_set_opts( _swrContext,
                                        outChannelLayout, _outputParams.sampleFormat, _outputParams.sampleRate,
                                        inChannelLayout, _inputParams.sampleFormat, _inputParams.sampleRate,
                                        0, nullptr );
+   if ( _swrContext == nullptr )
+      return false;
 
-   ::swr_init( _swrContext );
-   if ( ::swr_is_initialized( _swrContext ) == 0 )
+   _usingSoxr = false;
+   switch ( _quality )
+   {
+   case ResamplerQuality::Preview:
+      ::av_opt_set_int( _swrContext, "filter_size", 8, 0 );
+      ::av_opt_set_int( _swrContext, "phase_shift", 6, 0 );
+      ::av_opt_set_int( _swrContext, "linear_interp", 1, 0 );
+      break;
+
+   case ResamplerQuality::Default:
+      break;
+
+   case ResamplerQuality::Mastering:
+      if ( allowSoxr )
+      {
+         ::av_opt_set_int( _swrContext, "resampler", SWR_ENGINE_SOXR, 0 );
+         ::av_opt_set_double( _swrContext, "precision", 28.0, 0 );
+         _usingSoxr = true;
+      }
+      else
+      {
+         ::av_opt_set_int( _swrContext, "resampler", SWR_ENGINE_SWR, 0 );
+         ::av_opt_set_int( _swrContext, "filter_size", 128, 0 );
+         ::av_opt_set_int( _swrContext, "phase_shift", 14, 0 );
+         ::av_opt_set_int( _swrContext, "linear_interp", 0, 0 );
+         ::av_opt_set_int( _swrContext, "exact_rational", 1, 0 );
+         ::av_opt_set_double( _swrContext, "cutoff", 0.98, 0 );
+      }
+      break;
+   }
+
+   if ( ::swr_init( _swrContext ) < 0 || ::swr_is_initialized( _swrContext ) == 0 )
+   {
+      _usingSoxr = false;
+      return false;
+   }
+   return true;
+}
+
+AudioResamplerInitState AudioResampler::reset()
+{
+   if ( _initState == AudioResamplerInitState::NoInit )
+      return initialize();
+   if ( _initState != AudioResamplerInitState::Ok )
+      return _initState;
+
+   _numConverted = 0;
+   ::swr_close( _swrContext );
+   if ( ::swr_init( _swrContext ) < 0 )
       SetStateAndReturn( AudioResamplerInitState::InitFails );
 
-   _maxReturnedSampleCount = ::swr_get_out_samples( _swrContext, _maxInSampleCount );
+   return _initState;
+}
+
+bool AudioResampler::allocateOutput( int sampleCount )
+{
+   if ( _dstData != nullptr )
+   {
+      ::av_freep( &_dstData[0] );
+      ::av_freep( &_dstData );
+   }
 
    int dst_linesize = 0;
-   int status = ::av_samples_alloc_array_and_samples( &_dstData, &dst_linesize, _outputParams.channelCount, _maxReturnedSampleCount, _outputParams.sampleFormat, 0 );
+   int status = ::av_samples_alloc_array_and_samples( &_dstData, &dst_linesize, _outputParams.channelCount, sampleCount, _outputParams.sampleFormat, 0 );
    if ( status <= 0 )
-      SetStateAndReturn( AudioResamplerInitState::OutputInitFails );
+   {
+      _maxReturnedSampleCount = 0;
+      return false;
+   }
 
-   SetStateAndReturn( AudioResamplerInitState::Ok );
+   _maxReturnedSampleCount = sampleCount;
+   return true;
 }
 
-int AudioResampler::convert( const uint8_t *nonPlanarPtr, int n )
+int AudioResampler::convert( const uint8_t* const* inputPlanes, int n )
 {
    if ( _initState == AudioResamplerInitState::NoInit )
       initialize();
    if ( _initState != AudioResamplerInitState::Ok )
       return 0;
 
-   return ::swr_convert( _swrContext, _dstData, _maxReturnedSampleCount, &nonPlanarPtr, n );
+   int needed = ::swr_get_out_samples( _swrContext, n );
+   if ( needed > _maxReturnedSampleCount && !allocateOutput( needed ) )
+      return 0;
+
+   return ::swr_convert( _swrContext, _dstData, _maxReturnedSampleCount, const_cast<const uint8_t**>( inputPlanes ), n );
 }
 
 int AudioResampler::flush()
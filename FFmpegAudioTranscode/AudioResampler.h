@@ -14,25 +14,56 @@ enum class AudioResamplerInitState
    Ok, NoInit, InitFails, OutputInitFails
 };
 
+// Trade-offs between resampling speed and accuracy
+enum class ResamplerQuality
+{
+   Preview,     // short filter with linear interpolation between phases; a rough but cheap conversion
+   Default,     // swresample's own defaults
+   Mastering    // the soxr engine at very high precision where FFmpeg has it, otherwise a long filter
+};
+
 class AudioResampler
 {
 public:
-   AudioResampler( const AudioParams& inputParams, int inMaxSampleCount, const AudioParams& outputParams );
+   AudioResampler( const AudioParams& inputParams, int inMaxSampleCount, const AudioParams& outputParams,
+                   ResamplerQuality quality = ResamplerQuality::Default );
    virtual ~AudioResampler();
 
    AudioResamplerInitState initialize();
    AudioResamplerInitState initState() const { return _initState; }
 
-   int convert( const uint8_t* nonPlanarPtr, int n );
+   // Discards any buffered input and filter history so the resampler can start on a new stream
+   // with the same parameters, keeping its context and output buffers
+   AudioResamplerInitState reset();
+
+   const AudioParams& inputParams() const { return _inputParams; }
+   const AudioParams& outputParams() const { return _outputParams; }
+   ResamplerQuality quality() const { return _quality; }
+
+   // False where Mastering had to fall back to swresample's own engine
+   bool usingSoxr() const { return _usingSoxr; }
+
+   // One pointer per channel for planar input formats, a single pointer for packed ones. The
+   // output buffers grow if n is more than the resampler was sized for.
+   int convert( const uint8_t* const* inputPlanes, int n );
+   int convert( const uint8_t* nonPlanarPtr, int n ) { return convert( &nonPlanarPtr, n ); }
    int flush();
 
    int numConverted() const { return _numConverted; }
+
+   // Samples per channel the output buffers hold; grows when convert() is given more input
+   int outputCapacity() const { return _maxReturnedSampleCount; }
    const uint8_t * const * outputBuffers() const { return _dstData; }
 
 protected:
+   bool allocateOutput( int sampleCount );
+   bool initializeContext( bool allowSoxr );
+
    const AudioParams       _inputParams;
    const int               _maxInSampleCount;
    const AudioParams       _outputParams;
+   const ResamplerQuality  _quality;
+   bool                    _usingSoxr;
    int                     _maxReturnedSampleCount;
    uint8_t**               _dstData;
    AudioResamplerInitState _initState;
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+// Where encoded media is read from: a file on disk, a span of memory owned by the caller, or
+// caller-provided read/seek callbacks. Memory and callback sources are read through a custom
+// AVIOContext whose buffer size can be tuned via ioBufferSize.
+struct AudioSource
+{
+   // Fills buffer with up to size bytes and returns the number written; 0 at end of stream, negative on error
+   typedef std::function<int( uint8_t* buffer, int size )> ReadFn;
+
+   // fseek() semantics for SEEK_SET/SEEK_CUR/SEEK_END, returning the new position. Is also asked for
+   // the total size with whence == AVSEEK_SIZE; return a negative value if that's unknown.
+   typedef std::function<int64_t( int64_t offset, int whence )> SeekFn;
+
+   static const int DefaultIOBufferSize = 64 * 1024;
+
+   enum Kind { File, Memory, Callbacks };
+
+   static AudioSource fromFile( const std::string& path )
+   {
+      AudioSource source;
+      source.path = path;
+      return source;
+   }
+
+   // The memory must remain valid and unchanged for as long as anything is reading from it
+   static AudioSource fromMemory( const void* data, size_t size, int ioBufferSize = DefaultIOBufferSize )
+   {
+      AudioSource source;
+      source.kind = Memory;
+      source.data = static_cast<const uint8_t*>( data );
+      source.size = size;
+      source.ioBufferSize = ioBufferSize;
+      return source;
+   }
+
+   // Without a seek callback the input is treated as a non-seekable stream
+   static AudioSource fromCallbacks( ReadFn read, SeekFn seek = SeekFn(), int ioBufferSize = DefaultIOBufferSize )
+   {
+      AudioSource source;
+      source.kind = Callbacks;
+      source.read = read;
+      source.seek = seek;
+      source.ioBufferSize = ioBufferSize;
+      return source;
+   }
+
+   Kind           kind = File;
+   std::string    path;
+   const uint8_t* data = nullptr;
+   size_t         size = 0;
+   ReadFn         read;
+   SeekFn         seek;
+   int            ioBufferSize = DefaultIOBufferSize;
+};
@@ -0,0 +1,96 @@
+#include "stdafx.h"
+
+#include "AudioStreamReader.h"
+#include "AudioReaderDecoder.h"
+#include "AudioResampler.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+AudioStreamReader::AudioStreamReader( const std::string& path, bool forceLittleEndian/*=false*/ )
+   : AudioStreamReader( path, defaultOutputParams(), forceLittleEndian )
+{
+
+}
+
+AudioStreamReader::AudioStreamReader( const std::string& path, const AudioParams& outputParams, bool forceLittleEndian/*=false*/ )
+   : AudioStreamReader( AudioSource::fromFile( path ), outputParams, forceLittleEndian )
+{
+
+}
+
+AudioStreamReader::AudioStreamReader( const AudioSource& source, const AudioParams& outputParams/*=defaultOutputParams()*/, bool forceLittleEndian/*=false*/ )
+   : AudioLoader( source, outputParams, forceLittleEndian )
+   , _pendingReadPos( 0 )
+   , _drained( false )
+{
+   _callback = [this]( const AVFrame *frame )
+   {
+      this->processDecodedAudio( frame );
+   };
+}
+
+AudioStreamReader::~AudioStreamReader()
+{
+
+}
+
+size_t AudioStreamReader::read( int16_t* dst, size_t frames )
+{
+   if ( _state == NoInit )
+   {
+      if ( _outputParams.sampleFormat != AV_SAMPLE_FMT_S16 )
+      {
+         _state = UnsupportedOutputParams;
+         return 0;
+      }
+      if ( !initializeDecoding() )
+         return 0;
+      _state = Ok;
+   }
+
+   if ( _state != Ok )
+      return 0;
+
+   const size_t channelCount = _outputParams.channelCount;
+   size_t framesRead = 0;
+
+   while ( framesRead < frames )
+   {
+      size_t available = ( _pending.size() - _pendingReadPos ) / channelCount;
+      if ( available == 0 )
+      {
+         if ( _drained )
+            break;
+
+         // Everything pending has been handed out, so the buffer can be reused from the start
+         _pending.clear();
+         _pendingReadPos = 0;
+
+         if ( !_readerDecoder->decodeNextPacket( _callback ) )
+         {
+            finishDecoding();
+            _drained = true;
+         }
+         continue;
+      }
+
+      size_t n = std::min( available, frames - framesRead );
+      ::memcpy( dst + framesRead * channelCount, _pending.data() + _pendingReadPos, n * channelCount * sizeof( int16_t ) );
+      _pendingReadPos += n * channelCount;
+      framesRead += n;
+   }
+
+   if ( _forceLittleEndian )
+      convertToLittleEndian( dst, framesRead * channelCount );
+
+   return framesRead;
+}
+
+void AudioStreamReader::copyResampledAudio( int sampleCount )
+{
+   auto output = _resampler->outputBuffers();
+   const int16_t *ptr = (const int16_t *)output[0];
+   _pending.insert( _pending.end(), ptr, ptr + sampleCount * _outputParams.channelCount );
+}
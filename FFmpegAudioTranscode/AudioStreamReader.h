@@ -0,0 +1,45 @@
+#pragma once
+
+#include "AudioLoader.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Pull-based counterpart to AudioLoader: rather than decoding the entire stream up front,
+// each read() decodes and resamples only as much of the stream as is needed to satisfy it,
+// so memory use stays bounded regardless of the length of the input.
+class AudioStreamReader : protected AudioLoader
+{
+public:
+   AudioStreamReader( const std::string& path, bool forceLittleEndian=false );
+
+   // Output sample format must be AV_SAMPLE_FMT_S16; rate and channel count are up to the caller
+   AudioStreamReader( const std::string& path, const AudioParams& outputParams, bool forceLittleEndian=false );
+   AudioStreamReader( const AudioSource& source, const AudioParams& outputParams = defaultOutputParams(), bool forceLittleEndian=false );
+   ~AudioStreamReader() override;
+
+   using AudioLoader::State;
+   using AudioLoader::state;
+   using AudioLoader::outputParams;
+   using AudioLoader::setDecoderOptions;
+   using AudioLoader::setResamplerQuality;
+   using AudioLoader::readerDecoderInitState;
+   using AudioLoader::resamplerInitState;
+
+   // Fills dst with up to 'frames' frames of 16-bit interleaved audio and returns the
+   // number of frames written. Fewer than requested are returned only at the end of the stream.
+   size_t read( int16_t* dst, size_t frames );
+
+   bool endOfStream() const { return _drained && _pendingReadPos == _pending.size(); }
+
+protected:
+   void copyResampledAudio( int sampleCount ) override;
+
+   std::function< void( const AVFrame * ) > _callback;
+   std::vector<int16_t>                     _pending;      // resampled samples not yet handed out by read()
+   size_t                                   _pendingReadPos;
+   bool                                     _drained;
+};
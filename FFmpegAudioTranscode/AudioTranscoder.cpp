@@ -0,0 +1,214 @@
+#include "stdafx.h"
+
+#include "AudioTranscoder.h"
+#include "AudioReaderDecoder.h"
+#include "AudioResampler.h"
+
+extern "C"
+{
+#include <libavutil/samplefmt.h>
+}
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <thread>
+
+#include <string.h>
+
+AudioTranscoder::AudioTranscoder( const std::string& inPath, const std::string& outPath, const AudioParams& outputParams/*=defaultOutputParams()*/ )
+   : AudioTranscoder( AudioSource::fromFile( inPath ), outPath, outputParams )
+{
+
+}
+
+AudioTranscoder::AudioTranscoder( const AudioSource& source, const std::string& outPath, const AudioParams& outputParams/*=defaultOutputParams()*/ )
+   : AudioLoader( source, outputParams )
+   , _outPath( outPath )
+   , _encoding( WavEncoding::Signed16 )
+   , _encodingSet( false )
+   , _chunkFrames( DefaultChunkFrames )
+   , _chunkCount( DefaultChunkCount )
+   , _chunk( nullptr )
+   , _writeFailed( false )
+   , _framesWritten( 0 )
+{
+
+}
+
+AudioTranscoder::~AudioTranscoder()
+{
+
+}
+
+void AudioTranscoder::setChunking( size_t chunkFrames, size_t chunkCount )
+{
+   _chunkFrames = std::max<size_t>( chunkFrames, 1 );
+   _chunkCount = std::max<size_t>( chunkCount, 2 );
+}
+
+bool AudioTranscoder::run()
+{
+   _framesWritten = 0;
+   _writeFailed = false;
+
+   if ( !initializeDecoding() )
+      return false;
+
+   WavWriter::Format format;
+   format.channelCount = _outputParams.channelCount;
+   format.sampleRate = _outputParams.sampleRate;
+   format.encoding = _encodingSet ? _encoding : ( outputIsPlanar() ? WavEncoding::Float32 : WavEncoding::Signed16 );
+
+   // Given a duration, the output is mapped at about the right length up front; the writer
+   // truncates it, or carries on unmapped, if the estimate is off
+   uint64_t expectedFrames = 0;
+   double duration;
+   if ( _readerDecoder->getDuration( duration ) && duration > 0.0 )
+      expectedFrames = uint64_t( std::ceil( duration * _outputParams.sampleRate ) );
+
+   WavWriter writer;
+   if ( !writer.open( _outPath, format, expectedFrames ) )
+   {
+      _state = OutputWriteFails;
+      return false;
+   }
+
+   // Every chunk is allocated here; from now on they just go round between the two threads
+   const size_t planeCount = outputIsPlanar() ? _outputParams.channelCount : 1;
+   const size_t planeFrameBytes = size_t( ::av_get_bytes_per_sample( _outputParams.sampleFormat ) ) * ( _outputParams.channelCount / planeCount );
+   if ( _chunks.size() != _chunkCount || _chunks[0]->planes.size() != planeCount || _chunks[0]->planes[0].size() != _chunkFrames * planeFrameBytes )
+   {
+      _chunks.clear();
+      for ( size_t i = 0; i < _chunkCount; ++i )
+      {
+         _chunks.emplace_back( new Chunk );
+         _chunks.back()->planes.assign( planeCount, std::vector<uint8_t>( _chunkFrames * planeFrameBytes ) );
+      }
+   }
+
+   _filledChunks.reset( new SpscQueue<Chunk*>( _chunkCount ) );
+   _emptyChunks.reset( new SpscQueue<Chunk*>( _chunkCount ) );
+   for ( size_t i = 1; i < _chunkCount; ++i )
+   {
+      Chunk* chunk = _chunks[i].get();
+      _emptyChunks->tryPush( chunk );
+   }
+   _chunk = _chunks[0].get();
+   _chunk->frameCount = 0;
+
+   std::thread writerThread( [this, &writer]()
+   {
+      writeChunks( writer );
+   } );
+
+   std::function< void( const AVFrame * ) > callback = [this]( const AVFrame *frame )
+   {
+      this->processDecodedAudio( frame );
+   };
+
+   while ( _chunk != nullptr && _readerDecoder->decodeNextPacket( callback ) )
+      ;
+
+   if ( _chunk != nullptr )
+   {
+      finishDecoding();
+      if ( _chunk != nullptr && _chunk->frameCount > 0 )
+         sendChunk( false );
+   }
+
+   _filledChunks->close();
+   writerThread.join();
+   _chunk = nullptr;
+
+   if ( !writer.finish() || _writeFailed )
+   {
+      _state = OutputWriteFails;
+      return false;
+   }
+
+   _framesWritten = writer.framesWritten();
+   _state = Ok;
+   return true;
+}
+
+void AudioTranscoder::copyResampledAudio( int sampleCount )
+{
+   LOAD_STATS_TIME( &_loadStats, Copy );
+
+   auto output = _resampler->outputBuffers();
+   const size_t planeFrameBytes = size_t( ::av_get_bytes_per_sample( _outputParams.sampleFormat ) ) * ( outputIsPlanar() ? 1 : _outputParams.channelCount );
+
+   size_t copied = 0;
+   while ( copied < size_t( sampleCount ) && _chunk != nullptr )
+   {
+      const size_t n = std::min( _chunkFrames - _chunk->frameCount, size_t( sampleCount ) - copied );
+      for ( size_t i = 0; i < _chunk->planes.size(); ++i )
+         ::memcpy( _chunk->planes[i].data() + _chunk->frameCount * planeFrameBytes, output[i] + copied * planeFrameBytes, n * planeFrameBytes );
+      _chunk->frameCount += n;
+      copied += n;
+
+      if ( _chunk->frameCount == _chunkFrames )
+         sendChunk( true );
+   }
+}
+
+// Passes the current chunk to the writer and, if asked, waits for an empty one to fill next. Waiting
+// here is what holds decoding back when the disk can't keep up. Leaves _chunk null if the writer
+// has stopped.
+void AudioTranscoder::sendChunk( bool takeNext )
+{
+   Chunk* chunk = _chunk;
+   _chunk = nullptr;
+   if ( _writeFailed || !_filledChunks->push( chunk ) )
+      return;
+
+   if ( takeNext && _emptyChunks->pop( chunk ) && !_writeFailed )
+   {
+      chunk->frameCount = 0;
+      _chunk = chunk;
+   }
+}
+
+// Runs on the writer thread until the decoding side closes _filledChunks. After a failed write it
+// closes both queues, so the decoding side stops at its next chunk.
+void AudioTranscoder::writeChunks( WavWriter& writer )
+{
+   std::vector<const float*> planes;
+
+   Chunk* chunk;
+   while ( _filledChunks->pop( chunk ) )
+   {
+      if ( !_writeFailed )
+      {
+         bool ok;
+         if ( outputIsPlanar() )
+         {
+            planes.clear();
+            for ( const auto& plane : chunk->planes )
+               planes.push_back( (const float*)plane.data() );
+            ok = writer.write( planes.data(), chunk->frameCount );
+         }
+         else
+         {
+            ok = writer.write( (const int16_t*)chunk->planes[0].data(), chunk->frameCount );
+         }
+
+         if ( !ok )
+         {
+            _writeFailed = true;
+            _filledChunks->close();
+            _emptyChunks->close();
+         }
+      }
+
+      // There's always room: the queue holds as many chunks as there are
+      _emptyChunks->tryPush( chunk );
+   }
+}
+
+bool transcode( const std::string& inPath, const std::string& outPath, const AudioParams& outputParams/*=AudioLoader::defaultOutputParams()*/ )
+{
+   AudioTranscoder transcoder( inPath, outPath, outputParams );
+   return transcoder.run();
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "AudioLoader.h"
+#include "SpscQueue.h"
+#include "WavUtil.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// File-to-file counterpart to AudioLoader: decodes and resamples the input as AudioLoader would,
+// but hands the output to a WavWriter in fixed-size chunks instead of keeping it, so memory use is
+// the same whatever the length of the input. The writing happens on a thread of its own, fed
+// through a bounded queue, so disk writes overlap with decoding.
+class AudioTranscoder : protected AudioLoader
+{
+public:
+   AudioTranscoder( const std::string& inPath, const std::string& outPath, const AudioParams& outputParams = defaultOutputParams() );
+   AudioTranscoder( const AudioSource& source, const std::string& outPath, const AudioParams& outputParams = defaultOutputParams() );
+   ~AudioTranscoder() override;
+
+   using AudioLoader::State;
+   using AudioLoader::state;
+   using AudioLoader::outputParams;
+   using AudioLoader::setDecoderOptions;
+   using AudioLoader::setResamplerQuality;
+   using AudioLoader::readerDecoderInitState;
+   using AudioLoader::resamplerInitState;
+
+   // 16-bit output is written as 16-bit PCM and float output as 32-bit float, unless set otherwise;
+   // the container is chosen as WavWriter::Container::Auto does
+   void setEncoding( WavEncoding encoding ) { _encoding = encoding; _encodingSet = true; }
+
+   // Memory for samples in flight is chunkFrames frames times chunkCount; from the next run() on
+   void setChunking( size_t chunkFrames, size_t chunkCount );
+
+   bool run();
+
+   uint64_t framesWritten() const { return _framesWritten; }
+
+protected:
+   struct Chunk
+   {
+      std::vector< std::vector<uint8_t> > planes;   // one for interleaved output, else one per channel
+      size_t                              frameCount = 0;
+   };
+
+   void copyResampledAudio( int sampleCount ) override;
+   void sendChunk( bool takeNext );
+   void writeChunks( WavWriter& writer );
+
+   static const size_t DefaultChunkFrames = 32768;
+   static const size_t DefaultChunkCount = 8;
+
+   std::string                           _outPath;
+   WavEncoding                           _encoding;
+   bool                                  _encodingSet;
+   size_t                                _chunkFrames;
+   size_t                                _chunkCount;
+   std::vector< std::unique_ptr<Chunk> > _chunks;
+   std::unique_ptr< SpscQueue<Chunk*> >  _filledChunks;   // decoding thread to writer
+   std::unique_ptr< SpscQueue<Chunk*> >  _emptyChunks;    // and back again
+   Chunk*                                _chunk;          // being filled, null once the writer has given up
+   std::atomic<bool>                     _writeFailed;
+   uint64_t                              _framesWritten;
+};
+
+// Transcodes inPath to a WAV file at outPath in one go, as AudioTranscoder does
+bool transcode( const std::string& inPath, const std::string& outPath, const AudioParams& outputParams = AudioLoader::defaultOutputParams() );
@@ -0,0 +1,350 @@
+#include "stdafx.h"
+
+#include "CompressedSampleStore.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+
+namespace
+{
+   // Each block starts with one of these
+   enum BlockMode : uint8_t { Raw = 0, Coded = 1 };
+
+   const int OrderBits = 2;
+   const int RiceBits = 5;
+   const int MaxRiceParameter = 18;
+   const int MaxPredictorOrder = 2;
+
+   // Residuals with a quotient this large are written as a run of this many zeros followed by the
+   // zigzagged residual itself, which takes at most EscapeBits: an order-2 residual of 16-bit
+   // samples lies within +/-2^17
+   const int EscapeQuotient = 24;
+   const int EscapeBits = 19;
+
+   int countLeadingZeros( uint64_t value )
+   {
+      if ( value == 0 )
+         return 64;
+#if defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_ARM64 ) )
+      unsigned long index;
+      ::_BitScanReverse64( &index, value );
+      return 63 - int( index );
+#elif defined( _MSC_VER )
+      unsigned long index;
+      if ( ::_BitScanReverse( &index, (unsigned long)( value >> 32 ) ) )
+         return 31 - int( index );
+      ::_BitScanReverse( &index, (unsigned long)value );
+      return 63 - int( index );
+#else
+      return __builtin_clzll( value );
+#endif
+   }
+
+   uint32_t zigzag( int32_t value ) { return ( uint32_t( value ) << 1 ) ^ uint32_t( value >> 31 ); }
+   int32_t unzigzag( uint32_t value ) { return int32_t( value >> 1 ) ^ -int32_t( value & 1 ); }
+
+   // Predicts from the samples before it in the block; the first few use a lower order for want
+   // of history
+   int32_t prediction( const int16_t* samples, size_t i, size_t stride, int order )
+   {
+      if ( order == 0 || i == 0 )
+         return 0;
+      const int32_t previous = samples[( i - 1 ) * stride];
+      if ( order == 1 || i == 1 )
+         return previous;
+      return 2 * previous - samples[( i - 2 ) * stride];
+   }
+
+   // Most significant bit first
+   class BitWriter
+   {
+   public:
+      explicit BitWriter( std::vector<uint8_t>& out ) : _out( out ), _bits( 0 ), _count( 0 ) {}
+
+      // Up to 32 bits at a time
+      void put( uint32_t value, int count )
+      {
+         _bits = ( _bits << count ) | value;
+         _count += count;
+         while ( _count >= 8 )
+         {
+            _count -= 8;
+            _out.push_back( uint8_t( _bits >> _count ) );
+         }
+      }
+
+      void flush()
+      {
+         if ( _count > 0 )
+            _out.push_back( uint8_t( _bits << ( 8 - _count ) ) );
+         _count = 0;
+      }
+
+   private:
+      std::vector<uint8_t>& _out;
+      uint64_t              _bits;
+      int                   _count;
+   };
+
+   // Reads past the end come back as zeros
+   class BitReader
+   {
+   public:
+      BitReader( const uint8_t* data, size_t size ) : _next( data ), _end( data + size ), _window( 0 ), _count( 0 ) {}
+
+      // Tops the window up to at least 57 bits, enough for any one residual
+      void refill()
+      {
+         while ( _count <= 56 )
+         {
+            const uint64_t byte = ( _next < _end ) ? *_next++ : 0;
+            _window |= byte << ( 56 - _count );
+            _count += 8;
+         }
+      }
+
+      int leadingZeros() const { return countLeadingZeros( _window ); }
+
+      uint32_t get( int count )
+      {
+         if ( count == 0 )
+            return 0;
+         const uint32_t value = uint32_t( _window >> ( 64 - count ) );
+         skip( count );
+         return value;
+      }
+
+      void skip( int count )
+      {
+         _window <<= count;
+         _count -= count;
+      }
+
+   private:
+      const uint8_t* _next;
+      const uint8_t* _end;
+      uint64_t       _window;       // the next bits, most significant first
+      int            _count;
+   };
+}
+
+CompressedSampleStore::CompressedSampleStore( int channelCount, size_t blockFrames/*=DefaultBlockFrames*/, size_t cacheBlocks/*=DefaultCacheBlocks*/ )
+   : _channelCount( std::max( channelCount, 1 ) )
+   , _blockFrames( std::max<size_t>( blockFrames, 1 ) )
+   , _cacheBlocks( std::max<size_t>( cacheBlocks, 1 ) )
+   , _frameCount( 0 )
+   , _useCount( 0 )
+{
+
+}
+
+void CompressedSampleStore::append( const int16_t* frames, size_t frameCount )
+{
+   const size_t channelCount = size_t( _channelCount );
+   _frameCount += frameCount;
+
+   // Whole blocks are compressed straight from the input
+   if ( !_pending.empty() )
+   {
+      const size_t n = std::min( frameCount, _blockFrames - _pending.size() / channelCount );
+      _pending.insert( _pending.end(), frames, frames + n * channelCount );
+      frames += n * channelCount;
+      frameCount -= n;
+      if ( _pending.size() < _blockFrames * channelCount )
+         return;
+      compressBlock( _pending.data(), _blockFrames );
+      _pending.clear();
+   }
+
+   for ( ; frameCount >= _blockFrames; frameCount -= _blockFrames, frames += _blockFrames * channelCount )
+      compressBlock( frames, _blockFrames );
+
+   _pending.assign( frames, frames + frameCount * channelCount );
+}
+
+void CompressedSampleStore::finish()
+{
+   if ( !_pending.empty() )
+      compressBlock( _pending.data(), _pending.size() / size_t( _channelCount ) );
+   std::vector<int16_t>().swap( _pending );
+   std::vector<uint8_t>().swap( _scratch );
+}
+
+void CompressedSampleStore::compressBlock( const int16_t* frames, size_t frameCount )
+{
+   const size_t channelCount = size_t( _channelCount );
+   const size_t rawBytes = frameCount * channelCount * sizeof( int16_t );
+
+   _scratch.clear();
+   _scratch.reserve( rawBytes + 16 );
+   _scratch.push_back( Coded );
+
+   BitWriter writer( _scratch );
+   for ( size_t ch = 0; ch < channelCount; ++ch )
+   {
+      const int16_t* samples = frames + ch;
+
+      uint64_t sums[MaxPredictorOrder + 1] = {};
+      for ( size_t i = 0; i < frameCount; ++i )
+      {
+         for ( int order = 0; order <= MaxPredictorOrder; ++order )
+            sums[order] += zigzag( samples[i * channelCount] - prediction( samples, i, channelCount, order ) );
+      }
+      const int order = int( std::min_element( sums, sums + MaxPredictorOrder + 1 ) - sums );
+
+      // The Rice parameter that suits the mean residual
+      int k = 0;
+      while ( k < MaxRiceParameter && ( uint64_t( frameCount ) << ( k + 1 ) ) <= sums[order] )
+         ++k;
+
+      writer.put( uint32_t( order ), OrderBits );
+      writer.put( uint32_t( k ), RiceBits );
+      for ( size_t i = 0; i < frameCount; ++i )
+      {
+         const uint32_t residual = zigzag( samples[i * channelCount] - prediction( samples, i, channelCount, order ) );
+         const uint32_t quotient = residual >> k;
+         if ( quotient < uint32_t( EscapeQuotient ) )
+         {
+            writer.put( 1, int( quotient ) + 1 );
+            writer.put( residual & ( ( 1u << k ) - 1 ), k );
+         }
+         else
+         {
+            writer.put( 0, EscapeQuotient );
+            writer.put( residual, EscapeBits );
+         }
+      }
+   }
+   writer.flush();
+
+   if ( _scratch.size() >= rawBytes + 1 )
+   {
+      _scratch.resize( rawBytes + 1 );
+      _scratch[0] = Raw;
+      ::memcpy( _scratch.data() + 1, frames, rawBytes );
+   }
+   _blocks.emplace_back( _scratch.cbegin(), _scratch.cend() );
+}
+
+void CompressedSampleStore::decompressBlock( size_t index, int16_t* dst ) const
+{
+   const std::vector<uint8_t>& block = _blocks[index];
+   const size_t channelCount = size_t( _channelCount );
+   const size_t frameCount = framesInBlock( index );
+
+   if ( block[0] == Raw )
+   {
+      ::memcpy( dst, block.data() + 1, frameCount * channelCount * sizeof( int16_t ) );
+      return;
+   }
+
+   BitReader reader( block.data() + 1, block.size() - 1 );
+   for ( size_t ch = 0; ch < channelCount; ++ch )
+   {
+      int16_t* samples = dst + ch;
+
+      reader.refill();
+      const int order = int( reader.get( OrderBits ) );
+      const int k = int( reader.get( RiceBits ) );
+      for ( size_t i = 0; i < frameCount; ++i )
+      {
+         reader.refill();
+         uint32_t residual;
+         const int zeros = reader.leadingZeros();
+         if ( zeros < EscapeQuotient )
+         {
+            reader.skip( zeros + 1 );
+            residual = ( uint32_t( zeros ) << k ) | reader.get( k );
+         }
+         else
+         {
+            reader.skip( EscapeQuotient );
+            residual = reader.get( EscapeBits );
+         }
+         samples[i * channelCount] = int16_t( prediction( samples, i, channelCount, order ) + unzigzag( residual ) );
+      }
+   }
+}
+
+// Call with _cacheMutex held; the result is good until the next call
+const int16_t* CompressedSampleStore::decodedBlock( size_t index ) const
+{
+   for ( auto& cached : _cache )
+   {
+      if ( cached.index == index )
+      {
+         cached.lastUse = ++_useCount;
+         return cached.samples.data();
+      }
+   }
+
+   // Fill a free slot, or the least recently used one
+   CachedBlock* slot;
+   if ( _cache.size() < _cacheBlocks )
+   {
+      _cache.emplace_back();
+      slot = &_cache.back();
+      slot->samples.resize( _blockFrames * size_t( _channelCount ) );
+   }
+   else
+   {
+      slot = &*std::min_element( _cache.begin(), _cache.end(), []( const CachedBlock& a, const CachedBlock& b ) { return a.lastUse < b.lastUse; } );
+   }
+   slot->index = index;
+   slot->lastUse = ++_useCount;
+   decompressBlock( index, slot->samples.data() );
+   return slot->samples.data();
+}
+
+size_t CompressedSampleStore::framesInBlock( size_t index ) const
+{
+   const size_t compressedFrames = _frameCount - _pending.size() / size_t( _channelCount );
+   return std::min( _blockFrames, compressedFrames - index * _blockFrames );
+}
+
+void CompressedSampleStore::read( size_t firstFrame, size_t frameCount, int16_t* dst ) const
+{
+   const size_t channelCount = size_t( _channelCount );
+
+   std::lock_guard<std::mutex> lock( _cacheMutex );
+   while ( frameCount > 0 )
+   {
+      const size_t index = firstFrame / _blockFrames;
+      const size_t offset = firstFrame - index * _blockFrames;
+      const size_t n = std::min( frameCount, _blockFrames - offset );
+
+      const int16_t* src = ( index < _blocks.size() ) ? decodedBlock( index ) : _pending.data();
+      ::memcpy( dst, src + offset * channelCount, n * channelCount * sizeof( int16_t ) );
+
+      dst += n * channelCount;
+      firstFrame += n;
+      frameCount -= n;
+   }
+}
+
+size_t CompressedSampleStore::memoryBytes() const
+{
+   size_t bytes = _blocks.capacity() * sizeof( std::vector<uint8_t> ) + _pending.capacity() * sizeof( int16_t ) + _scratch.capacity();
+   for ( const auto& block : _blocks )
+      bytes += block.capacity();
+
+   std::lock_guard<std::mutex> lock( _cacheMutex );
+   for ( const auto& cached : _cache )
+      bytes += cached.samples.capacity() * sizeof( int16_t );
+   return bytes;
+}
+
+void CompressedSampleStore::clear()
+{
+   _blocks.clear();
+   _pending.clear();
+   _frameCount = 0;
+
+   std::lock_guard<std::mutex> lock( _cacheMutex );
+   _cache.clear();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Losslessly compressed storage for interleaved 16-bit samples. Frames are split into blocks of a
+// fixed size, each compressed on its own: per channel, a fixed polynomial predictor of order 0, 1
+// or 2 -- whichever leaves the smallest residuals -- followed by Rice coding of the residuals.
+// Blocks that don't get any smaller are kept as they are. Since no block depends on another, any
+// range of frames is read by decoding only the blocks it touches, and the last few blocks decoded
+// are kept around so that reads close to each other don't decode the same block again.
+class CompressedSampleStore
+{
+public:
+   static const size_t DefaultBlockFrames = 4096;
+   static const size_t DefaultCacheBlocks = 8;
+
+   explicit CompressedSampleStore( int channelCount, size_t blockFrames = DefaultBlockFrames, size_t cacheBlocks = DefaultCacheBlocks );
+
+   CompressedSampleStore( const CompressedSampleStore& ) = delete;
+   CompressedSampleStore& operator=( const CompressedSampleStore& ) = delete;
+
+   // Frames are compressed a block at a time as they're appended; the last, partly filled block
+   // waits for more, or for finish()
+   void append( const int16_t* frames, size_t frameCount );
+   void finish();
+
+   int channelCount() const { return _channelCount; }
+   size_t blockFrames() const { return _blockFrames; }
+   size_t frameCount() const { return _frameCount; }
+
+   // Copies frameCount frames from firstFrame on to dst, which must hold them all. Reads may run
+   // on several threads at once, but not alongside append(), finish() or clear().
+   void read( size_t firstFrame, size_t frameCount, int16_t* dst ) const;
+
+   // Compressed blocks, the block being filled and the cache of decoded blocks
+   size_t memoryBytes() const;
+
+   void clear();
+
+protected:
+   struct CachedBlock
+   {
+      size_t               index;
+      uint64_t             lastUse;
+      std::vector<int16_t> samples;
+   };
+
+   void compressBlock( const int16_t* frames, size_t frameCount );
+   void decompressBlock( size_t index, int16_t* dst ) const;
+   const int16_t* decodedBlock( size_t index ) const;
+   size_t framesInBlock( size_t index ) const;
+
+   const int                           _channelCount;
+   const size_t                        _blockFrames;
+   const size_t                        _cacheBlocks;
+   std::vector< std::vector<uint8_t> > _blocks;         // one per full block, then the finished tail
+   std::vector<int16_t>                _pending;        // frames of the block being filled
+   std::vector<uint8_t>                _scratch;        // compressBlock()'s output before it's sized
+   size_t                              _frameCount;
+   mutable std::mutex                  _cacheMutex;
+   mutable std::vector<CachedBlock>    _cache;
+   mutable uint64_t                    _useCount;
+};
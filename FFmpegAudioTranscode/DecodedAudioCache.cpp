@@ -0,0 +1,295 @@
+#include "stdafx.h"
+
+#include "DecodedAudioCache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+   const char     EntryExtension[] = ".pcm";
+   const char     Magic[8] = { 'F', 'A', 'T', 'P', 'C', 'M', '0', '1' };
+   const char     TempExtension[] = ".tmp";
+   const uint32_t DataAlignment = 64;
+   const size_t   ReadChunkFrames = 4096;   // asked of a FrameReader at a time
+
+   // Temp files this old were left behind by a writer that never finished
+   const std::chrono::hours AbandonedTempAge( 1 );
+
+   struct EntryHeader
+   {
+      char     magic[8];
+      uint32_t keyLength;
+      int32_t  channelCount;
+      int32_t  sampleFormat;
+      int32_t  sampleRate;
+      int32_t  planeCount;
+      int32_t  bytesPerFrame;    // per plane
+      uint64_t frameCount;
+      uint64_t dataOffset;
+   };
+
+   uint64_t fnv1a( const std::string& s )
+   {
+      uint64_t hash = 14695981039346656037ULL;
+      for ( unsigned char c : s )
+      {
+         hash ^= c;
+         hash *= 1099511628211ULL;
+      }
+      return hash;
+   }
+
+   int planeCountFor( const AudioParams& params )
+   {
+      return ::av_sample_fmt_is_planar( params.sampleFormat ) ? params.channelCount : 1;
+   }
+
+   int bytesPerFrameFor( const AudioParams& params )
+   {
+      int bytesPerSample = ::av_get_bytes_per_sample( params.sampleFormat );
+      return ::av_sample_fmt_is_planar( params.sampleFormat ) ? bytesPerSample : bytesPerSample * params.channelCount;
+   }
+}
+
+DecodedAudioCache::DecodedAudioCache( const std::string& directory, uint64_t maxBytes )
+   : _directory( directory )
+   , _maxBytes( maxBytes )
+{
+   std::error_code ec;
+   fs::create_directories( _directory, ec );
+}
+
+DecodedAudioCache::~DecodedAudioCache()
+{
+
+}
+
+bool DecodedAudioCache::makeKey( const std::string& sourcePath, const AudioParams& params, const std::string& variant,
+                                 std::string& key, std::string& entryPath ) const
+{
+   std::error_code ec;
+   fs::path absolutePath = fs::absolute( sourcePath, ec );
+   if ( ec )
+      return false;
+
+   uintmax_t size = fs::file_size( absolutePath, ec );
+   if ( ec )
+      return false;
+
+   auto modified = fs::last_write_time( absolutePath, ec );
+   if ( ec )
+      return false;
+
+   std::ostringstream os;
+   os << absolutePath.string() << '|' << size << '|' << modified.time_since_epoch().count() << '|'
+      << params.channelCount << '|' << params.sampleFormat << '|' << params.sampleRate << '|' << variant;
+   key = os.str();
+
+   char name[32];
+   std::snprintf( name, sizeof( name ), "%016llx", (unsigned long long)fnv1a( key ) );
+   entryPath = ( fs::path( _directory ) / ( std::string( name ) + EntryExtension ) ).string();
+   return true;
+}
+
+std::string DecodedAudioCache::uniqueTempPath( const std::string& entryPath )
+{
+   // Unique across threads (thread id, counter) and processes (random seed)
+   static std::atomic<unsigned> counter( 0 );
+   static const unsigned seed = std::random_device()();
+
+   std::ostringstream os;
+   os << entryPath << '.' << std::hex << seed << '-' << std::hash<std::thread::id>()( std::this_thread::get_id() )
+      << '-' << counter++ << TempExtension;
+   return os.str();
+}
+
+bool DecodedAudioCache::lookup( const std::string& sourcePath, const AudioParams& params, const std::string& variant, CachedAudio& result )
+{
+   std::string key, entryPath;
+   if ( !makeKey( sourcePath, params, variant, key, entryPath ) )
+      return false;
+
+   std::unique_ptr<MappedFile> mapping( new MappedFile );
+   if ( !mapping->open( entryPath ) )
+      return false;
+
+   // Validate everything; a hash collision or an entry from an older version is just a miss
+   EntryHeader header;
+   if ( mapping->size() < sizeof( header ) )
+      return false;
+   ::memcpy( &header, mapping->data(), sizeof( header ) );
+
+   const uint64_t dataBytes = header.frameCount * uint64_t( header.bytesPerFrame ) * uint64_t( header.planeCount );
+   if ( ::memcmp( header.magic, Magic, sizeof( Magic ) ) != 0
+        || header.keyLength != key.size()
+        || sizeof( header ) + header.keyLength > mapping->size()
+        || ::memcmp( mapping->data() + sizeof( header ), key.data(), key.size() ) != 0
+        || header.planeCount != planeCountFor( params )
+        || header.bytesPerFrame != bytesPerFrameFor( params )
+        || header.dataOffset + dataBytes > mapping->size() )
+      return false;
+
+   result.planes.clear();
+   for ( int i = 0; i < header.planeCount; ++i )
+      result.planes.push_back( mapping->data() + header.dataOffset + i * header.frameCount * header.bytesPerFrame );
+   result.frameCount = size_t( header.frameCount );
+   result.mapping = std::move( mapping );
+
+   // Recency for eviction purposes
+   std::error_code ec;
+   fs::last_write_time( entryPath, fs::file_time_type::clock::now(), ec );
+
+   return true;
+}
+
+bool DecodedAudioCache::store( const std::string& sourcePath, const AudioParams& params, const std::string& variant,
+                               const std::vector<const uint8_t*>& planes, size_t frameCount )
+{
+   if ( int( planes.size() ) != planeCountFor( params ) )
+      return false;
+
+   const std::streamsize planeBytes = std::streamsize( frameCount * bytesPerFrameFor( params ) );
+   return writeEntry( sourcePath, params, variant, frameCount, [&planes, planeBytes]( std::ostream& file )
+   {
+      for ( const uint8_t* plane : planes )
+         file.write( (const char*)plane, planeBytes );
+   } );
+}
+
+bool DecodedAudioCache::store( const std::string& sourcePath, const AudioParams& params, const std::string& variant,
+                               const FrameReader& readFrames, size_t frameCount )
+{
+   if ( planeCountFor( params ) != 1 )
+      return false;
+
+   const size_t bytesPerFrame = size_t( bytesPerFrameFor( params ) );
+   return writeEntry( sourcePath, params, variant, frameCount, [&readFrames, frameCount, bytesPerFrame]( std::ostream& file )
+   {
+      std::vector<uint8_t> chunk( std::min( frameCount, ReadChunkFrames ) * bytesPerFrame );
+      for ( size_t first = 0; first < frameCount && file; first += ReadChunkFrames )
+      {
+         const size_t n = std::min( frameCount - first, ReadChunkFrames );
+         readFrames( first, n, chunk.data() );
+         file.write( (const char*)chunk.data(), std::streamsize( n * bytesPerFrame ) );
+      }
+   } );
+}
+
+bool DecodedAudioCache::writeEntry( const std::string& sourcePath, const AudioParams& params, const std::string& variant,
+                                    size_t frameCount, const std::function< void( std::ostream& ) >& writeSamples )
+{
+   std::string key, entryPath;
+   if ( !makeKey( sourcePath, params, variant, key, entryPath ) )
+      return false;
+
+   EntryHeader header;
+   ::memcpy( header.magic, Magic, sizeof( Magic ) );
+   header.keyLength = uint32_t( key.size() );
+   header.channelCount = params.channelCount;
+   header.sampleFormat = params.sampleFormat;
+   header.sampleRate = params.sampleRate;
+   header.planeCount = planeCountFor( params );
+   header.bytesPerFrame = bytesPerFrameFor( params );
+   header.frameCount = frameCount;
+   header.dataOffset = ( sizeof( header ) + key.size() + DataAlignment - 1 ) / DataAlignment * DataAlignment;
+
+   const std::string tempPath = uniqueTempPath( entryPath );
+   {
+      std::ofstream file( tempPath, std::ofstream::binary );
+      file.write( (const char*)&header, sizeof( header ) );
+      file.write( key.data(), key.size() );
+
+      const char padding[DataAlignment] = {};
+      file.write( padding, header.dataOffset - sizeof( header ) - key.size() );
+
+      writeSamples( file );
+
+      if ( !file )
+      {
+         file.close();
+         std::error_code ec;
+         fs::remove( tempPath, ec );
+         return false;
+      }
+   }
+
+   // Atomic replacement; if another process got there first (or the entry is mapped and can't be
+   // replaced on this platform), its copy is just as good
+   std::error_code ec;
+   fs::rename( tempPath, entryPath, ec );
+   if ( ec )
+   {
+      fs::remove( tempPath, ec );
+      return fs::exists( entryPath, ec );
+   }
+
+   evict( entryPath );
+   return true;
+}
+
+void DecodedAudioCache::evict( const std::string& keepEntry/*=std::string()*/ )
+{
+   std::lock_guard<std::mutex> lock( _evictMutex );
+
+   struct Entry
+   {
+      fs::path             path;
+      uintmax_t            size;
+      fs::file_time_type   lastUsed;
+   };
+   std::vector<Entry> entries;
+   uintmax_t totalBytes = 0;
+
+   const auto now = fs::file_time_type::clock::now();
+
+   std::error_code ec;
+   for ( const auto& dirEntry : fs::directory_iterator( _directory, ec ) )
+   {
+      std::error_code entryEc;
+      if ( dirEntry.path().extension() == TempExtension )
+      {
+         if ( now - dirEntry.last_write_time( entryEc ) > AbandonedTempAge && !entryEc )
+            fs::remove( dirEntry.path(), entryEc );
+         continue;
+      }
+      if ( dirEntry.path().extension() != EntryExtension )
+         continue;
+
+      Entry entry = { dirEntry.path(), dirEntry.file_size( entryEc ), dirEntry.last_write_time( entryEc ) };
+      if ( entryEc )
+         continue; // removed by someone else in the meantime
+
+      totalBytes += entry.size;
+      entries.push_back( entry );
+   }
+
+   if ( totalBytes <= _maxBytes )
+      return;
+
+   std::sort( entries.begin(), entries.end(), []( const Entry& a, const Entry& b ) { return a.lastUsed < b.lastUsed; } );
+
+   for ( const auto& entry : entries )
+   {
+      if ( totalBytes <= _maxBytes )
+         break;
+      if ( entry.path == fs::path( keepEntry ) )
+         continue;
+
+      // Failure is fine: another process may have evicted it already, or (on Windows) still have it mapped
+      std::error_code removeEc;
+      if ( fs::remove( entry.path, removeEc ) )
+         totalBytes -= entry.size;
+   }
+}
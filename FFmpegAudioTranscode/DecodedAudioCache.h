@@ -0,0 +1,62 @@
+#pragma once
+
+#include "AudioParams.h"
+#include "MappedFile.h"
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Decoded audio as found in the cache: a read-only mapping of the entry plus a pointer to each
+// plane of samples within it (one plane for interleaved formats, one per channel for planar ones)
+struct CachedAudio
+{
+   std::unique_ptr<MappedFile>   mapping;
+   std::vector<const uint8_t*>   planes;
+   size_t                        frameCount = 0;
+};
+
+// Persistent cache of decoded PCM, shared by any number of processes through a directory. Entries
+// are keyed by source path, size and modification time plus the output AudioParams, and are
+// written to a temporary file and renamed into place so readers never see a partial entry. When
+// the directory grows past its size limit the least recently used entries are removed.
+class DecodedAudioCache
+{
+public:
+   DecodedAudioCache( const std::string& directory, uint64_t maxBytes );
+   virtual ~DecodedAudioCache();
+
+   // 'variant' distinguishes otherwise identical requests whose output differs (e.g. byte order)
+   bool lookup( const std::string& sourcePath, const AudioParams& params, const std::string& variant, CachedAudio& result );
+
+   // Each plane holds frameCount frames
+   bool store( const std::string& sourcePath, const AudioParams& params, const std::string& variant,
+               const std::vector<const uint8_t*>& planes, size_t frameCount );
+
+   // For interleaved output that isn't held whole: readFrames is asked for a few thousand frames at
+   // a time, in order, to be copied to dst
+   typedef std::function< void( size_t firstFrame, size_t frameCount, uint8_t* dst ) > FrameReader;
+   bool store( const std::string& sourcePath, const AudioParams& params, const std::string& variant,
+               const FrameReader& readFrames, size_t frameCount );
+
+   const std::string& directory() const { return _directory; }
+   uint64_t maxBytes() const { return _maxBytes; }
+
+   // Removes least recently used entries until the cache fits within its size limit
+   void evict( const std::string& keepEntry = std::string() );
+
+protected:
+   bool makeKey( const std::string& sourcePath, const AudioParams& params, const std::string& variant,
+                 std::string& key, std::string& entryPath ) const;
+   std::string uniqueTempPath( const std::string& entryPath );
+   bool writeEntry( const std::string& sourcePath, const AudioParams& params, const std::string& variant,
+                    size_t frameCount, const std::function< void( std::ostream& ) >& writeSamples );
+
+   const std::string _directory;
+   const uint64_t    _maxBytes;
+   std::mutex        _evictMutex;
+};
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+// Settings passed through to FFmpeg when AudioReaderDecoder opens its input and codec. The
+// defaults leave FFmpeg's own behavior unchanged: a single decoding thread and no extra options.
+struct DecoderOptions
+{
+   // Values of AVCodecContext::thread_type; decoders only use the kinds they support
+   enum ThreadType { FrameThreading = 1, SliceThreading = 2 };
+
+   // Zero lets FFmpeg choose, normally one per core
+   int threadCount = 1;
+   int threadType = FrameThreading | SliceThreading;
+
+   // Short name of the input format to use rather than probing for one, e.g. "mp3"
+   std::string inputFormat;
+
+   // Caps on how much of the input is read to detect its format (in bytes) and to fill in stream
+   // parameters its header leaves out (in microseconds); zero keeps FFmpeg's defaults
+   int64_t probeSize = 0;
+   int64_t analyzeDuration = 0;
+
+   // Passed to avformat_open_input() and avcodec_open2() respectively
+   std::map<std::string, std::string> formatOptions;
+   std::map<std::string, std::string> codecOptions;
+};
@@ -0,0 +1,337 @@
+#include "stdafx.h"
+
+#include "InterleaveKernels.h"
+
+#include <cstring>
+
+#if defined( _M_X64 ) || defined( _M_IX86 ) || defined( __x86_64__ ) || defined( __i386__ )
+#define INTERLEAVE_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined( _MSC_VER )
+#include <intrin.h>
+#define INTERLEAVE_TARGET_AVX2
+#else
+#define INTERLEAVE_TARGET_AVX2 __attribute__(( target( "avx2" ) ))
+#endif
+#endif
+
+namespace
+{
+   template <int Width> struct SampleOf;
+   template <> struct SampleOf<1> { typedef uint8_t type; };
+   template <> struct SampleOf<2> { typedef uint16_t type; };
+   template <> struct SampleOf<4> { typedef uint32_t type; };
+   template <> struct SampleOf<8> { typedef uint64_t type; };
+
+   // Channels of zero means the count is only known at run time
+   template <int Width, int Channels>
+   void interleaveScalar( const uint8_t* const* planes, size_t offset, size_t count, int channelCount, uint8_t* dst )
+   {
+      typedef typename SampleOf<Width>::type Sample;
+      const int channels = ( Channels > 0 ) ? Channels : channelCount;
+
+      if ( channels == 1 )
+      {
+         ::memcpy( dst, planes[0] + offset * Width, count * Width );
+         return;
+      }
+
+      Sample* out = reinterpret_cast<Sample*>( dst );
+      for ( size_t i = offset; i < offset + count; ++i )
+      {
+         for ( int ch = 0; ch < channels; ++ch )
+            *out++ = reinterpret_cast<const Sample*>( planes[ch] )[i];
+      }
+   }
+
+#ifdef INTERLEAVE_X86
+   template <int Width>
+   void interleaveStereoSSE2( const uint8_t* const* planes, size_t offset, size_t count, int, uint8_t* dst )
+   {
+      const uint8_t* left = planes[0] + offset * Width;
+      const uint8_t* right = planes[1] + offset * Width;
+      const size_t bytes = count * Width;
+
+      size_t i = 0;
+      for ( ; i + 16 <= bytes; i += 16 )
+      {
+         __m128i l = _mm_loadu_si128( reinterpret_cast<const __m128i*>( left + i ) );
+         __m128i r = _mm_loadu_si128( reinterpret_cast<const __m128i*>( right + i ) );
+         __m128i lo, hi;
+         if constexpr ( Width == 1 )
+         {
+            lo = _mm_unpacklo_epi8( l, r );
+            hi = _mm_unpackhi_epi8( l, r );
+         }
+         else if constexpr ( Width == 2 )
+         {
+            lo = _mm_unpacklo_epi16( l, r );
+            hi = _mm_unpackhi_epi16( l, r );
+         }
+         else if constexpr ( Width == 4 )
+         {
+            lo = _mm_unpacklo_epi32( l, r );
+            hi = _mm_unpackhi_epi32( l, r );
+         }
+         else
+         {
+            lo = _mm_unpacklo_epi64( l, r );
+            hi = _mm_unpackhi_epi64( l, r );
+         }
+         _mm_storeu_si128( reinterpret_cast<__m128i*>( dst + 2 * i ), lo );
+         _mm_storeu_si128( reinterpret_cast<__m128i*>( dst + 2 * i + 16 ), hi );
+      }
+
+      interleaveScalar<Width, 2>( planes, offset + i / Width, count - i / Width, 2, dst + 2 * i );
+   }
+
+   // 6 or 8 channels of 16-bit samples, eight frames at a time: one vector per channel is
+   // transposed into one vector per frame
+   template <int Channels>
+   void interleave16SSE2( const uint8_t* const* planes, size_t offset, size_t count, int, uint8_t* dst )
+   {
+      const __m128i zero = _mm_setzero_si128();
+
+      size_t i = 0;
+      for ( ; i + 8 <= count; i += 8 )
+      {
+         __m128i v[8];
+         for ( int ch = 0; ch < 8; ++ch )
+            v[ch] = ( ch < Channels ) ? _mm_loadu_si128( reinterpret_cast<const __m128i*>( planes[ch] + ( offset + i ) * 2 ) ) : zero;
+
+         __m128i a0 = _mm_unpacklo_epi16( v[0], v[1] ), a1 = _mm_unpackhi_epi16( v[0], v[1] );
+         __m128i a2 = _mm_unpacklo_epi16( v[2], v[3] ), a3 = _mm_unpackhi_epi16( v[2], v[3] );
+         __m128i a4 = _mm_unpacklo_epi16( v[4], v[5] ), a5 = _mm_unpackhi_epi16( v[4], v[5] );
+         __m128i a6 = _mm_unpacklo_epi16( v[6], v[7] ), a7 = _mm_unpackhi_epi16( v[6], v[7] );
+
+         __m128i b0 = _mm_unpacklo_epi32( a0, a2 ), b1 = _mm_unpackhi_epi32( a0, a2 );
+         __m128i b2 = _mm_unpacklo_epi32( a1, a3 ), b3 = _mm_unpackhi_epi32( a1, a3 );
+         __m128i b4 = _mm_unpacklo_epi32( a4, a6 ), b5 = _mm_unpackhi_epi32( a4, a6 );
+         __m128i b6 = _mm_unpacklo_epi32( a5, a7 ), b7 = _mm_unpackhi_epi32( a5, a7 );
+
+         __m128i frames[8] =
+         {
+            _mm_unpacklo_epi64( b0, b4 ), _mm_unpackhi_epi64( b0, b4 ),
+            _mm_unpacklo_epi64( b1, b5 ), _mm_unpackhi_epi64( b1, b5 ),
+            _mm_unpacklo_epi64( b2, b6 ), _mm_unpackhi_epi64( b2, b6 ),
+            _mm_unpacklo_epi64( b3, b7 ), _mm_unpackhi_epi64( b3, b7 )
+         };
+
+         uint8_t* out = dst + i * Channels * 2;
+         for ( int f = 0; f < 8; ++f, out += Channels * 2 )
+         {
+            if constexpr ( Channels == 8 )
+            {
+               _mm_storeu_si128( reinterpret_cast<__m128i*>( out ), frames[f] );
+            }
+            else
+            {
+               _mm_storel_epi64( reinterpret_cast<__m128i*>( out ), frames[f] );
+               int32_t last = _mm_cvtsi128_si32( _mm_srli_si128( frames[f], 8 ) );
+               ::memcpy( out + 8, &last, sizeof( last ) );
+            }
+         }
+      }
+
+      interleaveScalar<2, Channels>( planes, offset + i, count - i, Channels, dst + i * Channels * 2 );
+   }
+
+   // 6 or 8 channels of 32-bit samples, four frames at a time as two 4x4 transposes
+   template <int Channels>
+   void interleave32SSE2( const uint8_t* const* planes, size_t offset, size_t count, int, uint8_t* dst )
+   {
+      const __m128i zero = _mm_setzero_si128();
+
+      size_t i = 0;
+      for ( ; i + 4 <= count; i += 4 )
+      {
+         __m128i frames[2][4];
+         for ( int group = 0; group < 2; ++group )
+         {
+            __m128i v[4];
+            for ( int ch = 0; ch < 4; ++ch )
+            {
+               int channel = group * 4 + ch;
+               v[ch] = ( channel < Channels ) ? _mm_loadu_si128( reinterpret_cast<const __m128i*>( planes[channel] + ( offset + i ) * 4 ) ) : zero;
+            }
+
+            __m128i a0 = _mm_unpacklo_epi32( v[0], v[1] ), a1 = _mm_unpackhi_epi32( v[0], v[1] );
+            __m128i a2 = _mm_unpacklo_epi32( v[2], v[3] ), a3 = _mm_unpackhi_epi32( v[2], v[3] );
+            frames[group][0] = _mm_unpacklo_epi64( a0, a2 );
+            frames[group][1] = _mm_unpackhi_epi64( a0, a2 );
+            frames[group][2] = _mm_unpacklo_epi64( a1, a3 );
+            frames[group][3] = _mm_unpackhi_epi64( a1, a3 );
+         }
+
+         uint8_t* out = dst + i * Channels * 4;
+         for ( int f = 0; f < 4; ++f, out += Channels * 4 )
+         {
+            _mm_storeu_si128( reinterpret_cast<__m128i*>( out ), frames[0][f] );
+            if constexpr ( Channels == 8 )
+               _mm_storeu_si128( reinterpret_cast<__m128i*>( out + 16 ), frames[1][f] );
+            else
+               _mm_storel_epi64( reinterpret_cast<__m128i*>( out + 16 ), frames[1][f] );
+         }
+      }
+
+      interleaveScalar<4, Channels>( planes, offset + i, count - i, Channels, dst + i * Channels * 4 );
+   }
+
+   // 256-bit unpacks work within each 128-bit lane, so the halves are put back in order afterwards
+   template <int Width>
+   INTERLEAVE_TARGET_AVX2 void interleaveStereoAVX2( const uint8_t* const* planes, size_t offset, size_t count, int, uint8_t* dst )
+   {
+      const uint8_t* left = planes[0] + offset * Width;
+      const uint8_t* right = planes[1] + offset * Width;
+      const size_t bytes = count * Width;
+
+      size_t i = 0;
+      for ( ; i + 32 <= bytes; i += 32 )
+      {
+         __m256i l = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( left + i ) );
+         __m256i r = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( right + i ) );
+         __m256i lo, hi;
+         if constexpr ( Width == 1 )
+         {
+            lo = _mm256_unpacklo_epi8( l, r );
+            hi = _mm256_unpackhi_epi8( l, r );
+         }
+         else if constexpr ( Width == 2 )
+         {
+            lo = _mm256_unpacklo_epi16( l, r );
+            hi = _mm256_unpackhi_epi16( l, r );
+         }
+         else if constexpr ( Width == 4 )
+         {
+            lo = _mm256_unpacklo_epi32( l, r );
+            hi = _mm256_unpackhi_epi32( l, r );
+         }
+         else
+         {
+            lo = _mm256_unpacklo_epi64( l, r );
+            hi = _mm256_unpackhi_epi64( l, r );
+         }
+         _mm256_storeu_si256( reinterpret_cast<__m256i*>( dst + 2 * i ), _mm256_permute2x128_si256( lo, hi, 0x20 ) );
+         _mm256_storeu_si256( reinterpret_cast<__m256i*>( dst + 2 * i + 32 ), _mm256_permute2x128_si256( lo, hi, 0x31 ) );
+      }
+
+      interleaveScalar<Width, 2>( planes, offset + i / Width, count - i / Width, 2, dst + 2 * i );
+   }
+
+   bool cpuSupportsSSE2()
+   {
+#if defined( _M_X64 ) || defined( __x86_64__ )
+      return true;
+#elif defined( _MSC_VER )
+      int info[4];
+      ::__cpuid( info, 1 );
+      return ( info[3] & ( 1 << 26 ) ) != 0;
+#else
+      return __builtin_cpu_supports( "sse2" );
+#endif
+   }
+
+   bool cpuSupportsAVX2()
+   {
+#if defined( _MSC_VER )
+      int info[4];
+      ::__cpuid( info, 0 );
+      if ( info[0] < 7 )
+         return false;
+
+      // The OS has to be saving the YMM registers as well as the CPU having AVX2
+      ::__cpuid( info, 1 );
+      if ( ( info[2] & ( 1 << 27 ) ) == 0 || ( ::_xgetbv( 0 ) & 6 ) != 6 )
+         return false;
+
+      ::__cpuidex( info, 7, 0 );
+      return ( info[1] & ( 1 << 5 ) ) != 0;
+#else
+      return __builtin_cpu_supports( "avx2" );
+#endif
+   }
+#endif
+
+   template <int Width>
+   InterleaveKernel selectForWidth( int channelCount, InterleaveIsa isa )
+   {
+#ifdef INTERLEAVE_X86
+      if ( isa == InterleaveIsa::AVX2 && channelCount == 2 )
+         return interleaveStereoAVX2<Width>;
+
+      if ( isa != InterleaveIsa::Scalar )
+      {
+         if ( channelCount == 2 )
+            return interleaveStereoSSE2<Width>;
+
+         if constexpr ( Width == 2 )
+         {
+            if ( channelCount == 6 )
+               return interleave16SSE2<6>;
+            if ( channelCount == 8 )
+               return interleave16SSE2<8>;
+         }
+         else if constexpr ( Width == 4 )
+         {
+            if ( channelCount == 6 )
+               return interleave32SSE2<6>;
+            if ( channelCount == 8 )
+               return interleave32SSE2<8>;
+         }
+      }
+#else
+      (void)isa;
+#endif
+
+      switch ( channelCount )
+      {
+      case 1: return interleaveScalar<Width, 1>;
+      case 2: return interleaveScalar<Width, 2>;
+      case 6: return interleaveScalar<Width, 6>;
+      case 8: return interleaveScalar<Width, 8>;
+      default: return interleaveScalar<Width, 0>;
+      }
+   }
+}
+
+InterleaveIsa detectInterleaveIsa()
+{
+   static const InterleaveIsa isa = []()
+   {
+#ifdef INTERLEAVE_X86
+      if ( cpuSupportsAVX2() )
+         return InterleaveIsa::AVX2;
+      if ( cpuSupportsSSE2() )
+         return InterleaveIsa::SSE2;
+#endif
+      return InterleaveIsa::Scalar;
+   }();
+
+   return isa;
+}
+
+InterleaveKernel selectInterleaveKernel( int bytesPerSample, int channelCount, InterleaveIsa isa )
+{
+   switch ( bytesPerSample )
+   {
+   case 1: return selectForWidth<1>( channelCount, isa );
+   case 2: return selectForWidth<2>( channelCount, isa );
+   case 4: return selectForWidth<4>( channelCount, isa );
+   case 8: return selectForWidth<8>( channelCount, isa );
+   default: return nullptr;
+   }
+}
+
+void interleaveReference( const uint8_t* const* planes, size_t offset, size_t count, int channelCount, int bytesPerSample, uint8_t* dst )
+{
+   for ( size_t i = 0; i < count; ++i )
+   {
+      for ( int ch = 0; ch < channelCount; ++ch )
+      {
+         const uint8_t* src = &planes[ch][( offset + i ) * bytesPerSample];
+         ::memcpy( dst, src, bytesPerSample );
+         dst += bytesPerSample;
+      }
+   }
+}
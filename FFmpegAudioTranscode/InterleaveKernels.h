@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Planar to interleaved conversion. Kernels are specialized at compile time on sample width (1, 2,
+// 4 or 8 bytes) and on the common channel counts (1, 2, 6, 8), with SSE2 and AVX2 versions where
+// they pay off. Anything else falls back to a generic loop.
+
+// Copies 'count' frames starting at frame 'offset' of each plane to dst, channel by channel
+typedef void ( *InterleaveKernel )( const uint8_t* const* planes, size_t offset, size_t count, int channelCount, uint8_t* dst );
+
+enum class InterleaveIsa { Scalar, SSE2, AVX2 };
+
+// Best instruction set both the build and the CPU running it support; detected once
+InterleaveIsa detectInterleaveIsa();
+
+// Null for sample widths other than 1, 2, 4 or 8. Kernels for an instruction set the CPU lacks
+// must not be called.
+InterleaveKernel selectInterleaveKernel( int bytesPerSample, int channelCount, InterleaveIsa isa );
+inline InterleaveKernel selectInterleaveKernel( int bytesPerSample, int channelCount )
+{
+   return selectInterleaveKernel( bytesPerSample, channelCount, detectInterleaveIsa() );
+}
+
+// The per-sample memcpy loop AudioLoader used before these kernels, kept as a reference
+void interleaveReference( const uint8_t* const* planes, size_t offset, size_t count, int channelCount, int bytesPerSample, uint8_t* dst );
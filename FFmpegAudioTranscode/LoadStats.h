@@ -0,0 +1,108 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+// Where the time goes in an AudioLoader load: cumulative time and number of timed calls per stage,
+// plus the amount of data that went through each. Collection is compiled in only when
+// AUDIO_LOAD_STATS is defined, as in the test project's Stats configuration; otherwise the
+// LOAD_STATS_* macros expand to nothing and loaders carry no stats at all.
+struct LoadStats
+{
+   // Interleaving isn't a stage of its own: the resampler writes straight into the output layout,
+   // so it's counted under Resample. Copy covers appending resampled audio to the output,
+   // building the waveform pyramid, and moving the output into place at the end.
+   enum Stage { Demux, Decode, Resample, Copy, StageCount };
+
+   struct StageTotals
+   {
+      double   seconds = 0.0;
+      uint64_t calls = 0;
+   };
+
+   StageTotals stages[StageCount];
+   uint64_t    bytesRead = 0;                // from the input, container overhead included
+   uint64_t    packets = 0;                  // of the audio stream
+   uint64_t    frames = 0;                   // decoded AVFrames
+   uint64_t    resamplerInputSamples = 0;    // per channel
+   uint64_t    resamplerOutputSamples = 0;   // per channel
+   uint64_t    bufferGrowths = 0;            // output blocks added and resampler output reallocations
+
+   static const char* stageName( Stage stage )
+   {
+      static const char* const names[StageCount] = { "demux", "decode", "resample", "copy" };
+      return names[stage];
+   }
+
+   double totalSeconds() const
+   {
+      double total = 0.0;
+      for ( const auto& stage : stages )
+         total += stage.seconds;
+      return total;
+   }
+
+   // Segmented and pipelined loads run stages on several threads at once, so their stage times
+   // add up to more than the time the load took
+   LoadStats& operator+=( const LoadStats& other )
+   {
+      for ( int i = 0; i < StageCount; ++i )
+      {
+         stages[i].seconds += other.stages[i].seconds;
+         stages[i].calls += other.stages[i].calls;
+      }
+      bytesRead += other.bytesRead;
+      packets += other.packets;
+      frames += other.frames;
+      resamplerInputSamples += other.resamplerInputSamples;
+      resamplerOutputSamples += other.resamplerOutputSamples;
+      bufferGrowths += other.bufferGrowths;
+      return *this;
+   }
+
+   static void add( LoadStats* stats, uint64_t LoadStats::* counter, uint64_t n )
+   {
+      if ( stats != nullptr )
+         stats->*counter += n;
+   }
+};
+
+// Adds the time until it goes out of scope to one stage; does nothing given null stats
+class LoadStatsTimer
+{
+public:
+   LoadStatsTimer( LoadStats* stats, LoadStats::Stage stage )
+      : _stats( stats ), _stage( stage )
+   {
+      if ( _stats != nullptr )
+         _start = std::chrono::steady_clock::now();
+   }
+
+   ~LoadStatsTimer()
+   {
+      if ( _stats == nullptr )
+         return;
+
+      LoadStats::StageTotals& totals = _stats->stages[_stage];
+      totals.seconds += std::chrono::duration<double>( std::chrono::steady_clock::now() - _start ).count();
+      ++totals.calls;
+   }
+
+   LoadStatsTimer( const LoadStatsTimer& ) = delete;
+   LoadStatsTimer& operator=( const LoadStatsTimer& ) = delete;
+
+protected:
+   LoadStats* const                      _stats;
+   const LoadStats::Stage                _stage;
+   std::chrono::steady_clock::time_point _start;
+};
+
+#ifdef AUDIO_LOAD_STATS
+#define LOAD_STATS_TIME( stats, stage ) LoadStatsTimer loadStatsTimer( stats, LoadStats::stage )
+#define LOAD_STATS_ADD( stats, counter, n ) LoadStats::add( stats, &LoadStats::counter, uint64_t( n ) )
+#define LOAD_STATS_RESET( stats ) ( *( stats ) = LoadStats() )
+#else
+#define LOAD_STATS_TIME( stats, stage )
+#define LOAD_STATS_ADD( stats, counter, n )
+#define LOAD_STATS_RESET( stats )
+#endif
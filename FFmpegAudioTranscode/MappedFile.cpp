@@ -0,0 +1,224 @@
+#include "stdafx.h"
+
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+   : _data( nullptr )
+   , _size( 0 )
+   , _writable( false )
+#ifdef _WIN32
+   , _fileHandle( INVALID_HANDLE_VALUE )
+   , _mappingHandle( nullptr )
+#else
+   , _fd( -1 )
+#endif
+{
+
+}
+
+MappedFile::~MappedFile()
+{
+   close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open( const std::string& path )
+{
+   close();
+
+   _fileHandle = ::CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+   if ( _fileHandle == INVALID_HANDLE_VALUE )
+      return false;
+
+   LARGE_INTEGER fileSize;
+   if ( !::GetFileSizeEx( _fileHandle, &fileSize ) || fileSize.QuadPart == 0 )
+   {
+      close();
+      return false;
+   }
+
+   _mappingHandle = ::CreateFileMappingA( _fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr );
+   if ( _mappingHandle == nullptr )
+   {
+      close();
+      return false;
+   }
+
+   _data = static_cast<const uint8_t*>( ::MapViewOfFile( _mappingHandle, FILE_MAP_READ, 0, 0, 0 ) );
+   if ( _data == nullptr )
+   {
+      close();
+      return false;
+   }
+
+   _size = size_t( fileSize.QuadPart );
+   return true;
+}
+
+bool MappedFile::create( const std::string& path, size_t size )
+{
+   close();
+
+   _fileHandle = ::CreateFileA( path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                                CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+   if ( _fileHandle == INVALID_HANDLE_VALUE || size == 0 )
+   {
+      close();
+      return false;
+   }
+
+   // Mapping more than the file holds extends it to the mapping's size
+   const uint64_t mappingSize = size;
+   _mappingHandle = ::CreateFileMappingA( _fileHandle, nullptr, PAGE_READWRITE, DWORD( mappingSize >> 32 ), DWORD( mappingSize ), nullptr );
+   if ( _mappingHandle == nullptr )
+   {
+      close();
+      return false;
+   }
+
+   _data = static_cast<const uint8_t*>( ::MapViewOfFile( _mappingHandle, FILE_MAP_WRITE, 0, 0, 0 ) );
+   if ( _data == nullptr )
+   {
+      close();
+      return false;
+   }
+
+   _size = size;
+   _writable = true;
+   return true;
+}
+
+bool MappedFile::closeTruncated( size_t size )
+{
+   if ( !_writable )
+      return false;
+
+   HANDLE fileHandle = _fileHandle;
+   _fileHandle = INVALID_HANDLE_VALUE;
+   close();
+
+   LARGE_INTEGER end;
+   end.QuadPart = LONGLONG( size );
+   const bool ok = ::SetFilePointerEx( fileHandle, end, nullptr, FILE_BEGIN ) && ::SetEndOfFile( fileHandle );
+   ::CloseHandle( fileHandle );
+   return ok;
+}
+
+void MappedFile::close()
+{
+   if ( _data != nullptr )
+      ::UnmapViewOfFile( _data );
+   if ( _mappingHandle != nullptr )
+      ::CloseHandle( _mappingHandle );
+   if ( _fileHandle != INVALID_HANDLE_VALUE )
+      ::CloseHandle( _fileHandle );
+
+   _data = nullptr;
+   _size = 0;
+   _writable = false;
+   _mappingHandle = nullptr;
+   _fileHandle = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool MappedFile::open( const std::string& path )
+{
+   close();
+
+   _fd = ::open( path.c_str(), O_RDONLY );
+   if ( _fd < 0 )
+      return false;
+
+   struct stat st;
+   if ( ::fstat( _fd, &st ) != 0 || st.st_size == 0 )
+   {
+      close();
+      return false;
+   }
+
+   void* ptr = ::mmap( nullptr, size_t( st.st_size ), PROT_READ, MAP_SHARED, _fd, 0 );
+   if ( ptr == MAP_FAILED )
+   {
+      close();
+      return false;
+   }
+
+   _data = static_cast<const uint8_t*>( ptr );
+   _size = size_t( st.st_size );
+   return true;
+}
+
+bool MappedFile::create( const std::string& path, size_t size )
+{
+   close();
+
+   _fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+   if ( _fd < 0 || size == 0 || ::ftruncate( _fd, off_t( size ) ) != 0 )
+   {
+      close();
+      return false;
+   }
+
+#ifdef __linux__
+   // Without blocks set aside, running out of disk space would only show up as SIGBUS mid-write
+   if ( ::posix_fallocate( _fd, 0, off_t( size ) ) != 0 )
+   {
+      close();
+      return false;
+   }
+#endif
+
+   void* ptr = ::mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0 );
+   if ( ptr == MAP_FAILED )
+   {
+      close();
+      return false;
+   }
+
+   _data = static_cast<const uint8_t*>( ptr );
+   _size = size;
+   _writable = true;
+   return true;
+}
+
+bool MappedFile::closeTruncated( size_t size )
+{
+   if ( !_writable )
+      return false;
+
+   const int fd = _fd;
+   _fd = -1;
+   close();
+
+   const bool ok = ( ::ftruncate( fd, off_t( size ) ) == 0 );
+   ::close( fd );
+   return ok;
+}
+
+void MappedFile::close()
+{
+   if ( _data != nullptr )
+      ::munmap( const_cast<uint8_t*>( _data ), _size );
+   if ( _fd >= 0 )
+      ::close( _fd );
+
+   _data = nullptr;
+   _size = 0;
+   _writable = false;
+   _fd = -1;
+}
+
+#endif
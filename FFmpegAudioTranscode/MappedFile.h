@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Memory mapping of an entire file. Pages are only read from disk as they're touched. Mappings
+// are read-only unless made with create().
+class MappedFile
+{
+public:
+   MappedFile();
+   virtual ~MappedFile();
+
+   MappedFile( const MappedFile& ) = delete;
+   MappedFile& operator=( const MappedFile& ) = delete;
+
+   bool open( const std::string& path );
+   void close();
+
+   // Creates the file, replacing any that's there, with room for 'size' bytes allocated on disk
+   // up front, and maps it writable
+   bool create( const std::string& path, size_t size );
+
+   // Cuts a file made with create() down to the part that was used as it's closed
+   bool closeTruncated( size_t size );
+
+   bool isOpen() const { return _data != nullptr; }
+   const uint8_t* data() const { return _data; }
+   uint8_t* writableData() const { return _writable ? const_cast<uint8_t*>( _data ) : nullptr; }
+   size_t size() const { return _size; }
+
+protected:
+   const uint8_t* _data;
+   size_t         _size;
+   bool           _writable;
+#ifdef _WIN32
+   void*          _fileHandle;
+   void*          _mappingHandle;
+#else
+   int            _fd;
+#endif
+};
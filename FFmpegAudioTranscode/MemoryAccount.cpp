@@ -0,0 +1,94 @@
+#include "stdafx.h"
+
+#include "MemoryAccount.h"
+
+extern "C"
+{
+#include <libavutil/mem.h>
+}
+
+#include <algorithm>
+#include <climits>
+
+MemoryAccount::MemoryAccount( MemoryAccount* parent/*=&total()*/ )
+   : _parent( parent )
+   , _budget( 0 )
+   , _current( 0 )
+   , _peak( 0 )
+   , _refusals( 0 )
+{
+   for ( int i = 0; i < CategoryCount; ++i )
+   {
+      _categoryCurrent[i] = 0;
+      _categoryPeak[i] = 0;
+   }
+}
+
+MemoryAccount::~MemoryAccount()
+{
+   // Whatever is still charged stops counting towards the parent
+   if ( _parent != nullptr )
+   {
+      for ( int i = 0; i < CategoryCount; ++i )
+         _parent->release( Category( i ), _categoryCurrent[i] );
+   }
+}
+
+MemoryAccount& MemoryAccount::total()
+{
+   static MemoryAccount account( nullptr );
+   return account;
+}
+
+void MemoryAccount::setBudget( size_t bytes )
+{
+   _budget = bytes;
+
+   if ( this == &total() )
+      ::av_max_alloc( ( bytes == 0 ) ? size_t( INT_MAX ) : std::min( bytes, size_t( INT_MAX ) ) );
+}
+
+bool MemoryAccount::charge( Category category, size_t bytes )
+{
+   const size_t budget = _budget.load( std::memory_order_relaxed );
+   const size_t now = _current.fetch_add( bytes ) + bytes;
+   if ( ( budget != 0 && now > budget ) || ( _parent != nullptr && !_parent->charge( category, bytes ) ) )
+   {
+      _current.fetch_sub( bytes );
+      ++_refusals;
+      return false;
+   }
+
+   raisePeak( _peak, now );
+   raisePeak( _categoryPeak[category], _categoryCurrent[category].fetch_add( bytes ) + bytes );
+   return true;
+}
+
+void MemoryAccount::release( Category category, size_t bytes )
+{
+   _current.fetch_sub( bytes );
+   _categoryCurrent[category].fetch_sub( bytes );
+
+   if ( _parent != nullptr )
+      _parent->release( category, bytes );
+}
+
+void MemoryAccount::resetPeaks()
+{
+   _peak = _current.load();
+   for ( int i = 0; i < CategoryCount; ++i )
+      _categoryPeak[i] = _categoryCurrent[i].load();
+}
+
+const char* MemoryAccount::categoryName( Category category )
+{
+   static const char* const names[CategoryCount] = { "output", "staging", "resampler", "decoder" };
+   return names[category];
+}
+
+void MemoryAccount::raisePeak( std::atomic<size_t>& peak, size_t value )
+{
+   size_t previous = peak.load( std::memory_order_relaxed );
+   while ( value > previous && !peak.compare_exchange_weak( previous, value, std::memory_order_relaxed ) )
+      ;
+}
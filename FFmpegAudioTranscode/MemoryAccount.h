@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Bytes held on behalf of one or more loads, current and peak, in total and by what they're for.
+// Accounts form a tree: whatever is charged to an account is charged to its parent as well, up to
+// total(), which sees every account in the process. Any account may be given a budget; a charge
+// that would take it, or an account above it, over budget is refused and leaves nothing charged.
+// All members may be used from any thread.
+class MemoryAccount
+{
+public:
+   enum Category
+   {
+      Output,      // the finished samples
+      Staging,     // samples still being collected, and packets queued between pipeline stages
+      Resampler,   // resampler output buffers
+      Decoder,     // decoded frames, allocated by FFmpeg from the reader-decoder's frame pool
+      CategoryCount
+   };
+
+   explicit MemoryAccount( MemoryAccount* parent = &total() );
+   ~MemoryAccount();
+
+   MemoryAccount( const MemoryAccount& ) = delete;
+   MemoryAccount& operator=( const MemoryAccount& ) = delete;
+
+   // Every account reports to this one unless given another parent. FFmpeg's allocations outside
+   // the frame pool can't be counted, but with a budget on total() no single one of them may be
+   // larger than the budget either (av_max_alloc).
+   static MemoryAccount& total();
+
+   // Zero, the default, means no budget
+   void setBudget( size_t bytes );
+   size_t budget() const { return _budget.load( std::memory_order_relaxed ); }
+
+   bool charge( Category category, size_t bytes );
+   void release( Category category, size_t bytes );
+
+   size_t current() const { return _current.load( std::memory_order_relaxed ); }
+   size_t peak() const { return _peak.load( std::memory_order_relaxed ); }
+   size_t current( Category category ) const { return _categoryCurrent[category].load( std::memory_order_relaxed ); }
+   size_t peak( Category category ) const { return _categoryPeak[category].load( std::memory_order_relaxed ); }
+
+   // Charges refused so far, here or further up
+   uint64_t refusals() const { return _refusals.load( std::memory_order_relaxed ); }
+
+   // Starts the peaks over from the current amounts
+   void resetPeaks();
+
+   static const char* categoryName( Category category );
+
+protected:
+   static void raisePeak( std::atomic<size_t>& peak, size_t value );
+
+   MemoryAccount* const _parent;
+   std::atomic<size_t>  _budget;
+   std::atomic<size_t>  _current;
+   std::atomic<size_t>  _peak;
+   std::atomic<size_t>  _categoryCurrent[CategoryCount];
+   std::atomic<size_t>  _categoryPeak[CategoryCount];
+   std::atomic<uint64_t> _refusals;
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Append-only sample storage made up of separately allocated blocks. Growing the store adds
+// a block rather than reallocating, so samples that have already been written are never moved.
+template<typename T>
+class SampleBlockStore
+{
+public:
+   static const size_t DefaultBlockSize = 1 << 20;
+
+   explicit SampleBlockStore( size_t blockSize = DefaultBlockSize )
+      : _blockSize( blockSize ), _size( 0 ) {}
+
+   // Sizes the first block to hold n samples; ideally n is the expected total so that
+   // everything ends up in a single block. Has no effect once samples have been appended.
+   void reserve( size_t n )
+   {
+      if ( _size != 0 || n == 0 )
+         return;
+      _blocks.clear();
+      addBlock( n );
+   }
+
+   void append( const T* src, size_t n )
+   {
+      while ( n > 0 )
+      {
+         if ( _blocks.empty() || _blocks.back().samples.size() == _blocks.back().capacity )
+            addBlock( std::max( _blockSize, n ) );
+
+         // Never past the reserved capacity, so the vector's buffer stays put
+         Block& block = _blocks.back();
+         size_t numToCopy = std::min( block.capacity - block.samples.size(), n );
+         block.samples.insert( block.samples.end(), src, src + numToCopy );
+         src += numToCopy;
+         n -= numToCopy;
+         _size += numToCopy;
+      }
+   }
+
+   size_t size() const { return _size; }
+   size_t blockCount() const { return _blocks.size(); }
+
+   // Samples the allocated blocks have room for
+   size_t capacity() const
+   {
+      size_t n = 0;
+      for ( const auto& block : _blocks )
+         n += block.capacity;
+      return n;
+   }
+
+   // Copies n samples starting at 'first' to dst. This only goes by the buffer pointer and
+   // capacity each block recorded when it was added, which never change, and never touches the
+   // vectors themselves; every block but the last is full, so blocks are located by capacity. It
+   // may therefore run on another thread while append() adds to the last block, for samples that
+   // thread has been shown were appended. It mustn't overlap an append() that adds a block,
+   // clear() or moveTo().
+   void read( size_t first, size_t n, T* dst ) const
+   {
+      size_t blockStart = 0;
+      for ( size_t i = 0; i < _blocks.size() && n > 0; ++i )
+      {
+         const size_t blockEnd = blockStart + _blocks[i].capacity;
+         if ( first < blockEnd )
+         {
+            const size_t count = std::min( n, blockEnd - first );
+            const T* src = _blocks[i].data + ( first - blockStart );
+            std::copy( src, src + count, dst );
+            dst += count;
+            first += count;
+            n -= count;
+         }
+         blockStart = blockEnd;
+      }
+   }
+
+   void clear()
+   {
+      _blocks.clear();
+      _size = 0;
+   }
+
+   // Hands the contents over to dst and empties the store. When everything fit in one block
+   // the block itself is moved into dst; otherwise the blocks are concatenated with one copy.
+   void moveTo( std::vector<T>& dst )
+   {
+      if ( _blocks.size() == 1 )
+      {
+         dst = std::move( _blocks.front().samples );
+      }
+      else
+      {
+         dst.clear();
+         dst.reserve( _size );
+         for ( const auto& block : _blocks )
+            dst.insert( dst.end(), block.samples.cbegin(), block.samples.cend() );
+      }
+      clear();
+   }
+
+protected:
+   // The vector is reserved at its full capacity and never grows past it, so its buffer never
+   // moves; readers use the copies of its address and capacity taken here, which the appending
+   // thread never writes
+   struct Block
+   {
+      std::vector<T> samples;
+      const T*       data;
+      size_t         capacity;
+   };
+
+   void addBlock( size_t capacity )
+   {
+      Block block;
+      block.samples.reserve( capacity );
+      block.data = block.samples.data();
+      block.capacity = block.samples.capacity();
+      _blocks.push_back( std::move( block ) );
+   }
+
+   std::vector<Block> _blocks;
+   const size_t       _blockSize;
+   size_t             _size;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread. push() waits
+// while the queue is full, which is what holds a fast producer back to the consumer's pace, and
+// pop() waits while it's empty. Either side can close() the queue: the consumer then drains
+// whatever is left, and a producer's push() fails so it can stop early.
+template <typename T>
+class SpscQueue
+{
+public:
+   // Capacity is rounded up to a power of two
+   explicit SpscQueue( size_t capacity )
+   {
+      size_t size = 2;
+      while ( size < capacity )
+         size *= 2;
+      _slots.resize( size );
+      _mask = size - 1;
+   }
+
+   bool tryPush( T& item )
+   {
+      const size_t tail = _tail.load( std::memory_order_relaxed );
+      if ( tail - _head.load( std::memory_order_acquire ) == _slots.size() )
+         return false;
+
+      _slots[tail & _mask] = std::move( item );
+      _tail.store( tail + 1, std::memory_order_release );
+      return true;
+   }
+
+   bool tryPop( T& item )
+   {
+      const size_t head = _head.load( std::memory_order_relaxed );
+      if ( head == _tail.load( std::memory_order_acquire ) )
+         return false;
+
+      item = std::move( _slots[head & _mask] );
+      _head.store( head + 1, std::memory_order_release );
+      return true;
+   }
+
+   // False if the queue was closed; item is left untouched then
+   bool push( T& item )
+   {
+      for ( unsigned spins = 0; !tryPush( item ); ++spins )
+      {
+         if ( _closed.load( std::memory_order_acquire ) )
+            return false;
+         backOff( spins );
+      }
+      return true;
+   }
+
+   // False once the queue is closed and empty
+   bool pop( T& item )
+   {
+      for ( unsigned spins = 0; !tryPop( item ); ++spins )
+      {
+         // Re-check after seeing the close, in case the last push landed in between
+         if ( _closed.load( std::memory_order_acquire ) )
+            return tryPop( item );
+         backOff( spins );
+      }
+      return true;
+   }
+
+   void close() { _closed.store( true, std::memory_order_release ); }
+   bool closed() const { return _closed.load( std::memory_order_acquire ); }
+
+protected:
+   // Spin briefly for the common case of the other side being just behind, then stop hogging the core
+   static void backOff( unsigned spins )
+   {
+      if ( spins < 64 )
+         std::this_thread::yield();
+      else
+         std::this_thread::sleep_for( std::chrono::microseconds( 50 ) );
+   }
+
+   std::vector<T>       _slots;
+   size_t               _mask;
+   // Each index on its own cache line, so the two threads aren't contending for one
+   alignas( 64 ) std::atomic<size_t> _head { 0 };
+   alignas( 64 ) std::atomic<size_t> _tail { 0 };
+   std::atomic<bool>    _closed { false };
+};
@@ -2,89 +2,961 @@
 
 #include "WavUtil.h"
 
+#include "InterleaveKernels.h"
+
+extern "C"
+{
+#include <libavutil/channel_layout.h>
+}
+
+#include <algorithm>
 #include <cassert>
+#include <climits>
+#include <cmath>
+#include <cstring>
 #include <fstream>
 
-struct WAVHeader
+#if defined( _M_X64 ) || defined( __x86_64__ )
+#define WAVUTIL_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+   bool hostIsBigEndian()
+   {
+      const uint16_t one = 1;
+      return *reinterpret_cast<const uint8_t*>( &one ) == 0;
+   }
+
+   template <bool BigEndian> uint16_t load16( const uint8_t* p )
+   {
+      return BigEndian ? uint16_t( p[0] << 8 | p[1] ) : uint16_t( p[1] << 8 | p[0] );
+   }
+
+   template <bool BigEndian> uint32_t load24( const uint8_t* p )
+   {
+      return BigEndian ? ( uint32_t( p[0] ) << 16 | uint32_t( p[1] ) << 8 | p[2] ) : ( uint32_t( p[2] ) << 16 | uint32_t( p[1] ) << 8 | p[0] );
+   }
+
+   template <bool BigEndian> uint32_t load32( const uint8_t* p )
+   {
+      return BigEndian ? ( uint32_t( load16<true>( p ) ) << 16 | load16<true>( p + 2 ) ) : ( uint32_t( load16<false>( p + 2 ) ) << 16 | load16<false>( p ) );
+   }
+
+   template <bool BigEndian> uint64_t load64( const uint8_t* p )
+   {
+      return BigEndian ? ( uint64_t( load32<true>( p ) ) << 32 | load32<true>( p + 4 ) ) : ( uint64_t( load32<false>( p + 4 ) ) << 32 | load32<false>( p ) );
+   }
+
+   uint16_t read16( const uint8_t* p, bool bigEndian ) { return bigEndian ? load16<true>( p ) : load16<false>( p ); }
+   uint32_t read32( const uint8_t* p, bool bigEndian ) { return bigEndian ? load32<true>( p ) : load32<false>( p ); }
+   uint64_t read64( const uint8_t* p, bool bigEndian ) { return bigEndian ? load64<true>( p ) : load64<false>( p ); }
+
+   // Reads one sample as FFmpeg hands it on: integers scaled to the full 32-bit range (which is
+   // how its decoder produces 24-bit samples, and how swresample treats every integer format when
+   // converting), floats as they are
+   template <WavEncoding Encoding, bool BigEndian> struct SampleReader;
+
+   template <bool BigEndian> struct SampleReader<WavEncoding::Unsigned8, BigEndian>
+   {
+      enum { Width = 1, IsFloat = 0 };
+      static int32_t read( const uint8_t* p ) { return int32_t( uint32_t( p[0] ^ 0x80 ) << 24 ); }
+   };
+
+   template <bool BigEndian> struct SampleReader<WavEncoding::Signed16, BigEndian>
+   {
+      enum { Width = 2, IsFloat = 0 };
+      static int32_t read( const uint8_t* p ) { return int32_t( uint32_t( load16<BigEndian>( p ) ) << 16 ); }
+   };
+
+   template <bool BigEndian> struct SampleReader<WavEncoding::Signed24, BigEndian>
+   {
+      enum { Width = 3, IsFloat = 0 };
+      static int32_t read( const uint8_t* p ) { return int32_t( load24<BigEndian>( p ) << 8 ); }
+   };
+
+   template <bool BigEndian> struct SampleReader<WavEncoding::Signed32, BigEndian>
+   {
+      enum { Width = 4, IsFloat = 0 };
+      static int32_t read( const uint8_t* p ) { return int32_t( load32<BigEndian>( p ) ); }
+   };
+
+   template <bool BigEndian> struct SampleReader<WavEncoding::Float32, BigEndian>
+   {
+      enum { Width = 4, IsFloat = 1 };
+      static float read( const uint8_t* p )
+      {
+         const uint32_t bits = load32<BigEndian>( p );
+         float value;
+         ::memcpy( &value, &bits, sizeof( value ) );
+         return value;
+      }
+   };
+
+   template <bool BigEndian> struct SampleReader<WavEncoding::Float64, BigEndian>
+   {
+      enum { Width = 8, IsFloat = 1 };
+      static double read( const uint8_t* p )
+      {
+         const uint64_t bits = load64<BigEndian>( p );
+         double value;
+         ::memcpy( &value, &bits, sizeof( value ) );
+         return value;
+      }
+   };
+
+   // Rounded to nearest and clipped, as swresample does; NaN comes out as the low end, as it does
+   // from the SSE2 versions
+   int64_t roundClipped( double x, double low, double high )
+   {
+      x = ( x > low ) ? x : low;
+      x = ( x < high ) ? x : high;
+      return std::llrint( x );
+   }
+
+   int16_t floatToS16( double x )
+   {
+      return int16_t( roundClipped( x * 32768.0, -32768.0, 32767.0 ) );
+   }
+
+   template <typename Reader> int16_t toS16( const uint8_t* p )
+   {
+      if constexpr ( Reader::IsFloat )
+         return floatToS16( Reader::read( p ) );
+      else
+         return int16_t( Reader::read( p ) >> 16 );
+   }
+
+   template <typename Reader> float toFloat( const uint8_t* p )
+   {
+      if constexpr ( Reader::IsFloat )
+         return float( Reader::read( p ) );
+      else
+         return float( Reader::read( p ) ) * ( 1.0f / 2147483648.0f );
+   }
+
+   // One pass over the interleaved frames, writing every output plane as it goes
+   template <WavEncoding Encoding, bool BigEndian>
+   void convertScalar( const uint8_t* src, size_t count, int channelCount, AVSampleFormat format, uint8_t* const* planes )
+   {
+      typedef SampleReader<Encoding, BigEndian> Reader;
+
+      if ( format == AV_SAMPLE_FMT_S16 )
+      {
+         int16_t* out = reinterpret_cast<int16_t*>( planes[0] );
+         const size_t sampleCount = count * channelCount;
+         for ( size_t i = 0; i < sampleCount; ++i, src += Reader::Width )
+            out[i] = toS16<Reader>( src );
+      }
+      else
+      {
+         float* const* out = reinterpret_cast<float* const*>( planes );
+         for ( size_t i = 0; i < count; ++i )
+         {
+            for ( int ch = 0; ch < channelCount; ++ch, src += Reader::Width )
+               out[ch][i] = toFloat<Reader>( src );
+         }
+      }
+   }
+
+   typedef void ( *ConvertFunction )( const uint8_t* src, size_t count, int channelCount, AVSampleFormat format, uint8_t* const* planes );
+
+   template <WavEncoding Encoding> ConvertFunction scalarConverter( bool bigEndian )
+   {
+      return bigEndian ? convertScalar<Encoding, true> : convertScalar<Encoding, false>;
+   }
+
+   ConvertFunction selectScalarConverter( WavEncoding encoding, bool bigEndian )
+   {
+      switch ( encoding )
+      {
+      case WavEncoding::Unsigned8:  return scalarConverter<WavEncoding::Unsigned8>( bigEndian );
+      case WavEncoding::Signed16:   return scalarConverter<WavEncoding::Signed16>( bigEndian );
+      case WavEncoding::Signed24:   return scalarConverter<WavEncoding::Signed24>( bigEndian );
+      case WavEncoding::Signed32:   return scalarConverter<WavEncoding::Signed32>( bigEndian );
+      case WavEncoding::Float32:    return scalarConverter<WavEncoding::Float32>( bigEndian );
+      case WavEncoding::Float64:    return scalarConverter<WavEncoding::Float64>( bigEndian );
+      }
+      return nullptr;
+   }
+
+#ifdef WAVUTIL_SSE2
+   // The common cases, for little-endian files (and, for 16-bit output, byte-swapped ones). Each
+   // returns how many frames it converted; the scalar loop does the rest.
+
+   size_t s16ToFltpSSE2( const uint8_t* src, size_t count, int channelCount, uint8_t* const* planes )
+   {
+      const __m128 scale = _mm_set1_ps( 1.0f / 32768.0f );
+      size_t i = 0;
+      if ( channelCount == 1 )
+      {
+         float* out = reinterpret_cast<float*>( planes[0] );
+         for ( ; i + 8 <= count; i += 8 )
+         {
+            __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>( src + i * 2 ) );
+            __m128i lo = _mm_srai_epi32( _mm_unpacklo_epi16( v, v ), 16 );
+            __m128i hi = _mm_srai_epi32( _mm_unpackhi_epi16( v, v ), 16 );
+            _mm_storeu_ps( out + i, _mm_mul_ps( _mm_cvtepi32_ps( lo ), scale ) );
+            _mm_storeu_ps( out + i + 4, _mm_mul_ps( _mm_cvtepi32_ps( hi ), scale ) );
+         }
+      }
+      else if ( channelCount == 2 )
+      {
+         // Each 32-bit lane holds one frame, left channel in the low half
+         float* left = reinterpret_cast<float*>( planes[0] );
+         float* right = reinterpret_cast<float*>( planes[1] );
+         for ( ; i + 4 <= count; i += 4 )
+         {
+            __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>( src + i * 4 ) );
+            __m128i l = _mm_srai_epi32( _mm_slli_epi32( v, 16 ), 16 );
+            __m128i r = _mm_srai_epi32( v, 16 );
+            _mm_storeu_ps( left + i, _mm_mul_ps( _mm_cvtepi32_ps( l ), scale ) );
+            _mm_storeu_ps( right + i, _mm_mul_ps( _mm_cvtepi32_ps( r ), scale ) );
+         }
+      }
+      return i;
+   }
+
+   size_t f32ToS16SSE2( const uint8_t* src, size_t count, int channelCount, uint8_t* const* planes )
+   {
+      const float* in = reinterpret_cast<const float*>( src );
+      int16_t* out = reinterpret_cast<int16_t*>( planes[0] );
+      const size_t sampleCount = count * channelCount;
+      const __m128 scale = _mm_set1_ps( 32768.0f );
+      const __m128 low = _mm_set1_ps( -32768.0f );
+      const __m128 high = _mm_set1_ps( 32767.0f );
+
+      // Clamping ahead of the conversion keeps large values from wrapping around; rounding is to
+      // nearest, as with lrintf
+      size_t i = 0;
+      for ( ; i + 8 <= sampleCount; i += 8 )
+      {
+         __m128 a = _mm_min_ps( _mm_max_ps( _mm_mul_ps( _mm_loadu_ps( in + i ), scale ), low ), high );
+         __m128 b = _mm_min_ps( _mm_max_ps( _mm_mul_ps( _mm_loadu_ps( in + i + 4 ), scale ), low ), high );
+         _mm_storeu_si128( reinterpret_cast<__m128i*>( out + i ), _mm_packs_epi32( _mm_cvtps_epi32( a ), _mm_cvtps_epi32( b ) ) );
+      }
+      return i / channelCount;
+   }
+
+   size_t f32ToFltpSSE2( const uint8_t* src, size_t count, int channelCount, uint8_t* const* planes )
+   {
+      const float* in = reinterpret_cast<const float*>( src );
+      if ( channelCount == 1 )
+      {
+         ::memcpy( planes[0], in, count * sizeof( float ) );
+         return count;
+      }
+
+      size_t i = 0;
+      if ( channelCount == 2 )
+      {
+         float* left = reinterpret_cast<float*>( planes[0] );
+         float* right = reinterpret_cast<float*>( planes[1] );
+         for ( ; i + 4 <= count; i += 4 )
+         {
+            __m128 a = _mm_loadu_ps( in + i * 2 );
+            __m128 b = _mm_loadu_ps( in + i * 2 + 4 );
+            _mm_storeu_ps( left + i, _mm_shuffle_ps( a, b, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+            _mm_storeu_ps( right + i, _mm_shuffle_ps( a, b, _MM_SHUFFLE( 3, 1, 3, 1 ) ) );
+         }
+      }
+      return i;
+   }
+
+   size_t swapS16SSE2( const uint8_t* src, size_t count, int channelCount, uint8_t* const* planes )
+   {
+      int16_t* out = reinterpret_cast<int16_t*>( planes[0] );
+      const size_t sampleCount = count * channelCount;
+      size_t i = 0;
+      for ( ; i + 8 <= sampleCount; i += 8 )
+      {
+         __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>( src + i * 2 ) );
+         _mm_storeu_si128( reinterpret_cast<__m128i*>( out + i ), _mm_or_si128( _mm_slli_epi16( v, 8 ), _mm_srli_epi16( v, 8 ) ) );
+      }
+      return i / channelCount;
+   }
+
+   size_t convertSSE2( WavEncoding encoding, bool bigEndian, const uint8_t* src, size_t count, int channelCount, AVSampleFormat format, uint8_t* const* planes )
+   {
+      if ( encoding == WavEncoding::Signed16 && format == AV_SAMPLE_FMT_S16 && bigEndian )
+         return swapS16SSE2( src, count, channelCount, planes );
+      if ( bigEndian )
+         return 0;
+
+      if ( encoding == WavEncoding::Signed16 && format == AV_SAMPLE_FMT_FLTP )
+         return s16ToFltpSSE2( src, count, channelCount, planes );
+      if ( encoding == WavEncoding::Float32 && format == AV_SAMPLE_FMT_S16 )
+         return f32ToS16SSE2( src, count, channelCount, planes );
+      if ( encoding == WavEncoding::Float32 && format == AV_SAMPLE_FMT_FLTP )
+         return f32ToFltpSSE2( src, count, channelCount, planes );
+      return 0;
+   }
+#endif
+
+   int wavBytesPerSample( WavEncoding encoding )
+   {
+      switch ( encoding )
+      {
+      case WavEncoding::Unsigned8:  return 1;
+      case WavEncoding::Signed16:   return 2;
+      case WavEncoding::Signed24:   return 3;
+      case WavEncoding::Signed32:   return 4;
+      case WavEncoding::Float32:    return 4;
+      case WavEncoding::Float64:    return 8;
+      }
+      return 0;
+   }
+
+   template <int Bytes> void storeLittleEndian( uint8_t* p, uint64_t value )
+   {
+      for ( int i = 0; i < Bytes; ++i )
+         p[i] = uint8_t( value >> ( 8 * i ) );
+   }
+
+   // Encodes one sample for the file from 16-bit or float, converting as swresample does
+   template <WavEncoding Encoding> struct SampleWriter;
+
+   template <> struct SampleWriter<WavEncoding::Unsigned8>
+   {
+      enum { Width = 1 };
+      static void fromS16( int16_t s, uint8_t* p ) { p[0] = uint8_t( ( s >> 8 ) + 0x80 ); }
+      static void fromFloat( float x, uint8_t* p ) { p[0] = uint8_t( roundClipped( x * 128.0, -128.0, 127.0 ) + 0x80 ); }
+   };
+
+   template <> struct SampleWriter<WavEncoding::Signed16>
+   {
+      enum { Width = 2 };
+      static void fromS16( int16_t s, uint8_t* p ) { storeLittleEndian<2>( p, uint16_t( s ) ); }
+      static void fromFloat( float x, uint8_t* p ) { storeLittleEndian<2>( p, uint16_t( floatToS16( x ) ) ); }
+   };
+
+   template <> struct SampleWriter<WavEncoding::Signed24>
+   {
+      enum { Width = 3 };
+      static void fromS16( int16_t s, uint8_t* p ) { storeLittleEndian<3>( p, uint32_t( s * 256 ) ); }
+      static void fromFloat( float x, uint8_t* p ) { storeLittleEndian<3>( p, uint64_t( roundClipped( x * 8388608.0, -8388608.0, 8388607.0 ) ) ); }
+   };
+
+   template <> struct SampleWriter<WavEncoding::Signed32>
+   {
+      enum { Width = 4 };
+      static void fromS16( int16_t s, uint8_t* p ) { storeLittleEndian<4>( p, uint32_t( s * 65536 ) ); }
+      static void fromFloat( float x, uint8_t* p ) { storeLittleEndian<4>( p, uint64_t( roundClipped( x * 2147483648.0, -2147483648.0, 2147483647.0 ) ) ); }
+   };
+
+   template <> struct SampleWriter<WavEncoding::Float32>
+   {
+      enum { Width = 4 };
+      static void fromS16( int16_t s, uint8_t* p ) { fromFloat( s * ( 1.0f / 32768.0f ), p ); }
+      static void fromFloat( float x, uint8_t* p )
+      {
+         uint32_t bits;
+         ::memcpy( &bits, &x, sizeof( bits ) );
+         storeLittleEndian<4>( p, bits );
+      }
+   };
+
+   template <> struct SampleWriter<WavEncoding::Float64>
+   {
+      enum { Width = 8 };
+      static void fromS16( int16_t s, uint8_t* p ) { fromDouble( s * ( 1.0 / 32768.0 ), p ); }
+      static void fromFloat( float x, uint8_t* p ) { fromDouble( x, p ); }
+      static void fromDouble( double x, uint8_t* p )
+      {
+         uint64_t bits;
+         ::memcpy( &bits, &x, sizeof( bits ) );
+         storeLittleEndian<8>( p, bits );
+      }
+   };
+
+   typedef void ( *S16Encoder )( const int16_t* samples, size_t sampleCount, uint8_t* dst );
+   typedef void ( *FloatEncoder )( const float* const* planes, size_t first, size_t count, int channelCount, uint8_t* dst );
+
+   template <WavEncoding Encoding>
+   void encodeS16( const int16_t* samples, size_t sampleCount, uint8_t* dst )
+   {
+      for ( size_t i = 0; i < sampleCount; ++i, dst += SampleWriter<Encoding>::Width )
+         SampleWriter<Encoding>::fromS16( samples[i], dst );
+   }
+
+   // Interleaves as it goes
+   template <WavEncoding Encoding>
+   void encodePlanarFloat( const float* const* planes, size_t first, size_t count, int channelCount, uint8_t* dst )
+   {
+      for ( size_t i = first; i < first + count; ++i )
+      {
+         for ( int ch = 0; ch < channelCount; ++ch, dst += SampleWriter<Encoding>::Width )
+            SampleWriter<Encoding>::fromFloat( planes[ch][i], dst );
+      }
+   }
+
+   S16Encoder selectS16Encoder( WavEncoding encoding )
+   {
+      switch ( encoding )
+      {
+      case WavEncoding::Unsigned8:  return encodeS16<WavEncoding::Unsigned8>;
+      case WavEncoding::Signed16:   return encodeS16<WavEncoding::Signed16>;
+      case WavEncoding::Signed24:   return encodeS16<WavEncoding::Signed24>;
+      case WavEncoding::Signed32:   return encodeS16<WavEncoding::Signed32>;
+      case WavEncoding::Float32:    return encodeS16<WavEncoding::Float32>;
+      case WavEncoding::Float64:    return encodeS16<WavEncoding::Float64>;
+      }
+      return nullptr;
+   }
+
+   FloatEncoder selectFloatEncoder( WavEncoding encoding )
+   {
+      switch ( encoding )
+      {
+      case WavEncoding::Unsigned8:  return encodePlanarFloat<WavEncoding::Unsigned8>;
+      case WavEncoding::Signed16:   return encodePlanarFloat<WavEncoding::Signed16>;
+      case WavEncoding::Signed24:   return encodePlanarFloat<WavEncoding::Signed24>;
+      case WavEncoding::Signed32:   return encodePlanarFloat<WavEncoding::Signed32>;
+      case WavEncoding::Float32:    return encodePlanarFloat<WavEncoding::Float32>;
+      case WavEncoding::Float64:    return encodePlanarFloat<WavEncoding::Float64>;
+      }
+      return nullptr;
+   }
+
+#ifdef WAVUTIL_SSE2
+   // Planar float to interleaved 16-bit for mono and stereo; returns how many frames it converted
+   size_t encodePlanarFloatS16SSE2( const float* const* planes, size_t first, size_t count, int channelCount, uint8_t* dst )
+   {
+      const __m128 scale = _mm_set1_ps( 32768.0f );
+      const __m128 low = _mm_set1_ps( -32768.0f );
+      const __m128 high = _mm_set1_ps( 32767.0f );
+      auto toInt32 = [&]( const float* p )
+      {
+         return _mm_cvtps_epi32( _mm_min_ps( _mm_max_ps( _mm_mul_ps( _mm_loadu_ps( p ), scale ), low ), high ) );
+      };
+
+      int16_t* out = reinterpret_cast<int16_t*>( dst );
+      size_t i = 0;
+      if ( channelCount == 1 )
+      {
+         const float* in = planes[0] + first;
+         for ( ; i + 8 <= count; i += 8 )
+            _mm_storeu_si128( reinterpret_cast<__m128i*>( out + i ), _mm_packs_epi32( toInt32( in + i ), toInt32( in + i + 4 ) ) );
+      }
+      else if ( channelCount == 2 )
+      {
+         const float* left = planes[0] + first;
+         const float* right = planes[1] + first;
+         for ( ; i + 4 <= count; i += 4 )
+         {
+            __m128i l = toInt32( left + i );
+            __m128i r = toInt32( right + i );
+            _mm_storeu_si128( reinterpret_cast<__m128i*>( out + i * 2 ), _mm_packs_epi32( _mm_unpacklo_epi32( l, r ), _mm_unpackhi_epi32( l, r ) ) );
+         }
+      }
+      return i;
+   }
+#endif
+
+   // Big enough that each write is a large sequential one
+   const size_t WavWriterBufferBytes = 4 << 20;
+
+   // A RIFF chunk of this size takes the place of the ds64 chunk in files that don't need one
+   const uint32_t Ds64ChunkSize = 28;
+}
+
+WavReader::WavReader()
+   : _data( nullptr )
+   , _frameCount( 0 )
+   , _channelCount( 0 )
+   , _sampleRate( 0 )
+   , _encoding( WavEncoding::Signed16 )
+   , _bytesPerSample( 0 )
+   , _bigEndian( false )
+{
+
+}
+
+WavReader::~WavReader()
 {
-   WAVHeader() {}
-   WAVHeader( int fileLength, int numChannels, int rate )
-      : sampleRate( rate )
+   close();
+}
+
+bool WavReader::open( const std::string& path )
+{
+   close();
+
+   if ( !_mapping.open( path ) )
+      return false;
+
+   if ( !parse() )
+   {
+      close();
+      return false;
+   }
+   return true;
+}
+
+void WavReader::close()
+{
+   _mapping.close();
+   _data = nullptr;
+   _frameCount = 0;
+   _channelCount = 0;
+   _sampleRate = 0;
+   _encoding = WavEncoding::Signed16;
+   _bytesPerSample = 0;
+   _bigEndian = false;
+}
+
+bool WavReader::nativeByteOrder() const
+{
+   return _bigEndian == hostIsBigEndian();
+}
+
+bool WavReader::parse()
+{
+   const uint8_t* file = _mapping.data();
+   const uint64_t size = _mapping.size();
+   if ( size < 12 || ::memcmp( file + 8, "WAVE", 4 ) != 0 )
+      return false;
+
+   // RF64 and BW64 keep the sizes that don't fit in 32 bits in a ds64 chunk ahead of the others,
+   // and set the ones in the chunk headers to 0xFFFFFFFF
+   bool sizesIn64 = false;
+   if ( ::memcmp( file, "RIFX", 4 ) == 0 )
+      _bigEndian = true;
+   else if ( ::memcmp( file, "RF64", 4 ) == 0 || ::memcmp( file, "BW64", 4 ) == 0 )
+      sizesIn64 = true;
+   else if ( ::memcmp( file, "RIFF", 4 ) != 0 )
+      return false;
+
+   uint64_t dataSize64 = 0;
+   bool haveFormat = false;
+   for ( uint64_t pos = 12; pos + 8 <= size; )
    {
-      SetFileLength( fileLength );
-      channels = numChannels;
-      compressionCode = 1;
-      bitsPerSample = 16;
-      blockAlign = bitsPerSample * channels / 8;
-      bytesPerSecond = sampleRate * blockAlign;
+      const uint8_t* chunk = file + pos;
+      const uint8_t* body = chunk + 8;
+      const uint64_t available = size - pos - 8;
+      uint64_t chunkSize = read32( chunk + 4, _bigEndian );
+
+      if ( ::memcmp( chunk, "ds64", 4 ) == 0 && sizesIn64 && chunkSize >= 24 && available >= 24 )
+      {
+         dataSize64 = read64( body + 8, false );
+      }
+      else if ( ::memcmp( chunk, "fmt ", 4 ) == 0 )
+      {
+         if ( chunkSize > available || !parseFormat( body, chunkSize ) )
+            return false;
+         haveFormat = true;
+      }
+      else if ( ::memcmp( chunk, "data", 4 ) == 0 )
+      {
+         if ( !haveFormat )
+            return false;
+         if ( sizesIn64 && chunkSize == 0xFFFFFFFF )
+            chunkSize = ( dataSize64 != 0 ) ? dataSize64 : available;
+
+         // Files still being written, or cut short, hold less than their headers say
+         _data = body;
+         _frameCount = size_t( std::min( chunkSize, available ) / ( uint64_t( _channelCount ) * _bytesPerSample ) );
+         return true;
+      }
+
+      if ( chunkSize > available )
+         return false;
+      pos += 8 + chunkSize + ( chunkSize & 1 );
    }
-   void SetFileLength( int fileLength )
+   return false;
+}
+
+bool WavReader::parseFormat( const uint8_t* chunk, uint64_t size )
+{
+   if ( size < 16 )
+      return false;
+
+   unsigned formatTag = read16( chunk, _bigEndian );
+   const int channelCount = read16( chunk + 2, _bigEndian );
+   const uint32_t sampleRate = read32( chunk + 4, _bigEndian );
+   const int blockAlign = read16( chunk + 12, _bigEndian );
+   const int bitsPerSample = read16( chunk + 14, _bigEndian );
+
+   // WAVE_FORMAT_EXTENSIBLE has the actual format tag at the start of its SubFormat GUID, and
+   // bitsPerSample is the container size, whatever the number of valid bits within it
+   if ( formatTag == 0xFFFE )
    {
-      lenMinus8 = fileLength - 8;
-      dataChunkSize = fileLength - 44;
+      if ( size < 40 )
+         return false;
+      formatTag = read32( chunk + 24, _bigEndian ) & 0xFFFF;
    }
 
-   char riff[4] = { 'R', 'I', 'F', 'F' };
-   int lenMinus8;
-   char wave[4] = { 'W', 'A', 'V', 'E' };
-   char fmt[4] = { 'f', 'm', 't', ' ' };
-   int fmtChunkSize = 16;
-   short compressionCode = 1;
-   short channels = 2;
-   int sampleRate = 44100;
-   int bytesPerSecond;
-   short blockAlign;
-   short bitsPerSample = 16;
-   char data[4] = { 'd', 'a', 't', 'a' };
-   int dataChunkSize;
-};
+   if ( channelCount == 0 || sampleRate == 0 || sampleRate > INT_MAX || bitsPerSample % 8 != 0 || blockAlign != channelCount * bitsPerSample / 8 )
+      return false;
+
+   const int WaveFormatPcm = 1, WaveFormatIeeeFloat = 3;
+   if ( formatTag == WaveFormatPcm && bitsPerSample == 8 )
+      _encoding = WavEncoding::Unsigned8;
+   else if ( formatTag == WaveFormatPcm && bitsPerSample == 16 )
+      _encoding = WavEncoding::Signed16;
+   else if ( formatTag == WaveFormatPcm && bitsPerSample == 24 )
+      _encoding = WavEncoding::Signed24;
+   else if ( formatTag == WaveFormatPcm && bitsPerSample == 32 )
+      _encoding = WavEncoding::Signed32;
+   else if ( formatTag == WaveFormatIeeeFloat && bitsPerSample == 32 )
+      _encoding = WavEncoding::Float32;
+   else if ( formatTag == WaveFormatIeeeFloat && bitsPerSample == 64 )
+      _encoding = WavEncoding::Float64;
+   else
+      return false;
+
+   _channelCount = channelCount;
+   _sampleRate = int( sampleRate );
+   _bytesPerSample = bitsPerSample / 8;
+   return true;
+}
 
-class WAVFileWriter
+bool WavReader::convert( size_t first, size_t count, AVSampleFormat format, uint8_t* const* planes ) const
 {
-public:
-   WAVFileWriter( const std::string& filename, int numChannels, int rate )
-      : _File( filename, std::ofstream::binary )
-      , _WavHeader( 0, numChannels, rate )
+   if ( !isOpen() || first > _frameCount || count > _frameCount - first )
+      return false;
+   if ( format != AV_SAMPLE_FMT_S16 && format != AV_SAMPLE_FMT_FLTP )
+      return false;
+
+   const size_t frameBytes = size_t( _channelCount ) * _bytesPerSample;
+   const uint8_t* src = _data + first * frameBytes;
+
+   size_t done = 0;
+#ifdef WAVUTIL_SSE2
+   done = convertSSE2( _encoding, _bigEndian, src, count, _channelCount, format, planes );
+#endif
+   if ( done == count )
+      return true;
+
+   std::vector<uint8_t*> rest;
+   if ( format == AV_SAMPLE_FMT_S16 )
    {
-      static_assert( sizeof( _WavHeader ) == 44, "_WavHeader size is not correct" );
-      _File.write( (const char*)&_WavHeader, sizeof( _WavHeader ) );
+      rest.push_back( planes[0] + done * _channelCount * sizeof( int16_t ) );
    }
-   ~WAVFileWriter()
+   else
+   {
+      for ( int ch = 0; ch < _channelCount; ++ch )
+         rest.push_back( planes[ch] + done * sizeof( float ) );
+   }
+   selectScalarConverter( _encoding, _bigEndian )( src + done * frameBytes, count - done, _channelCount, format, rest.data() );
+   return true;
+}
+
+WavWriter::WavWriter()
+   : _open( false )
+   , _failed( false )
+   , _frameBytes( 0 )
+   , _headerSize( 0 )
+   , _framesWritten( 0 )
+   , _mappedFrames( 0 )
+   , _buffered( 0 )
+{
+
+}
+
+WavWriter::~WavWriter()
+{
+   finish();
+}
+
+bool WavWriter::open( const std::string& path, const Format& format, uint64_t frameCount/*=0*/ )
+{
+   finish();
+
+   if ( format.channelCount <= 0 || format.channelCount > 0xFFFF || format.sampleRate <= 0 )
+      return false;
+
+   _format = format;
+   _path = path;
+   _failed = false;
+   _frameBytes = size_t( format.channelCount ) * wavBytesPerSample( format.encoding );
+   _framesWritten = 0;
+   _mappedFrames = 0;
+   _buffered = 0;
+
+   const std::vector<uint8_t> header = makeHeader( false );
+   _headerSize = header.size();
+
+   // One byte to spare for the pad that follows a data chunk of odd length
+   const uint64_t mappedSize = _headerSize + frameCount * _frameBytes + 1;
+   if ( frameCount > 0 && frameCount < ( SIZE_MAX - _headerSize - 1 ) / _frameBytes && _mapping.create( path, size_t( mappedSize ) ) )
    {
-      std::streampos fileLen = _File.tellp();
-      _File.seekp( 0 );
-      WAVHeader hdr = _WavHeader;
-      hdr.SetFileLength( (int)fileLen );
-      _File.write( (const char*)&hdr, sizeof( hdr ) ); // overwrite header with real data
+      ::memcpy( _mapping.writableData(), header.data(), header.size() );
+      _mappedFrames = frameCount;
    }
-   void WriteSample( int16_t x )
+   else
    {
-      _File.write( (const char *)&x, 2 );
+      _stream.open( path, std::ios::out | std::ios::binary | std::ios::trunc );
+      _stream.write( (const char*)header.data(), std::streamsize( header.size() ) );
+      if ( !_stream )
+      {
+         _stream.close();
+         return false;
+      }
+      _buffer.resize( std::max( WavWriterBufferBytes, _frameBytes ) );
    }
 
-protected:
-   std::ofstream  _File;
-   WAVHeader      _WavHeader;
-};
+   _open = true;
+   return true;
+}
 
-bool WriteWav( const std::string& path, const std::vector< std::vector<int16_t> >& data, int rate )
+bool WavWriter::write( const uint8_t* frames, size_t frameCount )
+{
+   // Spans larger than the buffer go straight to the file
+   if ( _open && !_failed && !_mapping.isOpen() && frameCount * _frameBytes >= _buffer.size() )
+   {
+      if ( !flushBuffer() )
+         return false;
+
+      _stream.write( (const char*)frames, std::streamsize( frameCount * _frameBytes ) );
+      if ( !_stream )
+      {
+         _failed = true;
+         return false;
+      }
+      _framesWritten += frameCount;
+      return true;
+   }
+
+   const size_t frameBytes = _frameBytes;
+   return writeFrames( frameCount, [frames, frameBytes]( size_t first, size_t count, uint8_t* dst )
+   {
+      ::memcpy( dst, frames + first * frameBytes, count * frameBytes );
+   } );
+}
+
+bool WavWriter::write( const int16_t* frames, size_t frameCount )
+{
+   if ( _format.encoding == WavEncoding::Signed16 && !hostIsBigEndian() )
+      return write( reinterpret_cast<const uint8_t*>( frames ), frameCount );
+
+   const S16Encoder encode = selectS16Encoder( _format.encoding );
+   const size_t channelCount = size_t( _format.channelCount );
+   return writeFrames( frameCount, [frames, encode, channelCount]( size_t first, size_t count, uint8_t* dst )
+   {
+      encode( frames + first * channelCount, count * channelCount, dst );
+   } );
+}
+
+bool WavWriter::write( const float* const* planes, size_t frameCount )
 {
-   WAVFileWriter writer( path, 2, rate );
-   std::vector<int16_t>::size_type n = data[0].size();
-   for ( std::vector<int16_t>::size_type i = 0; i < n; ++i )
+   const FloatEncoder encode = selectFloatEncoder( _format.encoding );
+   const WavEncoding encoding = _format.encoding;
+   const int channelCount = _format.channelCount;
+   const size_t frameBytes = _frameBytes;
+   return writeFrames( frameCount, [planes, encode, encoding, channelCount, frameBytes]( size_t first, size_t count, uint8_t* dst )
    {
-      writer.WriteSample( data[0][i] );
-      writer.WriteSample( data[1][i] );
+      size_t done = 0;
+#ifdef WAVUTIL_SSE2
+      if ( encoding == WavEncoding::Signed16 )
+         done = encodePlanarFloatS16SSE2( planes, first, count, channelCount, dst );
+#else
+      (void)encoding;
+#endif
+      encode( planes, first + done, count - done, channelCount, dst + done * frameBytes );
+   } );
+}
+
+bool WavWriter::writeFrames( size_t frameCount, const std::function< void( size_t, size_t, uint8_t* ) >& convert )
+{
+   if ( !_open || _failed )
+      return false;
+
+   size_t done = 0;
+   if ( _mapping.isOpen() )
+   {
+      done = size_t( std::min<uint64_t>( frameCount, _mappedFrames - _framesWritten ) );
+      convert( 0, done, _mapping.writableData() + _headerSize + size_t( _framesWritten ) * _frameBytes );
+      _framesWritten += done;
+      if ( done == frameCount )
+         return true;
+
+      // Past the length given up front, the rest goes through the buffer
+      if ( !switchToStream() )
+      {
+         _failed = true;
+         return false;
+      }
    }
 
+   while ( done < frameCount )
+   {
+      size_t room = ( _buffer.size() - _buffered ) / _frameBytes;
+      if ( room == 0 )
+      {
+         if ( !flushBuffer() )
+            return false;
+         room = _buffer.size() / _frameBytes;
+      }
+
+      const size_t count = std::min( room, frameCount - done );
+      convert( done, count, _buffer.data() + _buffered );
+      _buffered += count * _frameBytes;
+      _framesWritten += count;
+      done += count;
+   }
    return true;
 }
 
+bool WavWriter::flushBuffer()
+{
+   if ( _buffered > 0 )
+      _stream.write( (const char*)_buffer.data(), std::streamsize( _buffered ) );
+   _buffered = 0;
+
+   if ( !_stream )
+      _failed = true;
+   return !_failed;
+}
+
+bool WavWriter::switchToStream()
+{
+   if ( !_mapping.closeTruncated( size_t( _headerSize + _framesWritten * _frameBytes ) ) )
+      return false;
+
+   _stream.open( _path, std::ios::in | std::ios::out | std::ios::binary );
+   _stream.seekp( 0, std::ios::end );
+   _buffer.resize( std::max( WavWriterBufferBytes, _frameBytes ) );
+   return bool( _stream );
+}
+
+bool WavWriter::finish()
+{
+   if ( !_open )
+      return false;
+   _open = false;
+
+   const uint64_t dataBytes = _framesWritten * _frameBytes;
+   const bool padded = ( dataBytes & 1 ) != 0;
+   const std::vector<uint8_t> header = makeHeader( true );
+
+   bool ok = !_failed;
+   if ( _mapping.isOpen() )
+   {
+      uint8_t* file = _mapping.writableData();
+      ::memcpy( file, header.data(), header.size() );
+      if ( padded )
+         file[_headerSize + dataBytes] = 0;
+      ok = _mapping.closeTruncated( size_t( _headerSize + dataBytes + ( padded ? 1 : 0 ) ) ) && ok;
+   }
+   else
+   {
+      ok = flushBuffer() && ok;
+      if ( padded )
+         _stream.put( 0 );
+      _stream.seekp( 0 );
+      _stream.write( (const char*)header.data(), std::streamsize( header.size() ) );
+      ok = bool( _stream ) && ok;
+      _stream.close();
+      ok = !_stream.fail() && ok;
+   }
+
+   std::vector<uint8_t>().swap( _buffer );
+   return ok;
+}
+
+// Lengths are left at 0xFFFFFFFF until the file is finished, which is also what streamed files
+// have, so readers of a file still being written take the data to run to the end
+std::vector<uint8_t> WavWriter::makeHeader( bool final ) const
+{
+   const int channelCount = _format.channelCount;
+   const int bytesPerSample = wavBytesPerSample( _format.encoding );
+   const bool isFloat = ( _format.encoding == WavEncoding::Float32 || _format.encoding == WavEncoding::Float64 );
+   const bool extensible = ( channelCount > 2 || ( bytesPerSample > 2 && !isFloat ) );
+   const uint32_t formatSize = extensible ? 40 : ( isFloat ? 18 : 16 );
+
+   const uint64_t headerSize = 12 + 8 + Ds64ChunkSize + 8 + formatSize + 8;
+   const uint64_t dataBytes = final ? _framesWritten * _frameBytes : 0;
+   const uint64_t riffSize = headerSize - 8 + dataBytes + ( dataBytes & 1 );
+   const bool sizesIn64 = ( _format.container != Container::Auto || riffSize > 0xFFFFFFFF );
+
+   std::vector<uint8_t> header;
+   header.reserve( size_t( headerSize ) );
+   auto putId = [&header]( const char* id ) { header.insert( header.end(), id, id + 4 ); };
+   auto put = [&header]( uint64_t value, int bytes )
+   {
+      for ( int i = 0; i < bytes; ++i )
+         header.push_back( uint8_t( value >> ( 8 * i ) ) );
+   };
+
+   putId( ( _format.container == Container::BW64 ) ? "BW64" : sizesIn64 ? "RF64" : "RIFF" );
+   put( ( final && !sizesIn64 ) ? riffSize : 0xFFFFFFFF, 4 );
+   putId( "WAVE" );
+
+   putId( sizesIn64 ? "ds64" : "JUNK" );
+   put( Ds64ChunkSize, 4 );
+   put( ( final && sizesIn64 ) ? riffSize : 0, 8 );
+   put( ( final && sizesIn64 ) ? dataBytes : 0, 8 );
+   put( ( final && sizesIn64 ) ? _framesWritten : 0, 8 );
+   put( 0, 4 );   // no table of other chunk sizes
+
+   putId( "fmt " );
+   put( formatSize, 4 );
+   put( extensible ? 0xFFFE : isFloat ? 3 : 1, 2 );
+   put( channelCount, 2 );
+   put( _format.sampleRate, 4 );
+   put( uint64_t( _format.sampleRate ) * _frameBytes, 4 );
+   put( _frameBytes, 2 );
+   put( bytesPerSample * 8, 2 );
+   if ( formatSize > 16 )
+      put( formatSize - 18, 2 );
+   if ( extensible )
+   {
+      // FFmpeg's default layouts use the same bits as WAVE speaker positions
+      static const uint8_t subFormatTail[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 };
+      put( bytesPerSample * 8, 2 );
+      put( uint64_t( ::av_get_default_channel_layout( channelCount ) ) & 0x3FFFF, 4 );
+      put( isFloat ? 3 : 1, 2 );
+      header.insert( header.end(), subFormatTail, subFormatTail + sizeof( subFormatTail ) );
+   }
+
+   putId( "data" );
+   put( ( final && !sizesIn64 ) ? dataBytes : 0xFFFFFFFF, 4 );
+   return header;
+}
+
+bool WriteWav( const std::string& path, const std::vector< std::vector<int16_t> >& data, int rate )
+{
+   if ( data.empty() )
+      return false;
+
+   WavWriter::Format format;
+   format.channelCount = int( data.size() );
+   format.sampleRate = rate;
+
+   size_t frameCount = data[0].size();
+   std::vector<const uint8_t*> planes;
+   for ( const auto& channel : data )
+   {
+      frameCount = std::min( frameCount, channel.size() );
+      planes.push_back( (const uint8_t*)channel.data() );
+   }
+
+   WavWriter writer;
+   if ( !writer.open( path, format, frameCount ) )
+      return false;
+
+   // Interleaved a chunk at a time on the way out
+   const size_t ChunkFrames = 65536;
+   const InterleaveKernel interleave = selectInterleaveKernel( sizeof( int16_t ), format.channelCount );
+   std::vector<int16_t> chunk( ChunkFrames * data.size() );
+   for ( size_t offset = 0; offset < frameCount; offset += ChunkFrames )
+   {
+      const size_t count = std::min( ChunkFrames, frameCount - offset );
+      interleave( planes.data(), offset, count, format.channelCount, (uint8_t*)chunk.data() );
+      if ( !writer.write( chunk.data(), count ) )
+         return false;
+   }
+
+   return writer.finish();
+}
+
 bool WriteWav( const std::string& path, const std::vector<int16_t>& data, int rate )
 {
-   WAVFileWriter writer( path, 2, rate );
-   for ( auto sample : data )
-      writer.WriteSample( sample );
+   WavWriter::Format format;
+   format.sampleRate = rate;
 
-   return true;
+   const size_t frameCount = data.size() / 2;
+   WavWriter writer;
+   return writer.open( path, format, frameCount ) && writer.write( data.data(), frameCount ) && writer.finish();
 }
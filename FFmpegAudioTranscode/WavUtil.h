@@ -1,10 +1,129 @@
 #pragma once
 
 #include "AudioParams.h"
+#include "MappedFile.h"
 
 #include <cstdint>
+#include <fstream>
+#include <functional>
 #include <string>
 #include <vector>
 
+// 16-bit WAV from one vector per channel, or from interleaved stereo
 extern bool WriteWav( const std::string& path, const std::vector< std::vector<int16_t> >& data, int rate );
 extern bool WriteWav( const std::string& path, const std::vector<int16_t>& data, int rate );
+
+// How a WAV file's samples are stored, each in bytesPerSample() bytes
+enum class WavEncoding { Unsigned8, Signed16, Signed24, Signed32, Float32, Float64 };
+
+// Native reader for uncompressed PCM and IEEE float WAV files: RIFF/WAVE, its big-endian twin
+// RIFX, and RF64/BW64 for data past 4 GB, with either a plain or a WAVE_FORMAT_EXTENSIBLE format
+// chunk. The file is memory mapped and the samples left where they lie, so they're only read
+// from disk as they're touched. Anything else (compressed formats, odd sample sizes, truncated
+// headers) fails to open, and is left to FFmpeg.
+class WavReader
+{
+public:
+   WavReader();
+   virtual ~WavReader();
+
+   WavReader( const WavReader& ) = delete;
+   WavReader& operator=( const WavReader& ) = delete;
+
+   bool open( const std::string& path );
+   void close();
+
+   bool isOpen() const { return _data != nullptr; }
+
+   int channelCount() const { return _channelCount; }
+   int sampleRate() const { return _sampleRate; }
+   WavEncoding encoding() const { return _encoding; }
+   int bytesPerSample() const { return _bytesPerSample; }
+   bool bigEndian() const { return _bigEndian; }
+   bool nativeByteOrder() const;
+
+   // Interleaved frames, frameCount() of them, within the mapping
+   const uint8_t* data() const { return _data; }
+   size_t frameCount() const { return _frameCount; }
+
+   // Converts frames [first, first + count) to interleaved 16-bit (AV_SAMPLE_FMT_S16, one plane)
+   // or per-channel float (AV_SAMPLE_FMT_FLTP, a plane per channel) in native byte order, in a
+   // single pass and with the same scaling and rounding FFmpeg's decoders and swresample use
+   bool convert( size_t first, size_t count, AVSampleFormat format, uint8_t* const* planes ) const;
+
+protected:
+   bool parse();
+   bool parseFormat( const uint8_t* chunk, uint64_t size );
+
+   MappedFile     _mapping;
+   const uint8_t* _data;
+   size_t         _frameCount;
+   int            _channelCount;
+   int            _sampleRate;
+   WavEncoding    _encoding;
+   int            _bytesPerSample;
+   bool           _bigEndian;
+};
+
+// Writes WAV files a span of frames at a time, converting from 16-bit or float samples to any of
+// the encodings WavReader reads. Given the final length up front, frames go straight into a
+// memory mapping of the file, preallocated at that size; otherwise, or past that length, they go
+// through a large buffer. The header keeps room for a ds64 chunk, so a file that outgrows what a
+// RIFF header can describe (4 GB) is finished as RF64 rather than having its lengths wrap.
+class WavWriter
+{
+public:
+   // Auto writes RIFF, switching to RF64 only if the file turns out too large for it
+   enum class Container { Auto, RF64, BW64 };
+
+   struct Format
+   {
+      int         channelCount = 2;
+      int         sampleRate = 44100;
+      WavEncoding encoding = WavEncoding::Signed16;
+      Container   container = Container::Auto;
+   };
+
+   WavWriter();
+   virtual ~WavWriter();   // finishes the file if that hasn't been done
+
+   WavWriter( const WavWriter& ) = delete;
+   WavWriter& operator=( const WavWriter& ) = delete;
+
+   // A nonzero frameCount maps the file at that length
+   bool open( const std::string& path, const Format& format, uint64_t frameCount = 0 );
+
+   // Interleaved frames already in the file's encoding, little-endian
+   bool write( const uint8_t* frames, size_t frameCount );
+
+   // Interleaved 16-bit frames, or one plane of float samples per channel
+   bool write( const int16_t* frames, size_t frameCount );
+   bool write( const float* const* planes, size_t frameCount );
+
+   // Fills in the header's lengths and closes the file
+   bool finish();
+
+   bool isOpen() const { return _open; }
+   const Format& format() const { return _format; }
+   uint64_t framesWritten() const { return _framesWritten; }
+
+protected:
+   // Hands 'convert' room for the next frames, as many at a time as fit: (first frame, frame count, destination)
+   bool writeFrames( size_t frameCount, const std::function< void( size_t, size_t, uint8_t* ) >& convert );
+   bool flushBuffer();
+   bool switchToStream();
+   std::vector<uint8_t> makeHeader( bool final ) const;
+
+   Format               _format;
+   std::string          _path;
+   bool                 _open;
+   bool                 _failed;
+   size_t               _frameBytes;
+   size_t               _headerSize;
+   uint64_t             _framesWritten;
+   MappedFile           _mapping;
+   uint64_t             _mappedFrames;
+   std::fstream         _stream;
+   std::vector<uint8_t> _buffer;
+   size_t               _buffered;
+};
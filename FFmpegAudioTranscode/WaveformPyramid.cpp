@@ -0,0 +1,404 @@
+#include "stdafx.h"
+
+#include "WaveformPyramid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#if defined( _M_X64 ) || defined( __x86_64__ )
+#define WAVEFORM_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+   const char Magic[8] = { 'F', 'A', 'T', 'W', 'A', 'V', '0', '1' };
+
+   struct SidecarHeader
+   {
+      char     magic[8];
+      uint32_t channelCount;
+      uint32_t baseBlockSize;
+      uint64_t frameCount;
+      uint32_t levelCount;
+      uint32_t reserved;
+   };
+
+   struct SidecarEntry
+   {
+      int16_t  min;
+      int16_t  max;
+      uint16_t rms;
+   };
+
+   const float  S16Scale = 1.0f / 32768.0f;
+   const double S16SquareScale = 1.0 / ( 32768.0 * 32768.0 );
+
+   int16_t quantize( float value )
+   {
+      return int16_t( std::lround( std::min( std::max( value, -1.0f ), 1.0f ) * 32767.0f ) );
+   }
+
+   // Per-channel minimum, maximum and sum of squares of the 16-bit samples, as integers
+   struct S16Stats
+   {
+      int     min;
+      int     max;
+      int64_t sumSquares;
+   };
+
+   void reduceS16Scalar( const int16_t* samples, size_t sampleCount, int channelCount, S16Stats* stats )
+   {
+      for ( size_t i = 0; i < sampleCount; ++i )
+      {
+         S16Stats& s = stats[i % channelCount];
+         const int value = samples[i];
+         s.min = std::min( s.min, value );
+         s.max = std::max( s.max, value );
+         s.sumSquares += value * value;
+      }
+   }
+
+   void reduceS16( const int16_t* samples, size_t frameCount, int channelCount, S16Stats* stats )
+   {
+      const size_t sampleCount = frameCount * channelCount;
+      size_t i = 0;
+
+#ifdef WAVEFORM_SSE2
+      // Eight samples per vector, so lanes map onto channels for mono and stereo: all lanes are the
+      // one channel, or even lanes are left and odd lanes right. Squares go to 64-bit lanes,
+      // which alternate the same way.
+      if ( channelCount <= 2 && sampleCount >= 8 )
+      {
+         const __m128i zero = _mm_setzero_si128();
+         __m128i vmin = _mm_set1_epi16( 32767 );
+         __m128i vmax = _mm_set1_epi16( -32768 );
+         __m128i vsum = zero;
+         for ( ; i + 8 <= sampleCount; i += 8 )
+         {
+            __m128i v = _mm_loadu_si128( reinterpret_cast<const __m128i*>( samples + i ) );
+            vmin = _mm_min_epi16( vmin, v );
+            vmax = _mm_max_epi16( vmax, v );
+
+            // Squares are never negative and fit 32 bits, so they're widened with zeroes
+            __m128i lo = _mm_mullo_epi16( v, v );
+            __m128i hi = _mm_mulhi_epi16( v, v );
+            __m128i squares0 = _mm_unpacklo_epi16( lo, hi );
+            __m128i squares1 = _mm_unpackhi_epi16( lo, hi );
+            vsum = _mm_add_epi64( vsum, _mm_unpacklo_epi32( squares0, zero ) );
+            vsum = _mm_add_epi64( vsum, _mm_unpackhi_epi32( squares0, zero ) );
+            vsum = _mm_add_epi64( vsum, _mm_unpacklo_epi32( squares1, zero ) );
+            vsum = _mm_add_epi64( vsum, _mm_unpackhi_epi32( squares1, zero ) );
+         }
+
+         int16_t mins[8], maxs[8];
+         int64_t sums[2];
+         _mm_storeu_si128( reinterpret_cast<__m128i*>( mins ), vmin );
+         _mm_storeu_si128( reinterpret_cast<__m128i*>( maxs ), vmax );
+         _mm_storeu_si128( reinterpret_cast<__m128i*>( sums ), vsum );
+         for ( int lane = 0; lane < 8; ++lane )
+         {
+            S16Stats& s = stats[lane % channelCount];
+            s.min = std::min<int>( s.min, mins[lane] );
+            s.max = std::max<int>( s.max, maxs[lane] );
+         }
+         for ( int lane = 0; lane < 2; ++lane )
+            stats[lane % channelCount].sumSquares += sums[lane];
+      }
+#endif
+
+      // Vectors always hold whole frames, so the tail starts on channel 0
+      reduceS16Scalar( samples + i, sampleCount - i, channelCount, stats );
+   }
+
+   void reduceFloat( const float* samples, size_t count, float& min, float& max, double& sumSquares )
+   {
+      size_t i = 0;
+
+#ifdef WAVEFORM_SSE2
+      if ( count >= 4 )
+      {
+         __m128 vmin = _mm_set1_ps( min );
+         __m128 vmax = _mm_set1_ps( max );
+         __m128 vsum = _mm_setzero_ps();
+         for ( ; i + 4 <= count; i += 4 )
+         {
+            __m128 v = _mm_loadu_ps( samples + i );
+            vmin = _mm_min_ps( vmin, v );
+            vmax = _mm_max_ps( vmax, v );
+            vsum = _mm_add_ps( vsum, _mm_mul_ps( v, v ) );
+         }
+
+         float mins[4], maxs[4], sums[4];
+         _mm_storeu_ps( mins, vmin );
+         _mm_storeu_ps( maxs, vmax );
+         _mm_storeu_ps( sums, vsum );
+         for ( int lane = 0; lane < 4; ++lane )
+         {
+            min = std::min( min, mins[lane] );
+            max = std::max( max, maxs[lane] );
+            sumSquares += sums[lane];
+         }
+      }
+#endif
+
+      for ( ; i < count; ++i )
+      {
+         min = std::min( min, samples[i] );
+         max = std::max( max, samples[i] );
+         sumSquares += double( samples[i] ) * samples[i];
+      }
+   }
+}
+
+float WaveformPyramid::Entry::rms() const
+{
+   return std::sqrt( meanSquare );
+}
+
+WaveformPyramid::WaveformPyramid( int channelCount/*=0*/, int baseBlockSize/*=DefaultBaseBlockSize*/ )
+{
+   reset( channelCount, baseBlockSize );
+}
+
+void WaveformPyramid::reset( int channelCount, int baseBlockSize/*=DefaultBaseBlockSize*/ )
+{
+   _channelCount = std::max( channelCount, 0 );
+   _baseBlockSize = std::max( baseBlockSize, 1 );
+   _frameCount = 0;
+   _finished = false;
+   _levels.clear();
+   _lastEntryFrames.clear();
+   _block.resize( _channelCount );
+   _pending.resize( _channelCount );
+   clearAccumulators();
+}
+
+void WaveformPyramid::clearAccumulators()
+{
+   for ( auto& accumulator : _block )
+   {
+      accumulator.min = std::numeric_limits<float>::infinity();
+      accumulator.max = -std::numeric_limits<float>::infinity();
+      accumulator.sumSquares = 0.0;
+   }
+   _blockFrames = 0;
+}
+
+void WaveformPyramid::append( const int16_t* samples, size_t frameCount )
+{
+   if ( _finished || _channelCount == 0 )
+      return;
+
+   S16Stats stats[8];
+   std::vector<S16Stats> moreStats;
+   S16Stats* blockStats = stats;
+   if ( _channelCount > 8 )
+   {
+      moreStats.resize( _channelCount );
+      blockStats = moreStats.data();
+   }
+
+   while ( frameCount > 0 )
+   {
+      const size_t n = std::min( frameCount, size_t( _baseBlockSize ) - _blockFrames );
+
+      for ( int ch = 0; ch < _channelCount; ++ch )
+         blockStats[ch] = { 32767, -32768, 0 };
+      reduceS16( samples, n, _channelCount, blockStats );
+      for ( int ch = 0; ch < _channelCount; ++ch )
+      {
+         Accumulator& accumulator = _block[ch];
+         accumulator.min = std::min( accumulator.min, blockStats[ch].min * S16Scale );
+         accumulator.max = std::max( accumulator.max, blockStats[ch].max * S16Scale );
+         accumulator.sumSquares += blockStats[ch].sumSquares * S16SquareScale;
+      }
+
+      samples += n * _channelCount;
+      frameCount -= n;
+      _blockFrames += n;
+      _frameCount += n;
+      if ( _blockFrames == size_t( _baseBlockSize ) )
+         addBlock( _blockFrames );
+   }
+}
+
+void WaveformPyramid::append( const float* const* planes, size_t frameCount )
+{
+   if ( _finished || _channelCount == 0 )
+      return;
+
+   size_t offset = 0;
+   while ( offset < frameCount )
+   {
+      const size_t n = std::min( frameCount - offset, size_t( _baseBlockSize ) - _blockFrames );
+
+      for ( int ch = 0; ch < _channelCount; ++ch )
+      {
+         Accumulator& accumulator = _block[ch];
+         reduceFloat( planes[ch] + offset, n, accumulator.min, accumulator.max, accumulator.sumSquares );
+      }
+
+      offset += n;
+      _blockFrames += n;
+      _frameCount += n;
+      if ( _blockFrames == size_t( _baseBlockSize ) )
+         addBlock( _blockFrames );
+   }
+}
+
+void WaveformPyramid::addBlock( size_t frameCount )
+{
+   for ( int ch = 0; ch < _channelCount; ++ch )
+   {
+      const Accumulator& accumulator = _block[ch];
+      _pending[ch] = { accumulator.min, accumulator.max, float( accumulator.sumSquares / double( frameCount ) ) };
+   }
+   clearAccumulators();
+
+   addEntries( 0, _pending.data(), frameCount );
+}
+
+// Adds one entry per channel to a level. Every second entry completes a pair, whose combination
+// goes up to the next level. Only the last entry of a level can cover less than a full block, so
+// the first of a pair is always full.
+void WaveformPyramid::addEntries( size_t level, const Entry* entries, uint64_t frameCount )
+{
+   if ( level == _levels.size() )
+   {
+      _levels.emplace_back();
+      _lastEntryFrames.push_back( 0 );
+   }
+
+   std::vector<Entry>& entriesOfLevel = _levels[level];
+   entriesOfLevel.insert( entriesOfLevel.end(), entries, entries + _channelCount );
+   _lastEntryFrames[level] = frameCount;
+
+   const size_t entryCount = entriesOfLevel.size() / _channelCount;
+   if ( entryCount % 2 != 0 )
+      return;
+
+   const double firstWeight = double( blockSize( int( level ) ) );
+   const double secondWeight = double( frameCount );
+   const Entry* first = &entriesOfLevel[( entryCount - 2 ) * _channelCount];
+   const Entry* second = &entriesOfLevel[( entryCount - 1 ) * _channelCount];
+   for ( int ch = 0; ch < _channelCount; ++ch )
+   {
+      _pending[ch].min = std::min( first[ch].min, second[ch].min );
+      _pending[ch].max = std::max( first[ch].max, second[ch].max );
+      _pending[ch].meanSquare = float( ( first[ch].meanSquare * firstWeight + second[ch].meanSquare * secondWeight ) / ( firstWeight + secondWeight ) );
+   }
+
+   addEntries( level + 1, _pending.data(), blockSize( int( level ) ) + frameCount );
+}
+
+void WaveformPyramid::finish()
+{
+   if ( _finished )
+      return;
+
+   if ( _blockFrames > 0 )
+      addBlock( _blockFrames );
+
+   // A level that ends on an unpaired entry hands a copy of it up, so every level has half as
+   // many entries as the one below, rounded up
+   for ( size_t level = 0; level < _levels.size(); ++level )
+   {
+      const size_t entryCount = _levels[level].size() / _channelCount;
+      if ( entryCount > 1 && entryCount % 2 != 0 )
+      {
+         std::copy( _levels[level].end() - _channelCount, _levels[level].end(), _pending.begin() );
+         addEntries( level + 1, _pending.data(), _lastEntryFrames[level] );
+      }
+   }
+
+   _finished = true;
+}
+
+int WaveformPyramid::levelFor( double framesPerPixel ) const
+{
+   int level = 0;
+   while ( level + 1 < levelCount() && double( blockSize( level + 1 ) ) <= framesPerPixel )
+      ++level;
+   return level;
+}
+
+bool WaveformPyramid::save( const std::string& path ) const
+{
+   if ( !_finished )
+      return false;
+
+   SidecarHeader header;
+   ::memcpy( header.magic, Magic, sizeof( Magic ) );
+   header.channelCount = uint32_t( _channelCount );
+   header.baseBlockSize = uint32_t( _baseBlockSize );
+   header.frameCount = _frameCount;
+   header.levelCount = uint32_t( _levels.size() );
+   header.reserved = 0;
+
+   std::ofstream file( path, std::ofstream::binary );
+   file.write( (const char*)&header, sizeof( header ) );
+
+   std::vector<SidecarEntry> packed;
+   for ( const auto& entries : _levels )
+   {
+      const uint64_t entryCount = entries.size() / _channelCount;
+      file.write( (const char*)&entryCount, sizeof( entryCount ) );
+
+      packed.resize( entries.size() );
+      for ( size_t i = 0; i < entries.size(); ++i )
+      {
+         packed[i].min = quantize( entries[i].min );
+         packed[i].max = quantize( entries[i].max );
+         packed[i].rms = uint16_t( std::lround( std::min( entries[i].rms(), 1.0f ) * 65535.0f ) );
+      }
+      file.write( (const char*)packed.data(), std::streamsize( packed.size() * sizeof( SidecarEntry ) ) );
+   }
+
+   return bool( file );
+}
+
+bool WaveformPyramid::load( const std::string& path )
+{
+   std::ifstream file( path, std::ifstream::binary );
+
+   SidecarHeader header;
+   if ( !file.read( (char*)&header, sizeof( header ) ) || ::memcmp( header.magic, Magic, sizeof( Magic ) ) != 0 ||
+        header.channelCount == 0 || header.baseBlockSize == 0 || header.levelCount > 64 )
+      return false;
+
+   reset( int( header.channelCount ), int( header.baseBlockSize ) );
+
+   std::vector<SidecarEntry> packed;
+   for ( uint32_t level = 0; level < header.levelCount; ++level )
+   {
+      uint64_t entryCount = 0;
+      const uint64_t expectedCount = ( header.frameCount + blockSize( int( level ) ) - 1 ) / blockSize( int( level ) );
+      if ( !file.read( (char*)&entryCount, sizeof( entryCount ) ) || entryCount != expectedCount )
+      {
+         reset( 0 );
+         return false;
+      }
+
+      packed.resize( size_t( entryCount ) * _channelCount );
+      if ( !file.read( (char*)packed.data(), std::streamsize( packed.size() * sizeof( SidecarEntry ) ) ) )
+      {
+         reset( 0 );
+         return false;
+      }
+
+      _levels.emplace_back( packed.size() );
+      for ( size_t i = 0; i < packed.size(); ++i )
+      {
+         const float rms = packed[i].rms / 65535.0f;
+         _levels.back()[i] = { packed[i].min / 32767.0f, packed[i].max / 32767.0f, rms * rms };
+      }
+   }
+
+   _frameCount = header.frameCount;
+   _finished = true;
+   return true;
+}
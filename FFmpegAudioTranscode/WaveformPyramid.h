@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Min/max/RMS overview of a stream of samples at a series of resolutions, for drawing waveforms
+// at any zoom level without going back to the samples. Each entry of level 0 covers a block of
+// baseBlockSize frames, and each entry of level n + 1 covers two entries of level n, until the
+// top level is down to a single entry. Samples are appended in whatever chunks they arrive in,
+// and entries are added as their blocks fill up, so the pyramid is built in the same pass as the
+// samples are produced. Values are normalized so that full scale is +/-1.
+class WaveformPyramid
+{
+public:
+   static const int DefaultBaseBlockSize = 256;
+
+   struct Entry
+   {
+      float min;
+      float max;
+      float meanSquare;
+
+      float rms() const;
+   };
+
+   explicit WaveformPyramid( int channelCount = 0, int baseBlockSize = DefaultBaseBlockSize );
+
+   // Empties the pyramid, ready to start on a new stream
+   void reset( int channelCount, int baseBlockSize = DefaultBaseBlockSize );
+
+   // Interleaved 16-bit samples, or one float plane per channel
+   void append( const int16_t* samples, size_t frameCount );
+   void append( const float* const* planes, size_t frameCount );
+
+   // Adds the final, partly filled, block and completes the upper levels. Call once all samples
+   // have been appended; nothing more may be appended afterwards.
+   void finish();
+   bool finished() const { return _finished; }
+
+   int channelCount() const { return _channelCount; }
+   int baseBlockSize() const { return _baseBlockSize; }
+   uint64_t frameCount() const { return _frameCount; }
+
+   int levelCount() const { return int( _levels.size() ); }
+   size_t levelSize( int level ) const { return _levels[level].size() / size_t( _channelCount ); }
+   uint64_t blockSize( int level ) const { return uint64_t( _baseBlockSize ) << level; }
+   const Entry& entry( int level, int channel, size_t index ) const { return _levels[level][index * _channelCount + channel]; }
+
+   // The coarsest level whose entries cover no more than the given number of frames each, which
+   // is the one to draw from at a zoom of that many frames per pixel
+   int levelFor( double framesPerPixel ) const;
+
+   // Compact binary sidecar: min and max are stored as 16-bit values and RMS as 16 bits unsigned,
+   // so each entry takes 6 bytes per channel. Only finished pyramids are saved.
+   bool save( const std::string& path ) const;
+   bool load( const std::string& path );
+
+protected:
+   struct Accumulator
+   {
+      float  min;
+      float  max;
+      double sumSquares;
+   };
+
+   void clearAccumulators();
+   void addBlock( size_t frameCount );
+   void addEntries( size_t level, const Entry* entries, uint64_t frameCount );
+
+   int                               _channelCount;
+   int                               _baseBlockSize;
+   uint64_t                          _frameCount;
+   bool                              _finished;
+   std::vector< std::vector<Entry> > _levels;            // entries of each level, interleaved by channel
+   std::vector<uint64_t>             _lastEntryFrames;   // frames covered by the last entry of each level
+   std::vector<Accumulator>          _block;             // the block of level 0 being filled, per channel
+   size_t                            _blockFrames;
+   std::vector<Entry>                _pending;
+};
@@ -0,0 +1,113 @@
+#include "stdafx.h"
+
+#include "WorkStealingThreadPool.h"
+
+#include <algorithm>
+
+namespace
+{
+   // Identifies the pool (and queue) the current thread works for, if any
+   thread_local const WorkStealingThreadPool* currentPool = nullptr;
+   thread_local unsigned currentQueueIndex = 0;
+}
+
+WorkStealingThreadPool::WorkStealingThreadPool( unsigned workerCount/*=0*/ )
+   : _queuedCount( 0 )
+   , _nextQueue( 0 )
+   , _stopping( false )
+{
+   if ( workerCount == 0 )
+      workerCount = std::max( 1U, std::thread::hardware_concurrency() );
+
+   for ( unsigned i = 0; i < workerCount; ++i )
+      _queues.emplace_back( new WorkerQueue );
+
+   for ( unsigned i = 0; i < workerCount; ++i )
+      _threads.emplace_back( &WorkStealingThreadPool::workerLoop, this, i );
+}
+
+WorkStealingThreadPool::~WorkStealingThreadPool()
+{
+   {
+      std::lock_guard<std::mutex> lock( _wakeMutex );
+      _stopping = true;
+   }
+   _wake.notify_all();
+
+   for ( auto& thread : _threads )
+      thread.join();
+}
+
+void WorkStealingThreadPool::submit( Task task )
+{
+   unsigned index;
+   if ( currentPool == this )
+      index = currentQueueIndex;
+   else
+      index = _nextQueue++ % unsigned( _queues.size() );
+
+   {
+      // Counted before it's queued so the count never lags behind what workers can pop; taking
+      // the lock orders the increment with a worker's check-then-wait
+      std::lock_guard<std::mutex> lock( _wakeMutex );
+      ++_queuedCount;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock( _queues[index]->mutex );
+      _queues[index]->tasks.push_back( std::move( task ) );
+   }
+
+   _wake.notify_one();
+}
+
+bool WorkStealingThreadPool::popOrSteal( unsigned index, Task& task )
+{
+   {
+      WorkerQueue& own = *_queues[index];
+      std::lock_guard<std::mutex> lock( own.mutex );
+      if ( !own.tasks.empty() )
+      {
+         task = std::move( own.tasks.back() );
+         own.tasks.pop_back();
+         return true;
+      }
+   }
+
+   size_t n = _queues.size();
+   for ( size_t i = 1; i < n; ++i )
+   {
+      WorkerQueue& victim = *_queues[( index + i ) % n];
+      std::lock_guard<std::mutex> lock( victim.mutex );
+      if ( !victim.tasks.empty() )
+      {
+         task = std::move( victim.tasks.front() );
+         victim.tasks.pop_front();
+         return true;
+      }
+   }
+
+   return false;
+}
+
+void WorkStealingThreadPool::workerLoop( unsigned index )
+{
+   currentPool = this;
+   currentQueueIndex = index;
+
+   for ( ;; )
+   {
+      Task task;
+      if ( popOrSteal( index, task ) )
+      {
+         --_queuedCount;
+         task();
+         continue;
+      }
+
+      std::unique_lock<std::mutex> lock( _wakeMutex );
+      _wake.wait( lock, [this]() { return _queuedCount > 0 || _stopping; } );
+      if ( _stopping && _queuedCount == 0 )
+         break;
+   }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size thread pool where each worker owns a task queue. Workers run their own most
+// recently queued task first and steal the oldest task from another worker when they run dry,
+// which keeps all cores busy when task lengths vary widely (e.g. decoding files of mixed length).
+class WorkStealingThreadPool
+{
+public:
+   typedef std::function<void()> Task;
+
+   // A worker count of zero means one worker per hardware thread
+   explicit WorkStealingThreadPool( unsigned workerCount = 0 );
+
+   // Runs any tasks still queued, then joins the workers
+   virtual ~WorkStealingThreadPool();
+
+   unsigned workerCount() const { return unsigned( _threads.size() ); }
+
+   // Tasks submitted from one of the pool's own workers go on that worker's queue; others are
+   // distributed round-robin
+   void submit( Task task );
+
+   template<typename Fn>
+   auto async( Fn fn ) -> std::future< decltype( fn() ) >
+   {
+      typedef decltype( fn() ) Result;
+      auto task = std::make_shared< std::packaged_task<Result()> >( std::move( fn ) );
+      std::future<Result> future = task->get_future();
+      submit( [task]() { ( *task )(); } );
+      return future;
+   }
+
+protected:
+   struct WorkerQueue
+   {
+      std::mutex        mutex;
+      std::deque<Task>  tasks;
+   };
+
+   void workerLoop( unsigned index );
+   bool popOrSteal( unsigned index, Task& task );
+
+   std::vector< std::unique_ptr<WorkerQueue> > _queues;
+   std::vector<std::thread>                    _threads;
+   std::mutex                                  _wakeMutex;
+   std::condition_variable                     _wake;
+   std::atomic<size_t>                         _queuedCount;
+   std::atomic<unsigned>                       _nextQueue;
+   bool                                        _stopping;
+};
@@ -3,24 +3,45 @@
 
 #include "stdafx.h"
 
+#include "AudioBatchEncoder.h"
+#include "AudioBatchLoader.h"
+#include "AudioEncoder.h"
 #include "AudioLoader.h"
+#include "AudioProbe.h"
+#include "AudioStreamReader.h"
+#include "AudioTranscoder.h"
+#include "AudioReaderDecoder.h"
+#include "AudioResampler.h"
+#include "DecodedAudioCache.h"
 #include "InitFFmpeg.h"
+#include "InterleaveKernels.h"
 #include "VideoExporter.h"
+#include "WavUtil.h"
 
 #include <gtest/gtest.h>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
 extern "C"
 {
 #include <libavformat/avformat.h>
 }
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <functional>
+#include <future>
 #include <iterator>
 #include <iostream>
+#include <memory>
 #include <string>
 
 int main( int argc, char **argv )
@@ -149,6 +170,1134 @@ TEST_F( FFmpegAudioTranscodeIntegrationTest, WavImport_WorksAsExpected_WithoutPr
    EXPECT_EQ( decodedAudioSize, expectedSize );
 }
 
+TEST_F( FFmpegAudioTranscodeIntegrationTest, FloatPlanarOutput_MatchesInterleavedOutput )
+{
+   const std::string testMediaPath( ".\\TestMedia\\sine.wav" );
+
+   AudioLoader interleavedLoader( testMediaPath );
+   EXPECT_TRUE( interleavedLoader.loadAudioData() );
+   const std::vector<int16_t>& interleaved = interleavedLoader.processedAudio();
+
+   AudioLoader planarLoader( testMediaPath, AudioParams( 2, AV_SAMPLE_FMT_FLTP, 44100, 4 ) );
+   EXPECT_TRUE( planarLoader.loadAudioData() );
+   const auto& planar = planarLoader.processedPlanarAudio();
+
+   EXPECT_TRUE( planarLoader.processedAudio().empty() );
+   ASSERT_EQ( planar.size(), 2U );
+   ASSERT_EQ( planar[0].size(), interleaved.size() / 2 );
+   ASSERT_EQ( planar[1].size(), interleaved.size() / 2 );
+
+   // Both conversions come from the same source samples; the s16 path may resample with integer
+   // filter coefficients, so allow a few LSBs of difference
+   int maxDiff = 0;
+   for ( size_t i = 0; i < planar[0].size(); ++i )
+   {
+      for ( size_t ch = 0; ch < 2; ++ch )
+      {
+         int asInt = int( std::lround( planar[ch][i] * 32768.0f ) );
+         maxDiff = std::max( maxDiff, std::abs( asInt - interleaved[i * 2 + ch] ) );
+      }
+   }
+   EXPECT_LE( maxDiff, 8 );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, InterleaveKernels_MatchReference )
+{
+   // Every instruction set this machine can run, each sample width, the specialized channel counts
+   // and a few that aren't, starting at unaligned frames and with tails that don't fill a vector
+   std::vector<InterleaveIsa> isas = { InterleaveIsa::Scalar };
+   if ( detectInterleaveIsa() >= InterleaveIsa::SSE2 )
+      isas.push_back( InterleaveIsa::SSE2 );
+   if ( detectInterleaveIsa() >= InterleaveIsa::AVX2 )
+      isas.push_back( InterleaveIsa::AVX2 );
+
+   const int widths[] = { 1, 2, 4, 8 };
+   const int channelCounts[] = { 1, 2, 3, 5, 6, 7, 8, 11 };
+   const size_t offsets[] = { 0, 1, 3 };
+   const size_t counts[] = { 0, 1, 3, 7, 8, 15, 16, 17, 31, 33, 64, 1027 };
+   const size_t maxFrames = 3 + 1027;
+
+   uint32_t seed = 12345;
+   for ( int width : widths )
+   {
+      for ( int channelCount : channelCounts )
+      {
+         std::vector< std::vector<uint8_t> > planeData( channelCount, std::vector<uint8_t>( maxFrames * width ) );
+         std::vector<const uint8_t*> planes;
+         for ( auto& plane : planeData )
+         {
+            for ( auto& byte : plane )
+            {
+               seed = seed * 1664525 + 1013904223;
+               byte = uint8_t( seed >> 24 );
+            }
+            planes.push_back( plane.data() );
+         }
+
+         for ( InterleaveIsa isa : isas )
+         {
+            InterleaveKernel kernel = selectInterleaveKernel( width, channelCount, isa );
+            ASSERT_NE( kernel, nullptr ) << width << " bytes, " << channelCount << " channels";
+
+            for ( size_t offset : offsets )
+            {
+               for ( size_t count : counts )
+               {
+                  // One byte in, so the output isn't aligned either, with a guard byte either side
+                  const size_t bytes = count * channelCount * width;
+                  std::vector<uint8_t> expected( bytes );
+                  std::vector<uint8_t> actual( bytes + 2, 0xA5 );
+                  interleaveReference( planes.data(), offset, count, channelCount, width, expected.data() );
+                  kernel( planes.data(), offset, count, channelCount, actual.data() + 1 );
+
+                  EXPECT_TRUE( std::equal( expected.cbegin(), expected.cend(), actual.cbegin() + 1 ) )
+                     << "isa " << int( isa ) << ", " << width << " bytes, " << channelCount << " channels, frames " << offset << " + " << count;
+                  EXPECT_EQ( actual.front(), 0xA5 );
+                  EXPECT_EQ( actual.back(), 0xA5 );
+               }
+            }
+         }
+      }
+   }
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, MonoOutput_HasExpectedLength )
+{
+   const std::string testMediaPath( ".\\TestMedia\\sine.wav" );
+
+   AudioLoader audioLoader( testMediaPath, AudioParams( 1, AV_SAMPLE_FMT_S16, 22050, 2 ) );
+   EXPECT_TRUE( audioLoader.loadAudioData() );
+
+   int64_t decodedAudioSize = audioLoader.processedAudio().size();
+   EXPECT_LE( std::abs( decodedAudioSize - 22050 * 5 ), 2 );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, UnsupportedOutputFormat_FailsLoad )
+{
+   const std::string testMediaPath( ".\\TestMedia\\sine.wav" );
+
+   AudioLoader audioLoader( testMediaPath, AudioParams( 2, AV_SAMPLE_FMT_DBL, 44100, 8 ) );
+   EXPECT_FALSE( audioLoader.loadAudioData() );
+   EXPECT_EQ( audioLoader.state(), AudioLoader::UnsupportedOutputParams );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, StreamReader_MatchesAudioLoaderOutput )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+
+   AudioLoader audioLoader( testMediaPath );
+   EXPECT_TRUE( audioLoader.loadAudioData() );
+   const std::vector<int16_t>& expected = audioLoader.processedAudio();
+
+   // Deliberately awkward chunk size so reads straddle resampler output boundaries
+   AudioStreamReader streamReader( testMediaPath );
+   std::vector<int16_t> streamed;
+   std::vector<int16_t> chunk( 1000 * 2 );
+   size_t n;
+   while ( ( n = streamReader.read( chunk.data(), 1000 ) ) > 0 )
+      streamed.insert( streamed.end(), chunk.cbegin(), chunk.cbegin() + n * 2 );
+
+   EXPECT_EQ( streamReader.state(), AudioLoader::Ok );
+   EXPECT_TRUE( streamReader.endOfStream() );
+   EXPECT_EQ( streamed, expected );
+}
+
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, SegmentedLoad_MatchesSequentialLoad )
+{
+   const std::vector<std::string> paths =
+   {
+      ".\\TestMedia\\sine.wav",
+      ".\\TestMedia\\five second stereo 48kHz sine wave.mp3"
+   };
+
+   for ( const auto& path : paths )
+   {
+      AudioLoader sequentialLoader( path );
+      EXPECT_TRUE( sequentialLoader.loadAudioData() );
+      const std::vector<int16_t>& expected = sequentialLoader.processedAudio();
+
+      AudioLoader segmentedLoader( path );
+      EXPECT_TRUE( segmentedLoader.loadAudioDataSegmented( 4 ) );
+      const std::vector<int16_t>& actual = segmentedLoader.processedAudio();
+
+      // Documented tolerance for 16-bit output is 2 LSB
+      ASSERT_EQ( actual.size(), expected.size() );
+      int maxDiff = 0;
+      for ( size_t i = 0; i < actual.size(); ++i )
+         maxDiff = std::max( maxDiff, std::abs( actual[i] - expected[i] ) );
+      EXPECT_LE( maxDiff, 2 ) << path;
+   }
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, PipelinedLoad_MatchesSequentialLoad )
+{
+   const std::vector<std::string> paths =
+   {
+      ".\\TestMedia\\sine.wav",
+      ".\\TestMedia\\five second stereo 48kHz sine wave.mp3"
+   };
+
+   for ( const auto& path : paths )
+   {
+      AudioLoader sequentialLoader( path );
+      EXPECT_TRUE( sequentialLoader.loadAudioData() );
+
+      AudioLoader pipelinedLoader( path );
+      EXPECT_TRUE( pipelinedLoader.loadAudioDataPipelined() );
+      EXPECT_EQ( pipelinedLoader.processedAudio(), sequentialLoader.processedAudio() ) << path;
+   }
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, AsyncLoad_PrefixReadsMatchSequentialLoad )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+
+   for ( AVSampleFormat sampleFormat : { AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLTP } )
+   {
+      const AudioParams params( 2, sampleFormat, 44100, ::av_get_bytes_per_sample( sampleFormat ) );
+      AudioLoader sequentialLoader( testMediaPath, params );
+      ASSERT_TRUE( sequentialLoader.loadAudioData() );
+
+      // Read the prefix in small pieces as it grows, while the load carries on
+      AudioLoader asyncLoader( testMediaPath, params );
+      std::future<bool> loaded = asyncLoader.loadAudioDataAsync();
+      std::vector<int16_t> interleaved;
+      std::vector< std::vector<float> > planar( 2 );
+      size_t framesRead = 0;
+      size_t lastAvailable = 0;
+      bool finished = false;
+      while ( !finished )
+      {
+         // Checked before reading, so the last pass takes in everything
+         finished = loaded.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready;
+         const size_t available = asyncLoader.availableFrames();
+         EXPECT_GE( available, lastAvailable );
+         lastAvailable = available;
+
+         while ( framesRead < available )
+         {
+            const size_t n = std::min<size_t>( 1000, available - framesRead );
+            if ( sampleFormat == AV_SAMPLE_FMT_S16 )
+            {
+               interleaved.resize( ( framesRead + n ) * 2 );
+               EXPECT_EQ( asyncLoader.readAvailable( framesRead, n, interleaved.data() + framesRead * 2 ), n );
+            }
+            else
+            {
+               planar[0].resize( framesRead + n );
+               planar[1].resize( framesRead + n );
+               float* planes[] = { planar[0].data() + framesRead, planar[1].data() + framesRead };
+               EXPECT_EQ( asyncLoader.readAvailable( framesRead, n, planes ), n );
+            }
+            framesRead += n;
+         }
+      }
+
+      ASSERT_TRUE( loaded.get() );
+      EXPECT_EQ( framesRead, sequentialLoader.processedFrameCount() );
+      EXPECT_EQ( asyncLoader.availableFrames(), sequentialLoader.processedFrameCount() );
+      if ( sampleFormat == AV_SAMPLE_FMT_S16 )
+      {
+         EXPECT_EQ( interleaved, sequentialLoader.processedAudio() );
+         EXPECT_EQ( asyncLoader.processedAudio(), sequentialLoader.processedAudio() );
+      }
+      else
+      {
+         EXPECT_EQ( planar, sequentialLoader.processedPlanarAudio() );
+      }
+   }
+
+   // A load that fails leaves availableFrames() where it got to, but has nothing left to read
+   auto account = std::make_shared<MemoryAccount>();
+   account->setBudget( 64 * 1024 );
+   AudioLoader limitedLoader( testMediaPath );
+   limitedLoader.setMemoryAccount( account );
+   std::future<bool> failed = limitedLoader.loadAudioDataAsync();
+   size_t lastAvailable = 0;
+   while ( failed.wait_for( std::chrono::seconds( 0 ) ) != std::future_status::ready )
+   {
+      const size_t available = limitedLoader.availableFrames();
+      EXPECT_GE( available, lastAvailable );
+      lastAvailable = available;
+   }
+   EXPECT_FALSE( failed.get() );
+   EXPECT_EQ( limitedLoader.state(), AudioLoader::MemoryBudgetExceeded );
+   EXPECT_GE( limitedLoader.availableFrames(), lastAvailable );
+   int16_t frame[2];
+   EXPECT_EQ( limitedLoader.readAvailable( 0, 1, frame ), 0u );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, CompressedStorage_MatchesUncompressedLoad )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+
+   AudioLoader plainLoader( testMediaPath );
+   ASSERT_TRUE( plainLoader.loadAudioData() );
+   const std::vector<int16_t>& expected = plainLoader.processedAudio();
+   const size_t frameCount = plainLoader.processedFrameCount();
+
+   auto account = std::make_shared<MemoryAccount>();
+   AudioLoader compressedLoader( testMediaPath );
+   compressedLoader.setCompressedStorage( true );
+   compressedLoader.setMemoryAccount( account );
+   ASSERT_TRUE( compressedLoader.loadAudioData() );
+   ASSERT_EQ( compressedLoader.processedFrameCount(), frameCount );
+
+   // A sine wave is about as predictable as audio gets, and the output is compressed as it's
+   // decoded, so it's never held whole and uncompressed
+   EXPECT_LT( account->current( MemoryAccount::Output ), expected.size() * sizeof( int16_t ) / 2 );
+   EXPECT_LT( account->peak( MemoryAccount::Output ) + account->peak( MemoryAccount::Staging ), expected.size() * sizeof( int16_t ) / 2 );
+
+   // Ranges within a block, across blocks, and at either end
+   const size_t ranges[][2] = { { 0, 1 }, { 100, 200 }, { 4000, 300 }, { 12345, 20000 }, { frameCount - 777, 777 }, { 0, frameCount } };
+   for ( const auto& range : ranges )
+   {
+      std::vector<int16_t> samples( range[1] * 2 );
+      compressedLoader.readProcessedAudio( range[0], range[1], samples.data() );
+      EXPECT_TRUE( std::equal( samples.cbegin(), samples.cend(), expected.cbegin() + range[0] * 2 ) ) << range[0] << " + " << range[1];
+   }
+
+   EXPECT_EQ( compressedLoader.processedAudio(), expected );
+
+   // Decompressing the whole output is charged on top of the compressed copy, and is refused when
+   // that won't fit the budget; the output can still be read a range at a time
+   EXPECT_GE( account->current( MemoryAccount::Output ), expected.size() * sizeof( int16_t ) );
+
+   auto budgetAccount = std::make_shared<MemoryAccount>();
+   budgetAccount->setBudget( expected.size() * sizeof( int16_t ) * 3 / 4 );
+   AudioLoader budgetLoader( testMediaPath );
+   budgetLoader.setCompressedStorage( true );
+   budgetLoader.setMemoryAccount( budgetAccount );
+   ASSERT_TRUE( budgetLoader.loadAudioData() );
+   EXPECT_TRUE( budgetLoader.processedAudio().empty() );
+   EXPECT_EQ( budgetLoader.processedAudioData(), nullptr );
+   std::vector<int16_t> samples( frameCount * 2 );
+   budgetLoader.readProcessedAudio( 0, frameCount, samples.data() );
+   EXPECT_EQ( samples, expected );
+
+   // Range loads are compressed once cut down
+   AudioLoader plainRangeLoader( testMediaPath );
+   ASSERT_TRUE( plainRangeLoader.loadAudioData( 1.0, 2.5 ) );
+   AudioLoader compressedRangeLoader( testMediaPath );
+   compressedRangeLoader.setCompressedStorage( true );
+   ASSERT_TRUE( compressedRangeLoader.loadAudioData( 1.0, 2.5 ) );
+   EXPECT_EQ( compressedRangeLoader.processedAudio(), plainRangeLoader.processedAudio() );
+
+   // Compressed output is written to the cache a few blocks at a time, and reads back the same
+   const std::filesystem::path cacheDir = std::filesystem::temp_directory_path() / "FFmpegAudioTranscodeCompressedCacheTest";
+   std::filesystem::remove_all( cacheDir );
+   {
+      auto cache = std::make_shared<DecodedAudioCache>( cacheDir.string(), 64 * 1024 * 1024 );
+      AudioLoader storingLoader( testMediaPath );
+      storingLoader.setCompressedStorage( true );
+      storingLoader.setCache( cache );
+      ASSERT_TRUE( storingLoader.loadAudioData() );
+      EXPECT_FALSE( storingLoader.loadedFromCache() );
+
+      AudioLoader cachedLoader( testMediaPath );
+      cachedLoader.setCache( cache );
+      ASSERT_TRUE( cachedLoader.loadAudioData() );
+      EXPECT_TRUE( cachedLoader.loadedFromCache() );
+      EXPECT_EQ( cachedLoader.processedAudio(), expected );
+   }
+   std::filesystem::remove_all( cacheDir );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, RangeLoad_MatchesSliceOfFullLoad )
+{
+   const std::vector<std::string> paths =
+   {
+      ".\\TestMedia\\sine.wav",
+      ".\\TestMedia\\five second stereo 48kHz sine wave.mp3"
+   };
+
+   for ( const auto& path : paths )
+   {
+      AudioLoader fullLoader( path );
+      EXPECT_TRUE( fullLoader.loadAudioData() );
+      const std::vector<int16_t>& full = fullLoader.processedAudio();
+
+      AudioLoader rangeLoader( path );
+      EXPECT_TRUE( rangeLoader.loadAudioData( 1.5, 3.25 ) );
+      const std::vector<int16_t>& actual = rangeLoader.processedAudio();
+
+      const size_t first = 44100 * 3 / 2 * 2;
+      ASSERT_EQ( actual.size(), size_t( 44100 * 7 / 4 * 2 ) ) << path;
+      int maxDiff = 0;
+      for ( size_t i = 0; i < actual.size(); ++i )
+         maxDiff = std::max( maxDiff, std::abs( actual[i] - full[first + i] ) );
+      EXPECT_LE( maxDiff, 2 ) << path;
+
+      // An open-ended range runs to the end of the full load
+      AudioLoader tailLoader( path );
+      EXPECT_TRUE( tailLoader.loadAudioData( 4.0, -1.0 ) );
+      EXPECT_EQ( tailLoader.processedAudio().size(), full.size() - 44100 * 4 * 2 ) << path;
+   }
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, DecoderOptions_ThreadedDecodeMatchesDefault )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 32kHz sine wave.mp3" );
+
+   AudioLoader defaultLoader( testMediaPath );
+   ASSERT_TRUE( defaultLoader.loadAudioData() );
+
+   DecoderOptions options;
+   options.threadCount = 0;
+   options.inputFormat = "mp3";
+   AudioLoader threadedLoader( testMediaPath );
+   threadedLoader.setDecoderOptions( options );
+   ASSERT_TRUE( threadedLoader.loadAudioData() );
+   EXPECT_EQ( threadedLoader.processedAudio(), defaultLoader.processedAudio() );
+
+   options.inputFormat = "no such format";
+   AudioLoader badFormatLoader( testMediaPath );
+   badFormatLoader.setDecoderOptions( options );
+   EXPECT_FALSE( badFormatLoader.loadAudioData() );
+   AudioReaderDecoderInitState initState;
+   EXPECT_TRUE( badFormatLoader.readerDecoderInitState( initState ) );
+   EXPECT_EQ( initState, AudioReaderDecoderInitState::OpenFails );
+}
+
+// Handles (Windows) or file descriptors this process has open, for catching inputs that are
+// never closed; -1 if the platform doesn't say
+int openHandleCount()
+{
+#ifdef _WIN32
+   DWORD count = 0;
+   return ::GetProcessHandleCount( ::GetCurrentProcess(), &count ) ? int( count ) : -1;
+#else
+   std::error_code ec;
+   std::filesystem::directory_iterator fds( "/proc/self/fd", ec );
+   return ec ? -1 : int( std::distance( fds, std::filesystem::directory_iterator() ) );
+#endif
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, ResetLoader_MatchesFreshLoaders )
+{
+   const std::vector<std::string> paths =
+   {
+      ".\\TestMedia\\five second mono sine wave.mp3",
+      ".\\TestMedia\\five second stereo 48kHz sine wave.mp3",
+      ".\\TestMedia\\five second stereo 48kHz sine wave.mp3",
+      ".\\TestMedia\\sine.wav",
+      ".\\TestMedia\\five second stereo 32kHz sine wave.mp3"
+   };
+
+   AudioLoader reusedLoader( paths[0] );
+   for ( const auto& path : paths )
+   {
+      AudioLoader freshLoader( path );
+      ASSERT_TRUE( freshLoader.loadAudioData() );
+
+      reusedLoader.reset( path );
+      ASSERT_TRUE( reusedLoader.loadAudioData() ) << path;
+      EXPECT_EQ( reusedLoader.processedAudio(), freshLoader.processedAudio() ) << path;
+   }
+
+   // Each reset has to close the last input: once warmed up, the loader holds exactly as many
+   // handles after any number of resets as after one
+   const int ResetCount = 50;
+   reusedLoader.reset( paths[0] );
+   ASSERT_TRUE( reusedLoader.loadAudioData( 0.0, 0.05 ) );
+   const int handlesBefore = openHandleCount();
+   for ( int i = 0; i < ResetCount; ++i )
+   {
+      reusedLoader.reset( paths[0] );
+      ASSERT_TRUE( reusedLoader.loadAudioData( 0.0, 0.05 ) ) << i;
+   }
+   if ( handlesBefore >= 0 )
+      EXPECT_EQ( openHandleCount(), handlesBefore );
+
+   reusedLoader.reset( ".\\TestMedia\\does not exist.mp3" );
+   EXPECT_FALSE( reusedLoader.loadAudioData() );
+   EXPECT_EQ( reusedLoader.state(), AudioLoader::ReaderDecoderInitFails );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, BatchLoader_LoadsEveryFileAndReportsFailures )
+{
+   const std::vector<std::string> paths =
+   {
+      ".\\TestMedia\\five second mono sine wave.mp3",
+      ".\\TestMedia\\five second stereo 32kHz sine wave.mp3",
+      ".\\TestMedia\\five second stereo 48kHz sine wave.mp3",
+      ".\\TestMedia\\sine.wav",
+      ".\\TestMedia\\does not exist.mp3"
+   };
+
+   AudioBatchLoader batchLoader( 3 );
+   std::atomic<int> numCompleted( 0 );
+   auto futures = batchLoader.load( paths, [&numCompleted]( size_t, const AudioLoader& ) { ++numCompleted; } );
+   ASSERT_EQ( futures.size(), paths.size() );
+
+   for ( size_t i = 0; i < paths.size() - 1; ++i )
+   {
+      AudioLoader sequentialLoader( paths[i] );
+      sequentialLoader.loadAudioData();
+
+      auto loader = futures[i].get();
+      EXPECT_EQ( loader->state(), AudioLoader::Ok );
+      EXPECT_EQ( loader->processedAudio(), sequentialLoader.processedAudio() );
+   }
+
+   auto failed = futures.back().get();
+   EXPECT_EQ( failed->state(), AudioLoader::ReaderDecoderInitFails );
+   AudioReaderDecoderInitState initState;
+   EXPECT_TRUE( failed->readerDecoderInitState( initState ) );
+   EXPECT_EQ( initState, AudioReaderDecoderInitState::OpenFails );
+
+   EXPECT_EQ( numCompleted, int( paths.size() ) );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, DecodedAudioCache_SecondLoadIsMappedFromCache )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+   const std::filesystem::path cacheDir = std::filesystem::temp_directory_path() / "FFmpegAudioTranscodeCacheTest";
+   std::filesystem::remove_all( cacheDir );
+
+   {
+      auto cache = std::make_shared<DecodedAudioCache>( cacheDir.string(), 64 * 1024 * 1024 );
+
+      AudioLoader decoded( testMediaPath );
+      decoded.setCache( cache );
+      ASSERT_TRUE( decoded.loadAudioData() );
+      EXPECT_FALSE( decoded.loadedFromCache() );
+
+      AudioLoader cached( testMediaPath );
+      cached.setCache( cache );
+      ASSERT_TRUE( cached.loadAudioData() );
+      EXPECT_TRUE( cached.loadedFromCache() );
+
+      ASSERT_EQ( cached.processedFrameCount(), decoded.processedFrameCount() );
+      EXPECT_EQ( std::memcmp( cached.processedAudioData(), decoded.processedAudioData(), decoded.processedAudio().size() * sizeof( int16_t ) ), 0 );
+      EXPECT_EQ( cached.processedAudio(), decoded.processedAudio() );
+
+      // The copy of the mapping is made once, however many threads ask for it at the same time
+      AudioLoader shared( testMediaPath );
+      shared.setCache( cache );
+      ASSERT_TRUE( shared.loadAudioData() );
+      std::vector< std::future<const int16_t*> > copies;
+      for ( int i = 0; i < 4; ++i )
+         copies.push_back( std::async( std::launch::async, [&shared]() { return shared.processedAudio().data(); } ) );
+      const int16_t* copy = copies[0].get();
+      for ( size_t i = 1; i < copies.size(); ++i )
+         EXPECT_EQ( copies[i].get(), copy );
+      EXPECT_EQ( shared.processedAudio(), decoded.processedAudio() );
+
+      // Different output params are a different cache entry
+      AudioLoader planar( testMediaPath, AudioParams( 2, AV_SAMPLE_FMT_FLTP, 44100, 4 ) );
+      planar.setCache( cache );
+      ASSERT_TRUE( planar.loadAudioData() );
+      EXPECT_FALSE( planar.loadedFromCache() );
+
+      // So are different decoder options, which may change what's decoded; the thread count doesn't
+      DecoderOptions options;
+      options.codecOptions[ "skip_frame" ] = "nokey";
+      AudioLoader withOptions( testMediaPath );
+      withOptions.setCache( cache );
+      withOptions.setDecoderOptions( options );
+      ASSERT_TRUE( withOptions.loadAudioData() );
+      EXPECT_FALSE( withOptions.loadedFromCache() );
+
+      options.threadCount = 0;
+      AudioLoader withThreads( testMediaPath );
+      withThreads.setCache( cache );
+      withThreads.setDecoderOptions( options );
+      ASSERT_TRUE( withThreads.loadAudioData() );
+      EXPECT_TRUE( withThreads.loadedFromCache() );
+   }
+
+   std::filesystem::remove_all( cacheDir );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, MemoryAndCallbackSources_MatchFileLoad )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+
+   AudioLoader fileLoader( testMediaPath );
+   ASSERT_TRUE( fileLoader.loadAudioData() );
+
+   std::ifstream in( testMediaPath, std::ios::binary );
+   std::vector<char> bytes( ( std::istreambuf_iterator<char>( in ) ), std::istreambuf_iterator<char>() );
+   ASSERT_FALSE( bytes.empty() );
+
+   AudioLoader memoryLoader( AudioSource::fromMemory( bytes.data(), bytes.size(), 4096 ) );
+   ASSERT_TRUE( memoryLoader.loadAudioData() );
+   EXPECT_EQ( memoryLoader.processedAudio(), fileLoader.processedAudio() );
+
+   // Non-seekable stream fed a few bytes at a time
+   size_t readPos = 0;
+   auto read = [&bytes, &readPos]( uint8_t* buffer, int size )
+   {
+      int count = int( std::min<size_t>( std::min( size, 1000 ), bytes.size() - readPos ) );
+      ::memcpy( buffer, bytes.data() + readPos, count );
+      readPos += count;
+      return count;
+   };
+   AudioLoader callbackLoader( AudioSource::fromCallbacks( read ) );
+   ASSERT_TRUE( callbackLoader.loadAudioDataSegmented() );
+   EXPECT_EQ( callbackLoader.processedAudio(), fileLoader.processedAudio() );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, AudioProbe_MatchesReaderDecoder )
+{
+   const std::vector<std::string> paths =
+   {
+      ".\\TestMedia\\five second mono sine wave.mp3",
+      ".\\TestMedia\\five second stereo 32kHz sine wave.mp3",
+      ".\\TestMedia\\five second stereo 48kHz sine wave.mp3",
+      ".\\TestMedia\\sine.wav"
+   };
+
+   AudioProbe audioProbe( paths[0] );
+   for ( const auto& path : paths )
+   {
+      AudioReaderDecoder readerDecoder( path );
+      AudioParams expected;
+      ASSERT_TRUE( readerDecoder.getAudioParams( expected ) );
+
+      audioProbe.reset( path );
+      AudioProbe::Result result;
+      ASSERT_TRUE( audioProbe.probe( result ) ) << path;
+      EXPECT_EQ( result.params.channelCount, expected.channelCount ) << path;
+      EXPECT_EQ( result.params.sampleRate, expected.sampleRate ) << path;
+      EXPECT_EQ( result.params.sampleFormat, expected.sampleFormat ) << path;
+      EXPECT_EQ( result.params.bytesPerSample, expected.bytesPerSample ) << path;
+      EXPECT_EQ( result.formatName, readerDecoder.formatName() ) << path;
+      EXPECT_NEAR( result.duration, 5.0, 0.1 ) << path;
+   }
+
+   AudioProbe::Result result;
+   EXPECT_FALSE( AudioProbe::probe( ".\\TestMedia\\does not exist.mp3", result ) );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, AudioProbe_ClosesEveryInput )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+   const int ProbeCount = 50;
+
+   // One probe reset onto the same file over and over, then the one-shot form, which makes a
+   // probe per call; after a warm-up round of each, neither may leave a single handle behind
+   AudioProbe audioProbe( testMediaPath );
+   AudioProbe::Result warmUp;
+   ASSERT_TRUE( audioProbe.probe( warmUp ) );
+   ASSERT_TRUE( AudioProbe::probe( testMediaPath, warmUp ) );
+   const int handlesBefore = openHandleCount();
+   for ( int i = 0; i < ProbeCount; ++i )
+   {
+      audioProbe.reset( testMediaPath );
+      AudioProbe::Result result;
+      ASSERT_TRUE( audioProbe.probe( result ) ) << i;
+      ASSERT_EQ( result.params.sampleRate, 48000 ) << i;
+   }
+   for ( int i = 0; i < ProbeCount; ++i )
+   {
+      AudioProbe::Result result;
+      ASSERT_TRUE( AudioProbe::probe( testMediaPath, result ) ) << i;
+   }
+   if ( handlesBefore >= 0 )
+      EXPECT_EQ( openHandleCount(), handlesBefore );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, WaveformPyramid_MatchesOutputAndSurvivesSidecar )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+   const int BlockSize = 256;
+
+   AudioLoader audioLoader( testMediaPath );
+   audioLoader.enableWaveformPyramid( BlockSize );
+   ASSERT_TRUE( audioLoader.loadAudioData() );
+   const WaveformPyramid* pyramid = audioLoader.waveformPyramid();
+   ASSERT_NE( pyramid, nullptr );
+
+   const std::vector<int16_t>& samples = audioLoader.processedAudio();
+   const size_t frameCount = samples.size() / 2;
+   EXPECT_EQ( pyramid->frameCount(), frameCount );
+   EXPECT_EQ( pyramid->levelSize( pyramid->levelCount() - 1 ), 1U );
+
+   // Every level against a straightforward second pass over the output
+   for ( int level = 0; level < pyramid->levelCount(); ++level )
+   {
+      const size_t blockSize = size_t( pyramid->blockSize( level ) );
+      ASSERT_EQ( pyramid->levelSize( level ), ( frameCount + blockSize - 1 ) / blockSize );
+      for ( size_t i = 0; i < pyramid->levelSize( level ); ++i )
+      {
+         for ( int ch = 0; ch < 2; ++ch )
+         {
+            int16_t lo = 32767, hi = -32768;
+            double sumSquares = 0.0;
+            const size_t end = std::min( frameCount, ( i + 1 ) * blockSize );
+            for ( size_t f = i * blockSize; f < end; ++f )
+            {
+               lo = std::min( lo, samples[f * 2 + ch] );
+               hi = std::max( hi, samples[f * 2 + ch] );
+               const double sample = samples[f * 2 + ch] / 32768.0;
+               sumSquares += sample * sample;
+            }
+            EXPECT_EQ( pyramid->entry( level, ch, i ).min, lo / 32768.0f );
+            EXPECT_EQ( pyramid->entry( level, ch, i ).max, hi / 32768.0f );
+            EXPECT_NEAR( pyramid->entry( level, ch, i ).rms(), std::sqrt( sumSquares / double( end - i * blockSize ) ), 1e-5 )
+               << "level " << level << ", entry " << i;
+         }
+      }
+   }
+
+   // Other ways of loading build the same pyramid, entry for entry, to within the difference in
+   // their samples: none for a pipelined load, 2 LSB for a segmented one
+   auto expectSamePyramid = [pyramid]( const WaveformPyramid* other, float tolerance, const char* how )
+   {
+      ASSERT_NE( other, nullptr ) << how;
+      ASSERT_EQ( other->levelCount(), pyramid->levelCount() ) << how;
+      EXPECT_EQ( other->frameCount(), pyramid->frameCount() ) << how;
+      for ( int level = 0; level < pyramid->levelCount(); ++level )
+      {
+         ASSERT_EQ( other->levelSize( level ), pyramid->levelSize( level ) ) << how;
+         for ( size_t i = 0; i < pyramid->levelSize( level ); ++i )
+         {
+            for ( int ch = 0; ch < 2; ++ch )
+            {
+               const WaveformPyramid::Entry& expected = pyramid->entry( level, ch, i );
+               const WaveformPyramid::Entry& actual = other->entry( level, ch, i );
+               EXPECT_NEAR( actual.min, expected.min, tolerance ) << how << ", level " << level << ", entry " << i;
+               EXPECT_NEAR( actual.max, expected.max, tolerance ) << how << ", level " << level << ", entry " << i;
+               EXPECT_NEAR( actual.rms(), expected.rms(), tolerance + 1e-6f ) << how << ", level " << level << ", entry " << i;
+            }
+         }
+      }
+   };
+
+   AudioLoader pipelinedLoader( testMediaPath );
+   pipelinedLoader.enableWaveformPyramid( BlockSize );
+   ASSERT_TRUE( pipelinedLoader.loadAudioDataPipelined() );
+   expectSamePyramid( pipelinedLoader.waveformPyramid(), 0.0f, "pipelined" );
+
+   // Segmented loads stitch the pyramid together from the kept part of each segment
+   AudioLoader segmentedLoader( testMediaPath );
+   segmentedLoader.enableWaveformPyramid( BlockSize );
+   ASSERT_TRUE( segmentedLoader.loadAudioDataSegmented( 4 ) );
+   expectSamePyramid( segmentedLoader.waveformPyramid(), 2.0f / 32768.0f, "segmented" );
+
+   const std::filesystem::path sidecarPath = std::filesystem::temp_directory_path() / "FFmpegAudioTranscodeTest.peaks";
+   ASSERT_TRUE( pyramid->save( sidecarPath.string() ) );
+   WaveformPyramid reloaded;
+   ASSERT_TRUE( reloaded.load( sidecarPath.string() ) );
+   std::filesystem::remove( sidecarPath );
+
+   ASSERT_EQ( reloaded.levelCount(), pyramid->levelCount() );
+   for ( int level = 0; level < pyramid->levelCount(); ++level )
+   {
+      ASSERT_EQ( reloaded.levelSize( level ), pyramid->levelSize( level ) );
+      for ( size_t i = 0; i < pyramid->levelSize( level ); ++i )
+      {
+         EXPECT_NEAR( reloaded.entry( level, 0, i ).max, pyramid->entry( level, 0, i ).max, 1e-4 );
+         EXPECT_NEAR( reloaded.entry( level, 1, i ).rms(), pyramid->entry( level, 1, i ).rms(), 1e-4 );
+      }
+   }
+}
+
+// Signal-to-error ratio, in dB, of a tone taken from 48 kHz to 44.1 kHz, against the exact tone at
+// 44.1 kHz; the first and last 100 ms are left out
+double resampledToneSnr( ResamplerQuality quality, double frequency )
+{
+   const double Pi = 3.14159265358979323846;
+   const int InRate = 48000, OutRate = 44100;
+
+   std::vector<float> input( InRate * 2 );
+   for ( size_t i = 0; i < input.size(); ++i )
+      input[i] = float( 0.5 * std::sin( 2.0 * Pi * frequency * double( i ) / InRate ) );
+
+   AudioResampler resampler( AudioParams( 1, AV_SAMPLE_FMT_FLTP, InRate, 4 ), int( input.size() ), AudioParams( 1, AV_SAMPLE_FMT_FLTP, OutRate, 4 ), quality );
+   if ( resampler.initialize() != AudioResamplerInitState::Ok )
+      return 0.0;
+
+   std::vector<float> output;
+   const uint8_t* plane = (const uint8_t*)input.data();
+   int n = resampler.convert( &plane, int( input.size() ) );
+   output.insert( output.end(), (const float*)resampler.outputBuffers()[0], (const float*)resampler.outputBuffers()[0] + n );
+   n = resampler.flush();
+   output.insert( output.end(), (const float*)resampler.outputBuffers()[0], (const float*)resampler.outputBuffers()[0] + n );
+
+   double signal = 0.0, error = 0.0;
+   for ( size_t i = OutRate / 10; i + OutRate / 10 < output.size(); ++i )
+   {
+      const double expected = 0.5 * std::sin( 2.0 * Pi * frequency * double( i ) / OutRate );
+      signal += expected * expected;
+      error += ( output[i] - expected ) * ( output[i] - expected );
+   }
+   return 10.0 * std::log10( signal / std::max( error, 1e-30 ) );
+}
+
+// Seconds it takes, at best out of three runs, to resample ten seconds of mono 48 kHz noise to 44.1 kHz
+double resampleSeconds( ResamplerQuality quality )
+{
+   const int InRate = 48000, OutRate = 44100;
+
+   std::vector<float> input( InRate * 10 );
+   uint32_t seed = 1;
+   for ( auto& sample : input )
+   {
+      seed = seed * 1664525 + 1013904223;
+      sample = float( int32_t( seed ) ) / 4294967296.0f;
+   }
+
+   double best = 1e30;
+   for ( int run = 0; run < 3; ++run )
+   {
+      AudioResampler resampler( AudioParams( 1, AV_SAMPLE_FMT_FLTP, InRate, 4 ), int( input.size() ), AudioParams( 1, AV_SAMPLE_FMT_FLTP, OutRate, 4 ), quality );
+      if ( resampler.initialize() != AudioResamplerInitState::Ok )
+         return 1e30;
+
+      const auto start = std::chrono::steady_clock::now();
+      const uint8_t* plane = (const uint8_t*)input.data();
+      resampler.convert( &plane, int( input.size() ) );
+      resampler.flush();
+      best = std::min( best, std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+   }
+   return best;
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, ResamplerQuality_PresetsOrderedByAccuracy )
+{
+   // Mid-band, where even the short preview filter does well
+   const double preview = resampledToneSnr( ResamplerQuality::Preview, 10000.0 );
+   const double standard = resampledToneSnr( ResamplerQuality::Default, 10000.0 );
+   EXPECT_GT( preview, 30.0 );
+   EXPECT_GT( standard, preview );
+
+   // Close to the band edge, where the default filter has started to roll off and mastering's
+   // longer one hasn't; in mid-band both can come close to the limit of float samples
+   const double standardEdge = resampledToneSnr( ResamplerQuality::Default, 18000.0 );
+   const double masteringEdge = resampledToneSnr( ResamplerQuality::Mastering, 18000.0 );
+   EXPECT_GT( masteringEdge, standardEdge );
+
+   // The extra accuracy has a price, but a bounded one: preview is no slower than the default, and
+   // mastering still runs at least 20 times faster than real time
+   const double standardSeconds = resampleSeconds( ResamplerQuality::Default );
+   EXPECT_LE( resampleSeconds( ResamplerQuality::Preview ), standardSeconds * 1.5 );
+   EXPECT_LT( resampleSeconds( ResamplerQuality::Mastering ), 10.0 / 20 );
+
+   // Presets only change the filter, so loads come out the same length give or take an engine's rounding
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+   AudioLoader defaultLoader( testMediaPath );
+   ASSERT_TRUE( defaultLoader.loadAudioData() );
+   for ( ResamplerQuality quality : { ResamplerQuality::Preview, ResamplerQuality::Mastering } )
+   {
+      AudioLoader audioLoader( testMediaPath );
+      audioLoader.setResamplerQuality( quality );
+      ASSERT_TRUE( audioLoader.loadAudioData() );
+      EXPECT_LE( std::abs( int64_t( audioLoader.processedAudio().size() ) - int64_t( defaultLoader.processedAudio().size() ) ), 8 );
+   }
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, MemoryAccount_TracksLoadAndEnforcesBudget )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+
+   auto account = std::make_shared<MemoryAccount>();
+   AudioLoader audioLoader( testMediaPath );
+   audioLoader.setMemoryAccount( account );
+   ASSERT_TRUE( audioLoader.loadAudioData() );
+
+   const size_t outputBytes = audioLoader.processedAudio().size() * sizeof( int16_t );
+   EXPECT_GE( account->current( MemoryAccount::Output ), outputBytes );
+   EXPECT_EQ( account->current( MemoryAccount::Staging ), 0U );
+   EXPECT_GT( account->peak( MemoryAccount::Resampler ), 0U );
+   EXPECT_GT( account->peak( MemoryAccount::Decoder ), 0U );
+   EXPECT_GE( account->peak(), account->current() );
+   EXPECT_GE( MemoryAccount::total().current(), account->current() );
+
+   // Well short of what the output needs: the load fails up front rather than running over
+   auto limitedAccount = std::make_shared<MemoryAccount>();
+   limitedAccount->setBudget( outputBytes / 4 );
+   AudioLoader limitedLoader( testMediaPath );
+   limitedLoader.setMemoryAccount( limitedAccount );
+   EXPECT_FALSE( limitedLoader.loadAudioData() );
+   EXPECT_EQ( limitedLoader.state(), AudioLoader::MemoryBudgetExceeded );
+   EXPECT_GT( limitedAccount->refusals(), 0U );
+   EXPECT_LE( limitedAccount->peak(), outputBytes / 4 );
+   EXPECT_EQ( limitedAccount->current( MemoryAccount::Output ) + limitedAccount->current( MemoryAccount::Staging ), 0U );
+
+   limitedAccount->setBudget( 0 );
+   EXPECT_TRUE( limitedLoader.loadAudioData() );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, NativeWav_MatchesFFmpegDecode )
+{
+   const std::string testMediaPath( ".\\TestMedia\\sine.wav" );
+
+   // sine.wav is 16-bit mono at 16 kHz, so 16-bit output at that rate is mapped as it is and
+   // float output takes a conversion pass
+   for ( AVSampleFormat format : { AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLTP } )
+   {
+      const AudioParams params( 1, format, 16000, ::av_get_bytes_per_sample( format ) );
+      AudioLoader nativeLoader( testMediaPath, params );
+      ASSERT_TRUE( nativeLoader.loadAudioData() );
+      EXPECT_TRUE( nativeLoader.loadedNatively() );
+      EXPECT_FALSE( nativeLoader.loadedFromCache() );
+
+      AudioLoader ffmpegLoader( testMediaPath, params );
+      ffmpegLoader.setNativeWavReading( false );
+      ASSERT_TRUE( ffmpegLoader.loadAudioData() );
+      EXPECT_FALSE( ffmpegLoader.loadedNatively() );
+
+      const size_t frameCount = nativeLoader.processedFrameCount();
+      ASSERT_EQ( frameCount, ffmpegLoader.processedFrameCount() );
+      if ( format == AV_SAMPLE_FMT_S16 )
+         EXPECT_EQ( std::memcmp( nativeLoader.processedAudioData(), ffmpegLoader.processedAudioData(), frameCount * sizeof( int16_t ) ), 0 );
+      else
+         EXPECT_EQ( std::memcmp( nativeLoader.processedPlanarAudioData( 0 ), ffmpegLoader.processedPlanarAudioData( 0 ), frameCount * sizeof( float ) ), 0 );
+
+      // Ranges are read natively too
+      AudioLoader rangeLoader( testMediaPath, params );
+      ASSERT_TRUE( rangeLoader.loadAudioData( 1.5, 3.25 ) );
+      EXPECT_TRUE( rangeLoader.loadedNatively() );
+      EXPECT_EQ( rangeLoader.processedFrameCount(), size_t( 16000 * 7 / 4 ) );
+   }
+
+   // Anything that needs resampling still goes through FFmpeg
+   AudioLoader resamplingLoader( testMediaPath );
+   ASSERT_TRUE( resamplingLoader.loadAudioData() );
+   EXPECT_FALSE( resamplingLoader.loadedNatively() );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, WavWriter_RoundTripsEveryEncoding )
+{
+   const std::string path = ( std::filesystem::temp_directory_path() / "WavWriterTest.wav" ).string();
+   const double Pi = 3.14159265358979323846;
+   const int SampleRate = 48000;
+   const size_t FrameCount = SampleRate * 2 + 1;
+
+   std::vector<float> left( FrameCount ), right( FrameCount );
+   for ( size_t i = 0; i < FrameCount; ++i )
+   {
+      left[i] = float( 0.9 * std::sin( 2.0 * Pi * 440.0 * double( i ) / SampleRate ) );
+      right[i] = -left[i];
+   }
+
+   const std::pair<WavEncoding, double> encodings[] =
+   {
+      { WavEncoding::Unsigned8, 1.0 / 128 }, { WavEncoding::Signed16, 1.0 / 32768 }, { WavEncoding::Signed24, 1e-6 },
+      { WavEncoding::Signed32, 1e-6 }, { WavEncoding::Float32, 0.0 }, { WavEncoding::Float64, 0.0 }
+   };
+   for ( const auto& encoding : encodings )
+   {
+      // Buffered, then mapped with too short a length given so it has to carry on buffered, as RF64
+      for ( bool mapped : { false, true } )
+      {
+         WavWriter::Format format;
+         format.sampleRate = SampleRate;
+         format.encoding = encoding.first;
+         format.container = mapped ? WavWriter::Container::RF64 : WavWriter::Container::Auto;
+
+         WavWriter writer;
+         ASSERT_TRUE( writer.open( path, format, mapped ? FrameCount / 2 : 0 ) );
+         for ( size_t offset = 0; offset < FrameCount; offset += 1000 )
+         {
+            const float* planes[] = { left.data() + offset, right.data() + offset };
+            ASSERT_TRUE( writer.write( planes, std::min<size_t>( 1000, FrameCount - offset ) ) );
+         }
+         ASSERT_TRUE( writer.finish() );
+
+         // Read back by FFmpeg and natively, which have to agree
+         AudioLoader ffmpegLoader( path, AudioParams( 2, AV_SAMPLE_FMT_FLTP, SampleRate, 4 ) );
+         ffmpegLoader.setNativeWavReading( false );
+         ASSERT_TRUE( ffmpegLoader.loadAudioData() );
+         AudioLoader nativeLoader( path, AudioParams( 2, AV_SAMPLE_FMT_FLTP, SampleRate, 4 ) );
+         ASSERT_TRUE( nativeLoader.loadAudioData() );
+         EXPECT_TRUE( nativeLoader.loadedNatively() );
+
+         ASSERT_EQ( ffmpegLoader.processedFrameCount(), FrameCount );
+         ASSERT_EQ( nativeLoader.processedFrameCount(), FrameCount );
+         const auto& decoded = ffmpegLoader.processedPlanarAudio();
+         double maxError = 0.0;
+         for ( size_t i = 0; i < FrameCount; ++i )
+            maxError = std::max( maxError, double( std::abs( decoded[0][i] - left[i] ) ) + std::abs( decoded[1][i] - right[i] ) );
+         EXPECT_LE( maxError, 2.0 * encoding.second ) << int( encoding.first );
+         EXPECT_EQ( nativeLoader.processedPlanarAudio(), decoded ) << int( encoding.first );
+      }
+   }
+
+   std::filesystem::remove( path );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, Transcoder_MatchesAudioLoaderOutput )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+   const std::string path = ( std::filesystem::temp_directory_path() / "TranscoderTest.wav" ).string();
+
+   for ( AVSampleFormat sampleFormat : { AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLTP } )
+   {
+      const AudioParams params( 2, sampleFormat, 44100, ::av_get_bytes_per_sample( sampleFormat ) );
+      AudioLoader audioLoader( testMediaPath, params );
+      ASSERT_TRUE( audioLoader.loadAudioData() );
+
+      // Small chunks, so the two threads hand plenty back and forth and resampler output straddles them
+      AudioTranscoder transcoder( testMediaPath, path, params );
+      transcoder.setChunking( 1000, 3 );
+      ASSERT_TRUE( transcoder.run() );
+      EXPECT_EQ( transcoder.state(), AudioLoader::Ok );
+      EXPECT_EQ( transcoder.framesWritten(), audioLoader.processedFrameCount() );
+
+      AudioLoader wavLoader( path, params );
+      ASSERT_TRUE( wavLoader.loadAudioData() );
+      EXPECT_TRUE( wavLoader.loadedNatively() );
+      if ( sampleFormat == AV_SAMPLE_FMT_S16 )
+         EXPECT_EQ( wavLoader.processedAudio(), audioLoader.processedAudio() );
+      else
+         EXPECT_EQ( wavLoader.processedPlanarAudio(), audioLoader.processedPlanarAudio() );
+   }
+
+   EXPECT_FALSE( transcode( ".\\TestMedia\\no such file.mp3", path ) );
+   std::filesystem::remove( path );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, AudioEncoder_EncodesLoaderAndStreamOutput )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+   const std::filesystem::path dir = std::filesystem::temp_directory_path();
+
+   AudioLoader audioLoader( testMediaPath );
+   ASSERT_TRUE( audioLoader.loadAudioData() );
+
+   // FLAC is lossless, so the 16-bit output comes back exactly
+   AudioEncoder::Params params;
+   params.codec = AudioEncoder::Codec::FLAC;
+   const std::string flacPath = ( dir / "AudioEncoderTest.flac" ).string();
+   AudioEncoder flacEncoder( flacPath, audioLoader.outputParams(), params );
+   ASSERT_TRUE( flacEncoder.encode( audioLoader ) );
+   EXPECT_EQ( flacEncoder.framesEncoded(), audioLoader.processedFrameCount() );
+
+   AudioLoader flacLoader( flacPath );
+   ASSERT_TRUE( flacLoader.loadAudioData() );
+   EXPECT_EQ( flacLoader.processedAudio(), audioLoader.processedAudio() );
+   std::filesystem::remove( flacPath );
+
+   // The lossy codecs from a stream reader; Opus is resampled to 48 kHz on the way in
+   for ( AudioEncoder::Codec codec : { AudioEncoder::Codec::AAC, AudioEncoder::Codec::Opus } )
+   {
+      params.codec = codec;
+      const std::string path = ( dir / ( codec == AudioEncoder::Codec::AAC ? "AudioEncoderTest.m4a" : "AudioEncoderTest.opus" ) ).string();
+
+      AudioStreamReader streamReader( testMediaPath );
+      AudioEncoder encoder( path, streamReader.outputParams(), params );
+      ASSERT_EQ( encoder.initialize(), AudioEncoderInitState::Ok ) << AudioEncoder::codecName( codec );
+      ASSERT_TRUE( encoder.encode( streamReader ) ) << AudioEncoder::codecName( codec );
+
+      // Encoder delay is trimmed again on decoding, so the length comes back to within a frame
+      AudioLoader decoded( path );
+      ASSERT_TRUE( decoded.loadAudioData() ) << AudioEncoder::codecName( codec );
+      EXPECT_NEAR( double( decoded.processedFrameCount() ), double( audioLoader.processedFrameCount() ), 2048.0 ) << AudioEncoder::codecName( codec );
+      std::filesystem::remove( path );
+   }
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, BatchEncoder_EncodesEveryJobAndReportsFailures )
+{
+   const std::filesystem::path dir = std::filesystem::temp_directory_path();
+   std::vector<AudioBatchEncoder::Job> jobs =
+   {
+      { ".\\TestMedia\\five second stereo 48kHz sine wave.mp3", ( dir / "BatchEncoderTest0.flac" ).string() },
+      { ".\\TestMedia\\five second stereo 32kHz sine wave.mp3", ( dir / "BatchEncoderTest1.flac" ).string() },
+      { ".\\TestMedia\\no such file.mp3", ( dir / "BatchEncoderTest2.flac" ).string() }
+   };
+
+   // Rate and channel count are left to each input
+   AudioEncoder::Params params;
+   params.codec = AudioEncoder::Codec::FLAC;
+   AudioBatchEncoder batchEncoder( 2, params );
+
+   std::atomic<int> completions( 0 );
+   auto futures = batchEncoder.encode( jobs, [&]( size_t, const AudioBatchEncoder::Result& ) { ++completions; } );
+   std::vector<AudioBatchEncoder::Result> results;
+   for ( auto& future : futures )
+      results.push_back( future.get() );
+
+   ASSERT_EQ( results.size(), jobs.size() );
+   EXPECT_EQ( completions.load(), int( jobs.size() ) );
+   for ( size_t i = 0; i < 2; ++i )
+   {
+      EXPECT_TRUE( results[i].ok ) << i;
+      EXPECT_EQ( results[i].loadState, AudioLoader::Ok ) << i;
+
+      // Encoded at the input's own rate
+      AudioLoader source( jobs[i].inPath );
+      AudioLoader encoded( jobs[i].outPath );
+      ASSERT_TRUE( source.loadAudioData() );
+      ASSERT_TRUE( encoded.loadAudioData() );
+      EXPECT_NEAR( double( encoded.processedFrameCount() ), double( source.processedFrameCount() ), 2.0 ) << i;
+      std::filesystem::remove( jobs[i].outPath );
+   }
+   EXPECT_FALSE( results[2].ok );
+   EXPECT_EQ( results[2].loadState, AudioLoader::ReaderDecoderInitFails );
+}
+
+TEST_F( FFmpegAudioTranscodeIntegrationTest, BatchEncoder_ClosesEveryInputAndOutput )
+{
+   // A batch leaves nothing open once it's done, however many jobs it ran: after a warm-up batch
+   // the handle count has to come back exactly. Outputs are deleted as each job finishes.
+   const std::filesystem::path dir = std::filesystem::temp_directory_path();
+   auto makeJobs = [&dir]( int count )
+   {
+      std::vector<AudioBatchEncoder::Job> jobs;
+      for ( int i = 0; i < count; ++i )
+         jobs.push_back( { ".\\TestMedia\\five second mono sine wave.mp3", ( dir / ( "BatchEncoderHandleTest" + std::to_string( i ) + ".flac" ) ).string() } );
+      return jobs;
+   };
+
+   AudioEncoder::Params params;
+   params.codec = AudioEncoder::Codec::FLAC;
+   AudioBatchEncoder batchEncoder( 0, params );
+
+   auto runBatch = [&batchEncoder]( const std::vector<AudioBatchEncoder::Job>& jobs )
+   {
+      std::atomic<int> succeeded( 0 );
+      auto futures = batchEncoder.encode( jobs, [&]( size_t index, const AudioBatchEncoder::Result& result )
+      {
+         if ( result.ok )
+            ++succeeded;
+         std::error_code ec;
+         std::filesystem::remove( jobs[index].outPath, ec );
+      } );
+      for ( auto& future : futures )
+         future.get();
+      return succeeded.load();
+   };
+
+   const std::vector<AudioBatchEncoder::Job> warmUp = makeJobs( 4 );
+   EXPECT_EQ( runBatch( warmUp ), int( warmUp.size() ) );
+
+   const int handlesBefore = openHandleCount();
+   const std::vector<AudioBatchEncoder::Job> jobs = makeJobs( 32 );
+   EXPECT_EQ( runBatch( jobs ), int( jobs.size() ) );
+   if ( handlesBefore >= 0 )
+      EXPECT_EQ( openHandleCount(), handlesBefore );
+}
+
+#ifdef AUDIO_LOAD_STATS
+TEST_F( FFmpegAudioTranscodeIntegrationTest, LoadStats_AccountForEveryStage )
+{
+   const std::string testMediaPath( ".\\TestMedia\\five second stereo 48kHz sine wave.mp3" );
+
+   AudioLoader audioLoader( testMediaPath );
+   ASSERT_TRUE( audioLoader.loadAudioData() );
+   const LoadStats& stats = audioLoader.loadStats();
+
+   for ( int stage = 0; stage < LoadStats::StageCount; ++stage )
+      EXPECT_GT( stats.stages[stage].calls, 0U ) << LoadStats::stageName( LoadStats::Stage( stage ) );
+   EXPECT_GT( stats.bytesRead, 0U );
+   EXPECT_GT( stats.packets, 0U );
+   EXPECT_GE( stats.frames, stats.packets / 2 );
+   EXPECT_EQ( stats.resamplerOutputSamples, audioLoader.processedFrameCount() );
+   EXPECT_NEAR( double( stats.resamplerInputSamples ), 5.0 * 48000, 48000 );
+
+   // Stats start over with each load, and a segmented load takes in its segments'
+   const uint64_t packets = stats.packets;
+   ASSERT_TRUE( audioLoader.loadAudioDataSegmented( 4 ) );
+   EXPECT_GE( audioLoader.loadStats().packets, packets );
+   EXPECT_LT( audioLoader.loadStats().packets, packets * 2 );
+}
+#endif
 
 class VideoExporterIntegrationTest : public ::testing::Test
 {
@@ -0,0 +1,120 @@
+#include "Benchmark.h"
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+namespace
+{
+   std::vector<BenchmarkResult> printedResults;
+
+   std::string jsonString( const std::string& s )
+   {
+      std::string quoted( 1, '"' );
+      for ( char c : s )
+      {
+         if ( c == '"' || c == '\\' )
+            quoted += '\\';
+         if ( (unsigned char)c >= 0x20 )
+            quoted += c;
+      }
+      return quoted + '"';
+   }
+}
+
+double processCpuSeconds()
+{
+#ifdef _WIN32
+   // The MSVC runtime's clock() measures wall time, so ask for the process's times directly
+   FILETIME creation, exited, kernel, user;
+   if ( !::GetProcessTimes( ::GetCurrentProcess(), &creation, &exited, &kernel, &user ) )
+      return 0.0;
+   auto seconds = []( const FILETIME& time ) { return ( ( uint64_t( time.dwHighDateTime ) << 32 ) | time.dwLowDateTime ) * 100e-9; };
+   return seconds( kernel ) + seconds( user );
+#else
+   return double( std::clock() ) / CLOCKS_PER_SEC;
+#endif
+}
+
+BenchmarkResult runBenchmark( const std::string& name, uint64_t samplesPerIteration, uint64_t bytesPerIteration,
+                              std::function<void()> fn, double minSeconds/*=1.0*/ )
+{
+   fn();
+
+   typedef std::chrono::steady_clock Clock;
+   auto start = Clock::now();
+   const double cpuStart = processCpuSeconds();
+   double elapsed = 0.0;
+   int iterations = 0;
+   do
+   {
+      fn();
+      ++iterations;
+      elapsed = std::chrono::duration<double>( Clock::now() - start ).count();
+   } while ( elapsed < minSeconds );
+
+   const double cpuSeconds = processCpuSeconds() - cpuStart;
+   BenchmarkResult result = { name, iterations, elapsed / iterations, samplesPerIteration, bytesPerIteration, cpuSeconds / iterations };
+   return result;
+}
+
+void printBenchmarkHeader()
+{
+   std::printf( "%-48s %8s %12s %12s %12s %10s\n", "benchmark", "iters", "ms/iter", "ns/sample", "Msamples/s", "MB/s" );
+}
+
+void printBenchmarkResult( const BenchmarkResult& result )
+{
+   double nsPerSample = result.samplesPerIteration ? result.secondsPerIteration * 1e9 / result.samplesPerIteration : 0.0;
+   double samplesPerSec = result.samplesPerIteration / result.secondsPerIteration;
+   double bytesPerSec = result.bytesPerIteration / result.secondsPerIteration;
+
+   std::printf( "%-48s %8d %12.3f %12.3f %12.2f %10.1f\n", result.name.c_str(), result.iterations,
+                result.secondsPerIteration * 1e3, nsPerSample, samplesPerSec / 1e6, bytesPerSec / ( 1024.0 * 1024.0 ) );
+
+   printedResults.push_back( result );
+}
+
+bool writeBenchmarkJson( const std::string& path, const std::map<std::string, std::string>& context )
+{
+   std::ofstream file( path );
+
+   file << "{\n  \"context\": {";
+   const char* separator = "\n";
+   for ( const auto& entry : context )
+   {
+      file << separator << "    " << jsonString( entry.first ) << ": " << jsonString( entry.second );
+      separator = ",\n";
+   }
+   file << "\n  },\n  \"benchmarks\": [";
+
+   separator = "\n";
+   for ( const auto& result : printedResults )
+   {
+      const double nsPerIteration = result.secondsPerIteration * 1e9;
+      file << separator << "    {\n"
+           << "      \"name\": " << jsonString( result.name ) << ",\n"
+           << "      \"run_name\": " << jsonString( result.name ) << ",\n"
+           << "      \"run_type\": \"iteration\",\n"
+           << "      \"iterations\": " << result.iterations << ",\n"
+           << "      \"real_time\": " << nsPerIteration << ",\n"
+           << "      \"cpu_time\": " << result.cpuSecondsPerIteration * 1e9 << ",\n"
+           << "      \"time_unit\": \"ns\",\n"
+           << "      \"items_per_second\": " << result.samplesPerIteration / result.secondsPerIteration << ",\n"
+           << "      \"bytes_per_second\": " << result.bytesPerIteration / result.secondsPerIteration << ",\n"
+           << "      \"samples_per_iteration\": " << result.samplesPerIteration << ",\n"
+           << "      \"bytes_per_iteration\": " << result.bytesPerIteration << "\n"
+           << "    }";
+      separator = ",\n";
+   }
+   file << "\n  ]\n}\n";
+
+   return bool( file );
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+
+struct BenchmarkResult
+{
+   std::string name;
+   int         iterations;
+   double      secondsPerIteration;
+   uint64_t    samplesPerIteration;
+   uint64_t    bytesPerIteration;
+   double      cpuSecondsPerIteration;   // of the whole process, so every thread a load starts counts
+};
+
+// CPU time, user plus kernel, the process has used so far across all of its threads
+double processCpuSeconds();
+
+// Calls fn once untimed to warm up, then repeatedly until at least minSeconds of wall time have
+// elapsed
+BenchmarkResult runBenchmark( const std::string& name, uint64_t samplesPerIteration, uint64_t bytesPerIteration,
+                              std::function<void()> fn, double minSeconds = 1.0 );
+
+void printBenchmarkHeader();
+
+// Also keeps the result for writeBenchmarkJson()
+void printBenchmarkResult( const BenchmarkResult& result );
+
+// Every result printed so far, in the layout of Google Benchmark's JSON output so its comparison
+// tools can be pointed at two runs. Context entries describe the run (versions, machine, etc).
+bool writeBenchmarkJson( const std::string& path, const std::map<std::string, std::string>& context );
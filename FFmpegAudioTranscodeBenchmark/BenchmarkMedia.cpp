@@ -0,0 +1,207 @@
+#include "BenchmarkMedia.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+}
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+
+namespace
+{
+   const double Pi = 3.14159265358979323846;
+   const double SweepSeconds = 10.0;
+   const double SweepStartHz = 100.0;
+   const double SweepEndHz = 5000.0;
+
+   // Linear sweep restarting every SweepSeconds; channels are offset in phase so they differ
+   double sweepSample( int64_t position, int sampleRate, int channel )
+   {
+      double t = std::fmod( double( position ) / sampleRate, SweepSeconds );
+      double phase = 2.0 * Pi * ( SweepStartHz * t + ( SweepEndHz - SweepStartHz ) * t * t / ( 2.0 * SweepSeconds ) );
+      return 0.5 * std::sin( phase + channel * 0.7 );
+   }
+
+   bool fillFrame( AVFrame* frame, int64_t position, int sampleRate )
+   {
+      const int channelCount = frame->channels;
+      const AVSampleFormat format = AVSampleFormat( frame->format );
+      const bool planar = ::av_sample_fmt_is_planar( format ) != 0;
+
+      for ( int i = 0; i < frame->nb_samples; ++i )
+      {
+         for ( int ch = 0; ch < channelCount; ++ch )
+         {
+            const double value = sweepSample( position + i, sampleRate, ch );
+            const int index = planar ? i : i * channelCount + ch;
+            uint8_t* plane = frame->extended_data[planar ? ch : 0];
+            switch ( ::av_get_packed_sample_fmt( format ) )
+            {
+            case AV_SAMPLE_FMT_S16: reinterpret_cast<int16_t*>( plane )[index] = int16_t( std::lround( value * 32767.0 ) ); break;
+            case AV_SAMPLE_FMT_S32: reinterpret_cast<int32_t*>( plane )[index] = int32_t( std::lround( value * 2147483647.0 ) ); break;
+            case AV_SAMPLE_FMT_FLT: reinterpret_cast<float*>( plane )[index] = float( value ); break;
+            case AV_SAMPLE_FMT_DBL: reinterpret_cast<double*>( plane )[index] = value; break;
+            default: return false;
+            }
+         }
+      }
+      return true;
+   }
+
+   bool writePackets( AVFormatContext* formatContext, AVCodecContext* codecContext, AVStream* stream, AVPacket* packet )
+   {
+      int status;
+      while ( ( status = ::avcodec_receive_packet( codecContext, packet ) ) == 0 )
+      {
+         ::av_packet_rescale_ts( packet, codecContext->time_base, stream->time_base );
+         packet->stream_index = stream->index;
+         if ( ::av_interleaved_write_frame( formatContext, packet ) < 0 )
+            return false;
+      }
+      return status == AVERROR( EAGAIN ) || status == AVERROR_EOF;
+   }
+
+   bool encode( const std::string& path, const BenchmarkMediaSpec& spec, AVFormatContext* formatContext,
+                AVCodecContext*& codecContext, AVFrame*& frame, AVPacket*& packet )
+   {
+      const AVCodec* codec = ::avcodec_find_encoder( formatContext->oformat->audio_codec );
+      if ( codec == nullptr )
+         return false;
+
+      codecContext = ::avcodec_alloc_context3( codec );
+      if ( codecContext == nullptr )
+         return false;
+      codecContext->sample_rate = spec.sampleRate;
+      codecContext->channels = spec.channelCount;
+      codecContext->channel_layout = ::av_get_default_channel_layout( spec.channelCount );
+      codecContext->sample_fmt = ( codec->sample_fmts != nullptr ) ? codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+      codecContext->bit_rate = 64000 * spec.channelCount;
+      codecContext->time_base = { 1, spec.sampleRate };
+      if ( formatContext->oformat->flags & AVFMT_GLOBALHEADER )
+         codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+      if ( ::avcodec_open2( codecContext, codec, nullptr ) != 0 )
+         return false;
+
+      AVStream* stream = ::avformat_new_stream( formatContext, nullptr );
+      if ( stream == nullptr || ::avcodec_parameters_from_context( stream->codecpar, codecContext ) < 0 )
+         return false;
+      stream->time_base = codecContext->time_base;
+
+      if ( ::avio_open( &formatContext->pb, path.c_str(), AVIO_FLAG_WRITE ) < 0 )
+         return false;
+      if ( ::avformat_write_header( formatContext, nullptr ) < 0 )
+         return false;
+
+      // PCM encoders take frames of any size
+      const bool fixedFrameSize = codecContext->frame_size > 0 && !( codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE );
+      const int frameSize = fixedFrameSize ? codecContext->frame_size : 4096;
+
+      frame = ::av_frame_alloc();
+      packet = ::av_packet_alloc();
+      if ( frame == nullptr || packet == nullptr )
+         return false;
+      frame->format = codecContext->sample_fmt;
+      frame->channels = codecContext->channels;
+      frame->channel_layout = codecContext->channel_layout;
+      frame->sample_rate = codecContext->sample_rate;
+      frame->nb_samples = frameSize;
+      if ( ::av_frame_get_buffer( frame, 0 ) < 0 )
+         return false;
+
+      const int64_t totalSamples = int64_t( spec.seconds * spec.sampleRate );
+      for ( int64_t position = 0; position < totalSamples; position += frame->nb_samples )
+      {
+         if ( ::av_frame_make_writable( frame ) < 0 )
+            return false;
+
+         // Every encoder used here accepts a short final frame
+         frame->nb_samples = int( std::min<int64_t>( frameSize, totalSamples - position ) );
+         frame->pts = position;
+         if ( !fillFrame( frame, position, spec.sampleRate ) )
+            return false;
+
+         if ( ::avcodec_send_frame( codecContext, frame ) < 0 || !writePackets( formatContext, codecContext, stream, packet ) )
+            return false;
+      }
+
+      if ( ::avcodec_send_frame( codecContext, nullptr ) < 0 || !writePackets( formatContext, codecContext, stream, packet ) )
+         return false;
+
+      return ::av_write_trailer( formatContext ) == 0;
+   }
+}
+
+std::string BenchmarkMediaSpec::fileName() const
+{
+   char name[96];
+   std::snprintf( name, sizeof( name ), "%s-%dHz-%dch-%ds%s", extension.c_str() + 1, sampleRate, channelCount, int( seconds ), extension.c_str() );
+   return name;
+}
+
+std::vector<BenchmarkMediaSpec> benchmarkMediaSpecs( bool longInputs )
+{
+   std::vector<BenchmarkMediaSpec> specs;
+   for ( const char* extension : { ".mp3", ".m4a", ".wav", ".flac" } )
+   {
+      // MP3 doesn't go beyond two channels
+      const bool multichannel = std::string( extension ) != ".mp3";
+
+      for ( int sampleRate : { 22050, 44100, 48000, 96000 } )
+      {
+         // MP3 tops out at 48 kHz
+         if ( sampleRate > 48000 && !multichannel )
+            continue;
+
+         for ( int channelCount : { 1, 2, 6 } )
+         {
+            if ( channelCount > 2 && !multichannel )
+               continue;
+            specs.push_back( { extension, sampleRate, channelCount, 10.0 } );
+         }
+      }
+
+      specs.push_back( { extension, 48000, 2, 600.0 } );
+      if ( longInputs )
+         specs.push_back( { extension, 48000, 2, 3600.0 } );
+   }
+   return specs;
+}
+
+bool generateBenchmarkMedia( const std::string& path, const BenchmarkMediaSpec& spec )
+{
+   // The container is picked from the real name, but the file is written under a temporary one
+   // so that an interrupted run doesn't leave a truncated file to be picked up by the next
+   AVFormatContext* formatContext = nullptr;
+   ::avformat_alloc_output_context2( &formatContext, nullptr, nullptr, path.c_str() );
+   if ( formatContext == nullptr )
+      return false;
+
+   const std::string tempPath = path + ".part";
+   AVCodecContext* codecContext = nullptr;
+   AVFrame* frame = nullptr;
+   AVPacket* packet = nullptr;
+   bool ok = encode( tempPath, spec, formatContext, codecContext, frame, packet );
+
+   if ( packet != nullptr )
+      ::av_packet_free( &packet );
+   if ( frame != nullptr )
+      ::av_frame_free( &frame );
+   if ( codecContext != nullptr )
+      ::avcodec_free_context( &codecContext );
+   if ( formatContext->pb != nullptr )
+      ::avio_closep( &formatContext->pb );
+   ::avformat_free_context( formatContext );
+
+   std::error_code ec;
+   if ( ok )
+      std::filesystem::rename( tempPath, path, ec );
+   if ( !ok || ec )
+      std::filesystem::remove( tempPath, ec );
+   return ok && std::filesystem::exists( path, ec );
+}
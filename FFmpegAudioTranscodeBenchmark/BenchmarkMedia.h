@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Test media for the benchmarks, encoded at run time so nothing large has to be checked in
+struct BenchmarkMediaSpec
+{
+   std::string extension;     // picks the container and its default audio codec: ".mp3", ".m4a", ".wav", ".flac"
+   int         sampleRate;
+   int         channelCount;
+   double      seconds;
+
+   // e.g. "flac-48000Hz-2ch-300s.flac"
+   std::string fileName() const;
+};
+
+// Combinations of codec, sample rate and channel count, several seconds long each, plus longer
+// stereo files; longInputs adds hour-long ones
+std::vector<BenchmarkMediaSpec> benchmarkMediaSpecs( bool longInputs );
+
+// Writes a repeating sine sweep with the given format to path. Returns false if the build of
+// FFmpeg lacks the encoder or muxer, or the file can't be written.
+bool generateBenchmarkMedia( const std::string& path, const BenchmarkMediaSpec& spec );
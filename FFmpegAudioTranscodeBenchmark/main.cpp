@@ -0,0 +1,817 @@
+// Benchmarks for the decode/resample path. Run from the project directory, or pass the
+// directory holding the test media as the first argument.
+//
+//   --json <file>   also write the results, with the FFmpeg version and machine, as JSON
+//   --long          add hour-long inputs to the generated media
+//
+// The generated media are encoded into a directory under the temp directory on the first run
+// and reused after that.
+
+#include "Benchmark.h"
+#include "BenchmarkMedia.h"
+
+#include "AudioBatchEncoder.h"
+#include "AudioBatchLoader.h"
+#include "AudioLoader.h"
+#include "AudioProbe.h"
+#include "AudioReaderDecoder.h"
+#include "AudioResampler.h"
+#include "AudioTranscoder.h"
+#include "InitFFmpeg.h"
+#include "InterleaveKernels.h"
+#include "SampleBlockStore.h"
+#include "WavUtil.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+}
+
+namespace
+{
+   // Keeps the optimizer from discarding benchmarked work
+   volatile size_t sink = 0;
+
+   // Ten minutes of 44.1 kHz stereo, handed over in the one-second chunks the resampler produces
+   const int    ChunkFrameCount = 44100;
+   const int    ChunkCount = 600;
+   const size_t TotalSampleCount = size_t( ChunkFrameCount ) * 2 * ChunkCount;
+
+   void benchmarkOutputAccumulation()
+   {
+      std::vector<int16_t> chunk( ChunkFrameCount * 2 );
+      for ( size_t i = 0; i < chunk.size(); ++i )
+         chunk[i] = int16_t( i );
+
+      // What AudioLoader::copyResampledAudio used to do: two push_back calls per frame into
+      // a vector that was never reserved
+      printBenchmarkResult( runBenchmark( "Accumulate/PushBackPerFrame", TotalSampleCount, TotalSampleCount * 2, [&]()
+      {
+         std::vector<int16_t> out;
+         for ( int c = 0; c < ChunkCount; ++c )
+         {
+            const int16_t* ptr = chunk.data();
+            for ( int i = 0; i < ChunkFrameCount; ++i )
+            {
+               out.push_back( *ptr++ );
+               out.push_back( *ptr++ );
+            }
+         }
+         sink = sink + out.size();
+      } ) );
+
+      // Store sized from the stream duration; everything lands in one block and is moved out
+      printBenchmarkResult( runBenchmark( "Accumulate/BlockStorePresized", TotalSampleCount, TotalSampleCount * 2, [&]()
+      {
+         SampleBlockStore<int16_t> store;
+         store.reserve( TotalSampleCount + ChunkFrameCount );
+         for ( int c = 0; c < ChunkCount; ++c )
+            store.append( chunk.data(), chunk.size() );
+
+         std::vector<int16_t> out;
+         store.moveTo( out );
+         sink = sink + out.size();
+      } ) );
+
+      // Duration unknown: the store grows block by block and is concatenated once at the end
+      printBenchmarkResult( runBenchmark( "Accumulate/BlockStoreUnsized", TotalSampleCount, TotalSampleCount * 2, [&]()
+      {
+         SampleBlockStore<int16_t> store;
+         for ( int c = 0; c < ChunkCount; ++c )
+            store.append( chunk.data(), chunk.size() );
+
+         std::vector<int16_t> out;
+         store.moveTo( out );
+         sink = sink + out.size();
+      } ) );
+   }
+
+   // Planar to interleaved conversion, one second of decoded audio at a time
+   void benchmarkInterleave()
+   {
+      const size_t FrameCount = 48000;
+      const InterleaveIsa best = detectInterleaveIsa();
+
+      for ( int bytesPerSample : { 2, 4 } )
+      {
+         for ( int channelCount : { 1, 2, 6, 8 } )
+         {
+            std::vector< std::vector<uint8_t> > planeData( channelCount, std::vector<uint8_t>( FrameCount * bytesPerSample ) );
+            std::vector<const uint8_t*> planes;
+            for ( auto& plane : planeData )
+            {
+               for ( size_t i = 0; i < plane.size(); ++i )
+                  plane[i] = uint8_t( i );
+               planes.push_back( plane.data() );
+            }
+            std::vector<uint8_t> out( FrameCount * channelCount * bytesPerSample );
+
+            const uint64_t sampleCount = FrameCount * channelCount;
+            const uint64_t byteCount = sampleCount * bytesPerSample;
+            const std::string suffix = "/bytes:" + std::to_string( bytesPerSample ) + "/channels:" + std::to_string( channelCount );
+
+            printBenchmarkResult( runBenchmark( "Interleave/MemcpyLoop" + suffix, sampleCount, byteCount, [&]()
+            {
+               interleaveReference( planes.data(), 0, FrameCount, channelCount, bytesPerSample, out.data() );
+               sink = sink + out[0];
+            } ) );
+
+            const std::pair<InterleaveIsa, const char*> isas[] =
+            {
+               { InterleaveIsa::Scalar, "Scalar" }, { InterleaveIsa::SSE2, "SSE2" }, { InterleaveIsa::AVX2, "AVX2" }
+            };
+            for ( const auto& isa : isas )
+            {
+               if ( isa.first > best )
+                  continue;
+
+               InterleaveKernel kernel = selectInterleaveKernel( bytesPerSample, channelCount, isa.first );
+               printBenchmarkResult( runBenchmark( std::string( "Interleave/" ) + isa.second + suffix, sampleCount, byteCount, [&]()
+               {
+                  kernel( planes.data(), 0, FrameCount, channelCount, out.data() );
+                  sink = sink + out[0];
+               } ) );
+            }
+         }
+      }
+   }
+
+   const std::pair<ResamplerQuality, const char*> resamplerQualities[] =
+   {
+      { ResamplerQuality::Preview, "Preview" }, { ResamplerQuality::Default, "Default" }, { ResamplerQuality::Mastering, "Mastering" }
+   };
+
+   // Sine at half of full scale, one plane per channel
+   std::vector< std::vector<float> > makeSine( double frequency, int sampleRate, size_t frameCount, int channelCount )
+   {
+      const double Pi = 3.14159265358979323846;
+      std::vector< std::vector<float> > planes( channelCount, std::vector<float>( frameCount ) );
+      for ( auto& plane : planes )
+      {
+         for ( size_t i = 0; i < frameCount; ++i )
+            plane[i] = float( 0.5 * std::sin( 2.0 * Pi * frequency * double( i ) / sampleRate ) );
+      }
+      return planes;
+   }
+
+   // Resamples a pure tone and compares the result with the exact tone at the output rate,
+   // returning the signal-to-error ratio in dB. The ends are left out, where the filter runs
+   // off the edge of the signal, and small whole-sample delays are allowed for.
+   double resamplingSnr( ResamplerQuality quality, int inRate, int outRate, double frequency )
+   {
+      const double Pi = 3.14159265358979323846;
+      const int inFrameCount = inRate * 2;
+      const auto input = makeSine( frequency, inRate, size_t( inFrameCount ), 1 );
+
+      AudioResampler resampler( AudioParams( 1, AV_SAMPLE_FMT_FLTP, inRate, 4 ), inFrameCount, AudioParams( 1, AV_SAMPLE_FMT_FLTP, outRate, 4 ), quality );
+      if ( resampler.initialize() != AudioResamplerInitState::Ok )
+         return 0.0;
+
+      std::vector<float> output;
+      auto appendOutput = [&]( int n )
+      {
+         const float* converted = (const float*)resampler.outputBuffers()[0];
+         output.insert( output.end(), converted, converted + std::max( n, 0 ) );
+      };
+      const uint8_t* plane = (const uint8_t*)input[0].data();
+      appendOutput( resampler.convert( &plane, inFrameCount ) );
+      appendOutput( resampler.flush() );
+
+      double best = 0.0;
+      const size_t margin = size_t( outRate / 10 );
+      for ( int delay = -16; delay <= 16; ++delay )
+      {
+         double signal = 0.0, error = 0.0;
+         for ( size_t i = margin; i + margin < output.size(); ++i )
+         {
+            const double expected = 0.5 * std::sin( 2.0 * Pi * frequency * double( int64_t( i ) - delay ) / outRate );
+            signal += expected * expected;
+            error += ( output[i] - expected ) * ( output[i] - expected );
+         }
+         if ( error > 0.0 )
+            best = std::max( best, 10.0 * std::log10( signal / error ) );
+      }
+      return best;
+   }
+
+   // Each quality preset on ten seconds of 48 kHz stereo going to 44.1 kHz, along with how far the
+   // result strays from the exact signal
+   void benchmarkResamplerQuality()
+   {
+      const int InRate = 48000;
+      const int ChunkFrames = 4096;
+      const size_t FrameCount = size_t( InRate ) * 10;
+      const auto input = makeSine( 1000.0, InRate, FrameCount, 2 );
+      const uint64_t sampleCount = FrameCount * 2;
+
+      for ( const auto& quality : resamplerQualities )
+      {
+         AudioResampler resampler( AudioParams( 2, AV_SAMPLE_FMT_FLTP, InRate, 4 ), ChunkFrames, AudioLoader::defaultOutputParams(), quality.first );
+         if ( resampler.initialize() != AudioResamplerInitState::Ok )
+            continue;
+
+         printBenchmarkResult( runBenchmark( std::string( "Resample/quality:" ) + quality.second, sampleCount, sampleCount * sizeof( float ), [&]()
+         {
+            resampler.reset();
+            for ( size_t offset = 0; offset < FrameCount; offset += ChunkFrames )
+            {
+               const uint8_t* planes[2] = { (const uint8_t*)( input[0].data() + offset ), (const uint8_t*)( input[1].data() + offset ) };
+               sink = sink + resampler.convert( planes, int( std::min<size_t>( ChunkFrames, FrameCount - offset ) ) );
+            }
+            sink = sink + resampler.flush();
+         } ) );
+
+         std::printf( "   %s%s: SNR %.1f dB at 1 kHz, %.1f dB at 10 kHz, %.1f dB at 18 kHz\n", quality.second, resampler.usingSoxr() ? " (soxr)" : "",
+                      resamplingSnr( quality.first, InRate, 44100, 1000.0 ), resamplingSnr( quality.first, InRate, 44100, 10000.0 ),
+                      resamplingSnr( quality.first, InRate, 44100, 18000.0 ) );
+      }
+   }
+
+   // A minute of stereo at 48 kHz to a temporary file, buffered or mapped, from interleaved 16-bit
+   // (no conversion for 16-bit files) and from planar float
+   void benchmarkWavWriter()
+   {
+      const int SampleRate = 48000;
+      const size_t FrameCount = SampleRate * 60;
+      const size_t SpanFrames = 4096;
+      const std::string path = ( std::filesystem::temp_directory_path() / "FFmpegAudioTranscodeBenchmark.wav" ).string();
+
+      const auto planes = makeSine( 440.0, SampleRate, FrameCount, 2 );
+      std::vector<int16_t> interleaved( FrameCount * 2 );
+      for ( size_t i = 0; i < interleaved.size(); ++i )
+         interleaved[i] = int16_t( planes[i % 2][i / 2] * 32767.0f );
+
+      const std::pair<WavEncoding, const char*> encodings[] =
+      {
+         { WavEncoding::Signed16, "S16" }, { WavEncoding::Signed24, "S24" }, { WavEncoding::Float32, "F32" }
+      };
+      for ( const auto& encoding : encodings )
+      {
+         WavWriter::Format format;
+         format.sampleRate = SampleRate;
+         format.encoding = encoding.first;
+         const uint64_t sampleCount = FrameCount * 2;
+         const uint64_t byteCount = sampleCount * ( encoding.first == WavEncoding::Signed24 ? 3 : encoding.first == WavEncoding::Signed16 ? 2 : 4 );
+
+         for ( bool mapped : { false, true } )
+         {
+            const std::string suffix = std::string( "/" ) + encoding.second + ( mapped ? "/mapped" : "/buffered" );
+            printBenchmarkResult( runBenchmark( "WavWriter/FromS16" + suffix, sampleCount, byteCount, [&]()
+            {
+               WavWriter writer;
+               writer.open( path, format, mapped ? FrameCount : 0 );
+               for ( size_t offset = 0; offset < FrameCount; offset += SpanFrames )
+                  writer.write( interleaved.data() + offset * 2, std::min( SpanFrames, FrameCount - offset ) );
+               writer.finish();
+            } ) );
+
+            printBenchmarkResult( runBenchmark( "WavWriter/FromFltp" + suffix, sampleCount, byteCount, [&]()
+            {
+               WavWriter writer;
+               writer.open( path, format, mapped ? FrameCount : 0 );
+               for ( size_t offset = 0; offset < FrameCount; offset += SpanFrames )
+               {
+                  const float* span[] = { planes[0].data() + offset, planes[1].data() + offset };
+                  writer.write( span, std::min( SpanFrames, FrameCount - offset ) );
+               }
+               writer.finish();
+            } ) );
+         }
+      }
+
+      std::error_code ec;
+      std::filesystem::remove( path, ec );
+   }
+
+   // Time from loadAudioDataAsync() until the first tenth of a second of output can be read, over
+   // a few loads; each load is then left to finish untimed. runBenchmark() can't leave that out.
+   BenchmarkResult timeToFirstAudio( const std::string& name, const std::string& path )
+   {
+      const int    Iterations = 5;
+      const size_t FirstFrameCount = 4410;
+
+      double seconds = 0.0, cpuSeconds = 0.0;
+      for ( int i = 0; i < Iterations; ++i )
+      {
+         AudioLoader audioLoader( path );
+         const auto start = std::chrono::steady_clock::now();
+         const double cpuStart = processCpuSeconds();
+         std::future<bool> loaded = audioLoader.loadAudioDataAsync();
+         while ( audioLoader.availableFrames() < FirstFrameCount && loaded.wait_for( std::chrono::seconds( 0 ) ) != std::future_status::ready )
+            std::this_thread::yield();
+         seconds += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+         cpuSeconds += processCpuSeconds() - cpuStart;
+         sink = sink + size_t( loaded.get() );
+      }
+
+      return BenchmarkResult { name, Iterations, seconds / Iterations, FirstFrameCount * 2, FirstFrameCount * 4, cpuSeconds / Iterations };
+   }
+
+   void benchmarkAudioLoader( const std::filesystem::path& mediaDir )
+   {
+      std::error_code ec;
+      for ( const auto& entry : std::filesystem::directory_iterator( mediaDir, ec ) )
+      {
+         const std::string path = entry.path().string();
+
+         AudioLoader probe( path );
+         if ( !probe.loadAudioData() )
+         {
+            std::printf( "skipping %s (load fails)\n", path.c_str() );
+            continue;
+         }
+         uint64_t sampleCount = probe.processedAudio().size();
+
+         printBenchmarkResult( runBenchmark( "AudioLoader/" + entry.path().filename().string(), sampleCount, sampleCount * 2, [&]()
+         {
+            AudioLoader audioLoader( path );
+            audioLoader.loadAudioData();
+            sink = sink + audioLoader.processedAudio().size();
+         } ) );
+
+         for ( const auto& quality : resamplerQualities )
+         {
+            if ( quality.first == ResamplerQuality::Default )
+               continue;
+
+            printBenchmarkResult( runBenchmark( std::string( "AudioLoader/quality:" ) + quality.second + "/" + entry.path().filename().string(), sampleCount, sampleCount * 2, [&]()
+            {
+               AudioLoader audioLoader( path );
+               audioLoader.setResamplerQuality( quality.first );
+               audioLoader.loadAudioData();
+               sink = sink + audioLoader.processedAudio().size();
+            } ) );
+         }
+
+         // Same load, building the waveform overview along the way
+         printBenchmarkResult( runBenchmark( "AudioLoader/WaveformPyramid/" + entry.path().filename().string(), sampleCount, sampleCount * 2, [&]()
+         {
+            AudioLoader audioLoader( path );
+            audioLoader.enableWaveformPyramid();
+            audioLoader.loadAudioData();
+            sink = sink + audioLoader.waveformPyramid()->levelCount();
+         } ) );
+      }
+   }
+
+   // Decoder thread counts per codec; only decoders with frame or slice threading speed up
+   void benchmarkDecoderThreading( const std::filesystem::path& mediaDir )
+   {
+      std::error_code ec;
+      for ( const auto& entry : std::filesystem::directory_iterator( mediaDir, ec ) )
+      {
+         const std::string path = entry.path().string();
+
+         AudioReaderDecoder readerDecoder( path );
+         if ( readerDecoder.initialize() != AudioReaderDecoderInitState::Ok )
+            continue;
+         const std::string codecName = readerDecoder.codecName();
+
+         AudioLoader probe( path );
+         if ( !probe.loadAudioData() )
+            continue;
+         uint64_t sampleCount = probe.processedAudio().size();
+
+         for ( int threadCount : { 1, 2, 4, 0 } )
+         {
+            DecoderOptions options;
+            options.threadCount = threadCount;
+
+            std::string name = "Decoder/" + codecName + "/threads:" + ( threadCount == 0 ? std::string( "auto" ) : std::to_string( threadCount ) ) + "/" + entry.path().filename().string();
+            printBenchmarkResult( runBenchmark( name, sampleCount, sampleCount * 2, [&]()
+            {
+               AudioLoader audioLoader( path );
+               audioLoader.setDecoderOptions( options );
+               audioLoader.loadAudioData();
+               sink = sink + audioLoader.processedAudio().size();
+            } ) );
+         }
+      }
+   }
+
+   // Single-file loads that use more than one thread: split into time ranges, or pipelined by stage
+   void benchmarkParallelLoad( const std::filesystem::path& mediaDir )
+   {
+      std::error_code ec;
+      for ( const auto& entry : std::filesystem::directory_iterator( mediaDir, ec ) )
+      {
+         const std::string path = entry.path().string();
+
+         AudioLoader probe( path );
+         if ( !probe.loadAudioData() )
+            continue;
+         uint64_t sampleCount = probe.processedAudio().size();
+
+         printBenchmarkResult( runBenchmark( "AudioLoader/Segmented/" + entry.path().filename().string(), sampleCount, sampleCount * 2, [&]()
+         {
+            AudioLoader audioLoader( path );
+            audioLoader.loadAudioDataSegmented();
+            sink = sink + audioLoader.processedAudio().size();
+         } ) );
+
+         printBenchmarkResult( runBenchmark( "AudioLoader/Pipelined/" + entry.path().filename().string(), sampleCount, sampleCount * 2, [&]()
+         {
+            AudioLoader audioLoader( path );
+            audioLoader.loadAudioDataPipelined();
+            sink = sink + audioLoader.processedAudio().size();
+         } ) );
+      }
+   }
+
+   // Metadata only, as when scheduling a large batch; compared with opening a full reader-decoder
+   void benchmarkProbe( const std::filesystem::path& mediaDir )
+   {
+      std::error_code ec;
+      for ( const auto& entry : std::filesystem::directory_iterator( mediaDir, ec ) )
+      {
+         const std::string path = entry.path().string();
+
+         AudioProbe::Result result;
+         if ( !AudioProbe::probe( path, result ) )
+            continue;
+
+         AudioProbe audioProbe( path );
+         printBenchmarkResult( runBenchmark( "AudioProbe/" + entry.path().filename().string(), 0, 0, [&]()
+         {
+            audioProbe.reset( path );
+            audioProbe.probe( result );
+            sink = sink + result.params.sampleRate;
+         } ) );
+
+         printBenchmarkResult( runBenchmark( "AudioReaderDecoder/Initialize/" + entry.path().filename().string(), 0, 0, [&]()
+         {
+            AudioReaderDecoder readerDecoder( path );
+            readerDecoder.initialize();
+            sink = sink + size_t( readerDecoder.initState() );
+         } ) );
+      }
+   }
+
+   // Each generated input through the stages separately -- demux and decode only, resample only
+   // from decoded audio held in memory -- and then through the whole of AudioLoader
+   void benchmarkGeneratedMedia( const std::filesystem::path& dir, bool longInputs )
+   {
+      // Resampling is timed on at most this much of each input, so hour-long files don't have to
+      // be held in memory decoded
+      const double MaxResampleSeconds = 60.0;
+      const int    ResampleChunkFrames = 4096;
+
+      // Random reads of compressed and plain output
+      const size_t ReadFrameCount = 4096;
+      const int    RandomReadCount = 1000;
+
+      std::error_code ec;
+      std::filesystem::create_directories( dir, ec );
+
+      for ( const auto& spec : benchmarkMediaSpecs( longInputs ) )
+      {
+         const std::string fileName = spec.fileName();
+         const std::string path = ( dir / fileName ).string();
+         if ( !std::filesystem::exists( path, ec ) && !generateBenchmarkMedia( path, spec ) )
+         {
+            std::printf( "skipping %s (no encoder for it in this build of FFmpeg)\n", fileName.c_str() );
+            continue;
+         }
+
+         AudioParams inputParams;
+         AudioReaderDecoder probe( path );
+         if ( !probe.getAudioParams( inputParams ) )
+         {
+            std::printf( "skipping %s (can't be opened)\n", fileName.c_str() );
+            continue;
+         }
+
+         // One decode up front: counts the samples, and keeps the start of the audio for the
+         // resampler, one buffer per plane
+         const bool planar = av_sample_fmt_is_planar( inputParams.sampleFormat ) != 0;
+         const int planeCount = planar ? inputParams.channelCount : 1;
+         const int planeSampleBytes = planar ? inputParams.bytesPerSample : inputParams.bytesPerSample * inputParams.channelCount;
+         const int64_t maxResampleFrames = int64_t( MaxResampleSeconds * inputParams.sampleRate );
+
+         std::vector< std::vector<uint8_t> > decoded( planeCount );
+         uint64_t decodedSampleCount = 0;
+         int64_t decodedFrameCount = 0;
+         probe.readAndDecode( [&]( const AVFrame* frame )
+         {
+            decodedSampleCount += uint64_t( frame->nb_samples ) * inputParams.channelCount;
+            const int64_t keep = std::min<int64_t>( frame->nb_samples, maxResampleFrames - decodedFrameCount );
+            if ( keep > 0 )
+            {
+               for ( int p = 0; p < planeCount; ++p )
+                  decoded[p].insert( decoded[p].end(), frame->extended_data[p], frame->extended_data[p] + keep * planeSampleBytes );
+               decodedFrameCount += keep;
+            }
+         } );
+         if ( decodedSampleCount == 0 )
+            continue;
+
+         const uint64_t decodedByteCount = decodedSampleCount * inputParams.bytesPerSample;
+         printBenchmarkResult( runBenchmark( "Decode/" + fileName, decodedSampleCount, decodedByteCount, [&]()
+         {
+            AudioReaderDecoder readerDecoder( path );
+            readerDecoder.readAndDecode( [&]( const AVFrame* frame ) { sink = sink + frame->nb_samples; } );
+         } ) );
+
+         const uint64_t resampleSampleCount = uint64_t( decodedFrameCount ) * inputParams.channelCount;
+         AudioResampler resampler( inputParams, ResampleChunkFrames, AudioLoader::defaultOutputParams() );
+         if ( resampler.initialize() == AudioResamplerInitState::Ok )
+         {
+            printBenchmarkResult( runBenchmark( "Resample/" + fileName, resampleSampleCount, resampleSampleCount * inputParams.bytesPerSample, [&]()
+            {
+               resampler.reset();
+               std::vector<const uint8_t*> planes( planeCount );
+               for ( int64_t offset = 0; offset < decodedFrameCount; offset += ResampleChunkFrames )
+               {
+                  for ( int p = 0; p < planeCount; ++p )
+                     planes[p] = decoded[p].data() + offset * planeSampleBytes;
+                  sink = sink + resampler.convert( planes.data(), int( std::min<int64_t>( ResampleChunkFrames, decodedFrameCount - offset ) ) );
+               }
+               sink = sink + resampler.flush();
+            } ) );
+         }
+
+         // Counted in output samples, as in the other AudioLoader benchmarks
+         const uint64_t outputSampleCount = uint64_t( std::llround( spec.seconds * AudioLoader::defaultOutputParams().sampleRate ) ) * 2;
+         printBenchmarkResult( runBenchmark( "AudioLoader/" + fileName, outputSampleCount, outputSampleCount * 2, [&]()
+         {
+            AudioLoader audioLoader( path );
+            audioLoader.loadAudioData();
+            sink = sink + audioLoader.processedAudio().size();
+         } ) );
+
+         // How soon playback could start on an async load, against the whole load above
+         printBenchmarkResult( timeToFirstAudio( "AudioLoader/AsyncFirstAudio/" + fileName, path ) );
+
+         // Compressed output: the extra cost of compressing it, then random reads a block's worth
+         // long, which mostly miss the decoded-block cache, against reads of the plain output
+         printBenchmarkResult( runBenchmark( "AudioLoader/Compressed/" + fileName, outputSampleCount, outputSampleCount * 2, [&]()
+         {
+            AudioLoader audioLoader( path );
+            audioLoader.setCompressedStorage( true );
+            audioLoader.loadAudioData();
+            sink = sink + audioLoader.processedFrameCount();
+         } ) );
+
+         AudioLoader plainLoader( path );
+         auto compressedAccount = std::make_shared<MemoryAccount>();
+         AudioLoader compressedLoader( path );
+         compressedLoader.setCompressedStorage( true );
+         compressedLoader.setMemoryAccount( compressedAccount );
+         if ( plainLoader.loadAudioData() && compressedLoader.loadAudioData() && plainLoader.processedFrameCount() > ReadFrameCount )
+         {
+            std::printf( "compressed output of %s: %.1f%% of %zu bytes\n", fileName.c_str(),
+                         100.0 * compressedAccount->current( MemoryAccount::Output ) / ( plainLoader.processedAudio().size() * sizeof( int16_t ) ),
+                         plainLoader.processedAudio().size() * sizeof( int16_t ) );
+
+            const size_t readSampleCount = size_t( RandomReadCount ) * ReadFrameCount * 2;
+            std::vector<int16_t> readBuffer( ReadFrameCount * 2 );
+            for ( const AudioLoader* loader : { &plainLoader, &compressedLoader } )
+            {
+               const std::string kind = ( loader == &plainLoader ) ? "Plain" : "Compressed";
+               printBenchmarkResult( runBenchmark( "RandomRead/" + kind + "/" + fileName, readSampleCount, readSampleCount * 2, [&]()
+               {
+                  std::mt19937 random( 1 );
+                  std::uniform_int_distribution<size_t> firstFrame( 0, loader->processedFrameCount() - ReadFrameCount );
+                  for ( int i = 0; i < RandomReadCount; ++i )
+                  {
+                     loader->readProcessedAudio( firstFrame( random ), ReadFrameCount, readBuffer.data() );
+                     sink = sink + size_t( readBuffer[0] );
+                  }
+               } ) );
+            }
+         }
+
+         // To a WAV file: streamed through in fixed-size chunks with the writing on its own thread,
+         // against loading the whole output and then writing it out
+         const std::string wavPath = ( dir / "transcoded.wav" ).string();
+         printBenchmarkResult( runBenchmark( "Transcode/Streamed/" + fileName, outputSampleCount, outputSampleCount * 2, [&]()
+         {
+            AudioTranscoder transcoder( path, wavPath );
+            transcoder.run();
+            sink = sink + transcoder.framesWritten();
+         } ) );
+         printBenchmarkResult( runBenchmark( "Transcode/LoadThenWrite/" + fileName, outputSampleCount, outputSampleCount * 2, [&]()
+         {
+            AudioLoader audioLoader( path );
+            audioLoader.loadAudioData();
+            WriteWav( wavPath, audioLoader.processedAudio(), audioLoader.outputParams().sampleRate );
+            sink = sink + audioLoader.processedAudio().size();
+         } ) );
+         std::filesystem::remove( wavPath, ec );
+
+         // WAV at the output's own rate and channel count is read natively: mapped as it is for
+         // 16-bit output, converted in one pass for float output; FFmpeg decoding the same for comparison
+         if ( spec.extension == ".wav" )
+         {
+            const uint64_t nativeSampleCount = uint64_t( std::llround( spec.seconds * spec.sampleRate ) ) * spec.channelCount;
+            for ( AVSampleFormat format : { AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLTP } )
+            {
+               const AudioParams params( spec.channelCount, format, spec.sampleRate, av_get_bytes_per_sample( format ) );
+               for ( bool native : { true, false } )
+               {
+                  const std::string name = std::string( native ? "AudioLoader/NativeWav/" : "AudioLoader/FFmpegWav/" ) + av_get_sample_fmt_name( format ) + "/" + fileName;
+                  printBenchmarkResult( runBenchmark( name, nativeSampleCount, nativeSampleCount * params.bytesPerSample, [&]()
+                  {
+                     AudioLoader audioLoader( path, params );
+                     audioLoader.setNativeWavReading( native );
+                     audioLoader.loadAudioData();
+                     sink = sink + audioLoader.processedFrameCount();
+                  } ) );
+               }
+            }
+         }
+      }
+   }
+
+   std::map<std::string, std::string> benchmarkContext()
+   {
+      char date[32] = "";
+      std::time_t now = std::time( nullptr );
+      std::strftime( date, sizeof( date ), "%Y-%m-%dT%H:%M:%S", std::localtime( &now ) );
+
+      std::map<std::string, std::string> context;
+      context["date"] = date;
+      context["ffmpeg_version"] = av_version_info();
+      context["avcodec_version"] = std::to_string( LIBAVCODEC_VERSION_MAJOR ) + "." + std::to_string( LIBAVCODEC_VERSION_MINOR ) + "." + std::to_string( LIBAVCODEC_VERSION_MICRO );
+      context["num_cpus"] = std::to_string( std::thread::hardware_concurrency() );
+      const InterleaveIsa isa = detectInterleaveIsa();
+      context["interleave_isa"] = ( isa == InterleaveIsa::AVX2 ) ? "AVX2" : ( isa == InterleaveIsa::SSE2 ) ? "SSE2" : "Scalar";
+#ifdef NDEBUG
+      context["library_build_type"] = "release";
+#else
+      context["library_build_type"] = "debug";
+#endif
+      return context;
+   }
+
+   // Many short files, as in a clip-ingest job; ideally time per batch halves as workers double
+   void benchmarkBatchLoader( const std::filesystem::path& mediaDir )
+   {
+      std::vector<std::string> mediaPaths;
+      std::error_code ec;
+      for ( const auto& entry : std::filesystem::directory_iterator( mediaDir, ec ) )
+         mediaPaths.push_back( entry.path().string() );
+      if ( mediaPaths.empty() )
+         return;
+
+      const size_t BatchSize = 64;
+      std::vector<std::string> batch;
+      uint64_t sampleCount = 0;
+      for ( size_t i = 0; i < BatchSize; ++i )
+      {
+         batch.push_back( mediaPaths[i % mediaPaths.size()] );
+         AudioLoader probe( batch.back() );
+         probe.loadAudioData();
+         sampleCount += probe.processedAudio().size();
+      }
+
+      // The same batch through a single loader that's reset for each file
+      printBenchmarkResult( runBenchmark( "AudioLoader/ResetPerFile", sampleCount, sampleCount * 2, [&]()
+      {
+         AudioLoader audioLoader( batch[0] );
+         for ( const auto& path : batch )
+         {
+            audioLoader.reset( path );
+            audioLoader.loadAudioData();
+            sink = sink + audioLoader.processedAudio().size();
+         }
+      } ) );
+
+      printBenchmarkResult( runBenchmark( "AudioLoader/FreshPerFile", sampleCount, sampleCount * 2, [&]()
+      {
+         for ( const auto& path : batch )
+         {
+            AudioLoader audioLoader( path );
+            audioLoader.loadAudioData();
+            sink = sink + audioLoader.processedAudio().size();
+         }
+      } ) );
+
+      unsigned maxWorkers = std::max( 1U, std::thread::hardware_concurrency() );
+      for ( unsigned workers = 1; workers <= maxWorkers; workers *= 2 )
+      {
+         AudioBatchLoader batchLoader( workers );
+         printBenchmarkResult( runBenchmark( "AudioBatchLoader/workers:" + std::to_string( workers ), sampleCount, sampleCount * 2, [&]()
+         {
+            auto loaders = batchLoader.loadAll( batch );
+            sink = sink + loaders.size();
+         } ) );
+      }
+   }
+
+   // The test media encoded to each codec, a batch of 16 at a time: one job after another, then
+   // spread over the pool. Counted in input samples at 44.1 kHz stereo, as above.
+   void benchmarkBatchEncoder( const std::filesystem::path& mediaDir )
+   {
+      std::vector<std::string> mediaPaths;
+      std::error_code ec;
+      for ( const auto& entry : std::filesystem::directory_iterator( mediaDir, ec ) )
+         mediaPaths.push_back( entry.path().string() );
+      if ( mediaPaths.empty() )
+         return;
+
+      const size_t BatchSize = 16;
+      const std::filesystem::path outDir = std::filesystem::temp_directory_path( ec );
+      uint64_t sampleCount = 0;
+      std::vector<std::string> inputs;
+      for ( size_t i = 0; i < BatchSize; ++i )
+      {
+         inputs.push_back( mediaPaths[i % mediaPaths.size()] );
+         AudioLoader probe( inputs.back() );
+         probe.loadAudioData();
+         sampleCount += probe.processedAudio().size();
+      }
+
+      const std::pair<AudioEncoder::Codec, const char*> codecs[] =
+      {
+         { AudioEncoder::Codec::AAC, ".m4a" }, { AudioEncoder::Codec::FLAC, ".flac" }, { AudioEncoder::Codec::Opus, ".opus" }
+      };
+      for ( const auto& codec : codecs )
+      {
+         std::vector<AudioBatchEncoder::Job> jobs;
+         for ( size_t i = 0; i < inputs.size(); ++i )
+            jobs.push_back( { inputs[i], ( outDir / ( "BatchEncoderBenchmark" + std::to_string( i ) + codec.second ) ).string() } );
+
+         AudioEncoder::Params params;
+         params.codec = codec.first;
+         const std::string name = std::string( "AudioBatchEncoder/" ) + AudioEncoder::codecName( codec.first );
+
+         printBenchmarkResult( runBenchmark( name + "/sequential", sampleCount, sampleCount * 2, [&]()
+         {
+            for ( const auto& job : jobs )
+               sink = sink + AudioBatchEncoder::encodeFile( job, params ).framesEncoded;
+         } ) );
+
+         unsigned maxWorkers = std::max( 1U, std::thread::hardware_concurrency() );
+         AudioBatchEncoder batchEncoder( maxWorkers, params );
+         printBenchmarkResult( runBenchmark( name + "/workers:" + std::to_string( maxWorkers ), sampleCount, sampleCount * 2, [&]()
+         {
+            auto results = batchEncoder.encodeAll( jobs );
+            sink = sink + results.size();
+         } ) );
+
+         for ( const auto& job : jobs )
+            std::filesystem::remove( job.outPath, ec );
+      }
+   }
+}
+
+int main( int argc, char **argv )
+{
+   InitFFmpeg();
+
+   std::filesystem::path mediaDir = "..\\FFmpegAudioTranscode\\TestMedia";
+   std::string jsonPath;
+   bool longInputs = false;
+   for ( int i = 1; i < argc; ++i )
+   {
+      const std::string arg = argv[i];
+      if ( arg == "--json" && i + 1 < argc )
+         jsonPath = argv[++i];
+      else if ( arg == "--long" )
+         longInputs = true;
+      else
+         mediaDir = arg;
+   }
+
+   std::error_code ec;
+   std::filesystem::path generatedDir = std::filesystem::temp_directory_path( ec ) / "FFmpegAudioTranscodeBenchmarkMedia";
+
+   printBenchmarkHeader();
+   benchmarkOutputAccumulation();
+   benchmarkInterleave();
+   benchmarkResamplerQuality();
+   benchmarkWavWriter();
+   benchmarkAudioLoader( mediaDir );
+   benchmarkDecoderThreading( mediaDir );
+   benchmarkParallelLoad( mediaDir );
+   benchmarkProbe( mediaDir );
+   benchmarkBatchLoader( mediaDir );
+   benchmarkBatchEncoder( mediaDir );
+   benchmarkGeneratedMedia( generatedDir, longInputs );
+
+   if ( !jsonPath.empty() && !writeBenchmarkJson( jsonPath, benchmarkContext() ) )
+   {
+      std::printf( "can't write %s\n", jsonPath.c_str() );
+      return 1;
+   }
+
+   return 0;
+}